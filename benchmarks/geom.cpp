@@ -0,0 +1,112 @@
+// Copyright 2023 Global Phasing Ltd.
+
+// Benchmark of Geometry::calc() (refinement restraints: target, gradient
+// and the sparse normal matrix) with different numbers of threads,
+// on a synthetic 50k-atom chain with bonds, angles, torsions and vdw pairs.
+// Requires the google/benchmark library. It can be built manually:
+// c++ -Wall -O2 -I../include -I$GB/include geom.cpp ../src/*.cpp $GB/src/libbenchmark.a -lz -pthread
+
+#include <random>
+#include <benchmark/benchmark.h>
+#include <gemmi/refine/geom.hpp>
+#include <gemmi/neighbor.hpp>
+
+static gemmi::Structure make_chain(int n_atoms) {
+  gemmi::Structure st;
+  st.cell.set(150., 150., 150., 90., 90., 90.);
+  st.spacegroup_hm = "P 1";
+  st.setup_cell_images();
+  st.models.emplace_back("1");
+  st.models[0].chains.emplace_back("A");
+  gemmi::Chain& chain = st.models[0].chains[0];
+  std::mt19937 rng(12345);
+  std::normal_distribution<double> step(0., 0.9);
+  gemmi::Position pos(75, 75, 75);
+  for (int i = 0; i < n_atoms; ++i) {
+    if (i % 10 == 0) {
+      chain.residues.emplace_back();
+      chain.residues.back().name = "UNK";
+      chain.residues.back().seqid = gemmi::SeqId(i / 10 + 1, ' ');
+    }
+    gemmi::Atom atom;
+    atom.name = "C" + std::to_string(i % 10);
+    atom.element = gemmi::El::C;
+    // a random walk with steps of ~1.5A, kept inside the box
+    gemmi::Position d(step(rng), step(rng), step(rng));
+    pos += d * (1.5 / d.length());
+    for (int j = 0; j < 3; ++j)
+      if (pos.at(j) < 10 || pos.at(j) > 140)
+        pos.at(j) = 150 - pos.at(j);
+    atom.pos = pos;
+    atom.serial = i + 1;
+    chain.residues.back().atoms.push_back(atom);
+  }
+  return st;
+}
+
+struct Setup {
+  gemmi::Structure st;
+  gemmi::Geometry geom;
+  explicit Setup(int n_atoms) : st(make_chain(n_atoms)), geom(st, nullptr) {
+    std::vector<gemmi::Atom*> atoms;
+    for (gemmi::CRA cra : st.models[0].all())
+      atoms.push_back(cra.atom);
+    for (size_t i = 0; i + 1 < atoms.size(); ++i) {
+      geom.bonds.emplace_back(atoms[i], atoms[i+1]);
+      geom.bonds.back().values.emplace_back(1.5, 0.02, 1.5, 0.02);
+    }
+    for (size_t i = 0; i + 2 < atoms.size(); ++i) {
+      geom.angles.emplace_back(atoms[i], atoms[i+1], atoms[i+2]);
+      geom.angles.back().values.emplace_back(109.5, 3.0);
+    }
+    for (size_t i = 0; i + 3 < atoms.size(); ++i) {
+      geom.torsions.emplace_back(atoms[i], atoms[i+1], atoms[i+2], atoms[i+3]);
+      geom.torsions.back().values.emplace_back(180., 15., 3);
+    }
+    gemmi::NeighborSearch ns(st.models[0], st.cell, 5);
+    ns.populate();
+    for (size_t i = 0; i < atoms.size(); ++i)
+      ns.for_each(atoms[i]->pos, ' ', 4.0, [&](gemmi::NeighborSearch::Mark& m, double) {
+        int j = m.atom_idx + 10 * m.residue_idx;  // residues have 10 atoms
+        if (j > (int) i + 3 && m.image_idx == 0) {
+          geom.vdws.emplace_back(atoms[i], atoms[j]);
+          geom.vdws.back().type = 1;
+          geom.vdws.back().value = 3.4;
+          geom.vdws.back().sigma = 0.2;
+        }
+      });
+    geom.setup_target(true, 0);
+  }
+};
+
+// calc() as used in refinement: below Geometry::min_threads_for_packets
+// threads (limited by the hardware concurrency) it uses the serial path
+static void bm_geom_calc(benchmark::State& state) {
+  static Setup setup(50000);
+  int nthreads = (int) state.range(0);
+  setup.geom.min_threads_for_packets = 3;
+  for (auto _ : state) {
+    setup.geom.clear_target();
+    double f = setup.geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1, nthreads);
+    benchmark::DoNotOptimize(f);
+  }
+  state.counters["restraints"] = double(setup.geom.bonds.size() + setup.geom.angles.size() +
+                                        setup.geom.torsions.size() + setup.geom.vdws.size());
+}
+
+// colored packets always used with nthreads > 1; compare with
+// bm_geom_calc/1 to find the break-even number of threads
+static void bm_geom_calc_packets(benchmark::State& state) {
+  static Setup setup(50000);
+  int nthreads = (int) state.range(0);
+  setup.geom.min_threads_for_packets = 0;
+  for (auto _ : state) {
+    setup.geom.clear_target();
+    double f = setup.geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1, nthreads);
+    benchmark::DoNotOptimize(f);
+  }
+}
+
+BENCHMARK(bm_geom_calc)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Unit(benchmark::kMillisecond);
+BENCHMARK(bm_geom_calc_packets)->Arg(2)->Arg(3)->Arg(4)->Arg(8)->Unit(benchmark::kMillisecond);
+BENCHMARK_MAIN();
@@ -0,0 +1,72 @@
+// Copyright 2023 Global Phasing Ltd.
+
+// Benchmark of MonLib::match_link() with and without the link index,
+// for all atom pairs closer than 2.5A in a given structure (preferably
+// a large glycosylated one). Requires the monomer library ($CLIBD_MON).
+// Requires the google/benchmark library. It can be built manually:
+// c++ -Wall -O2 -I../include -I$GB/include links.cpp ../src/*.cpp $GB/src/libbenchmark.a -lz -pthread
+
+#include <stdio.h>
+#include <cstdlib>  // for getenv
+#include <gemmi/mmread_gz.hpp>  // for read_structure_gz
+#include <gemmi/read_cif.hpp>   // for read_cif_gz
+#include <gemmi/monlib.hpp>
+#include <gemmi/neighbor.hpp>
+#include <gemmi/contact.hpp>
+#include <benchmark/benchmark.h>
+
+struct AtomPair {
+  gemmi::CRA cra1, cra2;
+};
+
+static gemmi::MonLib monlib;
+static std::vector<AtomPair> pairs;
+
+static void match_all(benchmark::State& state, const gemmi::MonLib& ml) {
+  for (auto _ : state) {
+    int found = 0;
+    for (const AtomPair& p : pairs) {
+      auto m = ml.match_link(*p.cra1.residue, p.cra1.atom->name, p.cra1.atom->altloc,
+                             *p.cra2.residue, p.cra2.atom->name, p.cra2.atom->altloc);
+      if (std::get<0>(m))
+        ++found;
+    }
+    benchmark::DoNotOptimize(found);
+  }
+  state.SetItemsProcessed(state.iterations() * pairs.size());
+}
+
+static void match_link_indexed(benchmark::State& state) {
+  match_all(state, monlib);
+}
+
+static void match_link_linear(benchmark::State& state) {
+  gemmi::MonLib linear = monlib;  // a copy has no index -> linear scan
+  match_all(state, linear);
+}
+
+int main(int argc, char** argv) {
+  const char* monomer_dir = std::getenv("CLIBD_MON");
+  if (argc < 2 || !monomer_dir) {
+    printf("Set $CLIBD_MON and call it with path to a coordinate file.\n");
+    return 1;
+  }
+  gemmi::Structure st = gemmi::read_structure_gz(argv[argc-1]);
+  std::string error;
+  monlib.read_monomer_lib(monomer_dir, st.models.at(0).get_all_residue_names(),
+                          gemmi::read_cif_gz, &error);
+  gemmi::NeighborSearch ns(st.models[0], st.cell, 5.0);
+  ns.populate();
+  gemmi::ContactSearch contacts(2.5f);
+  contacts.ignore = gemmi::ContactSearch::Ignore::AdjacentResidues;
+  contacts.for_each_contact(ns, [&](const gemmi::CRA& cra1, const gemmi::CRA& cra2,
+                                    int, float) {
+    pairs.push_back({cra1, cra2});
+  });
+  printf("%s: %zu atom pairs, %zu links in the library.\n",
+         st.name.c_str(), pairs.size(), monlib.links.size());
+  benchmark::RegisterBenchmark("match_link_indexed", match_link_indexed);
+  benchmark::RegisterBenchmark("match_link_linear", match_link_linear);
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+}
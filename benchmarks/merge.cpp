@@ -0,0 +1,51 @@
+// Copyright 2023 Global Phasing Ltd.
+
+// Benchmark of merging unmerged intensities (Intensities::merge_in_place)
+// on synthetic data, with different numbers of threads.
+// Requires the google/benchmark library. It can be built manually:
+// c++ -Wall -O2 -I../include -I$GB/include merge.cpp $GB/src/libbenchmark.a -pthread
+// The largest case (100M observations) needs about 10GB of memory;
+// use --benchmark_filter to skip it.
+
+#include <random>
+#include <benchmark/benchmark.h>
+#include <gemmi/merge.hpp>
+
+static gemmi::Intensities make_observations(size_t n) {
+  gemmi::Intensities intensities;
+  intensities.spacegroup = gemmi::find_spacegroup_by_name("P 21 21 21");
+  intensities.unit_cell.set(80., 90., 100., 90., 90., 90.);
+  intensities.type = gemmi::DataType::Unmerged;
+  std::mt19937 rng(12345);
+  std::uniform_int_distribution<int> index(-60, 60);
+  std::uniform_real_distribution<double> value(-10., 5000.);
+  std::uniform_real_distribution<double> sigma(0.5, 50.);
+  intensities.data.resize(n);
+  for (gemmi::Intensities::Refl& refl : intensities.data) {
+    refl.hkl = {{index(rng), index(rng), index(rng)}};
+    refl.isign = 0;
+    refl.nobs = 0;
+    refl.value = value(rng);
+    refl.sigma = sigma(rng);
+  }
+  return intensities;
+}
+
+static void bm_merge(benchmark::State& state) {
+  size_t n = (size_t) state.range(0);
+  int nthreads = (int) state.range(1);
+  const gemmi::Intensities orig = make_observations(n);
+  for (auto _ : state) {
+    state.PauseTiming();
+    gemmi::Intensities intensities = orig;
+    state.ResumeTiming();
+    intensities.switch_to_asu_indices(false, nthreads);
+    intensities.merge_in_place(gemmi::DataType::Anomalous, nthreads);
+    benchmark::DoNotOptimize(intensities.data.data());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK(bm_merge)->ArgsProduct({{1000000, 100000000}, {1, 2, 4, 8}})
+                   ->Unit(benchmark::kMillisecond);
+BENCHMARK_MAIN();
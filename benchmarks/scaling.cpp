@@ -0,0 +1,52 @@
+// Copyright 2023 Global Phasing Ltd.
+
+// Benchmark of anisotropic scaling with bulk solvent (Scaling::fit_parameters,
+// i.e. LevMar) on synthetic data, with different numbers of threads.
+// Requires the google/benchmark library. It can be built manually:
+// c++ -Wall -O2 -I../include -I$GB/include scaling.cpp $GB/src/libbenchmark.a -pthread
+
+#include <random>
+#include <benchmark/benchmark.h>
+#include <gemmi/scaling.hpp>
+
+static gemmi::Scaling<float> make_scaling(size_t n) {
+  gemmi::UnitCell cell(60., 70., 80., 90., 100., 90.);
+  gemmi::Scaling<float> scaling(cell, gemmi::find_spacegroup_by_name("P 1"));
+  scaling.use_solvent = true;
+  std::mt19937 rng(12345);
+  std::uniform_int_distribution<int> index(-60, 60);
+  std::normal_distribution<float> f(0.f, 100.f);
+  std::normal_distribution<float> noise(1.f, 0.05f);
+  const gemmi::SMat33<double> b_star =
+    gemmi::SMat33<double>{12, 18, 25, 1, -2, 3}.transformed_by(cell.frac.mat);
+  scaling.points.reserve(n);
+  while (scaling.points.size() < n) {
+    gemmi::Miller hkl{{index(rng), index(rng), index(rng)}};
+    double stol2 = cell.calculate_stol_sq(hkl);
+    if (stol2 == 0 || stol2 > 0.25 / (1.5 * 1.5))
+      continue;
+    std::complex<float> fcmol(f(rng), f(rng));
+    std::complex<float> fmask(f(rng), f(rng));
+    double k = 2.5 * std::exp(-0.25 * b_star.r_u_r(gemmi::Vec3(hkl)));
+    auto fc = fcmol + float(0.4 * std::exp(-50 * stol2)) * fmask;
+    float fobs = float(k * std::abs(fc)) * noise(rng);
+    scaling.points.push_back({hkl, stol2, fcmol, fmask, fobs, 1.f});
+  }
+  return scaling;
+}
+
+static void bm_scaling(benchmark::State& state) {
+  size_t n = (size_t) state.range(0);
+  int nthreads = (int) state.range(1);
+  const gemmi::Scaling<float> orig = make_scaling(n);
+  for (auto _ : state) {
+    gemmi::Scaling<float> scaling = orig;
+    scaling.fit_parameters(nthreads);
+    benchmark::DoNotOptimize(scaling.k_overall);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK(bm_scaling)->ArgsProduct({{100000, 1000000}, {1, 2, 4, 8}})
+                     ->Unit(benchmark::kMillisecond);
+BENCHMARK_MAIN();
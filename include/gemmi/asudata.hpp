@@ -6,7 +6,8 @@
 #define GEMMI_ASUDATA_HPP_
 
 #include <complex>       // for arg, abs
-#include <algorithm>     // for sort, is_sorted
+#include <algorithm>     // for sort, is_sorted, all_of
+#include "millerkey.hpp" // for sort_by_packed_key
 #include "unitcell.hpp"
 #include "symmetry.hpp"
 #include "stats.hpp"     // for Correlation
@@ -148,7 +149,13 @@ struct AsuData {
   const UnitCell& unit_cell() const { return unit_cell_; }
   const SpaceGroup* spacegroup() const { return spacegroup_; }
   void ensure_sorted() {
-    if (!std::is_sorted(v.begin(), v.end()))
+    if (std::is_sorted(v.begin(), v.end()))
+      return;
+    if (std::all_of(v.begin(), v.end(),
+                    [](const HklValue<T>& x) { return can_pack_miller(x.hkl); }))
+      sort_by_packed_key(v.begin(), v.end(),
+                         [](const HklValue<T>& x) { return pack_miller(x.hkl); });
+    else
       std::sort(v.begin(), v.end());
   }
 
@@ -90,7 +90,7 @@ inline int string_to_int(const char* p, bool checked, size_t length=0) {
   if (checked) {
     while ((length == 0 || i < length) && is_space(p[i]))
       ++i;
-    if (!has_digits || p[i] != '\0')
+    if (!has_digits || (length != 0 ? i != length : p[i] != '\0'))
       throw std::invalid_argument("not an integer: " +
                                   std::string(p, length ? length : i+1));
   }
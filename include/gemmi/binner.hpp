@@ -6,10 +6,14 @@
 #define GEMMI_BINNER_HPP_
 
 #include <vector>
+#include <algorithm>     // for is_sorted, all_of
 #include <limits>        // for numeric_limits
 #include <unordered_map> // for unordered_map
+#include "millerkey.hpp" // for MillerKeyMap
+#include "parallel.hpp"  // for parallel_for_chunks
+#include "reciproc.hpp"  // for for_all_reflections
 #include "unitcell.hpp"  // for UnitCell
-#include "stats.hpp"     // for Correlation
+#include "stats.hpp"     // for Correlation, Variance
 
 namespace gemmi {
 
@@ -151,18 +155,9 @@ struct Binner {
   std::vector<double> limits;  // upper limit of each bin
 };
 
-// the result is in a
 inline Correlation combine_two_correlations(const Correlation& a, const Correlation& b) {
-  Correlation r;
-  r.n = a.n + b.n;
-  r.mean_x = (a.n * a.mean_x + b.n * b.mean_x) / r.n;
-  r.mean_y = (a.n * a.mean_y + b.n * b.mean_y) / r.n;
-  r.sum_xx = a.sum_xx + a.n * sq(a.mean_x - r.mean_x)
-           + b.sum_xx + b.n * sq(b.mean_x - r.mean_x);
-  r.sum_yy = a.sum_yy + a.n * sq(a.mean_y - r.mean_y)
-           + b.sum_yy + b.n * sq(b.mean_y - r.mean_y);
-  r.sum_xy = a.sum_xy + a.n * (a.mean_x - r.mean_x) * (a.mean_y - r.mean_y)
-           + b.sum_xy + b.n * (b.mean_x - r.mean_x) * (b.mean_y - r.mean_y);
+  Correlation r = a;
+  r.add(b);
   return r;
 }
 
@@ -173,6 +168,95 @@ inline Correlation combine_correlations(const std::vector<Correlation>& cors) {
   return result;
 }
 
+// Single pass over reflections from DataProxy (MtzDataProxy, ReflnDataProxy,
+// AsuData) that accumulates statistics in resolution bins.
+// For each reflection func(acc, offset) is called, where acc is Acc of
+// the reflection's bin and offset is the reflection's position in proxy
+// (values are at proxy.get_num(offset + column_index)).
+// Reflections are split between threads, each thread has own accumulators,
+// and these are combined at the end using Acc::add(const Acc&).
+template<typename Acc, typename DataProxy, typename Func>
+std::vector<Acc> accumulate_in_bins(const Binner& binner, const DataProxy& proxy,
+                                    Func func, int nthreads=1) {
+  binner.ensure_limits_are_set();
+  size_t n = proxy.size() / proxy.stride();
+  nthreads = effective_thread_count(nthreads);
+  std::vector<std::vector<Acc>> partial(nthreads, std::vector<Acc>(binner.size()));
+  parallel_for_chunks(n, nthreads, [&](size_t begin, size_t end, int t) {
+    std::vector<Acc>& bins = partial[t];
+    int hint = 0;
+    for (size_t i = begin; i != end; ++i) {
+      size_t offset = i * proxy.stride();
+      func(bins[binner.get_bin_hinted(proxy.get_hkl(offset), hint)], offset);
+    }
+  });
+  for (int t = 1; t < nthreads; ++t)
+    for (size_t i = 0; i < binner.size(); ++i)
+      partial[0][i].add(partial[t][i]);
+  return partial[0];
+}
+
+// Statistics of one value (I, F, ...) in a resolution bin.
+struct BinStats {
+  Variance value;             // n, mean and variance of non-NaN values
+  Variance value_over_sigma;  // e.g. <I/sigma>, only if sigma > 0
+  Variance inv_d2;            // mean 1/d^2 (x axis of Wilson plot)
+  int nan_count = 0;
+
+  void add_point(double x, double sigma, double inv_d2_) {
+    if (std::isnan(x)) {
+      ++nan_count;
+      return;
+    }
+    value.add_point(x);
+    if (sigma > 0)
+      value_over_sigma.add_point(x / sigma);
+    inv_d2.add_point(inv_d2_);
+  }
+  void add(const BinStats& o) {
+    value.add(o.value);
+    value_over_sigma.add(o.value_over_sigma);
+    inv_d2.add(o.inv_d2);
+    nan_count += o.nan_count;
+  }
+  int count() const { return value.n; }
+  double mean() const { return value.mean_x; }
+  // <x^2>, e.g. <F^2>
+  double mean_sq() const { return value.for_population() + sq(value.mean_x); }
+  double mean_over_sigma() const { return value_over_sigma.mean_x; }
+};
+
+// Calculates BinStats for column value_idx, with sigma from column sigma_idx
+// (or without sigma if sigma_idx < 0). Indices are as in proxy.column_index().
+template<typename DataProxy>
+std::vector<BinStats> calculate_bin_stats(const Binner& binner, const DataProxy& proxy,
+                                          size_t value_idx, int sigma_idx=-1,
+                                          int nthreads=1) {
+  return accumulate_in_bins<BinStats>(binner, proxy, [&](BinStats& acc, size_t offset) {
+    double sigma = sigma_idx >= 0 ? (double) proxy.get_num(offset + sigma_idx) : NAN;
+    acc.add_point((double) proxy.get_num(offset + value_idx), sigma,
+                  binner.cell.calculate_1_d2(proxy.get_hkl(offset)));
+  }, nthreads);
+}
+
+// Number of possible (unique, not systematically absent) reflections
+// in each bin, for calculation of completeness.
+inline std::vector<int> count_reflections_in_bins(const Binner& binner,
+                                                  const SpaceGroup* spacegroup) {
+  binner.ensure_limits_are_set();
+  if (!spacegroup)
+    fail("count_reflections_in_bins(): unknown space group");
+  std::vector<int> counts(binner.size(), 0);
+  // margins for numerical errors, as in count_reflections()
+  double dmin = 1 / std::sqrt(binner.max_1_d2) - 1e-6;
+  double dmax = 1 / std::sqrt(binner.min_1_d2) + 1e-6;
+  int hint = 0;
+  for_all_reflections([&](const Miller& hkl) {
+    ++counts[binner.get_bin_hinted(hkl, hint)];
+  }, binner.cell, spacegroup, dmin, dmax);
+  return counts;
+}
+
 struct HklMatch {
   std::vector<int> pos;
   size_t hkl_size;
@@ -193,6 +277,14 @@ struct HklMatch {
         else
           ++b;
       }
+    } else if (std::all_of(hkl, hkl + hkl_size, can_pack_miller)) {
+      MillerKeyMap<int> hkl_index(hkl_size);
+      for (int i = 0; i != (int)hkl_size; ++i)
+        hkl_index.insert(pack_miller(hkl[i]), i);
+      for (size_t i = 0; i != ref_size; ++i)
+        if (can_pack_miller(ref[i]))
+          if (const int* p = hkl_index.find(pack_miller(ref[i])))
+            pos[i] = *p;
     } else {
       std::unordered_map<Miller, int, MillerHash> hkl_index;
       for (int i = 0; i != (int)hkl_size; ++i)
@@ -0,0 +1,467 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// BrickedGrid - real-space grid stored as 32x32x32 bricks that can be
+// swapped to a scratch file (LRU cache), for maps larger than memory.
+
+#ifndef GEMMI_BRICKGRID_HPP_
+#define GEMMI_BRICKGRID_HPP_
+
+#include <cstdint>   // for int32_t, uint64_t, int8_t
+#include <cstdio>    // for FILE, fread, fwrite, tmpfile
+#include <string>
+#include <vector>
+#include "grid.hpp"      // for GridMeta, Grid, cubic_interpolation
+#include "ccp4.hpp"      // for Ccp4
+#include "fileutil.hpp"  // for file_open, fileptr_t
+#include "input.hpp"     // for FileStream
+
+namespace gemmi {
+
+/// Grid that covers the whole unit cell (always in AxisOrder::XYZ) with data
+/// split into cubic bricks. Bricks are allocated when first accessed.
+/// By default all bricks are kept in memory. After set_storage(n, path)
+/// at most n bricks are in memory and the least recently used bricks
+/// are written to a scratch file.
+/// Reading values updates the cache, so even const member functions
+/// must not be called concurrently.
+template<typename T=float>
+struct BrickedGrid : GridMeta {
+  static constexpr int brick_bits = 5;
+  static constexpr int brick_dim = 1 << brick_bits;  // 32
+  static constexpr int brick_mask = brick_dim - 1;
+  static constexpr size_t brick_size = (size_t)brick_dim * brick_dim * brick_dim;
+
+  struct Slot {
+    std::vector<T> data;
+    size_t brick = (size_t)-1;
+    std::uint64_t last_used = 0;
+    bool dirty = false;
+  };
+
+  /// spacing between virtual planes, as in Grid
+  double spacing[3] = {0., 0., 0.};
+  /// value of the points in bricks that have not been written yet
+  T default_value = T();
+  /// number of bricks along u, v and w
+  int bu = 0, bv = 0, bw = 0;
+  /// maximal number of bricks kept in memory, 0 = no limit
+  size_t max_cached_bricks = 0;
+
+  // cache (mutable, because bricks are loaded when reading values)
+  mutable std::vector<Slot> slots;
+  mutable std::vector<std::int32_t> brick_slot;  // -1 if not in memory
+  mutable std::vector<char> brick_saved;  // 1 if present in the scratch file
+  mutable std::uint64_t clock = 0;
+  fileptr_t scratch{nullptr, &std::fclose};
+
+  void copy_metadata_from(const GridMeta& g) {
+    unit_cell = g.unit_cell;
+    spacegroup = g.spacegroup;
+    set_size(g.nu, g.nv, g.nw);
+  }
+
+  void calculate_spacing() {
+    spacing[0] = 1.0 / (nu * unit_cell.ar);
+    spacing[1] = 1.0 / (nv * unit_cell.br);
+    spacing[2] = 1.0 / (nw * unit_cell.cr);
+  }
+
+  /// Resets the data: all points get default_value.
+  void set_size(int nu_, int nv_, int nw_) {
+    nu = nu_, nv = nv_, nw = nw_;
+    axis_order = AxisOrder::XYZ;
+    calculate_spacing();
+    bu = (nu + brick_mask) >> brick_bits;
+    bv = (nv + brick_mask) >> brick_bits;
+    bw = (nw + brick_mask) >> brick_bits;
+    drop_bricks();
+  }
+
+  /// Limits memory usage to max_bricks (at least 8) bricks. Other bricks
+  /// are stored in the file path (or in std::tmpfile() if path is empty).
+  /// Must be called before the data is set.
+  void set_storage(size_t max_bricks, const std::string& path="") {
+    max_cached_bricks = max_bricks == 0 ? 0 : std::max(max_bricks, (size_t)8);
+    scratch.reset();
+    if (max_cached_bricks != 0) {
+      if (path.empty()) {
+        scratch.reset(std::tmpfile());
+        if (!scratch)
+          sys_fail("Failed to create temporary file for grid bricks");
+      } else {
+        scratch = file_open(path.c_str(), "w+b");
+      }
+    }
+    drop_bricks();
+  }
+
+  size_t brick_count() const { return (size_t)bu * bv * bw; }
+  size_t cached_brick_count() const { return slots.size(); }
+
+  void fill(T value) {
+    default_value = value;
+    drop_bricks();
+  }
+
+  size_t brick_index(int u, int v, int w) const {
+    return size_t(((w >> brick_bits) * bv + (v >> brick_bits)) * bu + (u >> brick_bits));
+  }
+  static size_t index_in_brick(int u, int v, int w) {
+    return size_t((((w & brick_mask) << brick_bits) + (v & brick_mask)) << brick_bits)
+           + (u & brick_mask);
+  }
+
+  /// Returns data of brick b (brick_size values in the u-fastest order).
+  /// The pointer is valid until the next brick is loaded.
+  const T* get_brick(size_t b) const { return brick_data(b, false); }
+  T* get_brick_for_writing(size_t b) { return brick_data(b, true); }
+
+  /// works only if `0 <= u < nu`, etc.
+  T get_value_q(int u, int v, int w) const {
+    return brick_data(brick_index(u, v, w), false)[index_in_brick(u, v, w)];
+  }
+  void set_value_q(int u, int v, int w, T x) {
+    brick_data(brick_index(u, v, w), true)[index_in_brick(u, v, w)] = x;
+  }
+  T get_value(int u, int v, int w) const {
+    return get_value_q(modulo(u, nu), modulo(v, nv), modulo(w, nw));
+  }
+  void set_value(int u, int v, int w, T x) {
+    set_value_q(modulo(u, nu), modulo(v, nv), modulo(w, nw), x);
+  }
+
+  /// Calls func(u, v, w, T& value) for all points, brick by brick.
+  template<typename Func> void for_each_point(Func func) {
+    iterate_bricks([&](size_t b) { return brick_data(b, true); }, func);
+  }
+  /// Calls func(u, v, w, T value) for all points, brick by brick.
+  template<typename Func> void for_each_point(Func func) const {
+    iterate_bricks([&](size_t b) { return brick_data(b, false); }, func);
+  }
+
+  /// The same as Grid<T>::interpolate_value() (trilinear interpolation).
+  T interpolate_value(double x, double y, double z) const {
+    int u, v, w;
+    double xd = Grid<T>::grid_modulo(x, nu, &u);
+    double yd = Grid<T>::grid_modulo(y, nv, &v);
+    double zd = Grid<T>::grid_modulo(z, nw, &w);
+    int u2 = u + 1 != nu ? u + 1 : 0;
+    int v2 = v + 1 != nv ? v + 1 : 0;
+    int w2 = w + 1 != nw ? w + 1 : 0;
+    T avg[2];
+    for (int i = 0; i < 2; ++i) {
+      int wi = i == 0 ? w : w2;
+      avg[i] = (T) lerp_(lerp_(get_value_q(u, v, wi), get_value_q(u2, v, wi), xd),
+                         lerp_(get_value_q(u, v2, wi), get_value_q(u2, v2, wi), xd),
+                         yd);
+    }
+    return (T) lerp_(avg[0], avg[1], zd);
+  }
+  T interpolate_value(const Fractional& fctr) const {
+    return interpolate_value(fctr.x * nu, fctr.y * nv, fctr.z * nw);
+  }
+  T interpolate_value(const Position& ctr) const {
+    return interpolate_value(unit_cell.fractionalize(ctr));
+  }
+
+  /// The same as Grid<T>::tricubic_interpolation().
+  double tricubic_interpolation(double x, double y, double z) const {
+    int u_indices[4], v_indices[4], w_indices[4];
+    prepare_cubic_indices(x, nu, u_indices);
+    prepare_cubic_indices(y, nv, v_indices);
+    prepare_cubic_indices(z, nw, w_indices);
+    double a[4], b[4];
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        auto s = [&](int k) {
+          return get_value_q(u_indices[i], v_indices[j], w_indices[k]);
+        };
+        a[j] = cubic_interpolation(z, s(0), s(1), s(2), s(3));
+      }
+      b[i] = cubic_interpolation(y, a[0], a[1], a[2], a[3]);
+    }
+    return cubic_interpolation(x, b[0], b[1], b[2], b[3]);
+  }
+  double tricubic_interpolation(const Fractional& fctr) const {
+    return tricubic_interpolation(fctr.x * nu, fctr.y * nv, fctr.z * nw);
+  }
+  double tricubic_interpolation(const Position& ctr) const {
+    return tricubic_interpolation(unit_cell.fractionalize(ctr));
+  }
+
+  /// @param order 1=nearest, 2=linear, 3=cubic interpolation
+  T interpolate(const Fractional& f, int order) const {
+    switch (order) {
+      case 1: return get_value(iround(f.x * nu), iround(f.y * nv), iround(f.z * nw));
+      case 2: return interpolate_value(f);
+      case 3: return (T) tricubic_interpolation(f);
+    }
+    throw std::invalid_argument("interpolation \"order\" must 1, 2 or 3");
+  }
+
+  /// Interpolates this grid at the points of dest, as Grid<T>::resample_to().
+  void resample_to(Grid<T>& dest, int order) const {
+    dest.check_not_empty();
+    size_t idx = 0;
+    for (int w = 0; w < dest.nw; ++w)
+      for (int v = 0; v < dest.nv; ++v)
+        for (int u = 0; u < dest.nu; ++u, ++idx)
+          dest.data[idx] = interpolate(dest.get_fractional(u, v, w), order);
+  }
+
+  void set_from_grid(const Grid<T>& grid) {
+    if (grid.axis_order != AxisOrder::XYZ)
+      fail("BrickedGrid can be set only from a Grid in XYZ order");
+    copy_metadata_from(grid);
+    for_each_point([&](int u, int v, int w, T& value) {
+        value = grid.data[grid.index_q(u, v, w)];
+    });
+  }
+
+  void copy_to_grid(Grid<T>& grid) const {
+    grid.copy_metadata_from(*this);
+    grid.data.resize(point_count());
+    for_each_point([&](int u, int v, int w, T value) {
+        grid.data[grid.index_q(u, v, w)] = value;
+    });
+  }
+
+  /// Copies a row of n (<= nu) points starting from (0,v,w) to dest.
+  void get_row(T* dest, int v, int w, int n) const {
+    for (int u0 = 0; u0 < n; u0 += brick_dim) {
+      const T* src = brick_data(brick_index(u0, v, w), false) + index_in_brick(0, v, w);
+      std::copy(src, src + std::min(brick_dim, n - u0), dest + u0);
+    }
+  }
+  void set_row(const T* src, int v, int w, int n) {
+    for (int u0 = 0; u0 < n; u0 += brick_dim) {
+      T* dest = brick_data(brick_index(u0, v, w), true) + index_in_brick(0, v, w);
+      std::copy(src + u0, src + u0 + std::min(brick_dim, n - u0), dest);
+    }
+  }
+
+  /// @private
+  void drop_bricks() {
+    slots.clear();
+    brick_slot.assign(brick_count(), -1);
+    brick_saved.assign(brick_count(), 0);
+    clock = 0;
+  }
+
+  /// @private
+  T* brick_data(size_t b, bool for_writing) const {
+    std::int32_t s = brick_slot[b];
+    if (s < 0)
+      s = load_brick(b);
+    Slot& slot = slots[s];
+    slot.last_used = ++clock;
+    if (for_writing)
+      slot.dirty = true;
+    return slot.data.data();
+  }
+
+  /// @private
+  std::int32_t load_brick(size_t b) const {
+    std::int32_t s;
+    if (max_cached_bricks == 0 || slots.size() < max_cached_bricks) {
+      s = (std::int32_t) slots.size();
+      slots.emplace_back();
+      slots.back().data.resize(brick_size);
+    } else {
+      s = 0;
+      for (size_t i = 1; i < slots.size(); ++i)
+        if (slots[i].last_used < slots[s].last_used)
+          s = (std::int32_t) i;
+      Slot& old = slots[s];
+      if (old.dirty) {
+        seek_brick(old.brick);
+        if (std::fwrite(old.data.data(), sizeof(T), brick_size, scratch.get()) != brick_size)
+          sys_fail("Failed to write grid brick to scratch file");
+        brick_saved[old.brick] = 1;
+      }
+      brick_slot[old.brick] = -1;
+    }
+    Slot& slot = slots[s];
+    slot.brick = b;
+    slot.dirty = false;
+    if (brick_saved[b]) {
+      seek_brick(b);
+      if (std::fread(slot.data.data(), sizeof(T), brick_size, scratch.get()) != brick_size)
+        fail("Failed to read grid brick from scratch file");
+    } else {
+      std::fill(slot.data.begin(), slot.data.end(), default_value);
+    }
+    brick_slot[b] = s;
+    return s;
+  }
+
+  /// @private
+  void seek_brick(size_t b) const {
+    if (!FileStream{scratch.get()}.seek((std::ptrdiff_t)(b * brick_size * sizeof(T))))
+      sys_fail("fseek failed in grid scratch file");
+  }
+
+  /// @private
+  static void prepare_cubic_indices(double& r, int nt, int (&indices)[4]) {
+    int t;
+    r = Grid<T>::grid_modulo(r, nt, &t);
+    indices[0] = (t != 0 ? t : nt) - 1;
+    indices[1] = t;
+    if (t + 2 < nt) {
+      indices[2] = t + 1;
+      indices[3] = t + 2;
+    } else {
+      indices[2] = t + 2 == nt ? t + 1 : 0;
+      indices[3] = t + 2 == nt ? 0 : 1;
+    }
+  }
+
+  /// @private
+  template<typename GetBrick, typename Func>
+  void iterate_bricks(GetBrick get, Func& func) const {
+    size_t b = 0;
+    for (int w0 = 0; w0 < nw; w0 += brick_dim)
+      for (int v0 = 0; v0 < nv; v0 += brick_dim)
+        for (int u0 = 0; u0 < nu; u0 += brick_dim, ++b) {
+          T* data = get(b);
+          int w_end = std::min(w0 + brick_dim, nw);
+          int v_end = std::min(v0 + brick_dim, nv);
+          int u_end = std::min(u0 + brick_dim, nu);
+          for (int w = w0; w < w_end; ++w)
+            for (int v = v0; v < v_end; ++v) {
+              T* row = data + index_in_brick(0, v, w);
+              for (int u = u0; u < u_end; ++u)
+                func(u, v, w, row[u & brick_mask]);
+            }
+        }
+  }
+};
+
+template<typename T>
+DataStats calculate_data_statistics(const BrickedGrid<T>& grid) {
+  DataStats stats;
+  double sum = 0;
+  double sq_sum = 0;
+  stats.dmin = INFINITY;
+  stats.dmax = -INFINITY;
+  grid.for_each_point([&](int, int, int, double d) {
+    if (std::isnan(d)) {
+      stats.nan_count++;
+      return;
+    }
+    sum += d;
+    sq_sum += d * d;
+    if (d < stats.dmin)
+      stats.dmin = d;
+    if (d > stats.dmax)
+      stats.dmax = d;
+  });
+  size_t n = grid.point_count() - stats.nan_count;
+  if (n != 0) {
+    stats.dmean = sum / n;
+    stats.rms = std::sqrt(sq_sum / n - stats.dmean * stats.dmean);
+  } else {
+    stats.dmin = NAN;
+    stats.dmax = NAN;
+  }
+  return stats;
+}
+
+/// Brick-by-brick equivalent of mask_nodes_above_threshold() from floodfill.hpp.
+inline void mask_nodes_above_threshold(BrickedGrid<std::int8_t>& mask,
+                                       const BrickedGrid<float>& grid,
+                                       double threshold, bool negate=false) {
+  mask.copy_metadata_from(grid);
+  for (size_t b = 0; b != grid.brick_count(); ++b) {
+    const float* src = grid.get_brick(b);
+    std::int8_t* dest = mask.get_brick_for_writing(b);
+    for (size_t i = 0; i != BrickedGrid<float>::brick_size; ++i)
+      dest[i] = std::int8_t((negate ? -src[i] : src[i]) > threshold);
+  }
+}
+
+/// Reads CCP4 map section by section into BrickedGrid, so that only
+/// one section and the cached bricks are in memory at the same time.
+/// The map must cover the whole unit cell in the X,Y,Z axis order.
+/// Returns the header (Ccp4Base) that can be used for writing.
+template<typename T, typename Stream>
+Ccp4Base read_ccp4_stream_to_bricks(Stream f, const std::string& path,
+                                    BrickedGrid<T>& bgrid) {
+  Ccp4<T> map;
+  map.read_ccp4_header(f, path);
+  if (map.grid.axis_order != AxisOrder::XYZ)
+    fail(path + ": reading into bricks requires map in X,Y,Z order "
+         "that covers the whole unit cell");
+  bgrid.spacegroup = map.grid.spacegroup;
+  bgrid.unit_cell = map.grid.unit_cell;
+  bgrid.set_size(map.grid.nu, map.grid.nv, map.grid.nw);
+  std::vector<T> section((size_t)bgrid.nu * bgrid.nv);
+  int mode = map.header_i32(4);
+  for (int w = 0; w < bgrid.nw; ++w) {
+    bool same = map.same_byte_order;
+    if (mode == 0)
+      impl::read_data<Stream, std::int8_t>(f, section, same);
+    else if (mode == 1)
+      impl::read_data<Stream, std::int16_t>(f, section, same);
+    else if (mode == 2)
+      impl::read_data<Stream, float>(f, section, same);
+    else if (mode == 6)
+      impl::read_data<Stream, std::uint16_t>(f, section, same);
+    else if (mode == 12)
+      impl::read_data<Stream, Half>(f, section, same);
+    else
+      fail("Mode " + std::to_string(mode) + " is not supported "
+           "(only 0, 1, 2, 6 and 12 are supported).");
+    for (int v = 0; v < bgrid.nv; ++v)
+      bgrid.set_row(&section[(size_t)v * bgrid.nu], v, w, bgrid.nu);
+  }
+  return map;
+}
+
+template<typename T, typename Input>
+Ccp4Base read_ccp4_to_bricks(Input&& input, BrickedGrid<T>& bgrid) {
+  if (input.is_stdin())
+    return read_ccp4_stream_to_bricks(FileStream{stdin}, "stdin", bgrid);
+  if (input.is_compressed())
+    return read_ccp4_stream_to_bricks(input.get_uncompressing_stream(),
+                                      input.path(), bgrid);
+  fileptr_t f = file_open(input.path().c_str(), "rb");
+  return read_ccp4_stream_to_bricks(FileStream{f.get()}, input.path(), bgrid);
+}
+
+/// Writes BrickedGrid as a CCP4 map, section by section.
+/// mode=-1 picks the mode corresponding to T (as in Ccp4::update_ccp4_header).
+template<typename T>
+void write_bricks_to_ccp4(const BrickedGrid<T>& bgrid, const std::string& path,
+                          int mode=-1) {
+  Ccp4<T> map;
+  map.grid.unit_cell = bgrid.unit_cell;
+  map.grid.spacegroup = bgrid.spacegroup;
+  map.grid.nu = bgrid.nu;
+  map.grid.nv = bgrid.nv;
+  map.grid.nw = bgrid.nw;
+  map.grid.axis_order = AxisOrder::XYZ;
+  map.hstats = calculate_data_statistics(bgrid);
+  map.update_ccp4_header(mode, /*update_stats=*/false);
+  mode = map.header_i32(4);
+  fileptr_t f = file_open(path.c_str(), "wb");
+  std::fwrite(map.ccp4_header.data(), 4, map.ccp4_header.size(), f.get());
+  std::vector<T> section((size_t)bgrid.nu * bgrid.nv);
+  for (int w = 0; w < bgrid.nw; ++w) {
+    for (int v = 0; v < bgrid.nv; ++v)
+      bgrid.get_row(&section[(size_t)v * bgrid.nu], v, w, bgrid.nu);
+    if (mode == 0)
+      impl::write_data<std::int8_t>(section, f.get());
+    else if (mode == 1)
+      impl::write_data<std::int16_t>(section, f.get());
+    else if (mode == 2)
+      impl::write_data<float>(section, f.get());
+    else if (mode == 6)
+      impl::write_data<std::uint16_t>(section, f.get());
+    else if (mode == 12)
+      impl::write_data<Half>(section, f.get());
+  }
+}
+
+} // namespace gemmi
+#endif
@@ -19,6 +19,7 @@
 #include "fileutil.hpp"  // for file_open, is_little_endian, ...
 #include "input.hpp"     // for FileStream
 #include "grid.hpp"
+#include "half.hpp"      // for Half
 
 namespace gemmi {
 
@@ -180,8 +181,8 @@ struct Ccp4 : public Ccp4Base {
   /// If the header is empty, prepare it; otherwise, update only MODE
   /// and, if update_stats==true, also DMIN, DMAX, DMEAN and RMS.
   void update_ccp4_header(int mode=-1, bool update_stats=true) {
-    if (mode > 2 && mode != 6)
-      fail("Only modes 0, 1, 2 and 6 are supported.");
+    if (mode > 2 && mode != 6 && mode != 12)
+      fail("Only modes 0, 1, 2, 6 and 12 are supported.");
     if (grid.point_count() == 0)
       fail("update_ccp4_header(): set the grid first (it has size 0)");
     if (grid.axis_order == AxisOrder::Unknown)
@@ -213,6 +214,8 @@ struct Ccp4 : public Ccp4Base {
       return 2;
     if (std::is_same<T, std::uint16_t>::value)
       return 6;
+    if (std::is_same<T, Half>::value)
+      return 12;
     return -1;
   }
 
@@ -309,13 +312,28 @@ To translate_map_point(From f) { return static_cast<To>(f); }
 // We convert map 2 to 0 by translating non-zero values to 1.
 template<> inline
 std::int8_t translate_map_point<float,std::int8_t>(float f) { return f != 0; }
+template<> inline
+std::int8_t translate_map_point<Half,std::int8_t>(Half f) { return (f.bits & 0x7fff) != 0; }
+
+template<typename T>
+void swap_bytes_of_values(T* data, size_t len) {
+  if (sizeof(T) == 2)
+    for (size_t i = 0; i < len; ++i)
+      swap_two_bytes(data + i);
+  else if (sizeof(T) == 4)
+    for (size_t i = 0; i < len; ++i)
+      swap_four_bytes(data + i);
+}
 
+// Byte order is fixed before the conversion from TFile to TMem.
 template<typename Stream, typename TFile, typename TMem>
-void read_data(Stream& f, std::vector<TMem>& content) {
+void read_data(Stream& f, std::vector<TMem>& content, bool same_byte_order) {
   if (std::is_same<TFile, TMem>::value) {
     size_t len = content.size();
     if (!f.read(content.data(), sizeof(TMem) * len))
       fail("Failed to read all the data from the map file.");
+    if (!same_byte_order)
+      swap_bytes_of_values(content.data(), len);
   } else {
     constexpr size_t chunk_size = 64 * 1024;
     std::vector<TFile> work(chunk_size);
@@ -323,6 +341,8 @@ void read_data(Stream& f, std::vector<TMem>& content) {
       size_t len = std::min(chunk_size, content.size() - i);
       if (!f.read(work.data(), sizeof(TFile) * len))
         fail("Failed to read all the data from the map file.");
+      if (!same_byte_order)
+        swap_bytes_of_values(work.data(), len);
       for (size_t j = 0; j < len; ++j)
         content[i+j] = translate_map_point<TFile,TMem>(work[j]);
     }
@@ -358,27 +378,20 @@ void Ccp4<T>::read_ccp4_stream(Stream f, const std::string& path) {
   grid.data.resize(grid.point_count());
   int mode = header_i32(4);
   if (mode == 0)
-    impl::read_data<Stream, std::int8_t>(f, grid.data);
+    impl::read_data<Stream, std::int8_t>(f, grid.data, same_byte_order);
   else if (mode == 1)
-    impl::read_data<Stream, std::int16_t>(f, grid.data);
+    impl::read_data<Stream, std::int16_t>(f, grid.data, same_byte_order);
   else if (mode == 2)
-    impl::read_data<Stream, float>(f, grid.data);
+    impl::read_data<Stream, float>(f, grid.data, same_byte_order);
   else if (mode == 6)
-    impl::read_data<Stream, std::uint16_t>(f, grid.data);
+    impl::read_data<Stream, std::uint16_t>(f, grid.data, same_byte_order);
+  else if (mode == 12)
+    impl::read_data<Stream, Half>(f, grid.data, same_byte_order);
   else
     fail("Mode " + std::to_string(mode) + " is not supported "
-         "(only 0, 1, 2 and 6 are supported).");
+         "(only 0, 1, 2, 6 and 12 are supported).");
   //if (std::fgetc(f) != EOF)
   //  fail("The map file is longer then expected.");
-
-  if (!same_byte_order) {
-    if (sizeof(T) == 2)
-      for (T& value : grid.data)
-        swap_two_bytes(&value);
-    else if (sizeof(T) == 4)
-      for (T& value : grid.data)
-        swap_four_bytes(&value);
-  }
 }
 
 template<typename T>
@@ -479,6 +492,8 @@ void Ccp4<T>::write_ccp4_map(const std::string& path) const {
     impl::write_data<float>(grid.data, f.get());
   else if (mode == 6)
     impl::write_data<std::uint16_t>(grid.data, f.get());
+  else if (mode == 12)
+    impl::write_data<Half>(grid.data, f.get());
 }
 
 } // namespace gemmi
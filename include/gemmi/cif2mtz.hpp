@@ -5,15 +5,19 @@
 #ifndef GEMMI_CIF2MTZ_HPP_
 #define GEMMI_CIF2MTZ_HPP_
 
+#include <algorithm>  // for count
 #include <ostream>
 #include <map>
 #include <set>
 #include <unordered_map>
 #include <utility>
+#include "atox.hpp"     // for string_to_int
 #include "cifdoc.hpp"   // for Loop, as_int, ...
 #include "fail.hpp"     // for fail
+#include "input.hpp"    // for CharArray
 #include "mtz.hpp"      // for Mtz
 #include "numb.hpp"     // for as_number
+#include "read_cif.hpp" // for read_cif_from_buffer
 #include "refln.hpp"    // for ReflnBlock
 #include "version.hpp"  // for GEMMI_VERSION
 
@@ -43,6 +47,195 @@ DataType check_data_type_under_symmetry(const DataProxy& proxy) {
   return data_type;
 }
 
+/// SF-mmCIF file read for conversion to MTZ. Values of the reflection loops
+/// (_refln and _diffrn_refln) are not stored in cif::Loop as strings.
+/// The file content is kept in memory and these values are stored
+/// as pointers to (whitespace-terminated) tokens in the buffer.
+struct RawReflnCif {
+  struct RawLoop {
+    const cif::Loop* loop;  // loop with tags, but without values
+    std::vector<const char*> values;
+  };
+  CharArray buffer;
+  std::vector<ReflnBlock> rblocks;
+  std::vector<RawLoop> raw_loops;
+
+  const std::vector<const char*>* find_raw_values(const cif::Loop* loop) const {
+    for (const RawLoop& raw : raw_loops)
+      if (raw.loop == loop)
+        return &raw.values;
+    return nullptr;
+  }
+
+  /// Number of rows in the loop, also if values are stored here.
+  size_t loop_length(const cif::Loop& loop) const {
+    if (const std::vector<const char*>* values = find_raw_values(&loop))
+      return values->size() / loop.width();
+    return loop.length();
+  }
+};
+
+/// Reads CIF file from buffer, tokenizing reflection loops directly.
+/// Only loops in a typical layout are handled this way: loop_ and each tag
+/// on a separate line, followed by values without quotes and text fields.
+/// Other loops are read by the CIF parser, as usual.
+inline RawReflnCif read_raw_refln_cif(CharArray&& buffer, const std::string& name) {
+  RawReflnCif raw;
+  raw.buffer = std::move(buffer);
+  const char* const start = raw.buffer.data();
+  const char* const end = start + raw.buffer.size();
+  auto next_line = [end](const char* ptr) {
+    const char* nl = (const char*) std::memchr(ptr, '\n', end - ptr);
+    return nl ? nl + 1 : end;
+  };
+  auto is_keyword = [end](const char* p) {
+    for (const char* kw : {"data_", "loop_", "save_", "stop_", "global_"}) {
+      const char* q = p;
+      for (; *kw != '\0' && q != end && (*q | 0x20) == (*kw | 0x20); ++q)
+        ++kw;
+      if (*kw == '\0')
+        return true;
+    }
+    return false;
+  };
+  auto skip_indent = [end](const char* p) {
+    while (p != end && (*p == ' ' || *p == '\t'))
+      ++p;
+    return p;
+  };
+  struct Cut {
+    int block_idx;
+    std::string first_tag;
+    std::vector<const char*> values;
+  };
+  std::vector<Cut> cuts;
+  std::string header;  // CIF content without values of the cut loops
+  const char* copied = start;  // content before it has been added to header
+  bool in_textfield = false;
+  int block_idx = -1;
+  std::vector<std::string> block_names;
+  for (const char* line = start; line != end; ) {
+    const char* next = next_line(line);
+    if (*line == ';')
+      in_textfield = !in_textfield;
+    // keywords can be indented; block names are checked after parsing
+    const char* kw = skip_indent(line);
+    if (in_textfield || *line == ';' || kw == end || !is_keyword(kw)) {
+      line = next;
+      continue;
+    }
+    char c = *kw | 0x20;
+    if (c == 'd' || c == 'g') {  // data_ or global_
+      ++block_idx;
+      block_names.emplace_back();
+      if (c == 'd') {
+        const char* p = kw + 5;
+        while (p != end && !is_space(*p))
+          ++p;
+        block_names.back().assign(kw + 5, p);
+        if (block_names.back().empty())  // see Action<rules::datablockname>
+          block_names.back() = "#";
+      }
+    }
+    if (c != 'l' || next == end || skip_blank(kw + 5) != next - 1 || block_idx < 0) {
+      line = next;
+      continue;
+    }
+    // loop_ on a separate line; tags must be on separate lines too
+    const char* tags_end = next;
+    int width = 0;
+    const char* prefix = nullptr;
+    while (tags_end != end && *tags_end == '_') {
+      if (!prefix) {
+        if (std::strncmp(tags_end, "_refln.", 7) == 0)
+          prefix = "_refln.";
+        else if (std::strncmp(tags_end, "_diffrn_refln.", 14) == 0)
+          prefix = "_diffrn_refln.";
+        else
+          break;
+      }
+      if (std::strncmp(tags_end, prefix, std::strlen(prefix)) != 0) {
+        prefix = nullptr;
+        break;
+      }
+      ++width;
+      tags_end = next_line(tags_end);
+    }
+    line = tags_end;
+    if (!prefix)
+      continue;
+    Cut cut;
+    cut.block_idx = block_idx;
+    cut.first_tag = read_word(next);
+    // read values until a line starting with a tag or keyword
+    bool ok = true;
+    const char* values_end = tags_end;
+    while (ok && values_end != end) {
+      const char* p = values_end;
+      while (p != end && (*p == ' ' || *p == '\t'))
+        ++p;
+      if (p != end && (*p == '_' || is_keyword(p)))
+        break;
+      const char* eol = next_line(values_end);
+      if (eol == end && end[-1] != '\n') {  // no whitespace after last token
+        ok = false;
+        break;
+      }
+      if (*values_end == ';')
+        ok = false;
+      while (ok && p < eol) {
+        if (is_space(*p)) {
+          ++p;
+          continue;
+        }
+        if (*p == '#')  // comment
+          break;
+        if (*p == '\'' || *p == '"' || *p == '_' || *p == '$' || is_keyword(p))
+          ok = false;
+        cut.values.push_back(p);
+        while (p != eol && !is_space(*p))
+          ++p;
+      }
+      values_end = eol;
+    }
+    if (!ok || cut.values.empty() || cut.values.size() % width != 0)
+      continue;
+    header.append(copied, tags_end);
+    // one row of placeholders, and newlines to keep line numbers
+    for (int i = 0; i < width; ++i)
+      header += "? ";
+    header.append(std::count(tags_end, values_end, '\n'), '\n');
+    copied = line = values_end;
+    cuts.push_back(std::move(cut));
+  }
+
+  cif::Document doc;
+  if (!cuts.empty()) {
+    header.append(copied, end);
+    CharArray mem(header.size());
+    std::memcpy(mem.data(), header.data(), header.size());
+    doc = read_cif_from_buffer(mem, name.c_str());
+    // If the blocks were not split here as by the parser (e.g. data_ after
+    // other tokens in the same line), the file is parsed as usual.
+    bool same_blocks = doc.blocks.size() == block_names.size();
+    for (size_t i = 0; same_blocks && i != block_names.size(); ++i)
+      same_blocks = doc.blocks[i].name == block_names[i];
+    if (!same_blocks)
+      cuts.clear();
+  }
+  if (cuts.empty())
+    doc = read_cif_from_buffer(raw.buffer, name.c_str());
+  raw.rblocks = as_refln_blocks(std::move(doc.blocks));
+  for (Cut& cut : cuts) {
+    cif::Loop* loop = raw.rblocks[cut.block_idx].block.find_loop(cut.first_tag).get_loop();
+    if (!loop || loop->tags[0] != cut.first_tag)
+      fail("failed to locate loop ", cut.first_tag, " in ", name);
+    loop->values.clear();
+    raw.raw_loops.push_back({loop, std::move(cut.values)});
+  }
+  return raw;
+}
+
 
 struct CifToMtz {
   // Alternative mmCIF tags for the same MTZ label should be consecutive
@@ -136,12 +329,15 @@ struct CifToMtz {
     }
 
     float translate_code_to_number(const std::string& v) const {
-      if (v.size() == 1) {
+      return translate_code_to_number(v.c_str(), v.size());
+    }
+    float translate_code_to_number(const char* v, size_t len) const {
+      if (len == 1) {
         for (const auto& c2n : code_to_number)
           if (c2n.first.size() == 1 && c2n.first[0] == v[0])
             return c2n.second;
       } else {
-        std::string s = cif::as_string(v);
+        std::string s = cif::as_string(std::string(v, len));
         for (const auto& c2n : code_to_number)
           if (c2n.first == s)
             return c2n.second;
@@ -157,7 +353,113 @@ struct CifToMtz {
   double wavelength = NAN;
   std::vector<std::string> spec_lines;
 
-  Mtz convert_block_to_mtz(const ReflnBlock& rb, std::ostream& out) const {
+  /// Prepared by prepare_mtz(), used to convert rows of the reflection loop.
+  struct RowConverter {
+    const cif::Loop* loop = nullptr;
+    // values of the loop, if they are not stored in loop (see RawReflnCif)
+    const std::vector<const char*>* raw_values = nullptr;
+    bool unmerged = false;
+    std::vector<int> indices;
+    std::vector<Entry> spec_entries;
+    std::vector<const Entry*> entries;  // used for code_to_number only
+    std::unique_ptr<UnmergedHklMover> hkl_mover;
+    std::vector<int> frame_ids;  // BATCH values, if unmerged
+
+    size_t length() const {
+      return raw_values ? raw_values->size() / loop->tags.size() : loop->length();
+    }
+
+    /// Returns n-th value of the loop; its length is stored in len.
+    const char* value(size_t n, size_t& len) const {
+      if (raw_values) {
+        const char* p = (*raw_values)[n];
+        const char* e = p;
+        while (!is_space(*e))
+          ++e;
+        len = e - p;
+        return p;
+      }
+      const std::string& v = loop->values[n];
+      len = v.size();
+      return v.c_str();
+    }
+
+    int value_as_int(size_t n) const {
+      size_t len;
+      const char* v = value(n, len);
+      return string_to_int(v, true, len);
+    }
+
+    /// Writes MTZ rows corresponding to loop rows [begin, end) into dest.
+    void convert_rows(size_t begin, size_t end, float* dest, std::ostream& out) {
+      size_t k = 0;
+      size_t width = loop->tags.size();
+      for (size_t row = begin; row != end; ++row) {
+        size_t i = row * width;
+        if (unmerged) {
+          std::array<int, 3> hkl;
+          for (size_t ii = 0; ii != 3; ++ii)
+            hkl[ii] = value_as_int(i + indices[ii]);
+          int isym = hkl_mover->move_to_asu(hkl);
+          for (size_t j = 0; j != 3; ++j)
+            dest[k++] = (float) hkl[j];
+          dest[k++] = (float) isym;
+          dest[k++] = frame_ids.empty() ? 1.f : (float) frame_ids[row];
+        } else {
+          for (size_t j = 0; j != 3; ++j)
+            dest[k++] = (float) value_as_int(i + indices[j]);
+        }
+        for (size_t j = 3; j != indices.size(); ++j) {
+          size_t len;
+          const char* v = value(i + indices[j], len);
+          if (len == 1 && (*v == '?' || *v == '.')) {
+            dest[k] = (float) NAN;
+          } else if (entries[j] != nullptr) {
+            dest[k] = entries[j]->translate_code_to_number(v, len);
+          } else {
+            dest[k] = (float) cif::as_number(v, v + len);
+            if (std::isnan(dest[k]))
+              out << "Value #" << i + indices[j] << " in the loop is not a number: "
+                  << std::string(v, len) << '\n';
+          }
+          ++k;
+        }
+      }
+    }
+  };
+
+  /// If raw is given, rb must be one of raw->rblocks.
+  Mtz convert_block_to_mtz(const ReflnBlock& rb, std::ostream& out,
+                           const RawReflnCif* raw=nullptr) const {
+    RowConverter conv;
+    Mtz mtz = prepare_mtz(rb, conv, out, raw);
+    mtz.data.resize(mtz.columns.size() * mtz.nreflections);
+    conv.convert_rows(0, mtz.nreflections, mtz.data.data(), out);
+    return mtz;
+  }
+
+  /// Converts the block and writes it to MTZ file in chunks of rows,
+  /// without storing all the data in memory.
+  void write_block_to_mtz_file(const ReflnBlock& rb, const std::string& path,
+                               std::ostream& out, const RawReflnCif* raw=nullptr,
+                               size_t chunk_rows=65536) const {
+    RowConverter conv;
+    Mtz mtz = prepare_mtz(rb, conv, out, raw);
+    MtzWriter writer(mtz, path);
+    size_t nrows = mtz.nreflections;
+    std::vector<float> buf(std::min(chunk_rows, nrows) * mtz.columns.size());
+    for (size_t row = 0; row < nrows; row += chunk_rows) {
+      size_t end = std::min(row + chunk_rows, nrows);
+      conv.convert_rows(row, end, buf.data(), out);
+      writer.add_rows(buf.data(), end - row);
+    }
+    writer.finish();
+  }
+
+  /// Sets up everything but the data. Mtz::nreflections is set,
+  /// Mtz::data is left empty, and conv is prepared for reading the data.
+  Mtz prepare_mtz(const ReflnBlock& rb, RowConverter& conv, std::ostream& out,
+                  const RawReflnCif* raw=nullptr) const {
     Mtz mtz;
     mtz.title = title.empty() ? "Converted from mmCIF block " + rb.block.name : title;
     if (!history.empty()) {
@@ -172,6 +474,9 @@ struct CifToMtz {
     if (!loop)
       fail("_refln category not found in mmCIF block: " + rb.block.name);
     bool unmerged = force_unmerged || !rb.refln_loop;
+    conv.loop = loop;
+    conv.raw_values = raw ? raw->find_raw_values(loop) : nullptr;
+    conv.unmerged = unmerged;
 
     if (!unmerged) {
       Mtz::Dataset& ds = mtz.add_dataset("unknown");
@@ -186,12 +491,12 @@ struct CifToMtz {
 
     if (verbose)
       out << "Searching tags with known MTZ equivalents ...\n";
-    std::vector<int> indices;
-    std::vector<const Entry*> entries;  // used for code_to_number only
+    std::vector<int>& indices = conv.indices;
+    std::vector<const Entry*>& entries = conv.entries;
     std::string tag = loop->tags[0];
     const size_t tag_offset = rb.tag_offset();
 
-    std::vector<Entry> spec_entries;
+    std::vector<Entry>& spec_entries = conv.spec_entries;
     if (!spec_lines.empty()) {
       spec_entries.reserve(spec_lines.size());
       for (const std::string& line : spec_lines)
@@ -257,16 +562,15 @@ struct CifToMtz {
       mtz.columns[i].parent = &mtz;
       mtz.columns[i].idx = i;
     }
-    mtz.nreflections = (int) loop->length();
+    mtz.nreflections = (int) conv.length();
 
-    std::unique_ptr<UnmergedHklMover> hkl_mover;
     struct BatchInfo {
       int sweep_id;
       int frame_id;
     };
     std::vector<BatchInfo> batch_nums;
     if (unmerged) {
-      hkl_mover.reset(new UnmergedHklMover(mtz.spacegroup));
+      conv.hkl_mover.reset(new UnmergedHklMover(mtz.spacegroup));
       tag.replace(tag_offset, std::string::npos, "diffrn_id");
       int sweep_id_index = loop->find_tag(tag);
       if (sweep_id_index == -1 && verbose)
@@ -294,14 +598,19 @@ struct CifToMtz {
       cif::Table tab_w2 = block.find("_diffrn_radiation_wavelength.",
                                      {"id", "wavelength"});
       // store sweep and frame numbers corresponding to reflections
-      batch_nums.reserve(loop->length());
-      for (size_t i = 0; i < loop->values.size(); i += loop->tags.size()) {
+      batch_nums.reserve(mtz.nreflections);
+      size_t len;
+      for (size_t i = 0; i < mtz.nreflections * loop->tags.size(); i += loop->tags.size()) {
         int sweep_id = 1;
-        if (sweep_id_index >= 0)
-          sweep_id = cif::as_int(loop->values[i + sweep_id_index], 1);
+        if (sweep_id_index >= 0) {
+          const char* v = conv.value(i + sweep_id_index, len);
+          if (!(len == 1 && (*v == '?' || *v == '.')))
+            sweep_id = string_to_int(v, true, len);
+        }
         int frame = 1;
         if (image_id_index >= 0) {
-          double d = cif::as_number(loop->values[i + image_id_index], 1.);
+          const char* v = conv.value(i + image_id_index, len);
+          double d = cif::as_number(v, v + len, 1.);
           frame = (int) std::ceil(d);
         }
         batch_nums.push_back({sweep_id, frame});
@@ -309,7 +618,8 @@ struct CifToMtz {
           SweepInfo& sweep = sweeps[sweep_id];
           // if new sweep was added - try to set crystal_id and wavelength
           if (sweep.frame_ids.empty() && sweep_id_index >= 0) {
-            const std::string& sweep_str = loop->values[i + sweep_id_index];
+            const char* v = conv.value(i + sweep_id_index, len);
+            const std::string sweep_str(v, len);
             try {
               sweep.crystal_id = tab_w0.find_row(sweep_str).str(1);
             } catch(std::exception&) {}
@@ -347,6 +657,9 @@ struct CifToMtz {
       for (BatchInfo& p : batch_nums)
         if (p.sweep_id >= 0 && p.frame_id >= 0)
           p.frame_id += sweeps.at(p.sweep_id).offset;
+      conv.frame_ids.reserve(batch_nums.size());
+      for (const BatchInfo& p : batch_nums)
+        conv.frame_ids.push_back(p.frame_id);
 
       // add MTZ batches
       for (const auto& sweep_pair : sweeps) {
@@ -373,38 +686,6 @@ struct CifToMtz {
       }
     }  // - if (unmerged)
 
-    // fill in the data
-    mtz.data.resize(mtz.columns.size() * mtz.nreflections);
-    size_t k = 0, row = 0;
-    for (size_t i = 0; i < loop->values.size(); i += loop->tags.size()) {
-      if (unmerged) {
-        std::array<int, 3> hkl;
-        for (size_t ii = 0; ii != 3; ++ii)
-          hkl[ii] = cif::as_int(loop->values[i + indices[ii]]);
-        int isym = hkl_mover->move_to_asu(hkl);
-        for (size_t j = 0; j != 3; ++j)
-          mtz.data[k++] = (float) hkl[j];
-        mtz.data[k++] = (float) isym;
-        mtz.data[k++] = batch_nums.empty() ? 1.f : (float) batch_nums[row++].frame_id;
-      } else {
-        for (size_t j = 0; j != 3; ++j)
-          mtz.data[k++] = (float) cif::as_int(loop->values[i + indices[j]]);
-      }
-      for (size_t j = 3; j != indices.size(); ++j) {
-        const std::string& v = loop->values[i + indices[j]];
-        if (cif::is_null(v)) {
-          mtz.data[k] = (float) NAN;
-        } else if (entries[j] != nullptr) {
-          mtz.data[k] = entries[j]->translate_code_to_number(v);
-        } else {
-          mtz.data[k] = (float) cif::as_number(v);
-          if (std::isnan(mtz.data[k]))
-            out << "Value #" << i + indices[j] << " in the loop is not a number: "
-                << v << '\n';
-        }
-        ++k;
-      }
-    }
     return mtz;
   }
 
@@ -6,6 +6,12 @@
 #define GEMMI_DENCALC_HPP_
 
 #include <cassert>
+#include <cmath>       // for llround
+#include <map>
+#include <memory>      // for shared_ptr
+#include <mutex>
+#include <tuple>       // for tie
+#include <vector>
 #include "addends.hpp"  // for Addends
 #include "formfact.hpp" // for ExpSum
 #include "grid.hpp"     // for Grid
@@ -82,11 +88,113 @@ inline double get_minimum_b(const Model& model) {
   return b_min;
 }
 
+// Density of an isotropic atom as a function of r^2, tabulated up to
+// the cutoff radius and linearly interpolated. The step is chosen so that
+// the interpolation error is below max_error.
+template<typename Real>
+struct DensityProfile {
+  double radius = 0.;
+  double inv_step = 0.;
+  std::vector<Real> values;
+
+  template<typename PrecalExpSum>
+  bool tabulate(const PrecalExpSum& precal, double radius_, double max_error,
+                size_t max_size=1000000) {
+    const int N = sizeof(precal.a) / sizeof(precal.a[0]);
+    // |d^2/d(r^2)^2 of a*exp(b*r^2)| <= |a|*b^2
+    double max_d2 = 0.;
+    for (int i = 0; i < N; ++i)
+      max_d2 += std::abs(precal.a[i]) * sq(precal.b[i]);
+    double step = std::sqrt(8 * max_error / std::max(max_d2, 1e-30));
+    double size = sq(radius_) / step + 2;
+    if (!(size < max_size))
+      return false;
+    radius = radius_;
+    inv_step = 1. / step;
+    values.resize((size_t) size);
+    for (size_t i = 0; i != values.size(); ++i)
+      values[i] = (Real) precal.calculate(Real(i * step));
+    return true;
+  }
+
+  // pre: r2 < radius^2
+  Real calculate(double r2) const {
+    double x = r2 * inv_step;
+    size_t i = (size_t) x;
+    Real frac = Real(x - i);
+    return values[i] + frac * (values[i+1] - values[i]);
+  }
+};
+
+// Tabulated density profiles, keyed by element, B and addend (f').
+// A cache can be shared by DensityCalculators that use the same Table
+// and Real (for instance, in different threads or in consecutive cycles
+// of refinement); access to the cache is guarded by a mutex.
+// It pays off when many atoms have the same element and B.
+// B is rounded to b_step and the profile is calculated for the rounded B;
+// it changes the density by a fraction of about 0.75*b_step/B (< 0.1%
+// for B > 7.5A^2 with the default step). When the cache reaches max_size
+// profiles, it is cleared (profiles in use are kept alive by shared_ptr).
+template<typename Table, typename Real>
+class DensityProfileCache {
+public:
+  using Profile = DensityProfile<Real>;
+
+  double b_step = 0.01;  // change it only when the cache is empty
+  size_t max_size = 10000;
+
+  // Returns a profile from the cache, or calls make(profile, rounded_b)
+  // to calculate and store it. Returns null if make() returned false.
+  template<typename Func>
+  std::shared_ptr<const Profile> get(El el, double b, float addend, float cutoff,
+                                     Func make) {
+    Key key{el, std::llround(b / b_step), addend, cutoff};
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = profiles_.find(key);
+      if (it != profiles_.end())
+        return it->second;
+    }
+    std::shared_ptr<Profile> profile(new Profile);
+    if (!make(*profile, key.b * b_step))
+      profile.reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (profiles_.size() >= max_size)
+      profiles_.clear();
+    // if another thread added the same key in the meantime, use its profile
+    return profiles_.emplace(key, std::move(profile)).first->second;
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return profiles_.size();
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    profiles_.clear();
+  }
+
+private:
+  struct Key {
+    El el;
+    long long b;  // B in units of b_step
+    float addend;
+    float cutoff;
+    bool operator<(const Key& o) const {
+      return std::tie(el, b, addend, cutoff) < std::tie(o.el, o.b, o.addend, o.cutoff);
+    }
+  };
+  mutable std::mutex mutex_;
+  std::map<Key, std::shared_ptr<const Profile>> profiles_;
+};
+
 // Usual usage:
 // - set d_min and optionally also other parameters,
 // - set addends to f' values for your wavelength (see fprime.hpp)
 // - use set_grid_cell_and_spacegroup() to set grid's unit cell and space group
 // - check that Table has SF coefficients for all elements that are to be used
+// - optionally, set profile_cache (if many atoms have the same B)
 // - call put_model_density_on_grid()
 // - do FFT using transform_map_to_f_phi()
 // - if blur is used, multiply the SF by reciprocal_space_multiplier()
@@ -98,6 +206,9 @@ struct DensityCalculator {
   double blur = 0.;
   float cutoff = 1e-5f;
   Addends addends;
+  // If set, isotropic atoms use tabulated density profiles, which adds
+  // interpolation errors below cutoff/10 (and B is rounded to 0.01A^2).
+  std::shared_ptr<DensityProfileCache<Table, Real>> profile_cache;
 
   using coef_type = typename Table::Coef::coef_type;
 
@@ -114,6 +225,23 @@ struct DensityCalculator {
   // pre: check if Table::has(atom.element)
   void add_atom_density_to_grid(const Atom& atom) {
     Element el = atom.element;
+    if (profile_cache && !atom.aniso.nonzero()) {
+      double b = atom.b_iso + blur;
+      float addend = addends.get(el);
+      auto profile = profile_cache->get(el.elem, b, addend, cutoff,
+                                        [&](DensityProfile<Real>& prof, double rounded_b) {
+        auto precal = Table::get(el).precalculate_density_iso(rounded_b, addend);
+        return prof.tabulate(precal, estimate_radius(precal, rounded_b), 0.1 * cutoff);
+      });
+      if (profile) {
+        Fractional fpos = grid.unit_cell.fractionalize(atom.pos);
+        grid.template use_points_around<true>(fpos, profile->radius,
+                                              [&](Real& point, double r2) {
+            point += Real(atom.occ * profile->calculate(r2));
+        }, /*fail_on_too_large_radius=*/false);
+        return;
+      }
+    }
     do_add_atom_density_to_grid(atom, Table::get(el), addends.get(el));
   }
 
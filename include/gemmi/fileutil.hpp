@@ -6,7 +6,7 @@
 #define GEMMI_FILEUTIL_HPP_
 
 #include <cctype>    // for isdigit, isalnum
-#include <cstdio>    // for FILE, fopen, fclose
+#include <cstdio>    // for FILE, fopen, fclose, remove, rename
 #include <cstdlib>   // getenv
 #include <cstring>   // strlen
 #include <initializer_list>
@@ -61,6 +61,32 @@ inline fileptr_t file_open_or(const char* path, const char* mode,
   return file_open(path, mode);
 }
 
+// Removes a file; errors are ignored (used for cleaning up).
+inline void remove_file(const std::string& path) {
+#if defined(_WIN32) && !defined(GEMMI_USE_FOPEN)
+  ::_wremove(UTF8_to_wchar(path.c_str()).c_str());
+#else
+  std::remove(path.c_str());
+#endif
+}
+
+// Renames a file, replacing the destination if it exists. Used with
+// temporary files, to avoid leaving a partially written output file.
+inline void rename_file(const std::string& old_path, const std::string& new_path) {
+#if defined(_WIN32)
+  // on Windows, rename() fails if the destination exists
+  remove_file(new_path);
+#endif
+#if defined(_WIN32) && !defined(GEMMI_USE_FOPEN)
+  int ret = ::_wrename(UTF8_to_wchar(old_path.c_str()).c_str(),
+                       UTF8_to_wchar(new_path.c_str()).c_str());
+#else
+  int ret = std::rename(old_path.c_str(), new_path.c_str());
+#endif
+  if (ret != 0)
+    sys_fail("Failed to rename " + old_path + " to " + new_path);
+}
+
 inline std::size_t file_size(std::FILE* f, const std::string& path) {
   if (std::fseek(f, 0, SEEK_END) != 0)
     sys_fail(path + ": fseek failed");
@@ -133,6 +159,17 @@ inline void swap_four_bytes(void* start) {
   std::swap(bytes[1], bytes[2]);
 }
 
+// byte-swapping of an array of 4-byte values, written to be auto-vectorized
+inline void swap_four_bytes_of_array(void* start, size_t n) {
+  char* bytes = static_cast<char*>(start);
+  for (size_t i = 0; i < n; ++i, bytes += 4) {
+    std::uint32_t u;
+    std::memcpy(&u, bytes, 4);
+    u = (u >> 24) | ((u >> 8) & 0xff00) | ((u << 8) & 0xff0000) | (u << 24);
+    std::memcpy(bytes, &u, 4);
+  }
+}
+
 inline void swap_eight_bytes(void* start) {
   char* bytes = static_cast<char*>(start);
   std::swap(bytes[0], bytes[7]);
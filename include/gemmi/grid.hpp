@@ -9,6 +9,7 @@
 #include <cstddef>    // for ptrdiff_t
 #include <complex>
 #include <algorithm>  // for fill
+#include <limits>     // for numeric_limits
 #include <memory>     // for unique_ptr
 #include <numeric>    // for accumulate
 #include <type_traits>
@@ -17,6 +18,8 @@
 #include "symmetry.hpp"
 #include "stats.hpp"  // for DataStats
 #include "fail.hpp"   // for fail
+#include "half.hpp"   // for Half
+#include "parallel.hpp"  // for parallel_for_chunks
 
 namespace gemmi {
 
@@ -156,6 +159,14 @@ inline double cubic_interpolation_der(double u, double a, double b, double c, do
          + u * (4.5*b*u - 5*b + 1.5*d*u - d);
 }
 
+/// Coefficients of a, b, c, d in cubic_interpolation(u, a, b, c, d).
+inline void cubic_interpolation_weights(double u, double (&wt)[4]) {
+  wt[0] = -0.5 * u * ((u-2)*u + 1);
+  wt[1] = 0.5 * ((3*u - 5) * u*u + 2);
+  wt[2] = -0.5 * u * ((3*u - 4) * u - 1);
+  wt[3] = 0.5 * (u-1) * u * u;
+}
+
 
 /// The base of Grid classes that does not depend on stored data type.
 struct GridMeta {
@@ -199,6 +210,44 @@ struct GridMeta {
     return grid_ops;
   }
 
+  /// Checks if ops (as from get_scaled_ops_except_id()) act on this grid
+  /// as a group: each op maps grid points to grid points consistently
+  /// with periodic boundaries and the ops with identity are closed under
+  /// composition (modulo grid size).
+  bool ops_are_consistent(const std::vector<GridOp>& ops) const {
+    const int n[3] = {nu, nv, nw};
+    for (const GridOp& op : ops)
+      for (int i = 0; i != 3; ++i)
+        for (int j = 0; j != 3; ++j)
+          if (op.scaled_op.rot[i][j] * n[j] % n[i] != 0)
+            return false;
+    auto same_mod_n = [&](const Op& a, const Op& b) {
+      return a.rot == b.rot && modulo(a.tran[0] - b.tran[0], nu) == 0
+                            && modulo(a.tran[1] - b.tran[1], nv) == 0
+                            && modulo(a.tran[2] - b.tran[2], nw) == 0;
+    };
+    Op identity = Op::identity();
+    identity.rot = {{{1,0,0}, {0,1,0}, {0,0,1}}};
+    for (const GridOp& a : ops)
+      for (const GridOp& b : ops) {
+        Op ab;
+        for (int i = 0; i != 3; ++i) {
+          ab.tran[i] = a.scaled_op.tran[i];
+          for (int j = 0; j != 3; ++j) {
+            ab.rot[i][j] = 0;
+            for (int k = 0; k != 3; ++k)
+              ab.rot[i][j] += a.scaled_op.rot[i][k] * b.scaled_op.rot[k][j];
+            ab.tran[i] += a.scaled_op.rot[i][j] * b.scaled_op.tran[j];
+          }
+        }
+        if (!same_mod_n(ab, identity) &&
+            std::none_of(ops.begin(), ops.end(), [&](const GridOp& c) {
+                           return same_mod_n(ab, c.scaled_op); }))
+          return false;
+      }
+    return true;
+  }
+
   /// Quick(est) index function, but works only if `0 <= u < nu`, etc.
   size_t index_q(int u, int v, int w) const {
     return size_t(w * nv + v) * nu + u;
@@ -264,7 +313,9 @@ struct GridBase : GridMeta {
   }
 
   using Tsum = typename std::conditional<std::is_integral<T>::value,
-                                         std::ptrdiff_t, T>::type;
+                                         std::ptrdiff_t,
+                 typename std::conditional<std::is_same<T, Half>::value,
+                                           double, T>::type>::type;
   Tsum sum() const { return std::accumulate(data.begin(), data.end(), Tsum()); }
 
 
@@ -431,18 +482,21 @@ struct Grid : GridBase<T> {
     double zd = grid_modulo(z, nw, &w);
     assert(u >= 0 && v >= 0 && w >= 0);
     assert(u < nu && v < nv && w < nw);
-    T avg[2];
+    // for Half, the intermediate values are not rounded to half precision
+    using Tavg = typename std::conditional<std::is_same<T, Half>::value,
+                                           float, T>::type;
+    Tavg avg[2];
     for (int i = 0; i < 2; ++i) {
       int wi = (i == 0 || w + 1 != nw ? w + i : 0);
       size_t idx1 = this->index_q(u, v, wi);
       int v2 = v + 1 != nv ? v + 1 : 0;
       size_t idx2 = this->index_q(u, v2, wi);
       int u_add = u + 1 != nu ? 1 : -u;
-      avg[i] = (T) lerp_(lerp_(data[idx1], data[idx1 + u_add], xd),
+      avg[i] = (Tavg) lerp_(lerp_(data[idx1], data[idx1 + u_add], xd),
                          lerp_(data[idx2], data[idx2 + u_add], xd),
                          yd);
     }
-    return (T) lerp_(avg[0], avg[1], zd);
+    return (T) (Tavg) lerp_(avg[0], avg[1], zd);
   }
   T interpolate_value(const Fractional& fctr) const {
     return interpolate_value(fctr.x * nu, fctr.y * nv, fctr.z * nw);
@@ -684,14 +738,88 @@ struct Grid : GridBase<T> {
   /// grid point, then assign the result to all the points.
   /// \par func takes two values and returns a value.
   template<typename Func>
-  void symmetrize(Func func) {
-    symmetrize_using_ops(this->get_scaled_ops_except_id(), func);
+  void symmetrize(Func func, int nthreads=1) {
+    symmetrize_using_ops(this->get_scaled_ops_except_id(), func, nthreads);
   }
 
+  /// Points are processed in orbits of symmetry-equivalent points. If ops
+  /// are consistent with the grid, an orbit is processed when its member
+  /// with the lowest index is reached, so orbits can be distributed between
+  /// threads and the result does not depend on nthreads.
   template<typename Func>
-  void symmetrize_using_ops(const std::vector<GridOp>& ops, Func func) {
+  void symmetrize_using_ops(const std::vector<GridOp>& ops, Func func, int nthreads=1) {
     if (ops.empty())
       return;
+    if (!this->ops_are_consistent(ops)) {
+      symmetrize_using_ops_serially(ops, func);
+      return;
+    }
+    size_t nrows = (size_t) nv * nw;
+    parallel_for_chunks(nrows, nthreads, [&](size_t begin, size_t end, int) {
+      const int n[3] = {nu, nv, nw};
+      std::vector<size_t> mates(ops.size(), 0);
+      // ops that need to be checked point by point, with current images
+      std::vector<std::pair<const GridOp*, std::array<int,3>>> checked;
+      for (size_t row = begin; row < end; ++row) {
+        int v = int(row % nv);
+        int w = int(row / nv);
+        // If an op maps the whole row to a single row, comparing rows
+        // tells if the mates of all points have lower or higher indices.
+        checked.clear();
+        bool skip_row = false;
+        for (const GridOp& op : ops) {
+          std::array<int,3> t = op.apply(0, v, w);
+          for (int i = 0; i < 3; ++i)
+            t[i] = modulo(t[i], n[i]);
+          if (op.scaled_op.rot[1][0] == 0 && op.scaled_op.rot[2][0] == 0) {
+            size_t image_row = (size_t) t[2] * nv + t[1];
+            if (image_row < row) {
+              skip_row = true;
+              break;
+            }
+            if (image_row > row)
+              continue;
+          }
+          checked.emplace_back(&op, t);
+        }
+        if (skip_row)
+          continue;
+        size_t idx = row * nu;
+        for (int u = 0; u != nu; ++u, ++idx) {
+          bool first_in_orbit = true;
+          for (auto& op_image : checked) {
+            std::array<int,3>& t = op_image.second;
+            if (this->index_q(t[0], t[1], t[2]) < idx)
+              first_in_orbit = false;
+            // move to the image of (u+1, v, w)
+            for (int i = 0; i < 3; ++i) {
+              t[i] += op_image.first->scaled_op.rot[i][0];
+              while (t[i] >= n[i])
+                t[i] -= n[i];
+              while (t[i] < 0)
+                t[i] += n[i];
+            }
+          }
+          if (!first_in_orbit)
+            continue;
+          for (size_t k = 0; k < ops.size(); ++k) {
+            std::array<int,3> t = ops[k].apply(u, v, w);
+            mates[k] = this->index_n(t[0], t[1], t[2]);
+          }
+          T value = data[idx];
+          for (size_t k : mates)
+            value = func(value, data[k]);
+          data[idx] = value;
+          for (size_t k : mates)
+            data[k] = value;
+        }
+      }
+    });
+  }
+
+  /// @private  the original algorithm, used when ops_are_consistent() fails
+  template<typename Func>
+  void symmetrize_using_ops_serially(const std::vector<GridOp>& ops, Func func) {
     std::vector<size_t> mates(ops.size(), 0);
     std::vector<bool> visited(data.size(), false);
     size_t idx = 0;
@@ -722,21 +850,23 @@ struct Grid : GridBase<T> {
   }
 
   // most common symmetrize functions
-  void symmetrize_min() {
-    symmetrize([](T a, T b) { return (a < b || !(b == b)) ? a : b; });
+  void symmetrize_min(int nthreads=1) {
+    symmetrize([](T a, T b) { return (a < b || !(b == b)) ? a : b; }, nthreads);
   }
-  void symmetrize_max() {
-    symmetrize([](T a, T b) { return (a > b || !(b == b)) ? a : b; });
+  void symmetrize_max(int nthreads=1) {
+    symmetrize([](T a, T b) { return (a > b || !(b == b)) ? a : b; }, nthreads);
   }
-  void symmetrize_abs_max() {
-    symmetrize([](T a, T b) { return (std::abs(a) > std::abs(b) || !(b == b)) ? a : b; });
+  void symmetrize_abs_max(int nthreads=1) {
+    symmetrize([](T a, T b) { return (std::abs(a) > std::abs(b) || !(b == b)) ? a : b; },
+               nthreads);
   }
   /// multiplies grid points on special position
-  void symmetrize_sum() {
-    symmetrize([](T a, T b) { return a + b; });
+  void symmetrize_sum(int nthreads=1) {
+    symmetrize([](T a, T b) { return a + b; }, nthreads);
   }
-  void symmetrize_nondefault(T default_) {
-    symmetrize([default_](T a, T b) { return impl::is_same(a, default_) ? b : a; });
+  void symmetrize_nondefault(T default_, int nthreads=1) {
+    symmetrize([default_](T a, T b) { return impl::is_same(a, default_) ? b : a; },
+               nthreads);
   }
 
   /// scale the data to get mean == 0 and rmsd == 1 (doesn't work for T=complex)
@@ -746,19 +876,239 @@ struct Grid : GridBase<T> {
       x = static_cast<T>((x - stats.dmean) / stats.rms);
   }
 
-  // TODO: can it be replaced with interpolate_grid(dest, src, Transform(), order)?
-  void resample_to(Grid<T>& dest, int order) const {
+  void resample_to(Grid<T>& dest, int order, int nthreads=1) const {
+    interpolate_to_grid(dest, FTransform(Transform()), order, nthreads);
+  }
+
+  /// Sets each point of dest to the value interpolated at frac_tr applied
+  /// to fractional coordinates of the point. Rows of dest are split between
+  /// nthreads threads. For order=3 the 4x4x4 neighbourhood is re-used
+  /// by consecutive points in a row that fall into the same grid cell.
+  void interpolate_to_grid(Grid<T>& dest, const FTransform& frac_tr,
+                           int order, int nthreads=1) const {
     dest.check_not_empty();
-    int idx = 0;
-    for (int w = 0; w < dest.nw; ++w)
-      for (int v = 0; v < dest.nv; ++v)
-        for (int u = 0; u < dest.nu; ++u, ++idx) {
-          const Fractional f = dest.get_fractional(u, v, w);
-          dest.data[idx] = interpolate(f, order);
+    if (order < 1 || order > 3)
+      throw std::invalid_argument("interpolation \"order\" must 1, 2 or 3");
+    size_t nrows = (size_t) dest.nv * dest.nw;
+    parallel_for_chunks(nrows, nthreads, [&](size_t begin, size_t end, int) {
+      std::array<std::array<std::array<T,4>,4>,4> copy;
+      int cell[3] = {0, 0, 0};
+      bool has_copy = false;
+      for (size_t row = begin; row < end; ++row) {
+        int v = int(row % dest.nv);
+        int w = int(row / dest.nv);
+        T* dest_row = &dest.data[row * dest.nu];
+        for (int u = 0; u < dest.nu; ++u) {
+          Fractional f = frac_tr.apply(dest.get_fractional(u, v, w));
+          if (order != 3) {
+            dest_row[u] = interpolate(f, order);
+            continue;
+          }
+          double x = f.x * nu, y = f.y * nv, z = f.z * nw;
+          int fx = (int) std::floor(x), fy = (int) std::floor(y), fz = (int) std::floor(z);
+          if (has_copy && fx == cell[0] && fy == cell[1] && fz == cell[2]) {
+            x -= fx, y -= fy, z -= fz;
+          } else {
+            copy_4x4x4(x, y, z, copy);
+            cell[0] = fx, cell[1] = fy, cell[2] = fz;
+            has_copy = true;
+          }
+          dest_row[u] = (T) tricubic_from_4x4x4(copy, x, y, z);
         }
+      }
+    });
+  }
+
+  /// Tricubic interpolation using values copied by copy_4x4x4(),
+  /// x, y, z are in [0,1). Gives the same as tricubic_interpolation(),
+  /// but with the weights calculated once per axis.
+  static double tricubic_from_4x4x4(const std::array<std::array<std::array<T,4>,4>,4>& copy,
+                                    double x, double y, double z) {
+    double wx[4], wy[4], wz[4];
+    cubic_interpolation_weights(x, wx);
+    cubic_interpolation_weights(y, wy);
+    cubic_interpolation_weights(z, wz);
+    double b = 0;
+    for (int i = 0; i < 4; ++i) {
+      double a = 0;
+      for (int j = 0; j < 4; ++j) {
+        const std::array<T,4>& s = copy[i][j];
+        a += wy[j] * (wz[0] * s[0] + wz[1] * s[1] + wz[2] * s[2] + wz[3] * s[3]);
+      }
+      b += wx[i] * a;
+    }
+    return b;
   }
 };
 
+/// Grid with values stored as 8- or 16-bit integers q that represent
+/// offset + scale * q. The lowest value of Q is reserved for NaN.
+/// Values are dequantized on the fly in interpolation functions,
+/// get_subarray() and calculate_data_statistics().
+/// Functions inherited from Grid<Q> (get_value(), symmetrize_max(), etc)
+/// operate on the stored integers.
+template<typename Q=std::int16_t>
+struct QuantizedGrid : Grid<Q> {
+  static_assert(std::is_integral<Q>::value && sizeof(Q) <= 2,
+                "QuantizedGrid stores 8- or 16-bit integers");
+  using Grid<Q>::nu;
+  using Grid<Q>::nv;
+  using Grid<Q>::nw;
+  using Grid<Q>::data;
+
+  float scale = 1.f;
+  float offset = 0.f;
+
+  static constexpr Q nan_code() { return std::numeric_limits<Q>::min(); }
+
+  float dequantize(Q q) const {
+    return q != nan_code() ? offset + scale * q : NAN;
+  }
+  Q quantize(double x) const {
+    if (std::isnan(x))
+      return nan_code();
+    double q = std::round((x - offset) / scale);
+    const double lo = std::numeric_limits<Q>::min() + 1;
+    const double hi = std::numeric_limits<Q>::max();
+    return static_cast<Q>(q < lo ? lo : q > hi ? hi : q);
+  }
+
+  /// Sets scale and offset so that [dmin, dmax] spans all the integer codes.
+  void set_range(double dmin, double dmax) {
+    const double qmin = std::numeric_limits<Q>::min() + 1;
+    const double qmax = std::numeric_limits<Q>::max();
+    scale = dmax > dmin ? float((dmax - dmin) / (qmax - qmin)) : 1.f;
+    offset = float(dmin - scale * qmin);
+  }
+
+  float get_real_value(int u, int v, int w) const {
+    return dequantize(this->get_value(u, v, w));
+  }
+  void set_real_value(int u, int v, int w, double x) {
+    this->set_value(u, v, w, quantize(x));
+  }
+
+  template<typename T>
+  void set_from_grid(const Grid<T>& src) {
+    this->copy_metadata_from(src);
+    DataStats st = calculate_data_statistics(src.data);
+    if (st.nan_count != src.data.size())
+      set_range(st.dmin, st.dmax);
+    else
+      set_range(0., 0.);
+    data.resize(src.data.size());
+    for (size_t i = 0; i < data.size(); ++i)
+      data[i] = quantize(src.data[i]);
+  }
+
+  template<typename T>
+  void copy_to_grid(Grid<T>& dest) const {
+    dest.copy_metadata_from(*this);
+    dest.data.resize(data.size());
+    for (size_t i = 0; i < data.size(); ++i)
+      dest.data[i] = static_cast<T>(dequantize(data[i]));
+  }
+
+  /// Trilinear interpolation of dequantized values.
+  float interpolate_value(double x, double y, double z) const {
+    this->check_not_empty();
+    int u, v, w;
+    double xd = this->grid_modulo(x, nu, &u);
+    double yd = this->grid_modulo(y, nv, &v);
+    double zd = this->grid_modulo(z, nw, &w);
+    double avg[2];
+    for (int i = 0; i < 2; ++i) {
+      int wi = (i == 0 || w + 1 != nw ? w + i : 0);
+      size_t idx1 = this->index_q(u, v, wi);
+      int v2 = v + 1 != nv ? v + 1 : 0;
+      size_t idx2 = this->index_q(u, v2, wi);
+      int u_add = u + 1 != nu ? 1 : -u;
+      avg[i] = lerp_(lerp_(dequantize(data[idx1]), dequantize(data[idx1 + u_add]), xd),
+                     lerp_(dequantize(data[idx2]), dequantize(data[idx2 + u_add]), xd),
+                     yd);
+    }
+    return (float) lerp_(avg[0], avg[1], zd);
+  }
+  float interpolate_value(const Fractional& fctr) const {
+    return interpolate_value(fctr.x * nu, fctr.y * nv, fctr.z * nw);
+  }
+  float interpolate_value(const Position& ctr) const {
+    return interpolate_value(this->unit_cell.fractionalize(ctr));
+  }
+
+  double tricubic_interpolation(double x, double y, double z) const {
+    std::array<std::array<std::array<Q,4>,4>,4> copy;
+    this->copy_4x4x4(x, y, z, copy);
+    std::array<std::array<std::array<float,4>,4>,4> real;
+    for (int i = 0; i < 4; ++i)
+      for (int j = 0; j < 4; ++j)
+        for (int k = 0; k < 4; ++k)
+          real[i][j][k] = dequantize(copy[i][j][k]);
+    return Grid<float>::tricubic_from_4x4x4(real, x, y, z);
+  }
+  double tricubic_interpolation(const Fractional& fctr) const {
+    return tricubic_interpolation(fctr.x * nu, fctr.y * nv, fctr.z * nw);
+  }
+  double tricubic_interpolation(const Position& ctr) const {
+    return tricubic_interpolation(this->unit_cell.fractionalize(ctr));
+  }
+
+  /// @param order 1=nearest, 2=linear, 3=cubic interpolation
+  float interpolate(const Fractional& f, int order) const {
+    switch (order) {
+      case 1: return dequantize(Grid<Q>::interpolate(f, 1));
+      case 2: return interpolate_value(f);
+      case 3: return (float) tricubic_interpolation(f);
+    }
+    throw std::invalid_argument("interpolation \"order\" must 1, 2 or 3");
+  }
+
+  /// Copies dequantized values, one row at a time.
+  void get_subarray(float* dest, std::array<int,3> start, std::array<int,3> shape) const {
+    std::vector<Q> row(shape[0]);
+    for (int w = 0; w < shape[2]; w++)
+      for (int v = 0; v < shape[1]; v++) {
+        Grid<Q>::get_subarray(row.data(), {start[0], start[1] + v, start[2] + w},
+                              {shape[0], 1, 1});
+        for (Q q : row)
+          *dest++ = dequantize(q);
+      }
+  }
+};
+
+/// Statistics of dequantized values (calculated from the stored integers).
+template<typename Q>
+DataStats calculate_data_statistics(const QuantizedGrid<Q>& grid) {
+  DataStats stats;
+  double sum = 0;
+  double sq_sum = 0;
+  int qmin = std::numeric_limits<Q>::max();
+  int qmax = std::numeric_limits<Q>::min();
+  for (Q q : grid.data) {
+    if (q == grid.nan_code()) {
+      stats.nan_count++;
+      continue;
+    }
+    sum += q;
+    sq_sum += (double) q * q;
+    qmin = std::min(qmin, (int) q);
+    qmax = std::max(qmax, (int) q);
+  }
+  size_t n = grid.data.size() - stats.nan_count;
+  if (n != 0) {
+    double qmean = sum / n;
+    double d1 = grid.dequantize((Q) qmin);
+    double d2 = grid.dequantize((Q) qmax);
+    stats.dmin = std::min(d1, d2);
+    stats.dmax = std::max(d1, d2);
+    stats.dmean = grid.offset + grid.scale * qmean;
+    stats.rms = std::fabs(grid.scale) * std::sqrt(sq_sum / n - qmean * qmean);
+  } else {
+    stats.dmin = NAN;
+    stats.dmax = NAN;
+  }
+  return stats;
+}
 
 template<typename T>
 Correlation calculate_correlation(const GridBase<T>& a, const GridBase<T>& b) {
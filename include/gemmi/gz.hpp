@@ -70,6 +70,19 @@ public:
     char* gets(char* line, int size) { return gzgets(f, line, size); }
     int getc() { return gzgetc(f); }
     bool read(void* buf, size_t len) { return big_gzread(f, buf, len) == len; }
+
+    // used in mtz.hpp; seeking backward restarts decompression from the start
+    bool seek(std::ptrdiff_t offset) {
+      return gzseek(f, (z_off_t) offset, SEEK_SET) == (z_off_t) offset;
+    }
+    std::string read_rest() {
+      std::string ret;
+      char buf[512];
+      int n;
+      while ((n = gzread(f, buf, sizeof(buf))) > 0)
+        ret.append(buf, n);
+      return ret;
+    }
   };
 
   explicit MaybeGzipped(const std::string& path)
@@ -109,7 +122,6 @@ public:
     size_t size = (limit == 0 ? estimate_uncompressed_size(path()) : limit);
     open();
     if (size > 3221225471)
-      // if this exception is changed adjust prog/cif2mtz.cpp
       fail("For now gz files above 3 GiB uncompressed are not supported.\n"
            "To read " + path() + " first uncompress it.");
     CharArray mem(size);
@@ -0,0 +1,84 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// IEEE 754 half-precision (binary16) number, used in MRC maps in mode 12.
+
+#ifndef GEMMI_HALF_HPP_
+#define GEMMI_HALF_HPP_
+
+#include <cstdint>  // for uint16_t, uint32_t
+#include <cstring>  // for memcpy
+#include <cmath>    // for isnan
+
+namespace gemmi {
+
+/// Conversion with rounding to nearest even. Values above the half range
+/// become infinities, values below it become subnormals or zero.
+inline std::uint16_t float_to_half_bits(float f) {
+  // based on public-domain float_to_half_fast3_rtne() by Fabian Giesen
+  const std::uint32_t f32infty = 255u << 23;
+  const std::uint32_t f16max = (127u + 16) << 23;
+  const std::uint32_t denorm_magic_u = ((127u - 15) + (23 - 10) + 1) << 23;
+  std::uint32_t u;
+  std::memcpy(&u, &f, 4);
+  std::uint32_t sign = u & 0x80000000u;
+  u ^= sign;
+  std::uint16_t h;
+  if (u >= f16max) {  // infinity, NaN or too large
+    h = u > f32infty ? 0x7e00 : 0x7c00;
+  } else if (u < (113u << 23)) {  // subnormal or zero
+    float magic, x;
+    std::memcpy(&magic, &denorm_magic_u, 4);
+    std::memcpy(&x, &u, 4);
+    x += magic;
+    std::memcpy(&u, &x, 4);
+    h = static_cast<std::uint16_t>(u - denorm_magic_u);
+  } else {
+    std::uint32_t mant_odd = (u >> 13) & 1;
+    u += ((15u - 127) << 23) + 0xfff;  // wraps around, as intended
+    u += mant_odd;
+    h = static_cast<std::uint16_t>(u >> 13);
+  }
+  return static_cast<std::uint16_t>(h | (sign >> 16));
+}
+
+inline float half_bits_to_float(std::uint16_t h) {
+  const std::uint32_t shifted_exp = 0x7c00u << 13;
+  std::uint32_t u = (std::uint32_t)(h & 0x7fff) << 13;
+  std::uint32_t exp = shifted_exp & u;
+  u += (127u - 15) << 23;
+  float f;
+  if (exp == shifted_exp) {  // Inf/NaN
+    u += (128u - 16) << 23;
+    std::memcpy(&f, &u, 4);
+  } else if (exp == 0) {  // zero or subnormal
+    u += 1u << 23;
+    std::memcpy(&f, &u, 4);
+    f -= 6.103515625e-05f;  // 2^-14
+  } else {
+    std::memcpy(&f, &u, 4);
+  }
+  return (h & 0x8000) ? -f : f;
+}
+
+/// Storage type: 16 bits in memory, converted to/from float on access.
+/// Arithmetic is done on floats (through the implicit conversion).
+struct Half {
+  std::uint16_t bits;
+
+  Half() = default;
+  Half(float f) : bits(float_to_half_bits(f)) {}
+  operator float() const { return half_bits_to_float(bits); }
+
+  static Half from_bits(std::uint16_t b) { Half h; h.bits = b; return h; }
+};
+
+namespace impl {
+// overloads of functions from math.hpp
+inline bool is_nan(Half a) { return (a.bits & 0x7fff) > 0x7c00; }
+inline bool is_same(Half a, Half b) {
+  return is_nan(b) ? is_nan(a) : (float) a == (float) b;
+}
+} // namespace impl
+
+} // namespace gemmi
+#endif
@@ -12,6 +12,7 @@
 #include <algorithm>  // for min
 #include <vector>
 #include "fail.hpp"   // for fail
+#include "parallel.hpp"  // for parallel_for_chunks
 
 //#define GEMMI_DEBUG_LEVMAR
 
@@ -70,6 +71,47 @@ inline void jordan_solve(std::vector<double>& a, std::vector<double>& b) {
   }
 }
 
+/// Solves A * x = b for symmetric positive definite A using Cholesky
+/// decomposition A = L L^T. Returns false (and leaves a and b unchanged)
+/// if A is not positive definite; then jordan_solve() can be used.
+/// On success, x is returned in b and a is overwritten.
+inline bool cholesky_solve(std::vector<double>& a, std::vector<double>& b) {
+  assert(a.size() == b.size() * b.size());
+  int n = (int) b.size();
+  // check that decomposition works before modifying a
+  std::vector<double> l(a.size(), 0.);
+  for (int j = 0; j < n; j++) {
+    double d = a[n * j + j];
+    for (int k = 0; k < j; k++)
+      d -= l[n * j + k] * l[n * j + k];
+    if (!(d > 0))
+      return false;
+    double ljj = std::sqrt(d);
+    l[n * j + j] = ljj;
+    for (int i = j + 1; i < n; i++) {
+      double x = a[n * i + j];
+      for (int k = 0; k < j; k++)
+        x -= l[n * i + k] * l[n * j + k];
+      l[n * i + j] = x / ljj;
+    }
+  }
+  // forward substitution: L y = b
+  for (int i = 0; i < n; i++) {
+    double x = b[i];
+    for (int k = 0; k < i; k++)
+      x -= l[n * i + k] * b[k];
+    b[i] = x / l[n * i + i];
+  }
+  // back substitution: L^T x = y
+  for (int i = n - 1; i >= 0; i--) {
+    double x = b[i];
+    for (int k = i + 1; k < n; k++)
+      x -= l[n * k + i] * b[k];
+    b[i] = x / l[n * i + i];
+  }
+  a.swap(l);
+  return true;
+}
 
 #ifdef GEMMI_DEBUG_LEVMAR
 inline void debug_print(const std::string& name, std::vector<double> &a) {
@@ -92,6 +134,8 @@ struct LevMar {
   double lambda_up_factor = 10;
   double lambda_down_factor = 0.1;
   double lambda_start = 0.001;
+  // derivatives are computed in parallel (in tiles) if nthreads > 1
+  int nthreads = 1;
 
   // values set in fit() that can be inspected later
   double initial_wssr;
@@ -131,7 +175,8 @@ struct LevMar {
       temp_beta = beta;
 
       // Matrix solution (Ax=b)  temp_alpha * da == temp_beta
-      jordan_solve(temp_alpha, temp_beta);
+      if (!cholesky_solve(temp_alpha, temp_beta))
+        jordan_solve(temp_alpha, temp_beta);
 
       for (size_t i = 0; i < na; i++)
         // put new a[] into temp_beta[]
@@ -188,28 +233,45 @@ private:
     std::fill(beta.begin(), beta.end(), 0.0);
     // Iterating over points is tiled to limit memory usage. It's also a little
     // faster than a single loop over all points for large number of points.
+    // Tiles are divided between threads; each thread sums its contributions
+    // to alpha and beta separately and these sums are added at the end.
     const size_t kMaxTileSize = 1024;
-    std::vector<double> dy_da;
     size_t n = target.points.size();
-    for (size_t tstart = 0; tstart < n; tstart += kMaxTileSize) {
-      size_t tsize = std::min(n - tstart, kMaxTileSize);
-      std::vector<double> yy(tsize, 0.);
-      dy_da.resize(tsize * na);
-      std::fill(dy_da.begin(), dy_da.end(), 0.);
-      target.compute_values_and_derivatives(tstart, tsize, yy, dy_da);
-      for (size_t i = 0; i != tsize; ++i) {
-        double weight = target.points[tstart + i].get_weight();
-        double dy_sig = weight * (target.points[tstart + i].get_y() - yy[i]);
-        double* t = &dy_da[i * na];
-        for (int j = 0; j != na; ++j) {
-          if (t[j] != 0) {
-            t[j] *= weight;
-            for (int k = j; k != -1; --k)
-              alpha[na * j + k] += t[j] * t[k];
-            beta[j] += dy_sig * t[j];
+    size_t ntiles = (n + kMaxTileSize - 1) / kMaxTileSize;
+    int nt = effective_thread_count(nthreads);
+    std::vector<std::vector<double>> thread_alpha(nt > 1 ? nt - 1 : 0, alpha);
+    std::vector<std::vector<double>> thread_beta(nt > 1 ? nt - 1 : 0, beta);
+    parallel_for_chunks(ntiles, nt, [&](size_t begin, size_t end, int thread) {
+      double* alpha_ = thread == 0 ? alpha.data() : thread_alpha[thread-1].data();
+      double* beta_ = thread == 0 ? beta.data() : thread_beta[thread-1].data();
+      std::vector<double> yy;
+      std::vector<double> dy_da;
+      for (size_t tile = begin; tile != end; ++tile) {
+        size_t tstart = tile * kMaxTileSize;
+        size_t tsize = std::min(n - tstart, kMaxTileSize);
+        yy.assign(tsize, 0.);
+        dy_da.assign(tsize * na, 0.);
+        target.compute_values_and_derivatives(tstart, tsize, yy, dy_da);
+        for (size_t i = 0; i != tsize; ++i) {
+          double weight = target.points[tstart + i].get_weight();
+          double dy_sig = weight * (target.points[tstart + i].get_y() - yy[i]);
+          double* t = &dy_da[i * na];
+          for (int j = 0; j != na; ++j) {
+            if (t[j] != 0) {
+              t[j] *= weight;
+              for (int k = j; k != -1; --k)
+                alpha_[na * j + k] += t[j] * t[k];
+              beta_[j] += dy_sig * t[j];
+            }
           }
         }
       }
+    });
+    for (size_t k = 0; k != thread_alpha.size(); ++k) {
+      for (size_t i = 0; i != alpha.size(); ++i)
+        alpha[i] += thread_alpha[k][i];
+      for (size_t i = 0; i != beta.size(); ++i)
+        beta[i] += thread_beta[k][i];
     }
 
     // Only half of the alpha matrix was filled above. Fill the rest.
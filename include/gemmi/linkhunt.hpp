@@ -5,8 +5,6 @@
 #ifndef GEMMI_LINKHUNT_HPP_
 #define GEMMI_LINKHUNT_HPP_
 
-#include <map>
-#include <unordered_map>
 #include "elem.hpp"
 #include "model.hpp"
 #include "monlib.hpp"
@@ -29,18 +27,11 @@ struct LinkHunt {
 
   double global_max_dist = 2.34; // ZN-CYS
   const MonLib* monlib_ptr = nullptr;
-  std::multimap<std::string, const ChemLink*> links;
-
-  void index_chem_links(const MonLib& monlib, bool use_alias=true) {
-    std::map<ChemComp::Group, std::map<std::string, std::vector<std::string>>> aliases;
-    if (use_alias)
-      for (const auto& iter : monlib.monomers)
-        for (const ChemComp::Aliasing& a : iter.second.aliases)
-          for (const std::pair<std::string, std::string>& r : a.related) {
-            const ChemComp::Group& gr = ChemComp::is_nucleotide_group(a.group) ? ChemComp::Group::DnaRna : a.group;
-            aliases[gr][r.second].push_back(r.first);
-          }
+  ChemLinkIndex links;
+  bool use_alias = true;
 
+  void index_chem_links(const MonLib& monlib, bool use_alias_=true) {
+    links.clear();
     for (const auto& iter : monlib.links) {
       const ChemLink& link = iter.second;
       if (link.rt.bonds.empty())
@@ -56,37 +47,10 @@ struct LinkHunt {
       const Restraints::Bond& bond = link.rt.bonds[0];
       if (bond.value > global_max_dist)
         global_max_dist = bond.value;
-      links.emplace(bond.lexicographic_str(), &link);
-
-      if (!use_alias || (!link.side1.comp.empty() && !link.side2.comp.empty()))
-        continue;
-      std::vector<std::string> *names1 = nullptr, *names2 = nullptr;
-      if (link.side1.comp.empty()) {
-        auto i = aliases.find(link.side1.group);
-        if (i != aliases.end()) {
-          auto j = i->second.find(bond.id1.atom);
-          if (j != i->second.end())
-            names1 = &j->second;
-        }
-      }
-      if (link.side2.comp.empty()) {
-        auto i = aliases.find(link.side2.group);
-        if (i != aliases.end()) {
-          auto j = i->second.find(bond.id2.atom);
-          if (j != i->second.end())
-            names2 = &j->second;
-        }
-      }
-     if (names1 && names2)
-       for (const std::string& n1 : *names1)
-         for (const std::string& n2 : *names2)
-           links.emplace(Restraints::lexicographic_str(n1, n2), &link);
-     else if (names1 || names2) {
-       const std::string& n1 = names1 ? bond.id2.atom : bond.id1.atom;
-       for (const std::string& n2 : (names1 ? *names1 : *names2))
-         links.emplace(Restraints::lexicographic_str(n1, n2), &link);
-     }
+      links.add(link);
     }
+    links.generation = monlib.links.generation();
+    use_alias = use_alias_;
     monlib_ptr = &monlib;
   }
 
@@ -95,6 +59,8 @@ struct LinkHunt {
                                          double radius_margin,
                                          ContactSearch::Ignore ignore) {
     std::vector<Match> results;
+    if (!links.is_current(monlib_ptr->links))  // MonLib::links changed
+      index_chem_links(*monlib_ptr, use_alias);
     Model& model = st.first_model();
     double search_radius = std::max(global_max_dist * bond_margin,
                                     /*max r1+r2 ~=*/3.0 * radius_margin);
@@ -109,27 +75,29 @@ struct LinkHunt {
 
         // search for a match in chem_links
         if (bond_margin > 0) {
-          auto range = links.equal_range(Restraints::lexicographic_str(
-                                            cra1.atom->name, cra2.atom->name));
           // similar to MonLib::match_link()
-          for (auto iter = range.first; iter != range.second; ++iter) {
-            const ChemLink& link = *iter->second;
+          monlib_ptr->for_each_link_candidate(links,
+                                              cra1.residue->name, cra1.atom->name,
+                                              cra2.residue->name, cra2.atom->name,
+                                              use_alias, [&](const ChemLink& link) {
             const Restraints::Bond& bond = link.rt.bonds[0];
             if (dist_sq > sq(bond.value * bond_margin))
-              continue;
+              return;
             const ChemComp::Aliasing* aliasing1 = nullptr;
             const ChemComp::Aliasing* aliasing2 = nullptr;
             bool order1;
             if (monlib_ptr->link_side_matches_residue(link.side1, cra1.residue->name, &aliasing1) &&
                 monlib_ptr->link_side_matches_residue(link.side2, cra2.residue->name, &aliasing2) &&
-                atom_match_with_alias(bond.id1.atom, cra1.atom->name, aliasing1))
+                atom_match_with_alias(bond.id1.atom, cra1.atom->name, aliasing1) &&
+                atom_match_with_alias(bond.id2.atom, cra2.atom->name, aliasing2))
               order1 = true;
             else if (monlib_ptr->link_side_matches_residue(link.side2, cra1.residue->name, &aliasing1) &&
                      monlib_ptr->link_side_matches_residue(link.side1, cra2.residue->name, &aliasing2) &&
-                     atom_match_with_alias(bond.id2.atom, cra1.atom->name, aliasing1))
+                     atom_match_with_alias(bond.id2.atom, cra1.atom->name, aliasing1) &&
+                     atom_match_with_alias(bond.id1.atom, cra2.atom->name, aliasing2))
               order1 = false;
             else
-              continue;
+              return;
             int link_score = link.calculate_score(
                     order1 ? *cra1.residue : *cra2.residue,
                     order1 ? cra2.residue : cra1.residue,
@@ -149,7 +117,7 @@ struct LinkHunt {
                 match.cra2 = cra1;
               }
             }
-          }
+          });
         }
 
         // potential other links according to covalent radii
@@ -0,0 +1,338 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Correlation between maps: local CC in real space (from summed-volume
+// tables) and Fourier shell correlation (FSC) in reciprocal space.
+
+#ifndef GEMMI_MAPCORR_HPP_
+#define GEMMI_MAPCORR_HPP_
+
+#include <cmath>         // for sqrt, ceil, floor
+#include <complex>
+#include <vector>
+#include "binner.hpp"    // for Binner
+#include "grid.hpp"      // for Grid, modulo
+#include "model.hpp"     // for Model, Residue
+#include "parallel.hpp"  // for parallel_for_chunks
+#include "recgrid.hpp"   // for ReciprocalGrid
+
+namespace gemmi {
+
+/// Summed-volume table (3D summed-area table) of data on a grid that covers
+/// the unit cell. A sum over any box, also a box that crosses the cell
+/// boundary, is obtained from a few table lookups.
+struct SummedVolumeTable {
+  int nu = 0, nv = 0, nw = 0;
+  /// (nu+1) x (nv+1) x (nw+1) array; element (u,v,w) is the sum of values
+  /// with indices below u, v and w.
+  std::vector<double> data;
+
+  size_t idx(int u, int v, int w) const {
+    return ((size_t)w * (nv + 1) + v) * (nu + 1) + u;
+  }
+
+  /// value_at(i) returns the value for index i in the grid's data array.
+  template<typename Func>
+  void build(int nu_, int nv_, int nw_, Func value_at, int nthreads=1) {
+    nu = nu_;
+    nv = nv_;
+    nw = nw_;
+    data.assign((size_t)(nu + 1) * (nv + 1) * (nw + 1), 0.);
+    // three passes of prefix sums: along u, v and w
+    parallel_for_chunks((size_t)nv * nw, nthreads, [&](size_t begin, size_t end, int) {
+      for (size_t i = begin; i < end; ++i) {
+        int v = int(i % nv);
+        int w = int(i / nv);
+        double* row = &data[idx(0, v + 1, w + 1)];
+        double sum = 0.;
+        for (int u = 0; u < nu; ++u) {
+          sum += value_at(i * nu + u);
+          row[u + 1] = sum;
+        }
+      }
+    });
+    parallel_for_chunks(nw, nthreads, [&](size_t begin, size_t end, int) {
+      for (int w = int(begin) + 1; w <= int(end); ++w)
+        for (int v = 2; v <= nv; ++v) {
+          double* row = &data[idx(0, v, w)];
+          const double* prev = &data[idx(0, v - 1, w)];
+          for (int u = 1; u <= nu; ++u)
+            row[u] += prev[u];
+        }
+    });
+    parallel_for_chunks(nv, nthreads, [&](size_t begin, size_t end, int) {
+      for (int v = int(begin) + 1; v <= int(end); ++v)
+        for (int w = 2; w <= nw; ++w) {
+          double* row = &data[idx(0, v, w)];
+          const double* prev = &data[idx(0, v, w - 1)];
+          for (int u = 1; u <= nu; ++u)
+            row[u] += prev[u];
+        }
+    });
+  }
+
+  /// sum over [u0,u1) x [v0,v1) x [w0,w1), 0 <= u0 <= u1 <= nu, etc.
+  double sum_in_range(int u0, int u1, int v0, int v1, int w0, int w1) const {
+    return data[idx(u1, v1, w1)] - data[idx(u0, v1, w1)]
+         - data[idx(u1, v0, w1)] - data[idx(u1, v1, w0)]
+         + data[idx(u0, v0, w1)] + data[idx(u0, v1, w0)]
+         + data[idx(u1, v0, w0)] - data[idx(u0, v0, w0)];
+  }
+
+  /// Sum over box su x sv x sw with the corner at (u,v,w).
+  /// The corner is taken modulo the grid size; the box size is limited
+  /// to the grid size.
+  double box_sum(int u, int v, int w, int su, int sv, int sw) const {
+    int ru[4], rv[4], rw[4];
+    int nru = split_range(u, su, nu, ru);
+    int nrv = split_range(v, sv, nv, rv);
+    int nrw = split_range(w, sw, nw, rw);
+    double sum = 0.;
+    for (int i = 0; i < nru; i += 2)
+      for (int j = 0; j < nrv; j += 2)
+        for (int k = 0; k < nrw; k += 2)
+          sum += sum_in_range(ru[i], ru[i+1], rv[j], rv[j+1], rw[k], rw[k+1]);
+    return sum;
+  }
+
+  // splits periodic range into one or two ranges, returns 2 or 4
+  static int split_range(int start, int size, int n, int (&r)[4]) {
+    start = modulo(start, n);
+    if (size >= n) {
+      r[0] = 0;
+      r[1] = n;
+      return 2;
+    }
+    r[0] = start;
+    if (start + size <= n) {
+      r[1] = start + size;
+      return 2;
+    }
+    r[1] = n;
+    r[2] = 0;
+    r[3] = start + size - n;
+    return 4;
+  }
+};
+
+/// Correlation between two maps (on the same grid) in arbitrary boxes.
+/// prepare() makes five summed-volume tables (40 bytes per grid point),
+/// after that CC in any box is calculated in constant time.
+/// The maps should cover the unit cell and have no NaNs.
+struct LocalCorrelation {
+  UnitCell unit_cell;
+  SummedVolumeTable sx, sy, sxx, syy, sxy;
+
+  template<typename T>
+  void prepare(const Grid<T>& x, const Grid<T>& y, int nthreads=1) {
+    x.check_not_empty();
+    if (x.nu != y.nu || x.nv != y.nv || x.nw != y.nw || x.data.size() != y.data.size())
+      fail("LocalCorrelation: maps have different grids");
+    if (x.axis_order != AxisOrder::XYZ)
+      fail("LocalCorrelation: the map must cover the unit cell in XYZ order");
+    unit_cell = x.unit_cell;
+    const T* a = x.data.data();
+    const T* b = y.data.data();
+    sx.build(x.nu, x.nv, x.nw, [&](size_t i) { return (double) a[i]; }, nthreads);
+    sy.build(x.nu, x.nv, x.nw, [&](size_t i) { return (double) b[i]; }, nthreads);
+    sxx.build(x.nu, x.nv, x.nw, [&](size_t i) { return (double) a[i] * a[i]; }, nthreads);
+    syy.build(x.nu, x.nv, x.nw, [&](size_t i) { return (double) b[i] * b[i]; }, nthreads);
+    sxy.build(x.nu, x.nv, x.nw, [&](size_t i) { return (double) a[i] * b[i]; }, nthreads);
+  }
+
+  /// CC in box su x sv x sw with the corner at (u,v,w).
+  /// Returns NaN if the values in the box are constant.
+  double box_cc(int u, int v, int w, int su, int sv, int sw) const {
+    su = std::min(su, sx.nu);
+    sv = std::min(sv, sx.nv);
+    sw = std::min(sw, sx.nw);
+    double n = double(su) * sv * sw;
+    double a = sx.box_sum(u, v, w, su, sv, sw);
+    double b = sy.box_sum(u, v, w, su, sv, sw);
+    double var_a = sxx.box_sum(u, v, w, su, sv, sw) - a * a / n;
+    double var_b = syy.box_sum(u, v, w, su, sv, sw) - b * b / n;
+    double cov = sxy.box_sum(u, v, w, su, sv, sw) - a * b / n;
+    // variance that is within rounding errors of the table is zero
+    if (var_a <= 1e-12 * sxx.data.back() || var_b <= 1e-12 * syy.data.back())
+      return NAN;
+    return cov / std::sqrt(var_a * var_b);
+  }
+
+  /// CC in the grid points inside a box given in fractional coordinates.
+  double box_cc(const Box<Fractional>& box) const {
+    int u0 = (int) std::ceil(box.minimum.x * sx.nu);
+    int v0 = (int) std::ceil(box.minimum.y * sx.nv);
+    int w0 = (int) std::ceil(box.minimum.z * sx.nw);
+    int u1 = (int) std::floor(box.maximum.x * sx.nu);
+    int v1 = (int) std::floor(box.maximum.y * sx.nv);
+    int w1 = (int) std::floor(box.maximum.z * sx.nw);
+    return box_cc(u0, v0, w0, u1 - u0 + 1, v1 - v0 + 1, w1 - w0 + 1);
+  }
+
+  /// Local CC for each grid point, in a box of size (2*ru+1, 2*rv+1, 2*rw+1)
+  /// centered at the point. dest must have the same size as the maps.
+  void calculate_map(Grid<float>& dest, int ru, int rv, int rw, int nthreads=1) const {
+    if (dest.nu != sx.nu || dest.nv != sx.nv || dest.nw != sx.nw)
+      fail("LocalCorrelation::calculate_map(): wrong size of the grid");
+    dest.data.resize((size_t)sx.nu * sx.nv * sx.nw);
+    parallel_for_chunks((size_t)sx.nv * sx.nw, nthreads,
+                        [&](size_t begin, size_t end, int) {
+      for (size_t i = begin; i < end; ++i) {
+        int v = int(i % sx.nv);
+        int w = int(i / sx.nv);
+        float* row = &dest.data[i * sx.nu];
+        for (int u = 0; u < sx.nu; ++u)
+          row[u] = (float) box_cc(u - ru, v - rv, w - rw,
+                                  2 * ru + 1, 2 * rv + 1, 2 * rw + 1);
+      }
+    });
+  }
+
+  /// CC in the bounding box of each residue extended by margin (in A).
+  /// The results are in the order of residues in the model.
+  std::vector<double> calculate_residue_cc(const Model& model, double margin,
+                                           int nthreads=1) const {
+    std::vector<const Residue*> residues;
+    for (const Chain& chain : model.chains)
+      for (const Residue& res : chain.residues)
+        residues.push_back(&res);
+    std::vector<double> result(residues.size(), NAN);
+    Fractional fmargin(margin * unit_cell.ar, margin * unit_cell.br,
+                       margin * unit_cell.cr);
+    parallel_for_chunks(residues.size(), nthreads, [&](size_t begin, size_t end, int) {
+      for (size_t i = begin; i < end; ++i) {
+        if (residues[i]->atoms.empty())
+          continue;
+        Box<Fractional> box;
+        for (const Atom& atom : residues[i]->atoms)
+          box.extend(unit_cell.fractionalize(atom.pos));
+        box.add_margins(fmargin);
+        result[i] = box_cc(box);
+      }
+    });
+    return result;
+  }
+};
+
+/// Local CC map in boxes with half-width radius (in A) around each point.
+template<typename T>
+Grid<float> calculate_local_correlation_map(const Grid<T>& x, const Grid<T>& y,
+                                            double radius, int nthreads=1) {
+  LocalCorrelation lc;
+  lc.prepare(x, y, nthreads);
+  Grid<float> dest;
+  dest.copy_metadata_from(x);
+  int r[3];
+  for (int i = 0; i < 3; ++i)
+    r[i] = std::max(1, iround(radius / x.spacing[i]));
+  lc.calculate_map(dest, r[0], r[1], r[2], nthreads);
+  return dest;
+}
+
+
+/// Sums for Fourier shell correlation in one resolution shell.
+struct FscBin {
+  int n = 0;
+  double sum_xy = 0.;  // sum of Re(F1 F2*)
+  double sum_xx = 0.;  // sum of |F1|^2
+  double sum_yy = 0.;  // sum of |F2|^2
+
+  void add_point(std::complex<double> x, std::complex<double> y) {
+    ++n;
+    sum_xy += x.real() * y.real() + x.imag() * y.imag();
+    sum_xx += std::norm(x);
+    sum_yy += std::norm(y);
+  }
+  void add(const FscBin& o) {
+    n += o.n;
+    sum_xy += o.sum_xy;
+    sum_xx += o.sum_xx;
+    sum_yy += o.sum_yy;
+  }
+  double fsc() const { return sum_xy / std::sqrt(sum_xx * sum_yy); }
+  /// For FSC between half maps: estimated FSC of the full map
+  /// (Rosenthal & Henderson, 2003).
+  double full_map_fsc() const {
+    double f = fsc();
+    return 2 * f / (1 + f);
+  }
+};
+
+/// Calls func(index, hkl) for points [begin, end) of the grid, skipping 000.
+template<typename T, typename Func>
+void for_each_hkl_in_grid(const ReciprocalGrid<T>& grid, size_t begin, size_t end,
+                          Func&& func) {
+  if (grid.axis_order == AxisOrder::ZYX)
+    fail("ReciprocalGrid in ZYX order is not supported");
+  for (size_t idx = begin; idx < end; ++idx) {
+    size_t uv = idx % ((size_t)grid.nu * grid.nv);
+    int u = int(uv % grid.nu);
+    int v = int(uv / grid.nu);
+    int w = int(idx / ((size_t)grid.nu * grid.nv));
+    Miller hkl{{2 * u >= grid.nu ? u - grid.nu : u,
+                2 * v >= grid.nv ? v - grid.nv : v,
+                2 * w >= grid.nw && !grid.half_l ? w - grid.nw : w}};
+    if (hkl[0] != 0 || hkl[1] != 0 || hkl[2] != 0)
+      func(idx, hkl);
+  }
+}
+
+/// Sets up binner for all reflections in the grid except 000.
+/// Except for Method::EqualCount, only the resolution range is used,
+/// so 1/d^2 of all the points is not stored.
+template<typename T>
+void setup_binner_for_grid(Binner& binner, int nbins, Binner::Method method,
+                           const ReciprocalGrid<T>& grid) {
+  const UnitCell& cell = grid.unit_cell;
+  std::vector<double> inv_d2;
+  if (method == Binner::Method::EqualCount) {
+    inv_d2.reserve(grid.data.size());
+    for_each_hkl_in_grid(grid, 0, grid.data.size(), [&](size_t, const Miller& hkl) {
+      inv_d2.push_back(cell.calculate_1_d2(hkl));
+    });
+  } else {
+    // 1/d^2 is a quadratic form, so the maximum in the box is in a corner
+    int mh = grid.nu / 2, mk = grid.nv / 2, ml = grid.half_l ? grid.nw - 1 : grid.nw / 2;
+    double min_1_d2 = INFINITY, max_1_d2 = 0.;
+    for (int h : {-1, 0, 1})
+      for (int k : {-1, 0, 1})
+        for (int l : {-1, 0, 1}) {
+          if (h == 0 && k == 0 && l == 0)
+            continue;
+          min_1_d2 = std::min(min_1_d2, cell.calculate_1_d2({{h, k, l}}));
+          max_1_d2 = std::max(max_1_d2, cell.calculate_1_d2({{h*mh, k*mk, l*ml}}));
+        }
+    inv_d2 = {min_1_d2, max_1_d2};
+  }
+  binner.setup_from_1_d2(nbins, method, std::move(inv_d2), &cell);
+}
+
+/// FSC between two reciprocal-space grids (e.g. from two half maps)
+/// in resolution shells from binner. The grids must have the same size.
+template<typename T>
+std::vector<FscBin> calculate_fsc(const ReciprocalGrid<std::complex<T>>& a,
+                                  const ReciprocalGrid<std::complex<T>>& b,
+                                  const Binner& binner, int nthreads=1) {
+  binner.ensure_limits_are_set();
+  if (a.nu != b.nu || a.nv != b.nv || a.nw != b.nw || a.half_l != b.half_l ||
+      a.data.size() != b.data.size())
+    fail("calculate_fsc(): grids have different sizes");
+  nthreads = effective_thread_count(nthreads);
+  std::vector<std::vector<FscBin>> partial(nthreads,
+                                           std::vector<FscBin>(binner.size()));
+  parallel_for_chunks(a.data.size(), nthreads, [&](size_t begin, size_t end, int t) {
+    std::vector<FscBin>& bins = partial[t];
+    int hint = 0;
+    for_each_hkl_in_grid(a, begin, end, [&](size_t idx, const Miller& hkl) {
+      double inv_d2 = a.unit_cell.calculate_1_d2(hkl);
+      int bin = binner.get_bin_from_1_d2_hinted(inv_d2, hint);
+      bins[bin].add_point(a.data[idx], b.data[idx]);
+    });
+  });
+  for (int t = 1; t < nthreads; ++t)
+    for (size_t i = 0; i < binner.size(); ++i)
+      partial[0][i].add(partial[t][i]);
+  return partial[0];
+}
+
+} // namespace gemmi
+#endif
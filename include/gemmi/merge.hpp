@@ -8,13 +8,18 @@
 #define GEMMI_MERGE_HPP_
 
 #include <cassert>
+#include <climits>      // for INT_MAX, INT_MIN
+#include <algorithm>    // for stable_sort, all_of
 #include "atof.hpp"     // for fast_from_chars
+#include "binner.hpp"   // for Binner
+#include "millerkey.hpp" // for sort_by_packed_key
+#include "parallel.hpp" // for parallel_for_chunks
 #include "symmetry.hpp"
 #include "unitcell.hpp"
 #include "util.hpp"     // for vector_remove_if
 #include "mtz.hpp"      // for Mtz
 #include "refln.hpp"    // for ReflnBlock
-#include "stats.hpp"    // for Correlation
+#include "stats.hpp"    // for Correlation, Variance
 #include "xds_ascii.hpp" // for XdsAscii
 
 namespace gemmi {
@@ -96,6 +101,36 @@ inline std::string read_staraniso_b_from_mtz(const Mtz& mtz, SMat33<double>& out
   return version;
 }
 
+// Data quality indicators of unmerged data in a resolution shell,
+// calculated by Intensities::calculate_merging_stats().
+struct MergingStats {
+  int all_refl = 0;     // observations
+  int unique_refl = 0;
+  int stats_refl = 0;   // unique reflections with 2+ observations
+  double r_merge_num = 0;  // sum |I - <I>|
+  double r_meas_num = 0;   // sum sqrt(n/(n-1)) |I - <I>|
+  double r_pim_num = 0;    // sum sqrt(1/(n-1)) |I - <I>|
+  double sum_i = 0;        // sum I (from reflections with 2+ observations)
+  Variance i_over_sigma;   // <I>/sigma(<I>) of merged reflections
+  Correlation half;        // between means of two half-datasets, for CC1/2
+
+  void add(const MergingStats& o) {
+    all_refl += o.all_refl;
+    unique_refl += o.unique_refl;
+    stats_refl += o.stats_refl;
+    r_merge_num += o.r_merge_num;
+    r_meas_num += o.r_meas_num;
+    r_pim_num += o.r_pim_num;
+    sum_i += o.sum_i;
+    i_over_sigma.add(o.i_over_sigma);
+    half.add(o.half);
+  }
+  double r_merge() const { return r_merge_num / sum_i; }
+  double r_meas() const { return r_meas_num / sum_i; }
+  double r_pim() const { return r_pim_num / sum_i; }
+  double cc_half() const { return half.coefficient(); }
+  double mean_i_over_sigma() const { return i_over_sigma.mean_x; }
+};
 
 struct Intensities {
   struct Refl {
@@ -198,22 +233,28 @@ struct Intensities {
     });
   }
 
-  void sort() { std::sort(data.begin(), data.end()); }
+  // stable sort (radix sort on packed hkl+isign, if indices are in range)
+  static void sort_range(Refl* first, Refl* last) {
+    if (std::all_of(first, last, [](const Refl& r) { return can_pack_miller(r.hkl); }))
+      sort_by_packed_key(first, last, [](const Refl& r) {
+          return pack_miller(r.hkl, unsigned(r.isign + 1));
+      });
+    else
+      std::stable_sort(first, last);
+  }
 
-  void merge_in_place(DataType data_type) {
-    type = data_type;
-    if (data.empty())
-      return;
-    if (data_type == DataType::Mean)
-      // discard signs so that merging produces Imean
-      for (Refl& refl : data)
-        refl.isign = 0;
-    sort();
-    std::vector<Refl>::iterator out = data.begin();
+  void sort() { sort_range(data.data(), data.data() + data.size()); }
+
+  // Merges observations from sorted range [begin, end) into the beginning
+  // of this range (weighted by 1/sigma^2). Returns the end of merged data.
+  static Refl* merge_sorted_range(Refl* begin, Refl* end) {
+    if (begin == end)
+      return end;
+    Refl* out = begin;
     double sum_wI = 0.;
     double sum_w = 0.;
     int nobs = 0;
-    for (auto in = data.begin(); in != data.end(); ++in) {
+    for (Refl* in = begin; in != end; ++in) {
       if (out->hkl != in->hkl || out->isign != in->isign) {
         out->value = sum_wI / sum_w;
         out->sigma = 1.0 / std::sqrt(sum_w);
@@ -232,34 +273,197 @@ struct Intensities {
     out->value = sum_wI / sum_w;
     out->sigma = 1.0 / std::sqrt(sum_w);
     out->nobs = nobs;
-    data.erase(++out, data.end());
+    return ++out;
+  }
+
+  // Observations of the same reflection are summed in the original order,
+  // so the result does not depend on nthreads.
+  void merge_in_place(DataType data_type, int nthreads=1) {
+    type = data_type;
+    if (data.empty())
+      return;
+    nthreads = effective_thread_count(nthreads);
+    if (data_type == DataType::Mean)
+      // discard signs so that merging produces Imean
+      parallel_for_chunks(data.size(), nthreads, [&](size_t begin, size_t end, int) {
+        for (size_t i = begin; i != end; ++i)
+          data[i].isign = 0;
+      });
+    if (nthreads > 1 && data.size() >= 10000 && merge_in_partitions(nthreads))
+      return;
+    sort();
+    Refl* end = merge_sorted_range(data.data(), data.data() + data.size());
+    data.resize(end - data.data());
+  }
+
+  // Statistics of unmerged data in resolution shells from binner
+  // (or in a single shell if binner is null), calculated in one pass over
+  // unique reflections. Observations are merged with 1/sigma^2 weights,
+  // as in merge_in_place(). For CC1/2 the observations of each reflection
+  // are split into two halves alternately, so the result is deterministic.
+  // If anomalous is false, I(+) and I(-) are merged together.
+  std::vector<MergingStats> calculate_merging_stats(const Binner* binner,
+                                                    bool anomalous=false,
+                                                    int nthreads=1) const {
+    if (type != DataType::Unmerged)
+      fail("calculate_merging_stats(): data is not unmerged");
+    std::vector<Refl> sorted = data;
+    if (!anomalous)
+      for (Refl& r : sorted)
+        r.isign = 0;
+    sort_range(sorted.data(), sorted.data() + sorted.size());
+    std::vector<size_t> starts;
+    for (size_t i = 0; i != sorted.size(); ++i)
+      if (i == 0 || sorted[i].hkl != sorted[i-1].hkl || sorted[i].isign != sorted[i-1].isign)
+        starts.push_back(i);
+    starts.push_back(sorted.size());
+    size_t nbins = binner ? binner->size() : 1;
+    nthreads = effective_thread_count(nthreads);
+    std::vector<std::vector<MergingStats>> partial(nthreads,
+                                                   std::vector<MergingStats>(nbins));
+    parallel_for_chunks(starts.size() - 1, nthreads, [&](size_t begin, size_t end, int t) {
+      int hint = 0;
+      for (size_t j = begin; j != end; ++j) {
+        const Refl* first = &sorted[starts[j]];
+        const Refl* last = &sorted[starts[j+1]];
+        int bin = binner ? binner->get_bin_hinted(first->hkl, hint) : 0;
+        MergingStats& ms = partial[t][bin];
+        double sum_w[2] = {0., 0.};
+        double sum_wi[2] = {0., 0.};
+        for (const Refl* r = first; r != last; ++r) {
+          double w = 1. / (r->sigma * r->sigma);
+          int h = (r - first) % 2;
+          sum_w[h] += w;
+          sum_wi[h] += w * r->value;
+        }
+        int n = int(last - first);
+        double mean = (sum_wi[0] + sum_wi[1]) / (sum_w[0] + sum_w[1]);
+        ms.all_refl += n;
+        ms.unique_refl += 1;
+        ms.i_over_sigma.add_point(mean * std::sqrt(sum_w[0] + sum_w[1]));
+        if (n < 2)
+          continue;
+        double sum_abs_diff = 0.;
+        for (const Refl* r = first; r != last; ++r) {
+          sum_abs_diff += std::fabs(r->value - mean);
+          ms.sum_i += r->value;
+        }
+        ms.stats_refl += 1;
+        ms.r_merge_num += sum_abs_diff;
+        ms.r_meas_num += std::sqrt(n / (n - 1.)) * sum_abs_diff;
+        ms.r_pim_num += std::sqrt(1. / (n - 1.)) * sum_abs_diff;
+        ms.half.add_point(sum_wi[0] / sum_w[0], sum_wi[1] / sum_w[1]);
+      }
+    });
+    for (int t = 1; t < nthreads; ++t)
+      for (size_t i = 0; i < nbins; ++i)
+        partial[0][i].add(partial[t][i]);
+    return partial[0];
+  }
+
+  // Parallel part of merge_in_place(). Observations are distributed into
+  // nthreads partitions with disjoint ranges of h, each partition is sorted
+  // and merged separately, and the results are concatenated.
+  // Returns false (and does nothing) if the range of h is unreasonable.
+  bool merge_in_partitions(int nthreads) {
+    size_t n = data.size();
+    std::vector<std::array<int,2>> h_ranges(nthreads, {{INT_MAX, INT_MIN}});
+    parallel_for_chunks(n, nthreads, [&](size_t begin, size_t end, int k) {
+      for (size_t i = begin; i != end; ++i) {
+        h_ranges[k][0] = std::min(h_ranges[k][0], data[i].hkl[0]);
+        h_ranges[k][1] = std::max(h_ranges[k][1], data[i].hkl[0]);
+      }
+    });
+    int h_min = INT_MAX, h_max = INT_MIN;
+    for (const std::array<int,2>& r : h_ranges) {
+      h_min = std::min(h_min, r[0]);
+      h_max = std::max(h_max, r[1]);
+    }
+    if ((long long) h_max - h_min >= 1 << 20)
+      return false;
+    size_t h_size = size_t(h_max - h_min + 1);
+    std::vector<std::vector<size_t>> h_counts(nthreads, std::vector<size_t>(h_size, 0));
+    parallel_for_chunks(n, nthreads, [&](size_t begin, size_t end, int k) {
+      for (size_t i = begin; i != end; ++i)
+        ++h_counts[k][data[i].hkl[0] - h_min];
+    });
+    // consecutive h values are assigned to partitions of similar size
+    size_t nparts = (size_t) nthreads;
+    std::vector<int> part_of_h(h_size);
+    size_t cumul = 0;
+    for (size_t j = 0; j != h_size; ++j) {
+      part_of_h[j] = (int) std::min(cumul * nparts / n, nparts - 1);
+      for (const std::vector<size_t>& counts : h_counts)
+        cumul += counts[j];
+    }
+    // counts[k][p] - number of observations from chunk k in partition p
+    std::vector<std::vector<size_t>> counts(nthreads, std::vector<size_t>(nparts, 0));
+    for (int k = 0; k != nthreads; ++k)
+      for (size_t j = 0; j != h_size; ++j)
+        counts[k][part_of_h[j]] += h_counts[k][j];
+    std::vector<size_t> part_start(nparts + 1, 0);
+    std::vector<std::vector<size_t>> offsets(nthreads, std::vector<size_t>(nparts));
+    for (size_t p = 0; p != nparts; ++p) {
+      size_t pos = part_start[p];
+      for (int k = 0; k != nthreads; ++k) {
+        offsets[k][p] = pos;
+        pos += counts[k][p];
+      }
+      part_start[p+1] = pos;
+    }
+    // scatter (stable, i.e. the original order is kept within partitions)
+    std::vector<Refl> parted(n);
+    parallel_for_chunks(n, nthreads, [&](size_t begin, size_t end, int k) {
+      std::vector<size_t>& pos = offsets[k];
+      for (size_t i = begin; i != end; ++i)
+        parted[pos[part_of_h[data[i].hkl[0] - h_min]]++] = data[i];
+    });
+    std::vector<Refl*> part_end(nparts);
+    parallel_for_chunks(nparts, nthreads, [&](size_t begin, size_t end, int) {
+      for (size_t p = begin; p != end; ++p) {
+        Refl* first = parted.data() + part_start[p];
+        Refl* last = parted.data() + part_start[p+1];
+        sort_range(first, last);
+        part_end[p] = merge_sorted_range(first, last);
+      }
+    });
+    Refl* out = part_end[0];
+    for (size_t p = 1; p != nparts; ++p)
+      out = std::move(parted.data() + part_start[p], part_end[p], out);
+    parted.resize(out - parted.data());
+    data.swap(parted);
+    return true;
   }
 
   // for unmerged centric reflections set isign=1.
-  void switch_to_asu_indices(bool merged=false) {
-    GroupOps gops = spacegroup->operations();
-    ReciprocalAsu asu(spacegroup);
-    for (Refl& refl : data) {
-      if (asu.is_in(refl.hkl)) {
+  void switch_to_asu_indices(bool merged=false, int nthreads=1) {
+    const GroupOps gops = spacegroup->operations();
+    const ReciprocalAsu asu(spacegroup);
+    parallel_for_chunks(data.size(), effective_thread_count(nthreads),
+                        [&](size_t begin, size_t end, int) {
+      for (size_t i = begin; i != end; ++i) {
+        Refl& refl = data[i];
+        if (asu.is_in(refl.hkl)) {
+          if (!merged) {
+            // isign is 0 for original hkl (e.g. from XDS file)
+            if (refl.isign == 0)
+              refl.isign = 1;  // since it's in asu - I+ or centric
+            // when reading asu hkl from MTZ file - count centrics always as I+
+            else if (refl.isign == -1 && gops.is_reflection_centric(refl.hkl))
+              refl.isign = 1;
+          }
+          continue;
+        }
+        auto hkl_isym = asu.to_asu(refl.hkl, gops);
+        refl.hkl = hkl_isym.first;
         if (!merged) {
-          // isign is 0 for original hkl (e.g. from XDS file)
-          if (refl.isign == 0)
-            refl.isign = 1;  // since it's in asu - I+ or centric
-          // when reading asu hkl from MTZ file - count centrics always as I+
-          else if (refl.isign == -1 && gops.is_reflection_centric(refl.hkl))
+          if (gops.is_reflection_centric(refl.hkl))
             refl.isign = 1;
+          else
+            refl.isign = (hkl_isym.second % 2 == 0 ? -1 : 1);
         }
-        continue;
-      }
-      auto hkl_isym = asu.to_asu(refl.hkl, gops);
-      refl.hkl = hkl_isym.first;
-      if (!merged) {
-        if (gops.is_reflection_centric(refl.hkl))
-          refl.isign = 1;
-        else
-          refl.isign = (hkl_isym.second % 2 == 0 ? -1 : 1);
       }
-    }
+    });
   }
 
   void read_unmerged_intensities_from_mtz(const Mtz& mtz) {
@@ -343,6 +547,34 @@ struct Intensities {
     }
   }
 
+  /// Labels of MTZ columns used by read_mtz(), for use with
+  /// Mtz::read_raw_data_of_columns() after reading the headers.
+  static std::vector<std::string> mtz_column_labels(const Mtz& mtz, DataType data_type) {
+    std::vector<std::string> labels;
+    auto add = [&](const Mtz::Column* col) {
+      if (col) {
+        labels.push_back(col->label);
+        labels.push_back("SIG" + col->label);
+      }
+    };
+    switch (data_type) {
+      case DataType::Unmerged:
+        labels = {"I", "SIGI"};
+        break;
+      case DataType::Mean:
+        add(mtz.imean_column());
+        break;
+      case DataType::Anomalous:
+        add(mtz.iplus_column());
+        add(mtz.iminus_column());
+        break;
+      case DataType::Unknown:
+        assert(0);
+        break;
+    }
+    return labels;
+  }
+
   void read_unmerged_intensities_from_mmcif(const ReflnBlock& rb) {
     size_t value_idx = rb.get_column_index("intensity_net");
     size_t sigma_idx = rb.get_column_index("intensity_sigma");
@@ -0,0 +1,154 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Miller indices packed into 64-bit keys that sort in the same order
+// as Miller arrays, with a radix sort and a flat hash map for such keys.
+
+#ifndef GEMMI_MILLERKEY_HPP_
+#define GEMMI_MILLERKEY_HPP_
+
+#include <cstdint>    // for uint64_t, uint32_t
+#include <algorithm>  // for move
+#include <iterator>   // for iterator_traits
+#include <vector>
+#include "unitcell.hpp"  // for Miller
+
+namespace gemmi {
+
+/// Each index must be in [-2^19, 2^19), which is checked by can_pack_miller().
+constexpr int MILLER_KEY_BITS = 20;
+
+inline bool can_pack_miller(const Miller& hkl) {
+  const int lim = 1 << (MILLER_KEY_BITS - 1);
+  return hkl[0] >= -lim && hkl[0] < lim &&
+         hkl[1] >= -lim && hkl[1] < lim &&
+         hkl[2] >= -lim && hkl[2] < lim;
+}
+
+/// 20 bits per index and 4 low bits for a small extra value (0-14),
+/// such as the sign of anomalous intensity. Comparing keys gives the same
+/// result as comparing std::tie(h, k, l, extra).
+inline std::uint64_t pack_miller(const Miller& hkl, unsigned extra=0) {
+  const int offset = 1 << (MILLER_KEY_BITS - 1);
+  return (std::uint64_t(hkl[0] + offset) << 44) |
+         (std::uint64_t(hkl[1] + offset) << 24) |
+         (std::uint64_t(hkl[2] + offset) << 4) | extra;
+}
+
+inline Miller unpack_miller(std::uint64_t key) {
+  const int offset = 1 << (MILLER_KEY_BITS - 1);
+  const std::uint64_t mask = (1 << MILLER_KEY_BITS) - 1;
+  return {{int((key >> 44) & mask) - offset,
+           int((key >> 24) & mask) - offset,
+           int((key >> 4) & mask) - offset}};
+}
+
+/// Stable LSD radix sort (8 bits per pass) of keys[i] paired with i.
+/// Returns the indices in the sorted order. Passes over bytes that are
+/// the same in all keys are skipped, so typically only 3-5 passes are done.
+inline std::vector<std::uint32_t> radix_sort_indices(const std::vector<std::uint64_t>& keys) {
+  size_t n = keys.size();
+  std::vector<std::uint32_t> idx(n), tmp(n);
+  for (size_t i = 0; i != n; ++i)
+    idx[i] = (std::uint32_t) i;
+  if (n < 2)
+    return idx;
+  std::vector<size_t> counts(8 * 256, 0);
+  for (std::uint64_t key : keys)
+    for (int b = 0; b != 8; ++b)
+      ++counts[b * 256 + ((key >> (8 * b)) & 0xff)];
+  for (int b = 0; b != 8; ++b) {
+    size_t* count = &counts[b * 256];
+    if (count[(keys[0] >> (8 * b)) & 0xff] == n)  // all the same
+      continue;
+    size_t pos = 0;
+    for (int j = 0; j != 256; ++j) {
+      size_t c = count[j];
+      count[j] = pos;
+      pos += c;
+    }
+    for (std::uint32_t i : idx)
+      tmp[count[(keys[i] >> (8 * b)) & 0xff]++] = i;
+    idx.swap(tmp);
+  }
+  return idx;
+}
+
+/// Stable sort of [first, last) by a packed key returned by get_key(item).
+/// Items are moved through a temporary vector.
+template<typename Iter, typename GetKey>
+void sort_by_packed_key(Iter first, Iter last, GetKey get_key) {
+  using T = typename std::iterator_traits<Iter>::value_type;
+  size_t n = last - first;
+  std::vector<std::uint64_t> keys(n);
+  for (size_t i = 0; i != n; ++i)
+    keys[i] = get_key(first[i]);
+  std::vector<std::uint32_t> order = radix_sort_indices(keys);
+  std::vector<T> sorted;
+  sorted.reserve(n);
+  for (std::uint32_t i : order)
+    sorted.push_back(std::move(first[i]));
+  std::move(sorted.begin(), sorted.end(), first);
+}
+
+/// Open-addressing (linear probing) hash map from packed Miller keys
+/// to values. Only insertion and lookup are supported.
+template<typename V>
+struct MillerKeyMap {
+  static constexpr std::uint64_t empty_key = ~std::uint64_t(0);  // never packed
+  std::vector<std::uint64_t> keys;
+  std::vector<V> values;
+  size_t mask = 0;
+  size_t count = 0;
+
+  explicit MillerKeyMap(size_t expected_size=0) {
+    size_t capacity = 16;
+    while (capacity < 2 * expected_size)
+      capacity *= 2;
+    keys.resize(capacity, empty_key);
+    values.resize(capacity);
+    mask = capacity - 1;
+  }
+
+  size_t size() const { return count; }
+
+  size_t slot(std::uint64_t key) const {
+    return size_t((key * 0x9E3779B97F4A7C15) >> 20) & mask;
+  }
+
+  /// Adds the key if it's not present yet; returns false if it was present.
+  bool insert(std::uint64_t key, const V& value) {
+    if (2 * (count + 1) > keys.size())
+      rehash(2 * keys.size());
+    for (size_t i = slot(key); ; i = (i + 1) & mask) {
+      if (keys[i] == key)
+        return false;
+      if (keys[i] == empty_key) {
+        keys[i] = key;
+        values[i] = value;
+        ++count;
+        return true;
+      }
+    }
+  }
+
+  const V* find(std::uint64_t key) const {
+    for (size_t i = slot(key); ; i = (i + 1) & mask) {
+      if (keys[i] == key)
+        return &values[i];
+      if (keys[i] == empty_key)
+        return nullptr;
+    }
+  }
+
+private:
+  void rehash(size_t capacity) {
+    MillerKeyMap<V> other(capacity / 2);
+    for (size_t i = 0; i != keys.size(); ++i)
+      if (keys[i] != empty_key)
+        other.insert(keys[i], values[i]);
+    *this = std::move(other);
+  }
+};
+
+} // namespace gemmi
+#endif
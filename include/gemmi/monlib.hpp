@@ -6,8 +6,10 @@
 #ifndef GEMMI_MONLIB_HPP_
 #define GEMMI_MONLIB_HPP_
 
+#include <algorithm>      // for lower_bound, sort, unique
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include "cifdoc.hpp"
 #include "elem.hpp"       // for Element
@@ -20,6 +22,8 @@ namespace gemmi {
 
 typedef cif::Document (*read_cif_func)(const std::string&);
 
+struct MonLibCache;  // in monlib_cache.hpp
+
 inline void add_distinct_altlocs(const Residue& res, std::string& altlocs) {
   for (const Atom& atom : res.atoms)
     if (atom.altloc && altlocs.find(atom.altloc) == std::string::npos)
@@ -66,6 +70,97 @@ struct ChemLink {
                       const ChemComp::Aliasing* aliasing2) const;
 };
 
+/// std::map of ChemLinks (by id) that counts modifications, so that
+/// ChemLinkIndex can tell if it's up-to-date. Links are read as from
+/// std::map; all non-const access, including modify(), counts as a change.
+class ChemLinkMap {
+public:
+  using map_type = std::map<std::string, ChemLink>;
+  using const_iterator = map_type::const_iterator;
+
+  ChemLinkMap() = default;
+  ChemLinkMap(const ChemLinkMap&) = default;
+  ChemLinkMap(ChemLinkMap&&) = default;
+  ChemLinkMap& operator=(const ChemLinkMap& o) { map_ = o.map_; ++generation_; return *this; }
+  ChemLinkMap& operator=(ChemLinkMap&& o) { map_ = std::move(o.map_); ++generation_; return *this; }
+
+  const_iterator begin() const { return map_.begin(); }
+  const_iterator end() const { return map_.end(); }
+  size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  size_t count(const std::string& id) const { return map_.count(id); }
+  const_iterator find(const std::string& id) const { return map_.find(id); }
+  const ChemLink& at(const std::string& id) const { return map_.at(id); }
+  // incremented on each change
+  size_t generation() const { return generation_; }
+
+  std::pair<const_iterator, bool> emplace(const std::string& id, const ChemLink& link) {
+    auto r = map_.emplace(id, link);
+    if (r.second)
+      ++generation_;
+    return r;
+  }
+  size_t erase(const std::string& id) {
+    ++generation_;
+    return map_.erase(id);
+  }
+  void clear() {
+    ++generation_;
+    map_.clear();
+  }
+  /// Access for in-place changes. Don't keep the reference: changes made
+  /// after the next index_links() or add_link() wouldn't be noticed.
+  ChemLink& modify(const std::string& id) {
+    ++generation_;
+    return map_.at(id);
+  }
+
+private:
+  map_type map_;
+  size_t generation_ = 0;
+};
+
+/// ChemLinks indexed by the names of atoms in the (first) bond,
+/// for quick lookup of links that may connect two given atoms.
+struct ChemLinkIndex {
+  // key: Restraints::lexicographic_str(atom1, atom2), links are sorted by id
+  std::unordered_map<std::string, std::vector<const ChemLink*>> by_atoms;
+  // ChemLinkMap::generation() of the indexed links; -1 if not set
+  size_t generation = (size_t)-1;
+
+  ChemLinkIndex() = default;
+  ChemLinkIndex(ChemLinkIndex&&) = default;
+  ChemLinkIndex& operator=(ChemLinkIndex&&) = default;
+  // A copy would point to links in the original MonLib, so it starts empty.
+  ChemLinkIndex(const ChemLinkIndex&) {}
+  ChemLinkIndex& operator=(const ChemLinkIndex&) { clear(); return *this; }
+
+  void clear() {
+    by_atoms.clear();
+    generation = (size_t)-1;
+  }
+
+  bool is_current(const ChemLinkMap& links) const {
+    return generation == links.generation();
+  }
+
+  void add(const ChemLink& link) {
+    if (link.rt.bonds.empty())
+      return;
+    std::vector<const ChemLink*>& v = by_atoms[link.rt.bonds[0].lexicographic_str()];
+    auto pos = std::lower_bound(v.begin(), v.end(), &link,
+                                [](const ChemLink* a, const ChemLink* b) { return a->id < b->id; });
+    if (pos == v.end() || *pos != &link)
+      v.insert(pos, &link);
+  }
+
+  const std::vector<const ChemLink*>* find(const std::string& atom1,
+                                           const std::string& atom2) const {
+    auto it = by_atoms.find(Restraints::lexicographic_str(atom1, atom2));
+    return it != by_atoms.end() ? &it->second : nullptr;
+  }
+};
+
 struct ChemMod {
   struct AtomMod {
     int func;
@@ -128,9 +223,14 @@ struct MonLib {
   std::string lib_version;
   EnerLib ener_lib;
   std::map<std::string, ChemComp> monomers;
-  std::map<std::string, ChemLink> links;
+  ChemLinkMap links;
   std::map<std::string, ChemMod> modifications;
   std::map<std::string, ChemComp::Group> cc_groups;
+  // optional, if set, files are read from the cache when possible
+  MonLibCache* cache = nullptr;
+  // index of links, used in match_link() if it's up-to-date
+  // (i.e. if links were not changed since it was built)
+  ChemLinkIndex link_index;
 
   const ChemLink* get_link(const std::string& link_id) const {
     auto link = links.find(link_id);
@@ -143,23 +243,25 @@ struct MonLib {
 
   // Returns the most specific link and a flag that is true
   // if the order is comp2-comp1 in the link definition.
+  // Uses link_index, unless it is outdated.
   std::tuple<const ChemLink*, bool, const ChemComp::Aliasing*, const ChemComp::Aliasing*>
   match_link(const Residue& res1, const std::string& atom1, char alt1,
              const Residue& res2, const std::string& atom2, char alt2,
              double min_bond_sq=0) const {
     const ChemLink* best_link = nullptr;
     bool inverted = false;
-    const ChemComp::Aliasing* aliasing1 = nullptr;
-    const ChemComp::Aliasing* aliasing2 = nullptr;
+    const ChemComp::Aliasing* best_aliasing1 = nullptr;
+    const ChemComp::Aliasing* best_aliasing2 = nullptr;
     int best_score = -1;
-    for (auto& ml : links) {
-      const ChemLink& link = ml.second;
+    auto check_link = [&](const ChemLink& link) {
       if (link.rt.bonds.empty())
-        continue;
+        return;
       // for now we don't have link definitions with >1 bonds
       const Restraints::Bond& bond = link.rt.bonds[0];
       if (sq(bond.value) < min_bond_sq)
-        continue;
+        return;
+      const ChemComp::Aliasing* aliasing1 = nullptr;
+      const ChemComp::Aliasing* aliasing2 = nullptr;
       if (link_side_matches_residue(link.side1, res1.name, &aliasing1) &&
           link_side_matches_residue(link.side2, res2.name, &aliasing2) &&
           atom_match_with_alias(bond.id1.atom, atom1, aliasing1) &&
@@ -168,6 +270,8 @@ struct MonLib {
         if (score > best_score) {
           best_link = &link;
           best_score = score;
+          best_aliasing1 = aliasing1;
+          best_aliasing2 = aliasing2;
           inverted = false;
         }
       }
@@ -179,11 +283,72 @@ struct MonLib {
         if (score > best_score) {
           best_link = &link;
           best_score = score;
+          best_aliasing1 = aliasing1;
+          best_aliasing2 = aliasing2;
           inverted = true;
         }
       }
+    };
+    if (link_index.is_current(links))
+      for_each_link_candidate(link_index, res1.name, atom1, res2.name, atom2,
+                              true, check_link);
+    else
+      for (auto& ml : links)
+        check_link(ml.second);
+    return std::make_tuple(best_link, inverted, best_aliasing1, best_aliasing2);
+  }
+
+  /// Calls func(const ChemLink&) for links from index that may connect
+  /// atom1 from residue resname1 with atom2 from resname2 (in any order).
+  /// Links are passed in the order of MonLib::links, each link once.
+  /// The caller still needs to check if the link matches.
+  template<typename Func>
+  void for_each_link_candidate(const ChemLinkIndex& index,
+                               const std::string& resname1, const std::string& atom1,
+                               const std::string& resname2, const std::string& atom2,
+                               bool use_alias, Func func) const {
+    std::vector<const std::string*> names1{&atom1}, names2{&atom2};
+    if (use_alias) {
+      add_names_in_link(resname1, atom1, names1);
+      add_names_in_link(resname2, atom2, names2);
+    }
+    if (names1.size() == 1 && names2.size() == 1) {
+      if (const std::vector<const ChemLink*>* v = index.find(atom1, atom2))
+        for (const ChemLink* link : *v)
+          func(*link);
+      return;
+    }
+    std::vector<const ChemLink*> candidates;
+    for (const std::string* n1 : names1)
+      for (const std::string* n2 : names2)
+        if (const std::vector<const ChemLink*>* v = index.find(*n1, *n2))
+          candidates.insert(candidates.end(), v->begin(), v->end());
+    std::sort(candidates.begin(), candidates.end(),
+              [](const ChemLink* a, const ChemLink* b) { return a->id < b->id; });
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    for (const ChemLink* link : candidates)
+      func(*link);
+  }
+
+  /// Rebuilds link_index. It is done automatically by read_monomer_doc(),
+  /// add_link() and Topo::initialize_refmac_topology(), if links changed.
+  void index_links() {
+    link_index.clear();
+    for (const auto& ml : links)
+      link_index.add(ml.second);
+    link_index.generation = links.generation();
+  }
+
+  /// Adds link (if its id is not used yet) and updates the index.
+  const ChemLink& add_link(const ChemLink& link) {
+    if (!link_index.is_current(links))
+      index_links();
+    auto it = links.emplace(link.id, link);
+    if (it.second) {
+      link_index.add(it.first->second);
+      link_index.generation = links.generation();
     }
-    return std::make_tuple(best_link, inverted, aliasing1, aliasing2);
+    return it.first->second;
   }
 
   void add_monomer_if_present(const cif::Block& block) {
@@ -219,6 +384,21 @@ struct MonLib {
     return false;
   }
 
+  /// Adds names that atom_name could have in link definitions: names for
+  /// which atom_name is an alias in aliasings of monomer res_name.
+  void add_names_in_link(const std::string& res_name, const std::string& atom_name,
+                         std::vector<const std::string*>& names) const {
+    auto it = monomers.find(res_name);
+    if (it == monomers.end())
+      return;
+    for (const ChemComp::Aliasing& a : it->second.aliases)
+      for (const auto& item : a.related)
+        if (item.first == atom_name &&
+            std::find_if(names.begin(), names.end(), [&](const std::string* n) {
+                           return *n == item.second; }) == names.end())
+          names.push_back(&item.second);
+  }
+
   /// Returns path to the monomer cif file (the file may not exist).
   std::string path(const std::string& code) {
       return monomer_dir + relative_monomer_path(code);
@@ -251,13 +431,21 @@ struct MonLib {
   void read_monomer_doc(const cif::Document& doc);
 
   void read_monomer_cif(const std::string& path_, read_cif_func read_cif) {
-    const cif::Document& doc = (*read_cif)(path_);
+    read_monomer_doc_and_version((*read_cif)(path_));
+  }
+
+  void read_monomer_doc_and_version(const cif::Document& doc) {
     if (!doc.blocks.empty() && doc.blocks[0].name == "lib")
       if (const std::string* ver = doc.blocks[0].find_value("_lib.version"))
         lib_version = *ver;
     read_monomer_doc(doc);
   }
 
+  /// Reads file from the monomer library (rel_path is relative to
+  /// monomer_dir) from the cache, if possible, otherwise using read_cif.
+  cif::Document read_library_file(const std::string& rel_path,
+                                  read_cif_func read_cif) const;
+
   void set_monomer_dir(const std::string& monomer_dir_) {
     monomer_dir = monomer_dir_;
     if (monomer_dir.back() != '/' && monomer_dir.back() != '\\')
@@ -274,16 +462,15 @@ struct MonLib {
       fail("read_monomer_lib: monomer_dir not specified.");
     set_monomer_dir(monomer_dir_);
 
-    read_monomer_cif(monomer_dir + "list/mon_lib_list.cif", read_cif);
-    ener_lib.read((*read_cif)(monomer_dir + "ener_lib.cif"));
+    read_monomer_doc_and_version(read_library_file("list/mon_lib_list.cif", read_cif));
+    ener_lib.read(read_library_file("ener_lib.cif", read_cif));
 
     bool ok = true;
     for (const std::string& name : resnames) {
       if (monomers.find(name) != monomers.end())
         continue;
       try {
-        const cif::Document& doc = (*read_cif)(path(name));
-        read_monomer_doc(doc);
+        read_monomer_doc(read_library_file(relative_monomer_path(name), read_cif));
       } catch (std::system_error& err) {
         if (error) {
           if (err.code().value() == ENOENT)
@@ -0,0 +1,341 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Binary cache of the monomer library. Files from the library are stored
+// in one file as parsed cif::Documents, so that programs using the library
+// don't need to open and parse many CIF files. Only the index is read
+// when the cache is opened, documents are read when requested.
+
+#ifndef GEMMI_MONLIB_CACHE_HPP_
+#define GEMMI_MONLIB_CACHE_HPP_
+
+#include <sys/stat.h>    // for stat
+#include <algorithm>     // for sort, lower_bound
+#include <cstdint>       // for uint32_t, uint64_t, int64_t
+#include <cstring>       // for memcpy
+#include "cifdoc.hpp"    // for Document, Block, Item
+#include "fail.hpp"      // for fail
+#include "fileutil.hpp"  // for file_open, fileptr_t, rename_file
+#include "input.hpp"     // for FileStream
+#include "monlib.hpp"    // for MonLib, read_cif_func
+
+namespace gemmi {
+
+namespace impl {
+
+// Values are written in native byte order; the cache is not portable
+// between machines with different endianness (this is checked).
+struct CacheWriter {
+  std::string& out;
+
+  template<typename T> void pod(T v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(T));
+  }
+  void str(const std::string& s) {
+    pod((std::uint32_t) s.size());
+    out += s;
+  }
+  void strings(const std::vector<std::string>& v) {
+    pod((std::uint32_t) v.size());
+    for (const std::string& s : v)
+      str(s);
+  }
+  void block(const cif::Block& b) {
+    str(b.name);
+    pod((std::uint32_t) b.items.size());
+    for (const cif::Item& item : b.items) {
+      pod((std::uint8_t) item.type);
+      pod((std::int32_t) item.line_number);
+      switch (item.type) {
+        case cif::ItemType::Pair:
+        case cif::ItemType::Comment:
+          str(item.pair[0]);
+          str(item.pair[1]);
+          break;
+        case cif::ItemType::Loop:
+          strings(item.loop.tags);
+          strings(item.loop.values);
+          break;
+        case cif::ItemType::Frame:
+          block(item.frame);
+          break;
+        case cif::ItemType::Erased:
+          break;
+      }
+    }
+  }
+};
+
+struct CacheReader {
+  const char* ptr;
+  const char* end;
+
+  void check(size_t n) const {
+    if (size_t(end - ptr) < n)
+      fail("monomer library cache is truncated or corrupted");
+  }
+  template<typename T> T pod() {
+    check(sizeof(T));
+    T v;
+    std::memcpy(&v, ptr, sizeof(T));
+    ptr += sizeof(T);
+    return v;
+  }
+  std::string str() {
+    std::uint32_t n = pod<std::uint32_t>();
+    check(n);
+    std::string s(ptr, n);
+    ptr += n;
+    return s;
+  }
+  void strings(std::vector<std::string>& v) {
+    std::uint32_t n = pod<std::uint32_t>();
+    v.reserve(n);
+    for (std::uint32_t i = 0; i != n; ++i)
+      v.push_back(str());
+  }
+  void block(cif::Block& b) {
+    b.name = str();
+    std::uint32_t n = pod<std::uint32_t>();
+    b.items.reserve(n);
+    for (std::uint32_t i = 0; i != n; ++i) {
+      auto type = (cif::ItemType) pod<std::uint8_t>();
+      int line_number = pod<std::int32_t>();
+      switch (type) {
+        case cif::ItemType::Pair: {
+          std::string tag = str();
+          b.items.emplace_back(tag, str());
+          break;
+        }
+        case cif::ItemType::Comment:
+          str();
+          b.items.emplace_back(cif::CommentArg{str()});
+          break;
+        case cif::ItemType::Loop:
+          b.items.emplace_back(cif::LoopArg{});
+          strings(b.items.back().loop.tags);
+          strings(b.items.back().loop.values);
+          break;
+        case cif::ItemType::Frame:
+          b.items.emplace_back(cif::FrameArg{std::string()});
+          block(b.items.back().frame);
+          break;
+        case cif::ItemType::Erased:
+          b.items.emplace_back(std::string());
+          b.items.back().erase();
+          break;
+        default:
+          fail("monomer library cache is corrupted");
+      }
+      b.items.back().line_number = line_number;
+    }
+  }
+};
+
+inline bool get_mtime_and_size(const std::string& path,
+                               std::int64_t& mtime, std::uint64_t& size) {
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0)
+    return false;
+  mtime = (std::int64_t) st.st_mtime;
+  size = (std::uint64_t) st.st_size;
+  return true;
+}
+
+constexpr char monlib_cache_magic[] = "GEMMI MONLIB CACHE 1";
+
+} // namespace impl
+
+struct MonLibCache {
+  struct Entry {
+    std::string path;  // relative to monomer_dir, e.g. "a/ALA.cif"
+    std::int64_t mtime;  // of the source file, when the cache was written
+    std::uint64_t size;  // of the source file
+    std::uint64_t offset;  // position of the serialized Document
+    std::uint64_t length;
+  };
+  std::string monomer_dir;  // the library from which the cache was made
+  std::vector<Entry> entries;  // sorted by path
+  // If set, entries are used only if the source file is unchanged
+  // (has the same mtime and size).
+  bool check_sources = true;
+
+  /// Reads the index. The file stays open until the cache is destroyed.
+  void open(const std::string& cache_path) {
+    file_ = file_open(cache_path.c_str(), "rb");
+    path_ = cache_path;
+    std::string header = read_bytes(0, sizeof(impl::monlib_cache_magic) + 12);
+    impl::CacheReader r{header.data(), header.data() + header.size()};
+    if (std::memcmp(r.ptr, impl::monlib_cache_magic, sizeof(impl::monlib_cache_magic)) != 0)
+      fail(cache_path + ": not a monomer library cache");
+    r.ptr += sizeof(impl::monlib_cache_magic);
+    if (r.pod<std::uint32_t>() != 0x01020304)
+      fail(cache_path + ": cache was written on a machine with different byte order");
+    std::uint64_t index_offset = r.pod<std::uint64_t>();
+    // the index is at the end of the file
+    FileStream stream{file_.get()};
+    if (!stream.seek((std::ptrdiff_t) index_offset))
+      fail(path_ + ": failed to read monomer library cache");
+    std::string index = stream.read_rest();
+    r = impl::CacheReader{index.data(), index.data() + index.size()};
+    monomer_dir = r.str();
+    std::uint32_t n = r.pod<std::uint32_t>();
+    entries.clear();
+    entries.reserve(n);
+    for (std::uint32_t i = 0; i != n; ++i) {
+      Entry e;
+      e.path = r.str();
+      e.mtime = r.pod<std::int64_t>();
+      e.size = r.pod<std::uint64_t>();
+      e.offset = r.pod<std::uint64_t>();
+      e.length = r.pod<std::uint64_t>();
+      entries.push_back(std::move(e));
+    }
+  }
+
+  const Entry* find(const std::string& rel_path) const {
+    auto it = std::lower_bound(entries.begin(), entries.end(), rel_path,
+                               [](const Entry& e, const std::string& p) { return e.path < p; });
+    return it != entries.end() && it->path == rel_path ? &*it : nullptr;
+  }
+
+  /// Reads the document if rel_path is in the cache and, with check_sources,
+  /// the source file (in dir, which usually is the same as monomer_dir)
+  /// has not changed. Not thread-safe.
+  bool read_document(const std::string& dir, const std::string& rel_path,
+                     cif::Document& doc) {
+    const Entry* e = find(rel_path);
+    if (!e)
+      return false;
+    std::string source = dir + rel_path;
+    if (check_sources) {
+      std::int64_t mtime;
+      std::uint64_t size;
+      if (!impl::get_mtime_and_size(source, mtime, size) ||
+          mtime != e->mtime || size != e->size)
+        return false;
+    }
+    std::string data = read_bytes(e->offset, e->length);
+    impl::CacheReader r{data.data(), data.data() + data.size()};
+    doc.clear();
+    doc.source = source;
+    std::uint32_t nblocks = r.pod<std::uint32_t>();
+    doc.blocks.resize(nblocks);
+    for (cif::Block& block : doc.blocks)
+      r.block(block);
+    return true;
+  }
+
+private:
+  std::string path_;
+  fileptr_t file_{nullptr, &std::fclose};
+
+  std::string read_bytes(std::uint64_t offset, std::uint64_t n) {
+    std::string buf(n, '\0');
+    if (!FileStream{file_.get()}.seek((std::ptrdiff_t) offset) ||
+        std::fread(&buf[0], 1, n, file_.get()) != n)
+      fail(path_ + ": failed to read monomer library cache");
+    return buf;
+  }
+};
+
+/// Writes a cache with list/mon_lib_list.cif, ener_lib.cif and monomers
+/// with given names (if resnames is empty: all monomers listed in
+/// mon_lib_list.cif). Files that cannot be read are skipped and listed
+/// in error. Returns the number of cached files.
+inline size_t write_monlib_cache(const std::string& cache_path,
+                                 const std::string& monomer_dir_,
+                                 std::vector<std::string> resnames,
+                                 read_cif_func read_cif,
+                                 std::string* error=nullptr) {
+  MonLib monlib;
+  monlib.set_monomer_dir(monomer_dir_);
+  const std::string& dir = monlib.monomer_dir;
+  cif::Document list_doc = (*read_cif)(dir + "list/mon_lib_list.cif");
+  if (resnames.empty())
+    if (cif::Block* block = list_doc.find_block("comp_list"))
+      for (const std::string& name : block->find_values("_chem_comp.id"))
+        resnames.push_back(cif::as_string(name));
+  std::vector<std::string> paths = {"list/mon_lib_list.cif", "ener_lib.cif"};
+  for (const std::string& name : resnames)
+    paths.push_back(MonLib::relative_monomer_path(name));
+  std::sort(paths.begin(), paths.end());
+  paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+  // written to a temporary file that is renamed at the end,
+  // so that a failure doesn't leave a truncated cache
+  const std::string tmp_path = cache_path + ".tmp";
+  fileptr_t f = file_open(tmp_path.c_str(), "wb");
+  auto write = [&](const std::string& data) {
+    if (std::fwrite(data.data(), 1, data.size(), f.get()) != data.size())
+      sys_fail("Failed to write " + cache_path);
+  };
+  std::vector<MonLibCache::Entry> entries;
+  try {
+    std::string out;
+    impl::CacheWriter w{out};
+    out.append(impl::monlib_cache_magic, sizeof(impl::monlib_cache_magic));
+    w.pod((std::uint32_t) 0x01020304);
+    const size_t index_offset_pos = out.size();
+    w.pod((std::uint64_t) 0);  // index offset, written at the end
+    std::uint64_t offset = out.size();
+    write(out);
+    for (const std::string& path : paths) {
+      cif::Document doc;
+      try {
+        doc = path == "list/mon_lib_list.cif" ? std::move(list_doc)
+                                              : (*read_cif)(dir + path);
+      } catch (std::runtime_error& err) {
+        if (error)
+          cat_to(*error, "Failed to read ", path, ": ", err.what(), ".\n");
+        continue;
+      }
+      MonLibCache::Entry e;
+      e.path = path;
+      if (!impl::get_mtime_and_size(dir + path, e.mtime, e.size))
+        e.mtime = e.size = 0;
+      out.clear();
+      w.pod((std::uint32_t) doc.blocks.size());
+      for (const cif::Block& block : doc.blocks)
+        w.block(block);
+      write(out);
+      e.offset = offset;
+      e.length = out.size();
+      offset += out.size();
+      entries.push_back(e);
+    }
+    out.clear();
+    w.str(dir);
+    w.pod((std::uint32_t) entries.size());
+    for (const MonLibCache::Entry& e : entries) {
+      w.str(e.path);
+      w.pod(e.mtime);
+      w.pod(e.size);
+      w.pod(e.offset);
+      w.pod(e.length);
+    }
+    write(out);
+    if (!FileStream{f.get()}.seek((std::ptrdiff_t) index_offset_pos))
+      sys_fail("Failed to write " + cache_path);
+    out.clear();
+    w.pod(offset);
+    write(out);
+  } catch (...) {
+    f.reset();
+    remove_file(tmp_path);
+    throw;
+  }
+  if (std::fclose(f.release()) != 0) {
+    remove_file(tmp_path);
+    sys_fail("Failed to write " + cache_path);
+  }
+  try {
+    rename_file(tmp_path, cache_path);
+  } catch (...) {
+    remove_file(tmp_path);
+    throw;
+  }
+  return entries.size();
+}
+
+} // namespace gemmi
+#endif
@@ -22,6 +22,7 @@
 #include "fail.hpp"      // for fail
 #include "fileutil.hpp"  // for file_open, is_little_endian, fileptr_t, ...
 #include "math.hpp"      // for rad, Mat33
+#include "millerkey.hpp" // for pack_miller, radix_sort_indices
 #include "symmetry.hpp"  // for find_spacegroup_by_name, SpaceGroup
 #include "unitcell.hpp"  // for UnitCell
 #include "util.hpp"      // for ialpha4_id, rtrim_str, ialpha3_id, ...
@@ -734,8 +735,55 @@ struct Mtz {
     if (!stream.read(data.data(), 4 * n))
       fail("Error when reading MTZ data");
     if (!same_byte_order)
-      for (float& f : data)
-        swap_four_bytes(&f);
+      swap_four_bytes_of_array(data.data(), n);
+  }
+
+  /// Reads data of the listed columns only; H, K, L (and M/ISYM in unmerged
+  /// files) are always read. Columns that are not read are removed.
+  /// Headers must be read first. The file is read in chunks of about
+  /// chunk_bytes, so memory usage depends only on the selected columns.
+  template<typename Stream>
+  void read_raw_data_of_columns(Stream& stream, const std::vector<std::string>& labels,
+                                size_t chunk_bytes=4*1024*1024) {
+    size_t ncol = columns.size();
+    std::vector<int> selected;
+    for (size_t i = 0; i != ncol; ++i) {
+      const Column& col = columns[i];
+      if (i < 3 || (col.label == "M/ISYM" && !is_merged()) ||
+          in_vector(col.label, labels))
+        selected.push_back((int) i);
+    }
+    for (const std::string& label : labels)
+      if (!column_with_label(label))
+        fail("MTZ: column not found: " + label);
+    if (selected.size() == ncol) {
+      read_raw_data(stream);
+      return;
+    }
+    std::vector<Column> new_columns;
+    new_columns.reserve(selected.size());
+    for (int i : selected) {
+      new_columns.push_back(std::move(columns[i]));
+      new_columns.back().idx = new_columns.size() - 1;
+    }
+    columns = std::move(new_columns);
+    size_t nsel = selected.size();
+    data.resize(nsel * nreflections);
+    if (!stream.seek(80))
+      fail("Cannot rewind to the MTZ data.");
+    size_t chunk_rows = std::max<size_t>(chunk_bytes / (4 * ncol), 1);
+    std::vector<float> buf(std::min(chunk_rows, (size_t) nreflections) * ncol);
+    float* out = data.data();
+    for (size_t row = 0; row < (size_t) nreflections; row += chunk_rows) {
+      size_t nrows = std::min(chunk_rows, (size_t) nreflections - row);
+      if (!stream.read(buf.data(), 4 * nrows * ncol))
+        fail("Error when reading MTZ data");
+      for (const float* in = buf.data(); in != buf.data() + nrows * ncol; in += ncol)
+        for (int i : selected)
+          *out++ = in[i];
+    }
+    if (!same_byte_order)
+      swap_four_bytes_of_array(data.data(), data.size());
   }
 
   template<typename Stream>
@@ -774,10 +822,33 @@ struct Mtz {
       read_stream(mem.stream(), with_data);
     } else {
       fileptr_t f = file_open(input.path().c_str(), "rb");
-      read_stream(FileStream{f.get()}, true);
+      read_stream(FileStream{f.get()}, with_data);
     }
   }
 
+  /// Reads headers and data of the listed columns, see read_raw_data_of_columns().
+  /// Compressed input is not uncompressed into memory, but read as a stream,
+  /// so the memory usage is bounded also for gzipped files. The stream
+  /// is then uncompressed twice: the headers are at the end of the file.
+  template<typename Input>
+  void read_input_columns(Input&& input, const std::vector<std::string>& labels) {
+    source_path = input.path();
+    if (input.is_stdin()) {
+      read_stream_columns(FileStream{stdin}, labels);
+    } else if (input.is_compressed()) {
+      read_stream_columns(input.get_uncompressing_stream(), labels);
+    } else {
+      fileptr_t f = file_open(input.path().c_str(), "rb");
+      read_stream_columns(FileStream{f.get()}, labels);
+    }
+  }
+
+  template<typename Stream>
+  void read_stream_columns(Stream&& stream, const std::vector<std::string>& labels) {
+    read_all_headers(stream);
+    read_raw_data_of_columns(stream, labels);
+  }
+
   std::vector<int> sorted_row_indices(int use_first=3) const {
     if (!has_data())
       fail("No data.");
@@ -786,17 +857,45 @@ struct Mtz {
     std::vector<int> indices(nreflections);
     for (int i = 0; i != nreflections; ++i)
       indices[i] = i;
-    std::stable_sort(indices.begin(), indices.end(), [&](int i, int j) {
+    auto compare_columns = [&](int start, int i, int j) {
       int a = i * (int) columns.size();
       int b = j * (int) columns.size();
-      for (int n = 0; n < use_first; ++n)
+      for (int n = start; n < use_first; ++n)
         if (data[a+n] != data[b+n])
           return data[a+n] < data[b+n];
       return false;
-    });
+    };
+    if (use_first >= 3 && has_packable_hkl()) {
+      // Sort by the remaining columns first, then (stable) radix sort by HKL.
+      if (use_first > 3)
+        std::stable_sort(indices.begin(), indices.end(),
+                         [&](int i, int j) { return compare_columns(3, i, j); });
+      std::vector<std::uint64_t> keys(nreflections);
+      for (int i = 0; i != nreflections; ++i)
+        keys[i] = pack_miller(get_hkl(indices[i] * columns.size()));
+      std::vector<std::uint32_t> perm = radix_sort_indices(keys);
+      std::vector<int> result(nreflections);
+      for (int i = 0; i != nreflections; ++i)
+        result[i] = indices[perm[i]];
+      return result;
+    }
+    std::stable_sort(indices.begin(), indices.end(),
+                     [&](int i, int j) { return compare_columns(0, i, j); });
     return indices;
   }
 
+  // true if all H, K, L values are integers that fit in pack_miller()
+  bool has_packable_hkl() const {
+    const float lim = float(1 << (MILLER_KEY_BITS - 1));
+    for (size_t n = 0; n < data.size(); n += columns.size())
+      for (int j = 0; j != 3; ++j) {
+        float x = data[n+j];
+        if (!(x >= -lim && x < lim) || x != (int) x)
+          return false;
+      }
+    return true;
+  }
+
   bool sort(int use_first=3) {
     std::vector<int> indices = sorted_row_indices(use_first);
     sort_order = {{0, 0, 0, 0, 0}};
@@ -1125,7 +1224,98 @@ struct Mtz {
   void write_to_file(const std::string& path) const;
 
 private:
+  friend struct MtzWriter;
   template<typename Write> void write_to_stream(Write write) const;
+  // writes everything that follows the data (headers, history, batches)
+  template<typename Write>
+  void write_headers_to_stream(Write write, std::int64_t nrefl,
+                               const std::vector<std::array<float,2>>& col_minmax,
+                               const std::array<double,2>& reso) const;
+};
+
+
+/// Writes MTZ file incrementally, so that the whole data doesn't need
+/// to be in memory. Rows are passed to add_rows() in batches; column
+/// min/max values and resolution limits are tracked on the fly.
+/// Headers are taken from mtz when finish() is called (Mtz::data is not
+/// used), so batches and history can still be added to mtz before that,
+/// but columns and cells must not change after the constructor.
+/// The data is written to a temporary file (path + ".tmp") that is renamed
+/// to path in finish(), so a failure doesn't destroy or truncate an existing
+/// file. If finish() is not called (or fails), the temporary file is removed.
+struct MtzWriter {
+  const Mtz& mtz;
+  std::string path;
+  std::string tmp_path;
+  fileptr_t file;
+  std::int64_t nreflections = 0;
+  std::vector<std::array<float,2>> column_minmax;
+  std::vector<UnitCell> cells;  // cells used for resolution limits
+  std::array<double,2> reso = {{INFINITY, 0.}};
+
+  MtzWriter(const Mtz& mtz_, const std::string& path_)
+      : mtz(mtz_), path(path_), tmp_path(path_ + ".tmp"), file(nullptr, &std::fclose) {
+    if (mtz.columns.size() < 3)
+      fail("Cannot write Mtz without H, K, L columns: " + path);
+    if (!mtz.spacegroup)
+      fail("Cannot write Mtz which has no space group: " + path);
+    column_minmax.resize(mtz.columns.size(), {{INFINITY, -INFINITY}});
+    // the same cells as in Mtz::calculate_min_max_1_d2()
+    if (mtz.cell.is_crystal() && mtz.cell.a > 0)
+      cells.push_back(mtz.cell);
+    const UnitCell* prev_cell = nullptr;
+    for (const Mtz::Dataset& ds : mtz.datasets)
+      if (ds.cell.is_crystal() && ds.cell.a > 0 && ds.cell != mtz.cell &&
+          (!prev_cell || ds.cell != *prev_cell)) {
+        cells.push_back(ds.cell);
+        prev_cell = &ds.cell;
+      }
+    file = file_open(tmp_path.c_str(), "wb");
+    // placeholder for the first record, which is written in finish()
+    char buf[80] = {0};
+    if (std::fwrite(buf, 80, 1, file.get()) != 1) {
+      file.reset();
+      remove_file(tmp_path);
+      sys_fail("Writing MTZ file failed: " + path);
+    }
+  }
+  MtzWriter(const MtzWriter&) = delete;
+  MtzWriter& operator=(const MtzWriter&) = delete;
+  ~MtzWriter() {
+    if (file) {
+      file.reset();
+      remove_file(tmp_path);
+    }
+  }
+
+  /// rows: nrows * mtz.columns.size() values
+  void add_rows(const float* rows, size_t nrows) {
+    size_t ncol = column_minmax.size();
+    for (const float* row = rows; row != rows + nrows * ncol; row += ncol) {
+      for (size_t j = 0; j != ncol; ++j) {
+        // NaNs fail both comparisons
+        if (row[j] < column_minmax[j][0])
+          column_minmax[j][0] = row[j];
+        if (row[j] > column_minmax[j][1])
+          column_minmax[j][1] = row[j];
+      }
+      for (const UnitCell& uc : cells) {
+        double res = uc.calculate_1_d2_double(row[0], row[1], row[2]);
+        reso[0] = std::min(reso[0], res);
+        reso[1] = std::max(reso[1], res);
+      }
+    }
+    if (nrows != 0 &&
+        std::fwrite(rows, 4 * ncol, nrows, file.get()) != nrows)
+      sys_fail("Writing MTZ file failed: " + path);
+    nreflections += nrows;
+  }
+  void add_rows(const std::vector<float>& rows) {
+    add_rows(rows.data(), rows.size() / column_minmax.size());
+  }
+
+  /// Writes headers and the first record, closes the file and renames it.
+  void finish();
 };
 
 
@@ -1142,6 +1332,13 @@ Mtz read_mtz(Input&& input, bool with_data) {
   return mtz;
 }
 
+template<typename Input>
+Mtz read_mtz_columns(Input&& input, const std::vector<std::string>& labels) {
+  Mtz mtz;
+  mtz.read_input_columns(std::forward<Input>(input), labels);
+  return mtz;
+}
+
 
 // Abstraction of data source, cf. ReflnDataProxy.
 struct MtzDataProxy {
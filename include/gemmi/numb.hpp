@@ -16,13 +16,13 @@
 namespace gemmi {
 namespace cif {
 
-inline double as_number(const std::string& s, double nan=NAN) {
-  const char* start = s.data();
-  const char* end = s.data() + s.size();
-  if (*start == '+')
+inline double as_number(const char* start, const char* end, double nan=NAN) {
+  if (start != end && *start == '+')
     ++start;
+  if (start == end)
+    return nan;
   // NaN, Inf and -Inf are not allowed in CIF
-  char f = start[int(*start == '-')] | 0x20;
+  char f = start[int(*start == '-' && start + 1 != end)] | 0x20;
   if (f == 'i' || f == 'n')
     return nan;
 
@@ -30,16 +30,20 @@ inline double as_number(const std::string& s, double nan=NAN) {
   auto result = fast_float::from_chars(start, end, d);
   if (result.ec != std::errc())
     return nan;
-  if (*result.ptr == '(') {
+  if (result.ptr != end && *result.ptr == '(') {
     const char* p = result.ptr + 1;
-    while (*p >= '0' && *p <= '9')
+    while (p != end && *p >= '0' && *p <= '9')
       ++p;
-    if (*p == ')')
+    if (p != end && *p == ')')
       result.ptr = p + 1;
   }
   return result.ptr == end ? d : nan;
 }
 
+inline double as_number(const std::string& s, double nan=NAN) {
+  return as_number(s.data(), s.data() + s.size(), nan);
+}
+
 inline bool is_numb(const std::string& s) {
   return !std::isnan(as_number(s));
 }
@@ -0,0 +1,58 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Helpers for running loops in multiple threads (thin layer over std::thread).
+
+#ifndef GEMMI_PARALLEL_HPP_
+#define GEMMI_PARALLEL_HPP_
+
+#include <cstddef>    // for size_t
+#include <algorithm>  // for min, max
+#include <exception>  // for exception_ptr, rethrow_exception
+#include <thread>
+#include <vector>
+
+namespace gemmi {
+
+/// Returns n if n > 0, otherwise the number of hardware threads.
+inline int effective_thread_count(int n) {
+  if (n > 0)
+    return n;
+  unsigned hw = std::thread::hardware_concurrency();
+  return hw != 0 ? (int) hw : 1;
+}
+
+/// Splits [0, n) into up to nthreads contiguous chunks and calls
+/// func(begin, end, thread_index) for each chunk in a separate thread.
+/// The calling thread processes the first chunk; nthreads <= 1 means that
+/// func(0, n, 0) is called directly. An exception thrown in any thread
+/// is re-thrown after all threads have finished.
+template<typename Func>
+void parallel_for_chunks(size_t n, int nthreads, Func&& func) {
+  size_t nt = std::min((size_t) std::max(nthreads, 1), n);
+  if (nt <= 1) {
+    if (n != 0)
+      func((size_t)0, n, 0);
+    return;
+  }
+  std::vector<std::exception_ptr> errors(nt);
+  auto run = [&](size_t k) {
+    try {
+      func(n * k / nt, n * (k + 1) / nt, (int) k);
+    } catch (...) {
+      errors[k] = std::current_exception();
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(nt - 1);
+  for (size_t k = 1; k < nt; ++k)
+    threads.emplace_back(run, k);
+  run(0);
+  for (std::thread& t : threads)
+    t.join();
+  for (std::exception_ptr& e : errors)
+    if (e)
+      std::rethrow_exception(e);
+}
+
+} // namespace gemmi
+#endif
@@ -17,6 +17,9 @@ cif::Document read_mmjson_gz(const std::string& path);
 CharArray read_into_buffer_gz(const std::string& path);
 cif::Document read_cif_from_buffer(const CharArray& buffer, const char* name);
 cif::Document read_first_block_gz(const std::string& path, size_t limit);
+// Reads file content until the second data block (data_ or global_
+// at the start of a line, possibly indented), without reading the rest.
+CharArray read_first_block_into_buffer_gz(const std::string& path);
 
 inline cif::Document read_cif_or_mmjson_gz(const std::string& path) {
   if (giends_with(path, "json") || giends_with(path, "js"))
@@ -9,29 +9,11 @@
 #include "../contact.hpp"  // for NeighborSearch, ContactSearch
 #include "../topo.hpp"     // for Topo
 #include "../select.hpp"   // for count_atom_sites
+#include "../parallel.hpp" // for parallel_for_chunks
+#include "sparse.hpp"      // for eigen_decomp_inv
 
 namespace gemmi {
 
-Mat33 eigen_decomp_inv(const SMat33<double> &m, double e, bool for_precond) {
-  const auto eig = m.calculate_eigenvalues();
-  // good e = 1.e-9 for plane and ~1e-6 or 1e-4 for precondition
-  auto f = [&](double v){
-    if (std::abs(v) < e) return 0.;
-    return for_precond ? 1. / std::sqrt(v) : 1. / v;
-  };
-  const Vec3 l{f(eig[0]), f(eig[1]), f(eig[2])};
-  Mat33 Q; // formed by eigenvectors
-  for (int j = 0; j < 3; ++j) {
-    const auto v = m.calculate_eigenvector(eig[j]);
-    for (int i = 0; i < 3; ++i) Q[i][j] = v.at(i);
-  }
-
-  if (for_precond)
-    return Q.multiply_by_diagonal(l);
-  else
-    return Q.multiply_by_diagonal(l).multiply(Q.transpose());
-}
-
 struct PlaneDeriv {
   PlaneDeriv(const std::vector<Atom*> &atoms)
     : dvmdx(atoms.size(), std::vector<Vec3>(3)), dDdx(atoms.size()) {
@@ -280,6 +262,225 @@ struct GeomTarget {
   }
 };
 
+// Greedy graph coloring of restraints. Consecutive restraints are grouped
+// into packets (to keep locality of memory access); packets with the same
+// color have no atoms in common, so they can be calculated in parallel.
+struct RestraintColoring {
+  static constexpr size_t packet_size = 64;
+  size_t n = 0;                // number of restraints
+  std::vector<size_t> order;   // packet indices sorted by color
+  std::vector<size_t> starts;  // color c is order[starts[c]] ... order[starts[c+1]-1]
+
+  // get_atoms(i, vec) appends indices of atoms in restraint i to vec
+  template<typename GetAtoms>
+  void set(size_t n_, size_t n_atoms, GetAtoms get_atoms) {
+    n = n_;
+    const size_t n_packets = (n + packet_size - 1) / packet_size;
+    std::vector<int> colors(n_packets);
+    std::vector<std::vector<char>> used;  // used[color][atom]
+    std::vector<int> idx;
+    for (size_t p = 0; p < n_packets; ++p) {
+      idx.clear();
+      for (size_t i = p * packet_size; i < std::min(n, (p + 1) * packet_size); ++i)
+        get_atoms(i, idx);
+      size_t c = 0;
+      for (;; ++c) {
+        if (c == used.size())
+          used.emplace_back(n_atoms, 0);
+        const std::vector<char>& u = used[c];
+        if (std::none_of(idx.begin(), idx.end(), [&](int a) { return u[a]; }))
+          break;
+      }
+      for (int a : idx)
+        used[c][a] = 1;
+      colors[p] = (int) c;
+    }
+    // counting sort, keeping the original order within each color
+    starts.assign(used.size() + 1, 0);
+    for (int c : colors)
+      ++starts[c+1];
+    for (size_t c = 1; c < starts.size(); ++c)
+      starts[c] += starts[c-1];
+    std::vector<size_t> pos(starts.begin(), starts.end() - 1);
+    order.resize(n_packets);
+    for (size_t p = 0; p < n_packets; ++p)
+      order[pos[colors[p]]++] = p;
+  }
+};
+
+// Bonds and angles compiled into flat arrays (structure of arrays), used in
+// Geometry::calc() when reporting is not needed. Atoms are referred to by
+// indices in coordinate arrays x, y, z and positions of off-diagonal blocks
+// in the normal matrix are found once, when compiling. Restraints that need
+// more than the basic calculation (several ideal values, symmetry mates,
+// robust target functions) are marked as fallback and calculated by
+// Bond::calc() or Angle::calc().
+// Restraints are evaluated in packets of up to RestraintColoring::packet_size:
+// first values and derivatives of the whole packet, in loops that the compiler
+// can vectorize, then the derivatives are added to GeomTarget.
+struct CompiledRestraints {
+  struct Bonds {
+    std::vector<int> atom1, atom2;
+    std::vector<double> value, sigma, value_nucleus, sigma_nucleus;
+    std::vector<int> am_pos;     // off-diagonal block in GeomTarget::am
+    std::vector<char> am_swap;   // imode==1 in find_restraint()
+    std::vector<char> fallback;
+    size_t size() const { return atom1.size(); }
+  };
+  struct Angles {
+    std::vector<int> atoms[3];
+    std::vector<double> value, sigma;
+    std::vector<int> am_pos[3];  // blocks for atom pairs 0-1, 0-2, 1-2
+    std::vector<char> am_swap[3];
+    std::vector<char> fallback;
+    size_t size() const { return value.size(); }
+  };
+  bool ready = false;
+  std::vector<double> x, y, z;  // atom positions, see load_positions()
+  Bonds bonds;
+  Angles angles;
+
+  void clear() { *this = CompiledRestraints(); }
+
+  void load_positions(const GeomTarget& target) {
+    const size_t n = target.n_atoms();
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+    for (size_t i = 0; i != n; ++i) {
+      const Position& pos = target.atoms[i]->pos;
+      x[i] = pos.x;
+      y[i] = pos.y;
+      z[i] = pos.z;
+    }
+  }
+
+  // Sets values[i-begin] for bonds in [begin, end) and adds derivatives
+  // to target. The operations are the same as in Bond::calc(), in the same
+  // order, so the results are equal within rounding (they may differ
+  // slightly only if the compiler contracts operations differently, e.g.
+  // into FMA). fallback(i) is called in order, together with other bonds.
+  template<typename Fallback>
+  void calc_bonds(size_t begin, size_t end, bool use_nucleus, double wdskal,
+                  double* values, GeomTarget& target, Fallback fallback) const {
+    const size_t n = end - begin;
+    assert(n <= RestraintColoring::packet_size);
+    double dx[RestraintColoring::packet_size];
+    double dy[RestraintColoring::packet_size];
+    double dz[RestraintColoring::packet_size];
+    double dfdy[RestraintColoring::packet_size];
+    const int* a1 = &bonds.atom1[begin];
+    const int* a2 = &bonds.atom2[begin];
+    for (size_t k = 0; k < n; ++k) {
+      dx[k] = x[a1[k]] - x[a2[k]];
+      dy[k] = y[a1[k]] - y[a2[k]];
+      dz[k] = z[a1[k]] - z[a2[k]];
+    }
+    const double* ideal = &(use_nucleus ? bonds.value_nucleus : bonds.value)[begin];
+    const double* sigma = &(use_nucleus ? bonds.sigma_nucleus : bonds.sigma)[begin];
+    for (size_t k = 0; k < n; ++k) {
+      const double b = std::sqrt(dx[k] * dx[k] + dy[k] * dy[k] + dz[k] * dz[k]);
+      const double weight = wdskal / sigma[k];
+      const double yv = (b - ideal[k]) * weight;
+      values[k] = 0.5 * yv * yv;
+      dfdy[k] = yv;
+      // dy/dx1 = weight * (x1 - x2) / max(b, 0.02), as in Bond::calc()
+      const double inv_b = 1.0 / std::max(b, 0.02);
+      dx[k] = weight * dx[k] * inv_b;
+      dy[k] = weight * dy[k] * inv_b;
+      dz[k] = weight * dz[k] * inv_b;
+    }
+    for (size_t k = 0; k < n; ++k) {
+      const size_t i = begin + k;
+      if (bonds.fallback[i]) {
+        values[k] = fallback(i);
+        continue;
+      }
+      const Vec3 dydx1(dx[k], dy[k], dz[k]);
+      const Vec3 dydx2 = -dydx1;
+      target.incr_vn(a1[k] * 3, dfdy[k], dydx1);
+      target.incr_vn(a2[k] * 3, dfdy[k], dydx2);
+      target.incr_am_diag(a1[k] * 6, 1.0, dydx1);
+      target.incr_am_diag(a2[k] * 6, 1.0, dydx2);
+      if (bonds.am_swap[i])
+        target.incr_am_ndiag(bonds.am_pos[i], 1.0, dydx2, dydx1);
+      else
+        target.incr_am_ndiag(bonds.am_pos[i], 1.0, dydx1, dydx2);
+    }
+  }
+
+  // The same for angles, as in Angle::calc().
+  template<typename Fallback>
+  void calc_angles(size_t begin, size_t end, double waskal,
+                   double* values, GeomTarget& target, Fallback fallback) const {
+    const size_t n = end - begin;
+    assert(n <= RestraintColoring::packet_size);
+    double v1[3][RestraintColoring::packet_size];
+    double v2[3][RestraintColoring::packet_size];
+    double wda[RestraintColoring::packet_size];
+    double weight[RestraintColoring::packet_size];
+    const int* a[3] = {&angles.atoms[0][begin], &angles.atoms[1][begin], &angles.atoms[2][begin]};
+    for (size_t k = 0; k < n; ++k) {
+      v1[0][k] = x[a[1][k]] - x[a[0][k]];
+      v1[1][k] = y[a[1][k]] - y[a[0][k]];
+      v1[2][k] = z[a[1][k]] - z[a[0][k]];
+      v2[0][k] = x[a[1][k]] - x[a[2][k]];
+      v2[1][k] = y[a[1][k]] - y[a[2][k]];
+      v2[2][k] = z[a[1][k]] - z[a[2][k]];
+    }
+    const double* ideal = &angles.value[begin];
+    const double* sigma = &angles.sigma[begin];
+    for (size_t k = 0; k < n; ++k) {
+      const double v1n = std::max(std::sqrt(v1[0][k] * v1[0][k] + v1[1][k] * v1[1][k] +
+                                            v1[2][k] * v1[2][k]), 0.02);
+      const double v2n = std::max(std::sqrt(v2[0][k] * v2[0][k] + v2[1][k] * v2[1][k] +
+                                            v2[2][k] * v2[2][k]), 0.02);
+      const double v12 = v1[0][k] * v2[0][k] + v1[1][k] * v2[1][k] + v1[2][k] * v2[2][k];
+      const double cosa = std::min(1., v12 / v1n / v2n);
+      const double sina = std::min(1., std::max(std::sqrt(1 - cosa * cosa), 0.1));
+      const double da = deg(std::acos(std::max(-1., std::min(1., cosa)))) - ideal[k];
+      weight[k] = waskal * waskal / (sigma[k] * sigma[k]);
+      values[k] = da * da * weight[k] * 0.5;
+      wda[k] = weight[k] * da;
+      const double inv12 = 1.0 / (v1n * v2n);
+      const double inv11 = 1.0 / (v1n * v1n);
+      const double inv22 = 1.0 / (v2n * v2n);
+      const double inv_sina = 1.0 / sina;
+      for (int j = 0; j < 3; ++j) {
+        // da/dx1 in v1, da/dx3 in v2
+        const double d1 = (v2[j][k] * inv12 - v1[j][k] * cosa * inv11) * inv_sina * deg(1);
+        const double d3 = (v1[j][k] * inv12 - v2[j][k] * cosa * inv22) * inv_sina * deg(1);
+        v1[j][k] = d1;
+        v2[j][k] = d3;
+      }
+    }
+    for (size_t k = 0; k < n; ++k) {
+      const size_t i = begin + k;
+      if (angles.fallback[i]) {
+        values[k] = fallback(i);
+        continue;
+      }
+      Vec3 dadx[3];
+      dadx[0] = Vec3(v1[0][k], v1[1][k], v1[2][k]);
+      dadx[2] = Vec3(v2[0][k], v2[1][k], v2[2][k]);
+      dadx[1] = -dadx[0] - dadx[2];
+      for (int j = 0; j < 3; ++j) {
+        target.incr_vn(a[j][k] * 3, wda[k], dadx[j]);
+        target.incr_am_diag(a[j][k] * 6, weight[k], dadx[j]);
+      }
+      static const int pair_atoms[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+      for (int p = 0; p < 3; ++p) {
+        const Vec3& d1 = dadx[pair_atoms[p][0]];
+        const Vec3& d2 = dadx[pair_atoms[p][1]];
+        if (angles.am_swap[p][i])
+          target.incr_am_ndiag(angles.am_pos[p][i], weight[k], d2, d1);
+        else
+          target.incr_am_ndiag(angles.am_pos[p][i], weight[k], d1, d2);
+      }
+    }
+  }
+};
+
 struct Geometry {
   struct Reporting;
   struct Bond {
@@ -494,8 +695,20 @@ struct Geometry {
     std::fill(target.vn.begin(), target.vn.end(), 0.);
     std::fill(target.am.begin(), target.am.end(), 0.);
   }
+  // Without check_only, bonds and angles are calculated from compiled
+  // restraints (CompiledRestraints), which are prepared on the first call;
+  // call setup_target() after changing restraints. Adding or removing
+  // restraints without it is an error; other changes are detected only
+  // by an assertion (in debug builds).
+  // With nthreads > 1 (see also min_threads_for_packets), restraints of each
+  // kind are calculated in parallel, one color (see RestraintColoring) at a time. The target value is the same
+  // as with one thread, derivatives may differ slightly in rounding, but they
+  // don't depend on nthreads. Reporting (check_only) is always serial.
+  // calc() functions of individual restraints (Bond::calc(), etc) add
+  // derivatives to target, but not their value; it's summed here,
+  // in target.target.
   double calc(bool use_nucleus, bool check_only, double wbond, double wangle, double wtors,
-              double wchir, double wplane, double wstack, double wvdw);
+              double wchir, double wplane, double wstack, double wvdw, int nthreads=1);
   double calc_adp_restraint(bool check_only, double sigma);
   void calc_jellybody();
 
@@ -533,6 +746,17 @@ struct Geometry {
   double vdw_sdi_dummy   = 0.3; // VDWR SIGM DUMM val
   //double dvdw_cut_min    = 1.75; // no need? // VDWR VDWC val
   //double dvdw_cut_min_x  = 1.75; // used as twice in fast_hessian_tabulation.f // VDWR VDWC val
+  // Verlet skin for setup_nonbonded(). If > 0, pairs are searched within
+  // the distance extended by the skin, and the next calls only filter
+  // these pairs, until an atom moves by more than skin/2 (or the model,
+  // cell or vdw parameters change). Then the pairs are searched again.
+  double nonbonded_skin = 0.;
+  // calc() with nthreads > 1 processes colored packets of restraints only if
+  // at least this many threads can run at the same time (nthreads limited
+  // by the hardware concurrency). In one thread, the colored order takes
+  // ~1.3x longer than the serial order, so with fewer threads the serial
+  // path is used. 0 = always use packets when nthreads > 1.
+  int min_threads_for_packets = 3;
 
   // ADP restraints
   float adpr_max_dist = 4.;
@@ -545,10 +769,39 @@ struct Geometry {
   bool ridge_symm = false; // inter-symmetry
 
 private:
+  // bonds, angles, torsions, chirs, planes, stackings, vdws;
+  // set when needed in calc(), reset in setup_target()
+  std::vector<RestraintColoring> colorings;
+  CompiledRestraints compiled;
+  // pairs found with nonbonded_skin, used in setup_nonbonded()
+  struct NonbondedCache {
+    std::vector<Vdw> vdws;  // as from set_vdw_values(), without image
+    std::vector<int> image_idx;
+    std::vector<char> same_asu;  // used in graph_distance()
+    std::vector<Atom*> atoms;
+    std::vector<Position> positions;  // of atoms, when pairs were searched
+    UnitCell cell;
+    double max_dist = 0.;  // search distance, including the skin
+    std::vector<double> params;
+  } nonbonded_cache;
+
+  std::vector<double> vdw_params() const {
+    return {vdw_sdi_vdw, vdw_sdi_torsion, vdw_sdi_hbond, vdw_sdi_metal,
+            hbond_dinc_ad, hbond_dinc_ah, dinc_torsion_o, dinc_torsion_n,
+            dinc_torsion_c, dinc_torsion_all, dinc_dummy, vdw_sdi_dummy};
+  }
+  bool nonbonded_cache_is_valid(double max_dist) const;
   void set_vdw_values(Geometry::Vdw &vdw, int d_1_2) const;
+  void setup_colorings();
+  void compile_restraints();
+  bool compiled_restraints_match() const;
+  template<typename Func>
+  void calc_in_packets(size_t kind, size_t n, int nthreads,
+                       double& sum, Func calc_packet) const;
 };
 
 inline void Geometry::load_topo(const Topo& topo) {
+  nonbonded_cache = NonbondedCache();
   auto add = [&](const Topo::Rule& rule, bool same_asu) {
                if (!same_asu && rule.rkind != Topo::RKind::Bond) return; // not supported
                if (rule.rkind == Topo::RKind::Bond) {
@@ -795,6 +1048,27 @@ inline void Geometry::set_vdw_values(Geometry::Vdw &vdw, int d_1_2) const {
   vdw.sigma = vdw_sdi_vdw;
 }
 
+inline bool Geometry::nonbonded_cache_is_valid(double max_dist) const {
+  const NonbondedCache& cache = nonbonded_cache;
+  if (cache.atoms.empty() || cache.max_dist != max_dist + nonbonded_skin ||
+      cache.params != vdw_params())
+    return false;
+  const UnitCell& c = st.cell;
+  if (c.a != cache.cell.a || c.b != cache.cell.b || c.c != cache.cell.c ||
+      c.alpha != cache.cell.alpha || c.beta != cache.cell.beta ||
+      c.gamma != cache.cell.gamma || c.images.size() != cache.cell.images.size())
+    return false;
+  const double max_shift_sq = sq(0.5 * nonbonded_skin);
+  size_t n = 0;
+  for (CRA cra : st.first_model().all()) {
+    if (n == cache.atoms.size() || cra.atom != cache.atoms[n] ||
+        cra.atom->pos.dist_sq(cache.positions[n]) > max_shift_sq)
+      return false;
+    ++n;
+  }
+  return n == cache.atoms.size();
+}
+
 // sets up nonbonded interactions for vdwr, ADP restraints, and jellybody
 inline void Geometry::setup_nonbonded() {
   if (ener_lib == nullptr) fail("set ener_lib");
@@ -813,26 +1087,80 @@ inline void Geometry::setup_nonbonded() {
   vdws.clear();
 
   // Reference: Refmac vdw_and_contacts.f
-  NeighborSearch ns(st.first_model(), st.cell, 4);
-  ns.populate();
   const float max_vdwr = 2.98f; // max from ener_lib, Cs.
   const float max_dist = std::max(std::max(ridge_dmax, adpr_max_dist), max_vdwr * 2);
-  ContactSearch contacts(max_dist);
-  contacts.ignore = ContactSearch::Ignore::Nothing;
-  contacts.for_each_contact(ns, [&](const CRA& cra1, const CRA& cra2,
-                                    int sym_idx, float) {
-    // XXX Refmac uses intervals for distances as well? vdw_and_contacts.f remove_bonds_and_angles()
-    NearestImage im = st.cell.find_nearest_pbc_image(cra1.atom->pos, cra2.atom->pos, sym_idx);
-    int d_1_2 = bondindex.graph_distance(*cra1.atom, *cra2.atom, im.sym_idx == 0 && im.same_asu());
-    if (d_1_2 > 2) {
-      vdws.emplace_back(cra1.atom, cra2.atom);
+  // In a small cell, ContactSearch can report the same pair twice (through
+  // different pbc images), which is not reproduced by filtering cached pairs.
+  const bool use_cache = nonbonded_skin > 0 &&
+    (!st.cell.is_crystal() ||
+     std::min(std::min(st.cell.a, st.cell.b), st.cell.c) > 2 * (max_dist + nonbonded_skin));
+  NonbondedCache& cache = nonbonded_cache;
+  if (!use_cache || !nonbonded_cache_is_valid(max_dist)) {
+    cache = NonbondedCache();
+    const float search_dist = use_cache ? float(max_dist + nonbonded_skin) : max_dist;
+    // NeighborSearch checks only neighbouring cells, so to find all pairs
+    // within search_dist the grid cannot be finer than search_dist.
+    NeighborSearch ns(st.first_model(), st.cell, search_dist);
+    ns.populate();
+    ContactSearch contacts(search_dist);
+    contacts.ignore = ContactSearch::Ignore::Nothing;
+    contacts.for_each_contact(ns, [&](const CRA& cra1, const CRA& cra2,
+                                      int sym_idx, float) {
+      // XXX Refmac uses intervals for distances as well? vdw_and_contacts.f remove_bonds_and_angles()
+      NearestImage im = st.cell.find_nearest_pbc_image(cra1.atom->pos, cra2.atom->pos, sym_idx);
+      const bool same_asu = im.sym_idx == 0 && im.same_asu();
+      int d_1_2 = bondindex.graph_distance(*cra1.atom, *cra2.atom, same_asu);
+      if (d_1_2 > 2) {
+        Vdw vdw(cra1.atom, cra2.atom);
+        set_vdw_values(vdw, d_1_2);
+        assert(!std::isnan(vdw.value) && vdw.value > 0);
+        if (use_cache) {
+          cache.vdws.push_back(vdw);
+          cache.image_idx.push_back(sym_idx);
+          cache.same_asu.push_back(same_asu);
+          return;
+        }
+        vdws.push_back(vdw);
+        vdws.back().set_image(im);
+        if (!same_asu)
+          vdws.back().type += 6;
+      }
+    });
+    if (!use_cache)
+      return;
+    for (CRA cra : st.first_model().all()) {
+      cache.atoms.push_back(cra.atom);
+      cache.positions.push_back(cra.atom->pos);
+    }
+    cache.cell = st.cell;
+    cache.max_dist = max_dist + nonbonded_skin;
+    cache.params = vdw_params();
+  }
+
+  // select cached pairs that are within max_dist now
+  const float max_dist_sq = sq(max_dist);
+  const double special_pos_cutoff_sq = sq(0.8);  // as in ContactSearch
+  for (size_t i = 0; i != cache.vdws.size(); ++i) {
+    const Vdw& vdw = cache.vdws[i];
+    NearestImage im = st.cell.find_nearest_pbc_image(vdw.atoms[0]->pos, vdw.atoms[1]->pos,
+                                                     cache.image_idx[i]);
+    if ((float) im.dist_sq >= max_dist_sq ||
+        (vdw.atoms[0] == vdw.atoms[1] && im.dist_sq < special_pos_cutoff_sq))
+      continue;
+    const bool same_asu = im.sym_idx == 0 && im.same_asu();
+    vdws.push_back(vdw);
+    if (same_asu != (bool) cache.same_asu[i]) {  // rare, may change graph distance
+      int d_1_2 = bondindex.graph_distance(*vdw.atoms[0], *vdw.atoms[1], same_asu);
+      if (d_1_2 <= 2) {
+        vdws.pop_back();
+        continue;
+      }
       set_vdw_values(vdws.back(), d_1_2);
-      assert(!std::isnan(vdws.back().value) && vdws.back().value > 0);
-      vdws.back().set_image(im);
-      if (im.sym_idx != 0 || !im.same_asu())
-        vdws.back().type += 6;
     }
-  });
+    vdws.back().set_image(im);
+    if (!same_asu)
+      vdws.back().type += 6;
+  }
 }
 
 inline void Geometry::setup_target(bool refine_xyz, int adp_mode) {
@@ -889,36 +1217,229 @@ inline void Geometry::setup_target(bool refine_xyz, int adp_mode) {
   }
 
   target.setup(st.first_model(), refine_xyz, adp_mode);
+  colorings.clear();
+  compiled.clear();
+}
+
+inline void Geometry::setup_colorings() {
+  const size_t n_atoms = target.n_atoms();
+  auto add = [](const Atom* a, std::vector<int>& idx) { idx.push_back(a->serial - 1); };
+  colorings.resize(7);
+  colorings[0].set(bonds.size(), n_atoms, [&](size_t i, std::vector<int>& idx) {
+    for (const Atom* a : bonds[i].atoms) add(a, idx);
+  });
+  colorings[1].set(angles.size(), n_atoms, [&](size_t i, std::vector<int>& idx) {
+    for (const Atom* a : angles[i].atoms) add(a, idx);
+  });
+  colorings[2].set(torsions.size(), n_atoms, [&](size_t i, std::vector<int>& idx) {
+    for (const Atom* a : torsions[i].atoms) add(a, idx);
+  });
+  colorings[3].set(chirs.size(), n_atoms, [&](size_t i, std::vector<int>& idx) {
+    for (const Atom* a : chirs[i].atoms) add(a, idx);
+  });
+  colorings[4].set(planes.size(), n_atoms, [&](size_t i, std::vector<int>& idx) {
+    for (const Atom* a : planes[i].atoms) add(a, idx);
+  });
+  colorings[5].set(stackings.size(), n_atoms, [&](size_t i, std::vector<int>& idx) {
+    for (const std::vector<Atom*>& plane : stackings[i].planes)
+      for (const Atom* a : plane) add(a, idx);
+  });
+  colorings[6].set(vdws.size(), n_atoms, [&](size_t i, std::vector<int>& idx) {
+    for (const Atom* a : vdws[i].atoms) add(a, idx);
+  });
+}
+
+inline void Geometry::compile_restraints() {
+  CompiledRestraints::Bonds& cb = compiled.bonds;
+  for (const Bond& t : bonds) {
+    const int ia1 = t.atoms[0]->serial - 1;
+    const int ia2 = t.atoms[1]->serial - 1;
+    cb.atom1.push_back(ia1);
+    cb.atom2.push_back(ia2);
+    bool fallback = t.values.size() != 1 || !t.same_asu() || ia1 == ia2 ||
+                    !(t.type < 2 || std::abs(t.alpha - 2) < 1e-3);
+    const Bond::Value v = t.values.empty() ? Bond::Value(0, 1, 0, 1) : t.values[0];
+    cb.value.push_back(v.value);
+    cb.sigma.push_back(v.sigma);
+    cb.value_nucleus.push_back(v.value_nucleus);
+    cb.sigma_nucleus.push_back(v.sigma_nucleus);
+    GeomTarget::MatPos mp{0, 0};
+    if (!fallback)
+      mp = target.find_restraint(ia1, ia2);
+    cb.am_pos.push_back(mp.ipos);
+    cb.am_swap.push_back(mp.imode == 1);
+    cb.fallback.push_back(fallback);
+  }
+  CompiledRestraints::Angles& ca = compiled.angles;
+  for (const Angle& t : angles) {
+    int ia[3];
+    for (int j = 0; j < 3; ++j) {
+      ia[j] = t.atoms[j]->serial - 1;
+      ca.atoms[j].push_back(ia[j]);
+    }
+    bool fallback = t.values.size() != 1 ||
+                    ia[0] == ia[1] || ia[0] == ia[2] || ia[1] == ia[2];
+    ca.value.push_back(t.values.empty() ? 0. : t.values[0].value);
+    ca.sigma.push_back(t.values.empty() ? 1. : t.values[0].sigma);
+    const int pair_atoms[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+    for (int p = 0; p < 3; ++p) {
+      GeomTarget::MatPos mp{0, 0};
+      if (!fallback)
+        mp = target.find_restraint(ia[pair_atoms[p][0]], ia[pair_atoms[p][1]]);
+      ca.am_pos[p].push_back(mp.ipos);
+      ca.am_swap[p].push_back(mp.imode == 1);
+    }
+    ca.fallback.push_back(fallback);
+  }
+  compiled.ready = true;
+}
+
+// Checks if compiled restraints are up to date. Slow, used in assertions.
+inline bool Geometry::compiled_restraints_match() const {
+  // value_nucleus and sigma_nucleus may be NaN
+  auto same = [](double a, double b) { return a == b || (std::isnan(a) && std::isnan(b)); };
+  const CompiledRestraints::Bonds& cb = compiled.bonds;
+  if (cb.size() != bonds.size())
+    return false;
+  for (size_t i = 0; i != bonds.size(); ++i) {
+    const Bond& t = bonds[i];
+    if (cb.atom1[i] != t.atoms[0]->serial - 1 || cb.atom2[i] != t.atoms[1]->serial - 1)
+      return false;
+    bool fallback = t.values.size() != 1 || !t.same_asu() || cb.atom1[i] == cb.atom2[i] ||
+                    !(t.type < 2 || std::abs(t.alpha - 2) < 1e-3);
+    if (fallback != (bool) cb.fallback[i])
+      return false;
+    if (!fallback) {
+      const Bond::Value& v = t.values[0];
+      if (!same(cb.value[i], v.value) || !same(cb.sigma[i], v.sigma) ||
+          !same(cb.value_nucleus[i], v.value_nucleus) ||
+          !same(cb.sigma_nucleus[i], v.sigma_nucleus))
+        return false;
+    }
+  }
+  const CompiledRestraints::Angles& ca = compiled.angles;
+  if (ca.size() != angles.size())
+    return false;
+  for (size_t i = 0; i != angles.size(); ++i) {
+    const Angle& t = angles[i];
+    for (int j = 0; j < 3; ++j)
+      if (ca.atoms[j][i] != t.atoms[j]->serial - 1)
+        return false;
+    if (ca.fallback[i] != (t.values.size() != 1 || ca.atoms[0][i] == ca.atoms[1][i] ||
+                           ca.atoms[0][i] == ca.atoms[2][i] || ca.atoms[1][i] == ca.atoms[2][i]))
+      return false;
+    if (!ca.fallback[i] &&
+        (ca.value[i] != t.values[0].value || ca.sigma[i] != t.values[0].sigma))
+      return false;
+  }
+  return true;
+}
+
+// Calls calc_packet(begin, end, values) for consecutive packets of restraints
+// of one kind (index in colorings), in parallel within each color if
+// nthreads > 1. Values of restraints are added to sum in the original order.
+template<typename Func>
+void Geometry::calc_in_packets(size_t kind, size_t n, int nthreads,
+                               double& sum, Func calc_packet) const {
+  const size_t packet_size = RestraintColoring::packet_size;
+  std::vector<double> values(n);
+  auto run = [&](size_t p) {
+    const size_t begin = p * packet_size;
+    calc_packet(begin, std::min(n, begin + packet_size), &values[begin]);
+  };
+  if (nthreads <= 1) {
+    for (size_t p = 0; p * packet_size < n; ++p)
+      run(p);
+  } else {
+    const RestraintColoring& coloring = colorings[kind];
+    if (coloring.n != n)
+      fail("Geometry::calc: restraints changed, call setup_target() first");
+    for (size_t c = 0; c + 1 < coloring.starts.size(); ++c) {
+      const size_t begin = coloring.starts[c];
+      const size_t count = coloring.starts[c+1] - begin;
+      // starting threads for a few packets would take longer than calculating
+      parallel_for_chunks(count, count < 16 ? 1 : nthreads, [&](size_t b, size_t e, int) {
+        for (size_t j = begin + b; j != begin + e; ++j)
+          run(coloring.order[j]);
+      });
+    }
+  }
+  for (double v : values)
+    sum += v;
 }
 
 inline double Geometry::calc(bool use_nucleus, bool check_only,
                              double wbond, double wangle, double wtors,
                              double wchir, double wplane, double wstack,
-                             double wvdw) {
-  if (check_only)
-    reporting = {};
-  else
-    assert(target.refine_xyz); // otherwise vector and matrix not ready
-
-  auto target_ptr = check_only ? nullptr : &target;
-  auto rep_ptr = check_only ? &reporting : nullptr;
+                             double wvdw, int nthreads) {
   double ret = 0.;
+  if (check_only) {
+    reporting = {};
+    Reporting* rep_ptr = &reporting;
+    for (const auto &t : bonds)
+      ret += t.calc(st.cell, use_nucleus, wbond, nullptr, rep_ptr);
+    for (const auto &t : angles)
+      ret += t.calc(wangle, nullptr, rep_ptr);
+    for (const auto &t : torsions)
+      ret += t.calc(wtors, nullptr, rep_ptr);
+    for (const auto &t : chirs)
+      ret += t.calc(wchir, nullptr, rep_ptr);
+    for (const auto &t : planes)
+      ret += t.calc(wplane, nullptr, rep_ptr);
+    for (const auto &t : stackings)
+      ret += t.calc(wstack, nullptr, rep_ptr);
+    for (const auto &t : vdws)
+      ret += t.calc(st.cell, wvdw, nullptr, rep_ptr);
+    // TODO intervals, harmonics, specials
+    return ret;
+  }
 
-  for (const auto &t : bonds)
-    ret += t.calc(st.cell, use_nucleus, wbond, target_ptr, rep_ptr);
-  for (const auto &t : angles)
-    ret += t.calc(wangle, target_ptr, rep_ptr);
-  for (const auto &t : torsions)
-    ret += t.calc(wtors, target_ptr, rep_ptr);
-  for (const auto &t : chirs)
-    ret += t.calc(wchir, target_ptr, rep_ptr);
-  for (const auto &t : planes)
-    ret += t.calc(wplane, target_ptr, rep_ptr);
-  for (const auto &t : stackings)
-    ret += t.calc(wstack, target_ptr, rep_ptr);
-  for (const auto &t : vdws)
-    ret += t.calc(st.cell, wvdw, target_ptr, rep_ptr);
-  if (!check_only && ridge_dmax > 0)
+  assert(target.refine_xyz); // otherwise vector and matrix not ready
+  GeomTarget* target_ptr = &target;
+  if (!compiled.ready)
+    compile_restraints();
+  else if (compiled.bonds.size() != bonds.size() || compiled.angles.size() != angles.size())
+    fail("Geometry::calc: restraints changed, call setup_target() first");
+  assert(compiled_restraints_match());
+  compiled.load_positions(target);
+  if (nthreads > 1 && min_threads_for_packets > 0 &&
+      std::min(nthreads, effective_thread_count(0)) < min_threads_for_packets)
+    nthreads = 1;
+  if (nthreads > 1 && colorings.empty())
+    setup_colorings();
+
+  calc_in_packets(0, bonds.size(), nthreads, ret, [&](size_t b, size_t e, double* values) {
+    compiled.calc_bonds(b, e, use_nucleus, wbond, values, target, [&](size_t i) {
+      return bonds[i].calc(st.cell, use_nucleus, wbond, target_ptr, nullptr);
+    });
+  });
+  calc_in_packets(1, angles.size(), nthreads, ret, [&](size_t b, size_t e, double* values) {
+    compiled.calc_angles(b, e, wangle, values, target, [&](size_t i) {
+      return angles[i].calc(wangle, target_ptr, nullptr);
+    });
+  });
+  calc_in_packets(2, torsions.size(), nthreads, ret, [&](size_t b, size_t e, double* values) {
+    for (size_t i = b; i != e; ++i)
+      values[i-b] = torsions[i].calc(wtors, target_ptr, nullptr);
+  });
+  calc_in_packets(3, chirs.size(), nthreads, ret, [&](size_t b, size_t e, double* values) {
+    for (size_t i = b; i != e; ++i)
+      values[i-b] = chirs[i].calc(wchir, target_ptr, nullptr);
+  });
+  calc_in_packets(4, planes.size(), nthreads, ret, [&](size_t b, size_t e, double* values) {
+    for (size_t i = b; i != e; ++i)
+      values[i-b] = planes[i].calc(wplane, target_ptr, nullptr);
+  });
+  calc_in_packets(5, stackings.size(), nthreads, ret, [&](size_t b, size_t e, double* values) {
+    for (size_t i = b; i != e; ++i)
+      values[i-b] = stackings[i].calc(wstack, target_ptr, nullptr);
+  });
+  calc_in_packets(6, vdws.size(), nthreads, ret, [&](size_t b, size_t e, double* values) {
+    for (size_t i = b; i != e; ++i)
+      values[i-b] = vdws[i].calc(st.cell, wvdw, target_ptr, nullptr);
+  });
+  target.target += ret;
+  if (ridge_dmax > 0)
     calc_jellybody(); // no contribution to target
 
   // TODO intervals, harmonics, specials
@@ -1071,8 +1592,6 @@ inline double Geometry::Bond::calc(const UnitCell& cell, bool use_nucleus, doubl
         target->incr_am_ndiag(mp.ipos, d2fdy, dydx2, dydx1);
     } else
       target->incr_am_diag12(ia1 * 6, d2fdy, dydx1, dydx2);
-
-    target->target += ret;
   }
   if (reporting != nullptr)
     reporting->bonds.emplace_back(this, closest, db);
@@ -1116,7 +1635,6 @@ inline double Geometry::Angle::calc(double waskal, GeomTarget* target, Reporting
         else
           target->incr_am_ndiag(mp.ipos, weight, dadx[j], dadx[i]);
       }
-    target->target += ret;
   }
   if (reporting != nullptr)
     reporting->angles.emplace_back(this, closest, da);
@@ -1204,7 +1722,6 @@ inline double Geometry::Torsion::calc(double wtskal, GeomTarget* target, Reporti
         else
           target->incr_am_ndiag(mp.ipos, weight, dthdx[j], dthdx[i]);
       }
-    target->target += ret;
   }
   if (reporting != nullptr)
     reporting->torsions.emplace_back(this, closest, dtheta);
@@ -1252,7 +1769,6 @@ inline double Geometry::Chirality::calc(double wchiral, GeomTarget* target, Repo
         else
           target->incr_am_ndiag(mp.ipos, weight, dcdx[j], dcdx[i]);
       }
-    target->target += ret;
   }
   if (reporting != nullptr)
     reporting->chirs.emplace_back(this, dv, ideal);
@@ -1298,7 +1814,6 @@ inline double Geometry::Plane::calc(double wplane, GeomTarget* target, Reporting
         }
       }
     }
-    target->target += ret;
   }
   if (reporting != nullptr)
     reporting->planes.emplace_back(this, deltas);
@@ -1422,8 +1937,6 @@ inline double Geometry::Stacking::calc(double wstack, GeomTarget* target, Report
       }
     }
   }
-  if (target != nullptr)
-    target->target += ret;
   if (reporting != nullptr)
     reporting->stackings.emplace_back(this, deltaa, deltad[0], deltad[1]);
   return ret;
@@ -1463,8 +1976,6 @@ Geometry::Vdw::calc(const UnitCell& cell, double wvdw, GeomTarget* target, Repor
         target->incr_am_ndiag(mp.ipos, weight, dbdx2, dbdx1);
     } else
       target->incr_am_diag12(ia1*6, weight, dbdx1, dbdx2);
-
-    target->target += ret;
   }
   if (reporting != nullptr)
     reporting->vdws.emplace_back(this, db);
@@ -8,6 +8,7 @@
 #include <gemmi/grid.hpp>
 #include <gemmi/it92.hpp>
 #include <gemmi/dencalc.hpp>
+#include <gemmi/parallel.hpp>  // for parallel_for_chunks
 
 namespace gemmi {
 
@@ -239,6 +240,8 @@ struct LL{
   std::vector<std::vector<double>> pp1; // for x-x diagonal
   std::vector<std::vector<double>> bb;  // for B-B diagonal
   std::vector<std::vector<double>> aa; // for B-B diagonal, aniso
+  // arguments of the last make_fisher_table_diag_fast() call
+  std::vector<double> table_args;
 
   LL(UnitCell cell, SpaceGroup *sg, const std::vector<Atom*> &atoms, bool mott_bethe,
      bool refine_xyz, int adp_mode, bool refine_h)
@@ -258,99 +261,103 @@ struct LL{
   // FFT-based gradient calculation: Murshudov et al. (1997) 10.1107/S0907444996012255
   // if cryo-EM SPA, den is the Fourier transform of (dLL/dAc-i dLL/dBc)*mott_bethe_factor/s^2
   // When b_add is given, den must have been sharpened
-  std::vector<double> calc_grad(Grid<float> &den, double b_add) { // needs <double>?
+  // Atoms are processed in nthreads threads; each atom has own elements of vn,
+  // so the result doesn't depend on nthreads.
+  std::vector<double> calc_grad(Grid<float> &den, double b_add, int nthreads=1) { // needs <double>?
     const size_t n_atoms = atoms.size();
     const size_t n_v = n_atoms * ((refine_xyz ? 3 : 0) + (adp_mode == 0 ? 0 : adp_mode == 1 ? 1 : 6));
     std::vector<double> vn(n_v, 0.);
-    for (size_t i = 0; i < n_atoms; ++i) {
-      const Atom &atom = *atoms[i];
-      if (!refine_h && atom.is_hydrogen()) continue;
-      const Element &el = atom.element;
-      const auto coef = Table::get(el);
-      using precal_aniso_t = decltype(coef.precalculate_density_aniso_b(SMat33<double>()));
-      const bool has_aniso = atom.aniso.nonzero();
-      if (adp_mode == 1 && has_aniso) fail("bad adp_mode");
-      for (const Transform &tr : ncs) { //TODO to use cell images?
-        const Fractional fpos = cell.fractionalize(Position(tr.apply(atom.pos)));
-        const SMat33<double> b_aniso = atom.aniso.scaled(u_to_b()).added_kI(b_add).transformed_by(tr.mat);
-        double b_max = atom.b_iso + b_add;
-        if (has_aniso) {
-          const auto eig = b_aniso.calculate_eigenvalues();
-          b_max = std::max(std::max(eig[0], eig[1]), eig[2]);
-        }
-        const auto precal = coef.precalculate_density_iso(b_max,
-                                                          mott_bethe ? -el.atomic_number() : 0.);
-        const precal_aniso_t precal_aniso = has_aniso ? coef.precalculate_density_aniso_b(b_aniso,
-                                                                                          mott_bethe ? -el.atomic_number() : 0.)
-          : precal_aniso_t();
-
-        const double radius = determine_cutoff_radius(it92_radius_approx(b_max),
-                                                      precal, 1e-7); // TODO cutoff?
-        const int N = sizeof(precal.a) / sizeof(precal.a[0]);
-        const int du = (int) std::ceil(radius / den.spacing[0]);
-        const int dv = (int) std::ceil(radius / den.spacing[1]);
-        const int dw = (int) std::ceil(radius / den.spacing[2]);
-        Position gx;
-        double gb = 0.;
-        double gb_aniso[6] = {0,0,0,0,0,0};
-        den.template use_points_in_box<true>(fpos, du, dv, dw,
-                                             [&](float& point, const Position& delta, int, int, int) {
-                                               if (point == 0) return;
-                                               const double r2 = delta.length_sq();
-                                               if (r2 > radius * radius) return;
-                                               if (!has_aniso) { // isotropic
-                                                 double for_x = 0., for_b = 0.;
-                                                 for (int j = 0; j < N; ++j) {
-                                                   const double tmp = precal.a[j] * std::exp(precal.b[j] * r2) * precal.b[j];
-                                                   for_x += tmp;
-                                                   if (adp_mode == 1) for_b += tmp * (1.5 + r2 * precal.b[j]);
-                                                 }
-                                                 gx += for_x * 2 * delta * point;
-                                                 if (adp_mode == 1) gb += for_b * point;
-                                               } else { // anisotropic
-                                                 for (int j = 0; j < N; ++j) {
-                                                   const double tmp = precal_aniso.a[j] * std::exp(precal_aniso.b[j].r_u_r(delta));
-                                                   const auto tmp2 = precal_aniso.b[j].multiply(delta); // -4pi^2 * (B+b)^-1 . delta
-                                                   gx += 2 * tmp * Position(tmp2) * point;
-                                                   if (adp_mode == 2) {
-                                                     // d/dp |B| = |B| B^-T
-                                                     const auto tmp3 = precal_aniso.b[j].scaled(0.5 * tmp * point).elements_pdb();
-                                                     // d/dp r^T B^-1 r = ..
-                                                     gb_aniso[0] += tmp3[0] + tmp2.x * tmp2.x * tmp * point;
-                                                     gb_aniso[1] += tmp3[1] + tmp2.y * tmp2.y * tmp * point;
-                                                     gb_aniso[2] += tmp3[2] + tmp2.z * tmp2.z * tmp * point;
-                                                     gb_aniso[3] += 2 * tmp3[3] + 2 * tmp2.x * tmp2.y * tmp * point;
-                                                     gb_aniso[4] += 2 * tmp3[4] + 2 * tmp2.x * tmp2.z * tmp * point;
-                                                     gb_aniso[5] += 2 * tmp3[5] + 2 * tmp2.y * tmp2.z * tmp * point;
+    parallel_for_chunks(n_atoms, nthreads, [&](size_t begin, size_t end, int) {
+      for (size_t i = begin; i < end; ++i) {
+        const Atom &atom = *atoms[i];
+        if (!refine_h && atom.is_hydrogen()) continue;
+        const Element &el = atom.element;
+        const auto coef = Table::get(el);
+        using precal_aniso_t = decltype(coef.precalculate_density_aniso_b(SMat33<double>()));
+        const bool has_aniso = atom.aniso.nonzero();
+        if (adp_mode == 1 && has_aniso) fail("bad adp_mode");
+        for (const Transform &tr : ncs) { //TODO to use cell images?
+          const Fractional fpos = cell.fractionalize(Position(tr.apply(atom.pos)));
+          const SMat33<double> b_aniso = atom.aniso.scaled(u_to_b()).added_kI(b_add).transformed_by(tr.mat);
+          double b_max = atom.b_iso + b_add;
+          if (has_aniso) {
+            const auto eig = b_aniso.calculate_eigenvalues();
+            b_max = std::max(std::max(eig[0], eig[1]), eig[2]);
+          }
+          const auto precal = coef.precalculate_density_iso(b_max,
+                                                            mott_bethe ? -el.atomic_number() : 0.);
+          const precal_aniso_t precal_aniso = has_aniso ? coef.precalculate_density_aniso_b(b_aniso,
+                                                                                            mott_bethe ? -el.atomic_number() : 0.)
+            : precal_aniso_t();
+
+          const double radius = determine_cutoff_radius(it92_radius_approx(b_max),
+                                                        precal, 1e-7); // TODO cutoff?
+          const int N = sizeof(precal.a) / sizeof(precal.a[0]);
+          const int du = (int) std::ceil(radius / den.spacing[0]);
+          const int dv = (int) std::ceil(radius / den.spacing[1]);
+          const int dw = (int) std::ceil(radius / den.spacing[2]);
+          Position gx;
+          double gb = 0.;
+          double gb_aniso[6] = {0,0,0,0,0,0};
+          den.template use_points_in_box<true>(fpos, du, dv, dw,
+                                               [&](float& point, const Position& delta, int, int, int) {
+                                                 if (point == 0) return;
+                                                 const double r2 = delta.length_sq();
+                                                 if (r2 > radius * radius) return;
+                                                 if (!has_aniso) { // isotropic
+                                                   double for_x = 0., for_b = 0.;
+                                                   for (int j = 0; j < N; ++j) {
+                                                     const double tmp = precal.a[j] * std::exp(precal.b[j] * r2) * precal.b[j];
+                                                     for_x += tmp;
+                                                     if (adp_mode == 1) for_b += tmp * (1.5 + r2 * precal.b[j]);
+                                                   }
+                                                   gx += for_x * 2 * delta * point;
+                                                   if (adp_mode == 1) gb += for_b * point;
+                                                 } else { // anisotropic
+                                                   for (int j = 0; j < N; ++j) {
+                                                     const double tmp = precal_aniso.a[j] * std::exp(precal_aniso.b[j].r_u_r(delta));
+                                                     const auto tmp2 = precal_aniso.b[j].multiply(delta); // -4pi^2 * (B+b)^-1 . delta
+                                                     gx += 2 * tmp * Position(tmp2) * point;
+                                                     if (adp_mode == 2) {
+                                                       // d/dp |B| = |B| B^-T
+                                                       const auto tmp3 = precal_aniso.b[j].scaled(0.5 * tmp * point).elements_pdb();
+                                                       // d/dp r^T B^-1 r = ..
+                                                       gb_aniso[0] += tmp3[0] + tmp2.x * tmp2.x * tmp * point;
+                                                       gb_aniso[1] += tmp3[1] + tmp2.y * tmp2.y * tmp * point;
+                                                       gb_aniso[2] += tmp3[2] + tmp2.z * tmp2.z * tmp * point;
+                                                       gb_aniso[3] += 2 * tmp3[3] + 2 * tmp2.x * tmp2.y * tmp * point;
+                                                       gb_aniso[4] += 2 * tmp3[4] + 2 * tmp2.x * tmp2.z * tmp * point;
+                                                       gb_aniso[5] += 2 * tmp3[5] + 2 * tmp2.y * tmp2.z * tmp * point;
+                                                     }
                                                    }
                                                  }
-                                               }
-                                             }, false /* fail_on_too_large_radius */);
-        gx *= atom.occ;
-        if (adp_mode == 1)
-          gb *= atom.occ * 0.25 / sq(pi());
-        else if (adp_mode == 2)
-          for (int i = 0; i < 6; ++i)
-            gb_aniso[i] *= atom.occ * 0.25 / sq(pi());
-
-        if (refine_xyz) {
-          const auto gx2 = tr.mat.transpose().multiply(gx);
-          vn[3*i  ] += gx2.x;
-          vn[3*i+1] += gx2.y;
-          vn[3*i+2] += gx2.z;
-        }
-        const int offset = (refine_xyz ? n_atoms * 3 : 0);
-        if (adp_mode == 1)
-          vn[offset + i] += gb;
-        else if (adp_mode == 2) { // added as B (not U)
-          for (int j = 0; j < 6; ++j) {
-            const auto m = SMat33<double>({double(j==0), double(j==1), double(j==2), double(j==3), double(j==4), double(j==5)}).transformed_by(tr.mat);
-            vn[offset + 6*i+j] += (gb_aniso[0] * m.u11 + gb_aniso[1] * m.u22 + gb_aniso[2] * m.u33 +
-                                   gb_aniso[3] * m.u12 + gb_aniso[4] * m.u13 + gb_aniso[5] * m.u23);
+                                               }, false /* fail_on_too_large_radius */);
+          gx *= atom.occ;
+          if (adp_mode == 1)
+            gb *= atom.occ * 0.25 / sq(pi());
+          else if (adp_mode == 2)
+            for (int i = 0; i < 6; ++i)
+              gb_aniso[i] *= atom.occ * 0.25 / sq(pi());
+
+          if (refine_xyz) {
+            const auto gx2 = tr.mat.transpose().multiply(gx);
+            vn[3*i  ] += gx2.x;
+            vn[3*i+1] += gx2.y;
+            vn[3*i+2] += gx2.z;
+          }
+          const int offset = (refine_xyz ? n_atoms * 3 : 0);
+          if (adp_mode == 1)
+            vn[offset + i] += gb;
+          else if (adp_mode == 2) { // added as B (not U)
+            for (int j = 0; j < 6; ++j) {
+              const auto m = SMat33<double>({double(j==0), double(j==1), double(j==2), double(j==3), double(j==4), double(j==5)}).transformed_by(tr.mat);
+              vn[offset + 6*i+j] += (gb_aniso[0] * m.u11 + gb_aniso[1] * m.u22 + gb_aniso[2] * m.u33 +
+                                     gb_aniso[3] * m.u12 + gb_aniso[4] * m.u13 + gb_aniso[5] * m.u23);
+            }
           }
         }
       }
-    }
+    });
     for (auto &v : vn) // to match scale of hessian
       v *= (mott_bethe ? -1 : 1) / (double) ncs.size();
     return vn;
@@ -382,8 +389,16 @@ struct LL{
 
   // preparation for fisher_diag_from_table()
   // Steiner et al. (2003) doi: 10.1107/S0907444903018675
+  // Tables are not recalculated if the arguments are the same as in
+  // the previous call (refinement cycles often have the same B range).
   void make_fisher_table_diag_fast(double b_min, double b_max,
-                                   const TableS3 &d2dfw_table) {
+                                   const TableS3 &d2dfw_table, int nthreads=1) {
+    std::vector<double> args = {b_min, b_max, d2dfw_table.s_min, d2dfw_table.s_max,
+                                double(mott_bethe)};
+    args.insert(args.end(), d2dfw_table.y_values.begin(), d2dfw_table.y_values.end());
+    if (args == table_args && !table_bs.empty())
+      return;
+    table_args.clear();
     pp1.resize(1);
     bb.resize(1);
     aa.resize(1);
@@ -398,46 +413,48 @@ struct LL{
 
     const double s_step = (s_max - s_min) / s_dim;
 
-    table_bs.clear();
-    table_bs.reserve(b_dim);
+    table_bs.resize(b_dim);
 
     // only for D = 0 (same atoms) for now
-    for (int ib = 0; ib < b_dim; ++ib) {
-      const double b = b_min + b_step * ib;
-      table_bs.push_back(b);
-
-      std::vector<double> tpp(s_dim+1), tbb(s_dim+1), taa(s_dim+1);
-      for (int i = 0; i <= s_dim; ++i) {
-        const double s = s_min + s_step * i;
-        const double w_c = d2dfw_table.get_value(s); // average of weight
-        const double w_c_ft_c = w_c * std::exp(-b*s*s/4.);
-        tpp[i] = 16. * pi() * pi() * pi() * w_c_ft_c / 3.; // (2pi)^2 * 4pi/3
-        tbb[i] = pi() / 4 * w_c_ft_c * s * s; // 1/16 * 4pi
-        taa[i] = pi() / 20 * w_c_ft_c * s * s; // 1/16 * 4pi/5 (later *1, *1/3, *4/3)
-        if (!mott_bethe) {
-          tpp[i] *= s*s*s*s;
-          tbb[i] *= s*s*s*s;
-          taa[i] *= s*s*s*s;
+    parallel_for_chunks(b_dim, nthreads, [&](size_t begin, size_t end, int) {
+      for (size_t ib = begin; ib < end; ++ib) {
+        const double b = b_min + b_step * ib;
+        table_bs[ib] = b;
+
+        std::vector<double> tpp(s_dim+1), tbb(s_dim+1), taa(s_dim+1);
+        for (int i = 0; i <= s_dim; ++i) {
+          const double s = s_min + s_step * i;
+          const double w_c = d2dfw_table.get_value(s); // average of weight
+          const double w_c_ft_c = w_c * std::exp(-b*s*s/4.);
+          tpp[i] = 16. * pi() * pi() * pi() * w_c_ft_c / 3.; // (2pi)^2 * 4pi/3
+          tbb[i] = pi() / 4 * w_c_ft_c * s * s; // 1/16 * 4pi
+          taa[i] = pi() / 20 * w_c_ft_c * s * s; // 1/16 * 4pi/5 (later *1, *1/3, *4/3)
+          if (!mott_bethe) {
+            tpp[i] *= s*s*s*s;
+            tbb[i] *= s*s*s*s;
+            taa[i] *= s*s*s*s;
+          }
         }
-      }
 
-      // Numerical integration by Simpson's rule
-      double sum_tpp1 = 0, sum_tpp2 = 0, sum_tbb1 = 0, sum_tbb2 = 0, sum_taa1 = 0, sum_taa2 = 0;
-      for (int i = 1; i < s_dim; i+=2) {
-        sum_tpp1 += tpp[i];
-        sum_tbb1 += tbb[i];
-        sum_taa1 += taa[i];
-      }
-      for (int i = 2; i < s_dim; i+=2) {
-        sum_tpp2 += tpp[i];
-        sum_tbb2 += tbb[i];
-        sum_taa2 += taa[i];
-      }
+        // Numerical integration by Simpson's rule
+        double sum_tpp1 = 0, sum_tpp2 = 0, sum_tbb1 = 0, sum_tbb2 = 0, sum_taa1 = 0, sum_taa2 = 0;
+        for (int i = 1; i < s_dim; i+=2) {
+          sum_tpp1 += tpp[i];
+          sum_tbb1 += tbb[i];
+          sum_taa1 += taa[i];
+        }
+        for (int i = 2; i < s_dim; i+=2) {
+          sum_tpp2 += tpp[i];
+          sum_tbb2 += tbb[i];
+          sum_taa2 += taa[i];
+        }
 
-      pp1[0][ib] = (tpp[0] + tpp.back() + 4 * sum_tpp1 + 2 * sum_tpp2) * s_step / 3.;
-      bb[0][ib] = (tbb[0] + tbb.back() + 4 * sum_tbb1 + 2 * sum_tbb2) * s_step / 3.;
-      aa[0][ib] = (taa[0] + taa.back() + 4 * sum_taa1 + 2 * sum_taa2) * s_step / 3.;
-    }
+        pp1[0][ib] = (tpp[0] + tpp.back() + 4 * sum_tpp1 + 2 * sum_tpp2) * s_step / 3.;
+        bb[0][ib] = (tbb[0] + tbb.back() + 4 * sum_tbb1 + 2 * sum_tbb2) * s_step / 3.;
+        aa[0][ib] = (taa[0] + taa.back() + 4 * sum_taa1 + 2 * sum_taa2) * s_step / 3.;
+      }
+    });
+    table_args = std::move(args);
   }
 
   // from Refmac SUBROUTINE LINTER_VALUE2
@@ -468,43 +485,45 @@ struct LL{
       return y;
   }
 
-  std::vector<double> fisher_diag_from_table() {
+  std::vector<double> fisher_diag_from_table(int nthreads=1) {
     const size_t n_atoms = atoms.size();
     const size_t n_a = n_atoms * ((refine_xyz ? 3 : 0) + (adp_mode == 0 ? 0 : adp_mode == 1 ? 1 : 9));
     const int N = Table::Coef::ncoeffs;
     std::vector<double> am(n_a, 0.);
-    for (size_t i = 0; i < n_atoms; ++i) {
-      const Atom &atom = *atoms[i];
-      if (!refine_h && atom.is_hydrogen()) continue;
-      const auto coef = Table::get(atom.element);
-      const double w = atom.occ * atom.occ;
-      const double c = mott_bethe ? coef.c() - atom.element.atomic_number(): coef.c();
-      const double b_iso = atom.aniso.nonzero() ? u_to_b() * atom.aniso.trace() / 3 : atom.b_iso;
-      double fac_x = 0., fac_b = 0., fac_a = 0.;
-
-      // TODO can be reduced for the same elements
-      for (int j = 0; j < N + 1; ++j)
-        for (int k = 0; k < N + 1; ++k) {
-          // * -1 is needed for mott_bethe case, but we only need aj * ak so they cancel.
-          const double aj = j < N ? coef.a(j) : c;
-          const double ak = k < N ? coef.a(k) : c;
-          const double b = 2 * b_iso + (j < N ? coef.b(j) : 0) + (k < N ? coef.b(k) : 0);
-          fac_x += aj * ak * interp_1d(table_bs, pp1[0], b);
-          fac_b += aj * ak * interp_1d(table_bs, bb[0], b);
-          fac_a += aj * ak * interp_1d(table_bs, aa[0], b);
-        }
+    parallel_for_chunks(n_atoms, nthreads, [&](size_t begin, size_t end, int) {
+      for (size_t i = begin; i < end; ++i) {
+        const Atom &atom = *atoms[i];
+        if (!refine_h && atom.is_hydrogen()) continue;
+        const auto coef = Table::get(atom.element);
+        const double w = atom.occ * atom.occ;
+        const double c = mott_bethe ? coef.c() - atom.element.atomic_number(): coef.c();
+        const double b_iso = atom.aniso.nonzero() ? u_to_b() * atom.aniso.trace() / 3 : atom.b_iso;
+        double fac_x = 0., fac_b = 0., fac_a = 0.;
+
+        // TODO can be reduced for the same elements
+        for (int j = 0; j < N + 1; ++j)
+          for (int k = 0; k < N + 1; ++k) {
+            // * -1 is needed for mott_bethe case, but we only need aj * ak so they cancel.
+            const double aj = j < N ? coef.a(j) : c;
+            const double ak = k < N ? coef.a(k) : c;
+            const double b = 2 * b_iso + (j < N ? coef.b(j) : 0) + (k < N ? coef.b(k) : 0);
+            fac_x += aj * ak * interp_1d(table_bs, pp1[0], b);
+            fac_b += aj * ak * interp_1d(table_bs, bb[0], b);
+            fac_a += aj * ak * interp_1d(table_bs, aa[0], b);
+          }
 
-      const int ipos = i*3;
-      if (refine_xyz) am[ipos] = am[ipos+1] = am[ipos+2] = w * fac_x;
-      const int offset = refine_xyz ? n_atoms * 3 : 0;
-      if (adp_mode == 1)
-        am[offset + i] = w * fac_b;
-      else if (adp_mode == 2) {
-        for (int j = 0; j < 3; ++j) am[offset + 9*i + j] = w * fac_a;     // 11-11, 22-22, 33-33
-        for (int j = 3; j < 6; ++j) am[offset + 9*i + j] = w * fac_a * 4; // 12-12, 13-13, 23-23
-        for (int j = 6; j < 9; ++j) am[offset + 9*i + j] = w * fac_a / 3; // 11-22, 11-33, 22-33
+        const int ipos = i*3;
+        if (refine_xyz) am[ipos] = am[ipos+1] = am[ipos+2] = w * fac_x;
+        const int offset = refine_xyz ? n_atoms * 3 : 0;
+        if (adp_mode == 1)
+          am[offset + i] = w * fac_b;
+        else if (adp_mode == 2) {
+          for (int j = 0; j < 3; ++j) am[offset + 9*i + j] = w * fac_a;     // 11-11, 22-22, 33-33
+          for (int j = 3; j < 6; ++j) am[offset + 9*i + j] = w * fac_a * 4; // 12-12, 13-13, 23-23
+          for (int j = 6; j < 9; ++j) am[offset + 9*i + j] = w * fac_a / 3; // 11-22, 11-33, 22-33
+        }
       }
-    }
+    });
     return am;
   }
 
@@ -0,0 +1,289 @@
+// Copyright 2023 MRC Laboratory of Molecular Biology
+//
+// Sparse symmetric matrices (such as normal matrices from GeomTarget and LL)
+// in the CSR format and a preconditioned conjugate gradient solver.
+
+#ifndef GEMMI_REFINE_SPARSE_HPP_
+#define GEMMI_REFINE_SPARSE_HPP_
+
+#include <climits>          // for INT_MAX
+#include <cmath>            // for sqrt, abs
+#include <algorithm>        // for lower_bound, stable_sort
+#include <utility>          // for pair
+#include <vector>
+#include "../math.hpp"      // for Mat33, SMat33
+#include "../fail.hpp"      // for fail
+#include "../parallel.hpp"  // for parallel_for_chunks
+
+namespace gemmi {
+
+inline Mat33 eigen_decomp_inv(const SMat33<double> &m, double e, bool for_precond) {
+  const auto eig = m.calculate_eigenvalues();
+  // good e = 1.e-9 for plane and ~1e-6 or 1e-4 for precondition
+  auto f = [&](double v){
+    if (std::abs(v) < e) return 0.;
+    return for_precond ? 1. / std::sqrt(v) : 1. / v;
+  };
+  const Vec3 l{f(eig[0]), f(eig[1]), f(eig[2])};
+  Mat33 Q; // formed by eigenvectors
+  for (int j = 0; j < 3; ++j) {
+    const auto v = m.calculate_eigenvector(eig[j]);
+    for (int i = 0; i < 3; ++i) Q[i][j] = v.at(i);
+  }
+
+  if (for_precond)
+    return Q.multiply_by_diagonal(l);
+  else
+    return Q.multiply_by_diagonal(l).multiply(Q.transpose());
+}
+
+// Square matrix in the CSR (compressed sparse row) format. Symmetric
+// matrices have both triangles stored. Arrays can be used directly as
+// scipy.sparse.csr_matrix((values, col_idx, row_ptr)).
+struct SparseMatrixCSR {
+  int n = 0;                  // number of rows and columns
+  std::vector<int> row_ptr;   // row i is in [row_ptr[i], row_ptr[i+1])
+  std::vector<int> col_idx;   // sorted within each row
+  std::vector<double> values;
+
+  size_t nnz() const { return values.size(); }
+
+  double at(int row, int col) const {
+    auto begin = col_idx.begin() + row_ptr.at(row);
+    auto end = col_idx.begin() + row_ptr.at(row + 1);
+    auto it = std::lower_bound(begin, end, col);
+    return it != end && *it == col ? values[it - col_idx.begin()] : 0.;
+  }
+
+  // y = A x
+  void multiply(const double* x, double* y, int nthreads=1) const {
+    parallel_for_chunks(n, nthreads, [&](size_t begin, size_t end, int) {
+      for (size_t i = begin; i != end; ++i) {
+        double sum = 0.;
+        for (int k = row_ptr[i]; k != row_ptr[i+1]; ++k)
+          sum += values[k] * x[col_idx[k]];
+        y[i] = sum;
+      }
+    });
+  }
+};
+
+// Collects elements of a symmetric matrix, in which each off-diagonal element
+// is given once, either as (i,j) or as (j,i), like am from GeomTarget and LL
+// (with indices from get_am_col_row()). Repeated elements are summed,
+// so normal matrices from different targets can be added together.
+struct SymmetricMatrixBuilder {
+  struct Entry {
+    int row, col;
+    double value;
+  };
+  int n;
+  std::vector<Entry> entries;
+
+  explicit SymmetricMatrixBuilder(int n_) : n(n_) {}
+
+  void add(const double* values, const int* rows, const int* cols, size_t len,
+           double weight=1.) {
+    entries.reserve(entries.size() + len);
+    for (size_t i = 0; i != len; ++i) {
+      if (rows[i] < 0 || rows[i] >= n || cols[i] < 0 || cols[i] >= n)
+        fail("SymmetricMatrixBuilder: index out of range");
+      if (values[i] != 0.)
+        entries.push_back({rows[i], cols[i], weight * values[i]});
+    }
+  }
+
+  // T is GeomTarget (am is then target.am) or LL (am from fisher_diag_from_table())
+  template<typename T>
+  void add_am(const T& t, const std::vector<double>& am, double weight=1.) {
+    std::vector<int> rows(am.size()), cols(am.size());
+    t.get_am_col_row(rows.data(), cols.data());
+    add(am.data(), rows.data(), cols.data(), am.size(), weight);
+  }
+
+  SparseMatrixCSR to_csr(int nthreads=1) const {
+    SparseMatrixCSR m;
+    m.n = n;
+    std::vector<size_t> count(n + 1, 0);
+    for (const Entry& e : entries) {
+      ++count[e.row + 1];
+      if (e.row != e.col)
+        ++count[e.col + 1];
+    }
+    for (int i = 0; i < n; ++i)
+      count[i+1] += count[i];
+    if (count[n] > (size_t) INT_MAX)
+      fail("SymmetricMatrixBuilder: too many elements for CSR with int indices");
+    std::vector<std::pair<int, double>> tmp(count[n]);
+    std::vector<size_t> pos(count.begin(), count.end() - 1);
+    for (const Entry& e : entries) {
+      tmp[pos[e.row]++] = {e.col, e.value};
+      if (e.row != e.col)
+        tmp[pos[e.col]++] = {e.row, e.value};
+    }
+    // sort each row by column and sum repeated elements, in place
+    std::vector<int> row_len(n);
+    parallel_for_chunks(n, nthreads, [&](size_t begin, size_t end, int) {
+      auto less = [](const std::pair<int, double>& a, const std::pair<int, double>& b) {
+        return a.first < b.first;
+      };
+      for (size_t i = begin; i != end; ++i) {
+        auto first = tmp.begin() + count[i];
+        auto last = tmp.begin() + count[i+1];
+        std::stable_sort(first, last, less);
+        auto out = first;
+        for (auto it = first; it != last; ++it) {
+          if (out != first && (out - 1)->first == it->first)
+            (out - 1)->second += it->second;
+          else
+            *out++ = *it;
+        }
+        row_len[i] = int(out - first);
+      }
+    });
+    m.row_ptr.resize(n + 1);
+    m.row_ptr[0] = 0;
+    for (int i = 0; i < n; ++i)
+      m.row_ptr[i+1] = m.row_ptr[i] + row_len[i];
+    m.col_idx.resize(m.row_ptr[n]);
+    m.values.resize(m.row_ptr[n]);
+    for (int i = 0; i < n; ++i)
+      for (int k = 0; k < row_len[i]; ++k) {
+        const std::pair<int, double>& p = tmp[count[i] + k];
+        m.col_idx[m.row_ptr[i] + k] = p.first;
+        m.values[m.row_ptr[i] + k] = p.second;
+      }
+    return m;
+  }
+};
+
+// Block-Jacobi preconditioner: inverses of 3x3 diagonal blocks of the first
+// n3 rows (positional parameters, x, y, z of each atom) and of diagonal
+// elements in the remaining rows. Eigenvalues (or diagonal elements)
+// with absolute value below cutoff are ignored, as in eigen_decomp_inv().
+struct BlockJacobi {
+  int n = 0;
+  int n3 = 0;
+  std::vector<Mat33> blocks;
+  std::vector<double> diag_inv;
+
+  BlockJacobi(const SparseMatrixCSR& a, int n3_, double cutoff) : n(a.n), n3(n3_) {
+    if (n3 < 0 || n3 % 3 != 0 || n3 > n)
+      fail("BlockJacobi: n3 must be a multiple of 3, not larger than n");
+    auto inv = [&](double v) { return std::abs(v) < cutoff ? 0. : 1. / v; };
+    blocks.resize(n3 / 3);
+    for (int j = 0; j < n3 / 3; ++j) {
+      const int i = 3 * j;
+      SMat33<double> m{a.at(i, i), a.at(i+1, i+1), a.at(i+2, i+2),
+                       a.at(i, i+1), a.at(i, i+2), a.at(i+1, i+2)};
+      const auto eig = m.calculate_eigenvalues();
+      if (m.u12 == 0 && m.u13 == 0 && m.u23 == 0)
+        // eigenvectors are not calculated reliably for repeated eigenvalues
+        blocks[j] = Mat33(inv(m.u11), 0, 0, 0, inv(m.u22), 0, 0, 0, inv(m.u33));
+      else if (std::min(std::min(std::abs(eig[0]), std::abs(eig[1])), std::abs(eig[2])) >= cutoff)
+        blocks[j] = m.inverse().as_mat33();
+      else
+        blocks[j] = eigen_decomp_inv(m, cutoff, false);
+    }
+    diag_inv.resize(n - n3);
+    for (int i = n3; i < n; ++i)
+      diag_inv[i - n3] = inv(a.at(i, i));
+  }
+
+  // z = M^-1 r
+  void apply(const double* r, double* z) const {
+    for (size_t j = 0; j < blocks.size(); ++j) {
+      const Vec3 v = blocks[j].multiply(Vec3(r[3*j], r[3*j+1], r[3*j+2]));
+      z[3*j] = v.x;
+      z[3*j+1] = v.y;
+      z[3*j+2] = v.z;
+    }
+    for (size_t i = 0; i < diag_inv.size(); ++i)
+      z[n3 + i] = diag_inv[i] * r[n3 + i];
+  }
+};
+
+namespace impl {
+// Calls func(begin, end) for fixed-size blocks of [0, n), in parallel,
+// and returns the sum of returned values, added in the order of blocks.
+template<typename Func>
+double sum_in_blocks(size_t n, int nthreads, std::vector<double>& partial, Func func) {
+  const size_t block = 4096;
+  partial.resize((n + block - 1) / block);
+  parallel_for_chunks(partial.size(), nthreads, [&](size_t b0, size_t b1, int) {
+    for (size_t k = b0; k != b1; ++k)
+      partial[k] = func(k * block, std::min(n, (k + 1) * block));
+  });
+  double sum = 0.;
+  for (double d : partial)
+    sum += d;
+  return sum;
+}
+} // namespace impl
+
+// Solves A x = b with the preconditioned conjugate gradient method,
+// starting from x (or from zero if x has a different size).
+// Stops when |b - A x| <= tol * |b| or after max_iter iterations.
+// Returns the number of iterations. Dot products are summed in fixed blocks,
+// so the result doesn't depend on nthreads.
+inline int solve_pcg(const SparseMatrixCSR& a, const BlockJacobi& precond,
+                     const std::vector<double>& b, std::vector<double>& x,
+                     int max_iter, double tol, int nthreads=1) {
+  const size_t n = a.n;
+  if (b.size() != n || precond.n != a.n)
+    fail("solve_pcg: sizes of matrix, vector and preconditioner differ");
+  if (x.size() != n)
+    x.assign(n, 0.);
+  // starting threads is not worth it for small vectors
+  const int nt = n < 20000 ? 1 : nthreads;
+  std::vector<double> r(n), z(n), p(n), ap(n), partial;
+  auto dot = [&](const std::vector<double>& u, const std::vector<double>& v) {
+    return impl::sum_in_blocks(n, nt, partial, [&](size_t begin, size_t end) {
+      double sum = 0.;
+      for (size_t i = begin; i != end; ++i)
+        sum += u[i] * v[i];
+      return sum;
+    });
+  };
+  a.multiply(x.data(), ap.data(), nt);
+  for (size_t i = 0; i != n; ++i)
+    r[i] = b[i] - ap[i];
+  const double tol_sq = sq(tol) * dot(b, b);
+  double rr = dot(r, r);
+  precond.apply(r.data(), z.data());
+  p = z;
+  double rz = dot(r, z);
+  int iter = 0;
+  while (iter < max_iter && rr > tol_sq && rz != 0.) {
+    a.multiply(p.data(), ap.data(), nt);
+    const double pap = dot(p, ap);
+    if (!(pap > 0.))  // A is not positive definite
+      break;
+    const double alpha = rz / pap;
+    rr = impl::sum_in_blocks(n, nt, partial, [&](size_t begin, size_t end) {
+      double sum = 0.;
+      for (size_t i = begin; i != end; ++i) {
+        x[i] += alpha * p[i];
+        r[i] -= alpha * ap[i];
+        sum += r[i] * r[i];
+      }
+      return sum;
+    });
+    ++iter;
+    if (rr <= tol_sq)
+      break;
+    precond.apply(r.data(), z.data());
+    const double rz_new = dot(r, z);
+    const double beta = rz_new / rz;
+    rz = rz_new;
+    impl::sum_in_blocks(n, nt, partial, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i != end; ++i)
+        p[i] = z[i] + beta * p[i];
+      return 0.;
+    });
+  }
+  return iter;
+}
+
+} // namespace gemmi
+#endif
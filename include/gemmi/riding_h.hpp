@@ -11,7 +11,60 @@
 namespace gemmi {
 
 void add_hydrogens_without_positions(Topo::ResInfo& ri);
-void place_hydrogens_on_all_atoms(Topo& topo);
+// Chains can be processed in parallel; the result doesn't depend on nthreads.
+void place_hydrogens_on_all_atoms(Topo& topo, int nthreads=1);
+
+// Placement of riding hydrogens compiled from Topo, for placing hydrogens
+// repeatedly in models with the same atoms (NMR ensembles, MD snapshots).
+// Restraints are looked up only once, in compile_hydrogen_recipe().
+// Atoms are referred to by index in the model (in the order of chains,
+// residues and atoms).
+struct HydrogenRecipe {
+  // How to place hydrogens bonded to one (parent) atom.
+  // Meaning of values[] depends on kind:
+  //  NoHeavy:    angles H1-X-H0, H2-X-H0, H2-X-H1 (in radians)
+  //  OneHeavy:   angle H0-X-A0, torsion angle (if tau_end != -1)
+  //  Planar:     angles H0-X-A0, H0-X-A1
+  //  TwoHeavy:   angles H0-X-A0, H0-X-A1, A0-X-A1, half of H0-X-H1
+  //  ThreeHeavy: cosines of angles A0-X-H0, A1-X-H0, A2-X-H0
+  // where X is the parent atom, H - hydrogens, A - bonded heavy atoms.
+  struct Rule {
+    enum class Kind : unsigned char {
+      Unplaced, NoHeavy, Linear, OneHeavy, Planar, TwoHeavy, ThreeHeavy
+    };
+    Kind kind = Kind::Unplaced;
+    unsigned char n_h = 0;        // number of hydrogens
+    unsigned char zero_occ = 0;   // bit mask: H atoms that get occupancy 0
+    unsigned char dummy = 0;      // bit mask: H atoms that are not placed
+    unsigned char torsion_h = 0;  // OneHeavy: H with the torsion restraint
+    signed char chir_sign = 0;    // TwoHeavy: sign of chirality (0 if none)
+    int parent = -1;
+    int heavy[3] = {-1, -1, -1};
+    int h[4] = {-1, -1, -1, -1};
+    int tau_end = -1;             // OneHeavy: atom that defines torsion angle
+    int chir[4] = {-1, -1, -1, -1};  // TwoHeavy: atoms of chirality restraint
+    double dist[4] = {0., 0., 0., 0.};
+    double values[4] = {0., 0., 0., 0.};
+  };
+
+  size_t atom_count = 0;
+  std::vector<Rule> rules;
+
+  // Sets positions of hydrogens (and occ and calc_flag, as in
+  // place_hydrogens_on_all_atoms()) in a model with the same atoms
+  // as the one used in compile_hydrogen_recipe().
+  // Returns the number of atoms with hydrogens that could not be placed.
+  size_t apply(Model& model, int nthreads=1) const;
+
+  // The same, for coordinates in SoA layout: atom i in the k-th set
+  // is (x[j], y[j], z[j]), where j = k * atom_count + i.
+  // Only positions of hydrogens are changed.
+  size_t apply(double* x, double* y, double* z, size_t nsets=1,
+               int nthreads=1) const;
+};
+
+// Problems are reported through topo.err(), as in place_hydrogens_on_all_atoms().
+HydrogenRecipe compile_hydrogen_recipe(const Topo& topo, const Model& model);
 
 inline void adjust_hydrogen_distances(Topo& topo, Restraints::DistanceOf of,
                                       double default_scale=1.) {
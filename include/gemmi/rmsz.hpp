@@ -0,0 +1,166 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Validation of geometry (Z-scores of restraints from the monomer library),
+// as in gemmi rmsz, for one model or for many files processed in parallel.
+
+#ifndef GEMMI_RMSZ_HPP_
+#define GEMMI_RMSZ_HPP_
+
+#include <cmath>         // for sqrt
+#include <algorithm>     // for min
+#include <atomic>
+#include <future>        // for shared_future
+#include <map>
+#include <memory>        // for shared_ptr, unique_ptr
+#include <mutex>
+#include <string>
+#include <vector>
+#include "topo.hpp"      // for Topo
+#include "monlib.hpp"    // for MonLib, read_cif_func
+#include "parallel.hpp"  // for parallel_for_chunks, effective_thread_count
+
+namespace gemmi {
+
+struct GeometryStats {
+  struct RMS {
+    int n = 0;
+    double sum_sq = 0.;
+    void put(double x) { ++n; sum_sq += x * x; }
+    double get_value() const { return std::sqrt(sum_sq / n); }
+    void add(const RMS& o) { n += o.n; sum_sq += o.sum_sq; }
+  };
+  RMS d_bond;
+  RMS d_angle;
+  RMS d_torsion;
+  RMS d_plane;
+  RMS z_bond;
+  RMS z_angle;
+  RMS z_torsion;
+  RMS z_plane;
+  int wrong_chirality = 0;
+  int all_chiralities = 0;
+  int wrong_bond = 0;
+  int wrong_angle = 0;
+  int wrong_torsion = 0;
+  int wrong_plane = 0;
+
+  // for summing statistics over models or files
+  void add(const GeometryStats& o) {
+    d_bond.add(o.d_bond);
+    d_angle.add(o.d_angle);
+    d_torsion.add(o.d_torsion);
+    d_plane.add(o.d_plane);
+    z_bond.add(o.z_bond);
+    z_angle.add(o.z_angle);
+    z_torsion.add(o.z_torsion);
+    z_plane.add(o.z_plane);
+    wrong_chirality += o.wrong_chirality;
+    all_chiralities += o.all_chiralities;
+    wrong_bond += o.wrong_bond;
+    wrong_angle += o.wrong_angle;
+    wrong_torsion += o.wrong_torsion;
+    wrong_plane += o.wrong_plane;
+  }
+};
+
+// Restraints with |Z| above cutoff, one row per outlier, stored in columns.
+// Angles (ideal and value) are in degrees. For planes, there is one row
+// per atom that is too far from the plane; ideal is 0 and value is
+// the distance. For wrong chirality, ideal, value and z are NaN.
+struct GeometryOutliers {
+  std::vector<int> model;            // index of model in Structure::models
+  std::vector<Topo::RKind> kind;
+  std::vector<std::string> tag;      // chain and residue(s), or "link"
+  std::vector<std::string> restraint;  // Restraints::*::str()
+  std::vector<std::string> atom;     // atom name (planes only)
+  std::vector<double> ideal;
+  std::vector<double> value;
+  std::vector<double> z;
+
+  size_t size() const { return kind.size(); }
+  void clear() { *this = GeometryOutliers(); }
+};
+
+// Checks all restraints in topo, in the order of chains and residues,
+// with links before the residue that follows them and extra links at the end.
+// Outliers, if requested, are added with model index model_idx.
+GeometryStats check_geometry(const Topo& topo, double cutoff,
+                             GeometryOutliers* outliers=nullptr,
+                             int model_idx=0);
+
+// Checks geometry of many files. Definitions of monomers (and
+// mon_lib_list.cif and ener_lib.cif) are read once and shared between
+// threads. Memory use doesn't grow with the number of files: results for
+// each file are passed to a callback and then discarded.
+struct GeometryValidator {
+  struct Result {
+    size_t entry;          // index in paths
+    std::string path;
+    std::string error;     // if not empty, the file was not (fully) checked
+    std::vector<std::string> model_names;
+    std::vector<GeometryStats> stats;  // one per model
+    GeometryOutliers outliers;
+    std::string warnings;  // from Topo
+  };
+
+  double cutoff = 2.0;
+  CoorFormat format = CoorFormat::Unknown;
+  // When more monomer files are read, the cache of monomer definitions
+  // is cleared (monomers from thousands of PDB entries would take gigabytes).
+  size_t max_cached_monomers = 5000;
+
+  // If cache is given, it's used by one thread at a time.
+  GeometryValidator(const std::string& monomer_dir, read_cif_func read_cif,
+                    MonLibCache* cache=nullptr);
+
+  // Reads and checks one file. Errors are returned in Result::error.
+  Result validate(const std::string& path, size_t entry=0);
+
+  // Calls validate() for each path, in nthreads threads, and func(Result&)
+  // for each result, in order of completion (it's the input order if
+  // nthreads=1). Calls to func are serialized. If func throws, remaining
+  // files are skipped and the exception is re-thrown.
+  template<typename Func>
+  void run(const std::vector<std::string>& paths, int nthreads, Func func) {
+    std::atomic<size_t> next(0);
+    std::atomic<bool> stop(false);
+    std::mutex callback_mutex;
+    size_t nt = std::min(paths.size(), (size_t) effective_thread_count(nthreads));
+    // one "chunk" per thread; files are taken from a shared counter,
+    // because the time needed per file can differ by orders of magnitude
+    parallel_for_chunks(nt, (int) nt, [&](size_t, size_t, int) {
+      for (size_t i = next++; i < paths.size() && !stop; i = next++) {
+        Result result = validate(paths[i], i);
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        try {
+          func(result);
+        } catch (...) {
+          stop = true;
+          throw;
+        }
+      }
+    });
+  }
+
+private:
+  read_cif_func read_cif_;
+  MonLib base_;  // mon_lib_list.cif and ener_lib.cif
+  std::mutex mutex_;        // for the members below
+  std::mutex cache_mutex_;  // for base_.cache
+  // Content of monomer files, interpreted as by MonLib::read_monomer_doc().
+  // A file is read by the first thread that needs it, without holding
+  // the mutex; if reading fails, the future stores the exception.
+  std::map<std::string, std::shared_future<std::shared_ptr<const MonLib>>> monomer_files_;
+  // Copies of base_ not used at the moment, with monomers added previously.
+  // Links and modifications from outside of base_ are removed after use.
+  std::vector<std::unique_ptr<MonLib>> idle_monlibs_;
+
+  std::shared_ptr<const MonLib> get_monomer_file(const std::string& name);
+  std::shared_ptr<const MonLib> read_monomer_file(const std::string& name);
+  bool add_monomers(MonLib& monlib, const std::vector<std::string>& resnames,
+                    std::string& error, std::vector<std::string>& extra);
+  void restore_base(MonLib& monlib, const std::vector<std::string>& extra) const;
+};
+
+} // namespace gemmi
+#endif
@@ -176,8 +176,39 @@ struct Scaling {
                       const AsuData<std::complex<Real>>& mask_data) {
     if (use_solvent && mask_data.size() != calc.size())
       fail("prepare_points(): mask data not prepared");
-    std::complex<Real> fmask;
     points.reserve(std::min(calc.size(), obs.size()));
+    auto add_point = [&](const HklValue<ValueSigma<Real>>& o, size_t c_idx) {
+      const HklValue<std::complex<Real>>& c = calc.v[c_idx];
+      std::complex<Real> fmask;
+      if (use_solvent) {
+        const HklValue<std::complex<Real>>& m = mask_data.v[c_idx];
+        if (m.hkl != c.hkl)
+          fail("prepare_points(): unexpected data");
+        fmask = m.value;
+      }
+      double stol2 = cell.calculate_stol_sq(o.hkl);
+      if (!std::isnan(o.value.value) && !std::isnan(o.value.sigma))
+        points.push_back({o.hkl, stol2, c.value, fmask, o.value.value, o.value.sigma});
+    };
+    if (calc.v.empty())
+      return;
+    auto packable = [](const HklValue<std::complex<Real>>& x) {
+      return can_pack_miller(x.hkl);
+    };
+    if (!std::is_sorted(calc.v.begin(), calc.v.end()) ||
+        !std::is_sorted(obs.v.begin(), obs.v.end())) {
+      if (std::all_of(calc.v.begin(), calc.v.end(), packable)) {
+        // unsorted data: look up calc by hash map
+        MillerKeyMap<size_t> calc_index(calc.size());
+        for (size_t i = 0; i != calc.v.size(); ++i)
+          calc_index.insert(pack_miller(calc.v[i].hkl), i);
+        for (const HklValue<ValueSigma<Real>>& o : obs.v)
+          if (can_pack_miller(o.hkl))
+            if (const size_t* idx = calc_index.find(pack_miller(o.hkl)))
+              add_point(o, *idx);
+        return;
+      }
+    }
     auto c = calc.v.begin();
     for (const HklValue<ValueSigma<Real>>& o : obs.v) {
       if (c->hkl != o.hkl) {
@@ -189,15 +220,7 @@ struct Scaling {
         if (c->hkl != o.hkl)
           continue;
       }
-      if (use_solvent) {
-        const HklValue<std::complex<Real>>& m = mask_data.v[c - calc.v.begin()];
-        if (m.hkl != c->hkl)
-          fail("prepare_points(): unexpected data");
-        fmask = m.value;
-      }
-      double stol2 = cell.calculate_stol_sq(o.hkl);
-      if (!std::isnan(o.value.value) && !std::isnan(o.value.sigma))
-        points.push_back({o.hkl, stol2, c->value, fmask, o.value.value, o.value.sigma});
+      add_point(o, c - calc.v.begin());
       ++c;
       if (c == calc.v.end())
         break;
@@ -243,8 +266,9 @@ struct Scaling {
     set_b_overall({b_iso, b_iso, b_iso, 0, 0, 0});
   }
 
-  void fit_parameters() {
+  void fit_parameters(int nthreads=1) {
     LevMar levmar;
+    levmar.nthreads = nthreads;
     levmar.fit(*this);
   }
 
@@ -6,14 +6,19 @@
 // cf. Bourhis et al (2014) https://doi.org/10.1107/S2053273314022207,
 // because direct calculations are not used in MX if performance is important.
 // For FFT-based calculations see dencalc.hpp + fourier.hpp.
+// Calculation for many reflections at once (calculate_sf_batch) is faster:
+// atoms are stored as structure of arrays, symmetry operations are applied
+// to hkl rather than to atoms, and reflections are split between threads.
 
 #ifndef GEMMI_SFCALC_HPP_
 #define GEMMI_SFCALC_HPP_
 
 #include <complex>
-#include "addends.hpp" // for Addends
-#include "model.hpp"   // for Structure, ...
-#include "small.hpp"   // for SmallStructure
+#include <vector>
+#include "addends.hpp"  // for Addends
+#include "model.hpp"    // for Structure, ...
+#include "parallel.hpp" // for parallel_for_chunks
+#include "small.hpp"    // for SmallStructure
 
 namespace gemmi {
 
@@ -24,6 +29,76 @@ inline std::complex<double> calculate_sf_part(const Fractional& fpos,
   return std::complex<double>{std::cos(arg), std::sin(arg)};
 }
 
+// sin(2 pi t) and cos(2 pi t). Branch-free and without calls to libm,
+// so that loops calling it can be vectorized by the compiler.
+// The argument is reduced to [-1/8, 1/8] cycle (by rounding with the
+// 1.5*2^52 trick, valid for |t| < 2^49) and the polynomials are the same
+// as in fdlibm's __kernel_sin and __kernel_cos.
+inline void sincos_2pi(double t, double* s, double* c) {
+  const double magic = 6755399441055744.0;  // 1.5 * 2^52
+  double q = (4 * t + magic) - magic;   // round(4t)
+  double x = 2 * pi() * (t - 0.25 * q);
+  double d = q - 4 * ((0.25 * q + magic) - magic);  // quadrant: -2...2
+  double z = x * x;
+  double sin_x = x + x * z * (-1.66666666666666324348e-01 +
+                 z * (8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 +
+                 z * (2.75573137070700676789e-06 + z * (-2.50507602534068634195e-08 +
+                 z * 1.58969099521155010221e-10)))));
+  double cos_x = 1 - 0.5 * z + z * z * (4.16666666666666019037e-02 +
+                 z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05 +
+                 z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 +
+                 z * -1.13596475577881948265e-11)))));
+  bool odd = d == 1 || d == -1;
+  bool half = d == 2 || d == -2;
+  double s_ = odd ? cos_x : sin_x;
+  double c_ = odd ? sin_x : cos_x;
+  *s = (d == -1 || half) ? -s_ : s_;
+  *c = (d == 1 || half) ? -c_ : c_;
+}
+
+// Atoms prepared for direct summation over many reflections.
+// Isotropic atoms (usually all or most of them) are stored as arrays.
+struct DirectSumAtoms {
+  std::vector<Element> elements;  // distinct elements, indexed by elem
+  // isotropic atoms
+  std::vector<double> x, y, z;    // fractional coordinates
+  std::vector<double> occ;
+  std::vector<double> b_iso;
+  std::vector<int> elem;
+  // anisotropic atoms
+  struct Aniso {
+    Fractional fract;
+    double occ;
+    SMat33<double> u;  // DWF = exp(-2 pi^2 h^T u h)
+    int elem;
+  };
+  std::vector<Aniso> aniso;
+
+  size_t size() const { return x.size() + aniso.size(); }
+
+  int element_index(Element el) {
+    for (size_t i = 0; i != elements.size(); ++i)
+      if (elements[i] == el)
+        return (int) i;
+    elements.push_back(el);
+    return (int) elements.size() - 1;
+  }
+
+  void add_iso(const Fractional& fract, double occupancy, double b, Element el) {
+    x.push_back(fract.x);
+    y.push_back(fract.y);
+    z.push_back(fract.z);
+    occ.push_back(occupancy);
+    b_iso.push_back(b);
+    elem.push_back(element_index(el));
+  }
+
+  void add_aniso(const Fractional& fract, double occupancy,
+                 const SMat33<double>& u, Element el) {
+    aniso.push_back({fract, occupancy, u, element_index(el)});
+  }
+};
+
 template <typename Table>
 class StructureFactorCalculator {
 public:
@@ -118,6 +193,9 @@ public:
   double mott_bethe_factor() const {
     return -mott_bethe_const() / 4 / stol2_;
   }
+  double mott_bethe_factor(const Miller& hkl) const {
+    return -mott_bethe_const() / 4 / cell_.calculate_stol_sq(hkl);
+  }
 
   // The occupancy is assumed to take into account symmetry,
   // i.e. to be fractional if the atom is on special position.
@@ -130,10 +208,132 @@ public:
     return sf;
   }
 
+  DirectSumAtoms prepare_atoms(const Model& model) const {
+    DirectSumAtoms atoms;
+    for (const Chain& chain : model.chains)
+      for (const Residue& res : chain.residues)
+        for (const Atom& atom : res.atoms) {
+          check_table(atom.element);
+          Fractional fract = cell_.fractionalize(atom.pos);
+          if (!atom.aniso.nonzero())
+            atoms.add_iso(fract, atom.occ, atom.b_iso, atom.element);
+          else
+            atoms.add_aniso(fract, atom.occ,
+                            atom.aniso.transformed_by<>(cell_.frac.mat),
+                            atom.element);
+        }
+    return atoms;
+  }
+
+  DirectSumAtoms prepare_atoms(const SmallStructure& small) const {
+    DirectSumAtoms atoms;
+    for (const SmallStructure::Site& site : small.sites) {
+      check_table(site.element);
+      if (!site.aniso.nonzero()) {
+        atoms.add_iso(site.fract, site.occ, u_to_b() * site.u_iso, site.element);
+      } else {
+        const SMat33<double>& u = site.aniso;
+        double r[3] = {cell_.ar, cell_.br, cell_.cr};
+        SMat33<double> u_hkl{u.u11 * r[0] * r[0], u.u22 * r[1] * r[1],
+                             u.u33 * r[2] * r[2], u.u12 * r[0] * r[1],
+                             u.u13 * r[0] * r[2], u.u23 * r[1] * r[2]};
+        atoms.add_aniso(site.fract, site.occ, u_hkl, site.element);
+      }
+    }
+    return atoms;
+  }
+
+  // Equivalent to calling calculate_sf_from_model() or
+  // calculate_sf_from_small_structure() for each hkl.
+  std::vector<std::complex<double>> calculate_sf_batch(const DirectSumAtoms& atoms,
+                                                       const std::vector<Miller>& hkls,
+                                                       int nthreads=1) const {
+    std::vector<std::complex<double>> result(hkls.size());
+    parallel_for_chunks(hkls.size(), effective_thread_count(nthreads),
+                        [&](size_t begin, size_t end, int) {
+      std::vector<double> work;
+      for (size_t i = begin; i != end; ++i)
+        result[i] = calculate_sf_direct(atoms, hkls[i], work);
+    });
+    return result;
+  }
+
+  // work is a buffer that is reused between calls
+  std::complex<double> calculate_sf_direct(const DirectSumAtoms& atoms,
+                                           const Miller& hkl,
+                                           std::vector<double>& work) const {
+    const double stol2 = cell_.calculate_stol_sq(hkl);
+    const size_t n = atoms.x.size();
+    const size_t n_elem = atoms.elements.size();
+    const size_t n_img = cell_.images.size() + 1;
+    work.resize(n_elem + 4 * n_img + 2 * n);
+    double* sf = work.data();
+    for (size_t i = 0; i != n_elem; ++i) {
+      Element el = atoms.elements[i];
+      sf[i] = Table::get(el.elem).calculate_sf(stol2) + addends.get(el);
+    }
+    // symmetry images applied to hkl: exp(2 pi i h (R x + t)),
+    // where h R is stored as (tx, ty, tz) and h t as shift
+    double* img = sf + n_elem;
+    Vec3 vhkl(hkl[0], hkl[1], hkl[2]);
+    for (size_t j = 0; j != n_img; ++j) {
+      Vec3 h = j == 0 ? vhkl : cell_.images[j-1].mat.left_multiply(vhkl);
+      img[4*j+0] = h.x;
+      img[4*j+1] = h.y;
+      img[4*j+2] = h.z;
+      img[4*j+3] = j == 0 ? 0. : vhkl.dot(cell_.images[j-1].vec);
+    }
+    // isotropic atoms: sum of cos and sin over images, in simple loops
+    double* c = img + 4 * n_img;
+    double* s = c + n;
+    const double* x = atoms.x.data();
+    const double* y = atoms.y.data();
+    const double* z = atoms.z.data();
+    for (size_t i = 0; i != n; ++i)
+      sincos_2pi(img[0] * x[i] + img[1] * y[i] + img[2] * z[i], &s[i], &c[i]);
+    for (size_t j = 1; j != n_img; ++j) {
+      const double* t = img + 4 * j;
+      for (size_t i = 0; i != n; ++i) {
+        double sin_, cos_;
+        sincos_2pi(t[0] * x[i] + t[1] * y[i] + t[2] * z[i] + t[3], &sin_, &cos_);
+        c[i] += cos_;
+        s[i] += sin_;
+      }
+    }
+    double re = 0, im = 0;
+    for (size_t i = 0; i != n; ++i) {
+      double w = atoms.occ[i] * sf[atoms.elem[i]] * std::exp(-stol2 * atoms.b_iso[i]);
+      re += w * c[i];
+      im += w * s[i];
+    }
+    // anisotropic atoms: DWF depends on the image
+    for (const DirectSumAtoms::Aniso& a : atoms.aniso) {
+      double sum_re = 0, sum_im = 0;
+      for (size_t j = 0; j != n_img; ++j) {
+        const double* t = img + 4 * j;
+        double sin_, cos_;
+        sincos_2pi(t[0] * a.fract.x + t[1] * a.fract.y + t[2] * a.fract.z + t[3],
+                   &sin_, &cos_);
+        double dwf = std::exp(-2 * pi() * pi() * a.u.r_u_r(Vec3(t[0], t[1], t[2])));
+        sum_re += dwf * cos_;
+        sum_im += dwf * sin_;
+      }
+      double w = a.occ * sf[a.elem];
+      re += w * sum_re;
+      im += w * sum_im;
+    }
+    return {re, im};
+  }
+
 private:
   const UnitCell& cell_;
   double stol2_;
   std::vector<double> scattering_factors_;
+
+  static void check_table(Element element) {
+    if (!Table::has(element.elem))
+      fail("Missing scattering factor for ", element.name());
+  }
 public:
   Addends addends;  // usually f' for X-rays
 };
@@ -28,6 +28,16 @@ struct Variance {
     mean_x += dx / n;
     sum_sq += dx * (x - mean_x);
   }
+  // combine with statistics of another set of points (Chan et al., 1979)
+  void add(const Variance& o) {
+    if (o.n == 0)
+      return;
+    int total = n + o.n;
+    double dx = o.mean_x - mean_x;
+    sum_sq += o.sum_sq + dx * dx * ((double) n * o.n / total);
+    mean_x += dx * o.n / total;
+    n = total;
+  }
   double for_sample() const { return sum_sq / (n - 1); }
   double for_population() const { return sum_sq / n; }
 };
@@ -61,6 +71,21 @@ struct Correlation {
     mean_x += dx / n;
     mean_y += dy / n;
   }
+  // combine with statistics of another set of points
+  void add(const Correlation& o) {
+    if (o.n == 0)
+      return;
+    int total = n + o.n;
+    double dx = o.mean_x - mean_x;
+    double dy = o.mean_y - mean_y;
+    double w = (double) n * o.n / total;
+    sum_xx += o.sum_xx + w * dx * dx;
+    sum_yy += o.sum_yy + w * dy * dy;
+    sum_xy += o.sum_xy + w * dx * dy;
+    mean_x += dx * o.n / total;
+    mean_y += dy * o.n / total;
+    n = total;
+  }
   double coefficient() const { return sum_xy / std::sqrt(sum_xx * sum_yy); }
   double x_variance() const { return sum_xx / n; }
   double y_variance() const { return sum_yy / n; }
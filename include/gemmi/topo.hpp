@@ -255,7 +255,9 @@ struct Topo {
   // This step stores pointers to gemmi::Atom's from model0,
   // so after this step don't add or remove atoms.
   // monlib is needed only for links.
-  void finalize_refmac_topology(const MonLib& monlib);
+  // Restraints of chains can be applied in parallel (nthreads > 1),
+  // the result is the same as with one thread.
+  void finalize_refmac_topology(const MonLib& monlib, int nthreads=1);
 
   Link* find_polymer_link(const AtomAddress& a1, const AtomAddress& a2) {
     for (ChainInfo& ci : chain_infos)
@@ -298,7 +300,8 @@ private:
 std::unique_ptr<Topo>
 prepare_topology(Structure& st, MonLib& monlib, size_t model_index,
                  HydrogenChange h_change, bool reorder,
-                 std::ostream* warnings=nullptr, bool ignore_unknown_links=false);
+                 std::ostream* warnings=nullptr, bool ignore_unknown_links=false,
+                 int nthreads=1);
 
 
 std::unique_ptr<ChemComp> make_chemcomp_with_restraints(const Residue& res);
@@ -5,10 +5,12 @@
 #ifndef GEMMI_XDS_ASCII_HPP_
 #define GEMMI_XDS_ASCII_HPP_
 
+#include <algorithm>     // for count
 #include "atof.hpp"      // for fast_from_chars
 #include "atox.hpp"      // for is_space
-#include "input.hpp"     // for copy_line_from_stream
-#include "fileutil.hpp"  // for file_open
+#include "input.hpp"     // for copy_line_from_stream, MemoryStream
+#include "fileutil.hpp"  // for file_open, read_into_buffer
+#include "parallel.hpp"  // for parallel_for_chunks
 #include "unitcell.hpp"  // for UnitCell
 #include "util.hpp"      // for starts_with
 
@@ -54,6 +56,7 @@ struct XdsAscii {
   };
   std::string source_path;
   bool has11;
+  int iset_col = 0;  // column with ISET (from !ITEM_ISET=), 0 if absent
   int spacegroup_number;
   UnitCell unit_cell;
   Mat33 cell_axes{0.};
@@ -86,16 +89,17 @@ struct XdsAscii {
   template<typename Stream>
   void read_stream(Stream&& stream, const std::string& source);
 
+  /// Reads the whole file from memory. Header lines are read as in
+  /// read_stream(), while data lines are parsed in parallel (nthreads
+  /// chunks) directly into preallocated data.
+  void read_buffer(const char* start, size_t size, const std::string& source,
+                   int nthreads=1);
+
   template<typename T>
-  inline void read_input(T&& input) {
-    if (input.is_stdin()) {
-      read_stream(FileStream{stdin}, "stdin");
-    } else if (input.is_compressed()) {
-      read_stream(input.get_uncompressing_stream(), input.path());
-    } else {
-      auto f = file_open(input.path().c_str(), "r");
-      read_stream(FileStream{f.get()}, input.path());
-    }
+  inline void read_input(T&& input, int nthreads=1) {
+    CharArray mem = read_into_buffer(input);
+    read_buffer(mem.data(), mem.size(), input.is_stdin() ? "stdin" : input.path(),
+                nthreads);
   }
 
   void gather_iset_statistics() {
@@ -177,6 +181,16 @@ struct XdsAscii {
 
   /// \par p is degree of polarization from range (0,1), as used in XDS.
   void apply_polarization_correction(double p, Vec3 normal);
+
+private:
+  // Reads the first line and then header and data lines; returns false
+  // if the stream ended before !END_OF_DATA.
+  template<typename Stream>
+  bool read_header_and_data(Stream& stream);
+  // Reads lines that follow the first line, see above.
+  template<typename Stream>
+  bool read_lines(Stream& stream);
+  void parse_data_line(const char* line, const char* end, Refl& r) const;
 };
 
 template<size_t N>
@@ -213,18 +227,30 @@ void parse_numbers_into_array(const char* start, const char* end,
 
 template<typename Stream>
 void XdsAscii::read_stream(Stream&& stream, const std::string& source) {
-  static const char* expected_columns[11] = {
-    "H=1", "K=2", "L=3", "IOBS=4", "SIGMA(IOBS)=5", "XD=6", "YD=7", "ZD=8",
-    "RLP=9", "PEAK=10", "CORR=11"
-  };
   source_path = source;
+  if (!read_header_and_data(stream))
+    fail("incorrect or unfinished file: " + source_path);
+}
+
+template<typename Stream>
+bool XdsAscii::read_header_and_data(Stream& stream) {
   has11 = true;
+  iset_col = 0;
   char line[256];
   size_t len0 = copy_line_from_stream(line, 255, stream);
-  int iset_col = 0;
   if (len0 == 0 || !(starts_with(line, "!FORMAT=XDS_ASCII    MERGE=FALSE") ||
                     (starts_with(line, "!OUTPUT_FILE=INTEGRATE.HKL"))))
     fail("not an unmerged XDS_ASCII nor INTEGRATE.HKL file: " + source_path);
+  return read_lines(stream);
+}
+
+template<typename Stream>
+bool XdsAscii::read_lines(Stream& stream) {
+  static const char* expected_columns[11] = {
+    "H=1", "K=2", "L=3", "IOBS=4", "SIGMA(IOBS)=5", "XD=6", "YD=7", "ZD=8",
+    "RLP=9", "PEAK=10", "CORR=11"
+  };
+  char line[256];
   const char* rhs;
   while (size_t len = copy_line_from_stream(line, 255, stream)) {
     if (line[0] == '!') {
@@ -327,37 +353,101 @@ void XdsAscii::read_stream(Stream&& stream, const std::string& source) {
         for (XdsAscii::Refl& refl : data)
           if (size_t(refl.iset - 1) >= isets.size())
             fail("unexpected ITEM_ISET " + std::to_string(refl.iset));
-        return;
+        return true;
       }
     } else {
       data.emplace_back();
-      XdsAscii::Refl& r = data.back();
-      const char* p = line;
-      for (int i = 0; i < 3; ++i)
-        r.hkl[i] = simple_atoi(p, &p);
-      auto result = fast_from_chars(p, line+len, r.iobs); // 4
-      result = fast_from_chars(result.ptr, line+len, r.sigma); // 5
-      result = fast_from_chars(result.ptr, line+len, r.xd); // 6
-      result = fast_from_chars(result.ptr, line+len, r.yd); // 7
-      result = fast_from_chars(result.ptr, line+len, r.zd); // 8
-      if (has11) {
-        result = fast_from_chars(result.ptr, line+len, r.rlp); // 9
-        result = fast_from_chars(result.ptr, line+len, r.peak); // 10
-        result = fast_from_chars(result.ptr, line+len, r.corr); // 11
-      } else {
-        r.rlp = r.peak = r.corr = 0;
-      }
-      if (result.ec != std::errc())
-        fail("failed to parse data line:\n", line);
-      if (iset_col > 10) {
-        const char* iset_ptr = result.ptr;
-        for (int j = 11; j < iset_col; ++j)
-          iset_ptr = skip_word(skip_blank(iset_ptr));
-        r.iset = simple_atoi(iset_ptr);
-      }
+      parse_data_line(line, line+len, data.back());
     }
   }
-  fail("incorrect or unfinished file: " + source_path);
+  return false;
+}
+
+inline void XdsAscii::parse_data_line(const char* line, const char* end, Refl& r) const {
+  const char* p = line;
+  for (int i = 0; i < 3; ++i)
+    r.hkl[i] = simple_atoi(p, &p);
+  auto result = fast_from_chars(p, end, r.iobs); // 4
+  result = fast_from_chars(result.ptr, end, r.sigma); // 5
+  result = fast_from_chars(result.ptr, end, r.xd); // 6
+  result = fast_from_chars(result.ptr, end, r.yd); // 7
+  result = fast_from_chars(result.ptr, end, r.zd); // 8
+  if (has11) {
+    result = fast_from_chars(result.ptr, end, r.rlp); // 9
+    result = fast_from_chars(result.ptr, end, r.peak); // 10
+    result = fast_from_chars(result.ptr, end, r.corr); // 11
+  } else {
+    r.rlp = r.peak = r.corr = 0;
+  }
+  if (result.ec != std::errc())
+    fail("failed to parse data line:\n", std::string(line, end));
+  r.iset = 1;
+  int ncol = has11 ? 11 : 8;
+  if (iset_col > ncol) {
+    const char* iset_ptr = result.ptr;
+    for (int j = ncol + 1; j < iset_col; ++j)
+      iset_ptr = skip_word(skip_blank(iset_ptr));
+    r.iset = simple_atoi(iset_ptr);
+  }
+}
+
+inline void XdsAscii::read_buffer(const char* start, size_t size,
+                                  const std::string& source, int nthreads) {
+  source_path = source;
+  const char* end = start + size;
+  auto next_line = [end](const char* ptr) {
+    const char* nl = (const char*) std::memchr(ptr, '\n', end - ptr);
+    return nl ? nl + 1 : end;
+  };
+  // header lines start with '!'
+  const char* data_start = start;
+  while (data_start != end && *data_start == '!')
+    data_start = next_line(data_start);
+  MemoryStream header(start, data_start - start);
+  if (read_header_and_data(header))  // no data lines
+    return;
+  // data lines are followed by !END_OF_DATA; '!' is not used in data lines
+  const char* data_end = data_start;
+  while (data_end != end && !(data_end[-1] == '\n' && *data_end == '!')) {
+    data_end = (const char*) std::memchr(data_end + 1, '!', end - data_end - 1);
+    if (!data_end)
+      data_end = end;
+  }
+  if (data_end == end)
+    fail("incorrect or unfinished file: " + source_path);
+
+  // Split data into chunks at line boundaries, count lines in each chunk,
+  // then parse lines in parallel directly into their places in data.
+  nthreads = effective_thread_count(nthreads);
+  size_t nbytes = data_end - data_start;
+  size_t nchunks = std::max<size_t>(1, std::min<size_t>(nthreads, nbytes / 4096));
+  std::vector<const char*> bounds(nchunks + 1, data_end);
+  bounds[0] = data_start;
+  for (size_t k = 1; k < nchunks; ++k)
+    bounds[k] = std::max(bounds[k-1], next_line(data_start + nbytes * k / nchunks));
+  std::vector<size_t> offsets(nchunks + 1, 0);
+  parallel_for_chunks(nchunks, nthreads, [&](size_t begin, size_t end_, int) {
+    for (size_t k = begin; k != end_; ++k)
+      offsets[k+1] = std::count(bounds[k], bounds[k+1], '\n');
+  });
+  for (size_t k = 0; k < nchunks; ++k)
+    offsets[k+1] += offsets[k];
+  size_t old_size = data.size();
+  data.resize(old_size + offsets[nchunks]);
+  parallel_for_chunks(nchunks, nthreads, [&](size_t begin, size_t end_, int) {
+    for (size_t k = begin; k != end_; ++k) {
+      Refl* r = &data[old_size + offsets[k]];
+      for (const char* line = bounds[k]; line != bounds[k+1]; ++r) {
+        const char* eol = (const char*) std::memchr(line, '\n', bounds[k+1] - line);
+        parse_data_line(line, eol, *r);
+        line = eol + 1;
+      }
+    }
+  });
+
+  MemoryStream tail(data_end, end - data_end);
+  if (!read_lines(tail))
+    fail("incorrect or unfinished file: " + source_path);
 }
 
 inline XdsAscii read_xds_ascii_file(const std::string& path) {
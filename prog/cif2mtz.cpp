@@ -6,8 +6,10 @@
 #include <cstdlib>            // for exit
 #include <iostream>           // for cerr
 #include <memory>             // for unique_ptr
-#include <gemmi/read_cif.hpp> // for read_cif_gz, read_first_block_gz
-#include <gemmi/cif2mtz.hpp>  // for CifToMtz
+#include <sstream>            // for ostringstream
+#include <gemmi/read_cif.hpp> // for read_first_block_into_buffer_gz
+#include <gemmi/cif2mtz.hpp>  // for CifToMtz, read_raw_refln_cif
+#include <gemmi/parallel.hpp> // for parallel_for_chunks
 
 #define GEMMI_PROG cif2mtz
 #include "options.h"
@@ -18,7 +20,8 @@ using std::fprintf;
 
 enum OptionIndex {
   BlockName=4, BlockNumber, Add, List, Dir, Spec, PrintSpec, Title,
-  History, Wavelength, Unmerged, Sort, SkipNegativeSigma, ZeroToMnf, Local
+  History, Wavelength, Unmerged, Sort, SkipNegativeSigma, ZeroToMnf, Local,
+  Threads
 };
 
 const option::Descriptor Usage[] = {
@@ -61,6 +64,9 @@ const option::Descriptor Usage[] = {
   { Local, 0, "", "local", Arg::None,
     "  --local  \tTake file from local copy of the PDB archive in "
     "$PDB_DIR/structures/divided/structure_factors/" },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of blocks converted in parallel with --dir"
+    " (default: 1)." },
   { NoOp, 0, "", "", Arg::None,
     "\nFirst variant: converts the first block of CIF_FILE, or the block"
     "\nspecified with --block=NAME, to MTZ file with given name."
@@ -99,11 +105,12 @@ void zero_to_mnf(gemmi::Mtz& mtz) {
   }
 }
 
-void print_block_info(gemmi::ReflnBlock& rb, const gemmi::Mtz& mtz) {
+void print_block_info(gemmi::ReflnBlock& rb, const gemmi::Mtz& mtz,
+                      const gemmi::RawReflnCif& cif) {
   std::printf("--block=%s - %.*s %zu x %zu ->",
               rb.block.name.c_str(), (int)rb.tag_offset() - 1,
               rb.default_loop->tags.at(0).c_str(),
-              rb.default_loop->width(), rb.default_loop->length());
+              rb.default_loop->width(), cif.loop_length(*rb.default_loop));
   for (const gemmi::Mtz::Column& col : mtz.columns)
     std::printf(" %s", col.label.c_str());
   std::putchar('\n');
@@ -187,35 +194,56 @@ int GEMMI_MAIN(int argc, char **argv) {
     }
     if (cif2mtz.verbose)
       fprintf(stderr, "Reading %s ...\n", cif_path.c_str());
-    // If the file is gzipped and huge, reading it will result in error,
-    // but if we are interested only in the first block we can recover.
-    gemmi::cif::Document doc;
-    // this limit is used only for when reading first block from gzipped file
-    constexpr int block_limit = 1073741824;  // 1GB, used only for gz files
-    if (convert_all || p.options[BlockName] || p.options[BlockNumber])
-      doc = gemmi::read_cif_gz(cif_path);
-    else  // optimization: ignore other blocks
-      doc = gemmi::read_first_block_gz(cif_path, block_limit);
-    auto rblocks = gemmi::as_refln_blocks(std::move(doc.blocks));
+    // optimization: if only the first block is used, ignore other blocks
+    bool first_block_only = !convert_all && !p.options[BlockName] &&
+                            !p.options[BlockNumber];
+    gemmi::RawReflnCif cif = gemmi::read_raw_refln_cif(
+        first_block_only ? gemmi::read_first_block_into_buffer_gz(cif_path)
+                         : gemmi::read_into_buffer_gz(cif_path),
+        cif_path);
+    std::vector<gemmi::ReflnBlock>& rblocks = cif.rblocks;
     if (convert_all) {
       bool ok = true;
-      for (gemmi::ReflnBlock& rb : rblocks) {
-        try {
-          gemmi::Mtz mtz = cif2mtz.convert_block_to_mtz(rb, std::cerr);
-          if (p.options[List]) {
-            print_block_info(rb, mtz);
-            continue;
+      if (p.options[List]) {
+        for (gemmi::ReflnBlock& rb : rblocks) {
+          try {
+            gemmi::Mtz mtz = cif2mtz.convert_block_to_mtz(rb, std::cerr, &cif);
+            print_block_info(rb, mtz, cif);
+          } catch (std::exception& e) {
+            fprintf(stderr, "ERROR: %s\n", e.what());
+            ok = false;
           }
-          std::string path = p.options[Dir].arg;
-          path += '/';
-          path += rb.block.name;
-          path += ".mtz";
-          if (cif2mtz.verbose)
-            fprintf(stderr, "Writing %s ...\n", path.c_str());
-          mtz.write_to_file(path);
-        } catch (std::exception& e) {
-          fprintf(stderr, "ERROR: %s\n", e.what());
-          ok = false;
+        }
+      } else {
+        // Blocks are converted in parallel. Messages are collected
+        // and printed in the order of blocks.
+        int nthreads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
+        std::vector<std::string> messages(rblocks.size());
+        std::vector<char> failed(rblocks.size(), 0);
+        gemmi::parallel_for_chunks(rblocks.size(), nthreads,
+                                   [&](size_t begin, size_t end, int) {
+          for (size_t i = begin; i != end; ++i) {
+            const gemmi::ReflnBlock& rb = rblocks[i];
+            std::ostringstream out;
+            try {
+              std::string path = p.options[Dir].arg;
+              path += '/';
+              path += rb.block.name;
+              path += ".mtz";
+              if (cif2mtz.verbose)
+                out << "Writing " << path << " ...\n";
+              cif2mtz.write_block_to_mtz_file(rb, path, out, &cif);
+            } catch (std::exception& e) {
+              out << "ERROR: " << e.what() << '\n';
+              failed[i] = 1;
+            }
+            messages[i] = out.str();
+          }
+        });
+        for (size_t i = 0; i != rblocks.size(); ++i) {
+          std::cerr << messages[i];
+          if (failed[i])
+            ok = false;
         }
       }
       if (!ok)
@@ -233,47 +261,56 @@ int GEMMI_MAIN(int argc, char **argv) {
       } else {
         rb = &rblocks.at(0);
       }
-      gemmi::Mtz mtz = cif2mtz.convert_block_to_mtz(*rb, std::cerr);
-      for (const option::Option* opt = p.options[Add]; opt; opt = opt->next()) {
+      // without post-processing, write the file without keeping data in memory
+      if (!p.options[Add] && !p.options[SkipNegativeSigma] &&
+          !p.options[ZeroToMnf] && !p.options[Sort]) {
         if (cif2mtz.verbose)
-          fprintf(stderr, "Reading %s ...\n", opt->arg);
-        auto rblocks2 = gemmi::as_refln_blocks(
-                          gemmi::read_first_block_gz(opt->arg, block_limit).blocks);
-        gemmi::Mtz mtz2 = cif2mtz.convert_block_to_mtz(rblocks2.at(0), std::cerr);
-        size_t ncol = mtz.columns.size();
-        size_t ncol2 = mtz2.columns.size();
-        if (ncol2 < 4)
-          continue;
-        mtz.copy_column(-1, mtz2.columns[3], std::vector<std::string>(ncol2-4));
-        // avoid the same names: remove or rename
-        for (size_t i = ncol; i < mtz.columns.size(); ++i) {
-          gemmi::Mtz::Column& col = mtz.columns[i];
-          for (size_t j = 3; j < ncol; ++j)
-            if (col.label == mtz.columns[j].label &&
-                col.dataset_id == mtz.columns[j].dataset_id) {
-              if (is_column_data_identical(mtz, i, j))
-                mtz.remove_column(i--);
-              else
-                change_label_to_unique(col);
-              break;
-            }
+          fprintf(stderr, "Writing %s ...\n", mtz_path);
+        cif2mtz.write_block_to_mtz_file(*rb, mtz_path, std::cerr, &cif);
+      } else {
+        gemmi::Mtz mtz = cif2mtz.convert_block_to_mtz(*rb, std::cerr, &cif);
+        for (const option::Option* opt = p.options[Add]; opt; opt = opt->next()) {
+          if (cif2mtz.verbose)
+            fprintf(stderr, "Reading %s ...\n", opt->arg);
+          gemmi::RawReflnCif cif2 = gemmi::read_raw_refln_cif(
+                            gemmi::read_first_block_into_buffer_gz(opt->arg), opt->arg);
+          gemmi::Mtz mtz2 = cif2mtz.convert_block_to_mtz(cif2.rblocks.at(0), std::cerr,
+                                                         &cif2);
+          size_t ncol = mtz.columns.size();
+          size_t ncol2 = mtz2.columns.size();
+          if (ncol2 < 4)
+            continue;
+          mtz.copy_column(-1, mtz2.columns[3], std::vector<std::string>(ncol2-4));
+          // avoid the same names: remove or rename
+          for (size_t i = ncol; i < mtz.columns.size(); ++i) {
+            gemmi::Mtz::Column& col = mtz.columns[i];
+            for (size_t j = 3; j < ncol; ++j)
+              if (col.label == mtz.columns[j].label &&
+                  col.dataset_id == mtz.columns[j].dataset_id) {
+                if (is_column_data_identical(mtz, i, j))
+                  mtz.remove_column(i--);
+                else
+                  change_label_to_unique(col);
+                break;
+              }
+          }
+        }
+        if (p.options[SkipNegativeSigma]) {
+          for (const gemmi::Mtz::Column& col : mtz.columns)
+            if (col.type == 'Q')  // typically, we'll find one Q column here
+              mtz.remove_rows_if([&](const float* row) { return row[col.idx] < 0; });
+        }
+        if (p.options[ZeroToMnf])
+          zero_to_mnf(mtz);
+        if (p.options[Sort]) {
+          bool reordered = mtz.sort();
+          if (cif2mtz.verbose)
+            fprintf(stderr, "Reflection order has %schanged.\n", reordered ? "" : "not ");
         }
-      }
-      if (p.options[SkipNegativeSigma]) {
-        for (const gemmi::Mtz::Column& col : mtz.columns)
-          if (col.type == 'Q')  // typically, we'll find one Q column here
-            mtz.remove_rows_if([&](const float* row) { return row[col.idx] < 0; });
-      }
-      if (p.options[ZeroToMnf])
-        zero_to_mnf(mtz);
-      if (p.options[Sort]) {
-        bool reordered = mtz.sort();
         if (cif2mtz.verbose)
-          fprintf(stderr, "Reflection order has %schanged.\n", reordered ? "" : "not ");
+          fprintf(stderr, "Writing %s ...\n", mtz_path);
+        mtz.write_to_file(mtz_path);
       }
-      if (cif2mtz.verbose)
-        fprintf(stderr, "Writing %s ...\n", mtz_path);
-      mtz.write_to_file(mtz_path);
     }
   } catch (std::exception& e) {
     fprintf(stderr, "ERROR: %s\n", e.what());
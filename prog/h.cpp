@@ -10,6 +10,7 @@
 #include <gemmi/to_mmcif.hpp>  // for make_mmcif_document
 #include <gemmi/to_pdb.hpp>    // for write_pdb
 #include <gemmi/monlib.hpp>    // for MonLib, read_monomer_lib
+#include <gemmi/monlib_cache.hpp> // for MonLibCache
 #include <gemmi/topo.hpp>      // for Topo
 #include <gemmi/fstream.hpp>   // for Ofstream
 #include <gemmi/riding_h.hpp>  // for prepare_topology
@@ -23,7 +24,8 @@ namespace cif = gemmi::cif;
 
 namespace {
 
-enum OptionIndex { Monomers=4, FormatIn, RemoveH, KeepH, Water, Sort };
+enum OptionIndex { Monomers=4, MonCache, FormatIn, RemoveH, KeepH, Water, Sort,
+                   Threads };
 
 const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -38,6 +40,8 @@ const option::Descriptor Usage[] = {
   CommonUsage[Verbose],
   { Monomers, 0, "", "monomers", Arg::Required,
     "  --monomers=DIR  \tMonomer library dir (default: $CLIBD_MON)." },
+  { MonCache, 0, "", "moncache", Arg::Required,
+    "  --moncache=FILE  \tCache of the monomer library (from gemmi moncache)." },
   { FormatIn, 0, "", "format", Arg::CoorFormat,
     "  --format=FORMAT  \tInput format (default: from the file extension)." },
   { RemoveH, 0, "", "remove", Arg::None,
@@ -48,6 +52,8 @@ const option::Descriptor Usage[] = {
     "  --water  \tAdd hydrogens also to waters." },
   { Sort, 0, "", "sort", Arg::None,
     "  --sort  \tOrder atoms in residues according to _chem_comp_atom." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -113,12 +119,18 @@ int GEMMI_MAIN(int argc, char **argv) {
       if (p.options[Verbose])
         std::printf("Reading %zu monomers and all links from %s\n",
                     res_names.size(), input.c_str());
-      std::string libin;
-      gemmi::MonLib monlib = gemmi::read_monomer_lib(monomer_dir, res_names,
-                                                     gemmi::read_cif_gz, libin, true);
+      gemmi::MonLib monlib;
+      gemmi::MonLibCache moncache;
+      if (p.options[MonCache]) {
+        moncache.open(p.options[MonCache].arg);
+        monlib.cache = &moncache;
+      }
+      monlib.read_monomer_lib(monomer_dir, res_names, gemmi::read_cif_gz);
+      int nthreads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
       for (size_t i = 0; i != st.models.size(); ++i)
         // preparing topology modifies hydrogens in the model
-        prepare_topology(st, monlib, i, h_change, p.options[Sort], &std::cerr);
+        prepare_topology(st, monlib, i, h_change, p.options[Sort], &std::cerr,
+                         false, nthreads);
     }
     if (p.options[Verbose])
       std::printf("Hydrogen site count: %zu in input, %zu in output.\n",
@@ -20,6 +20,7 @@ int map_main(int argc, char** argv);
 int map2sf_main(int argc, char** argv);
 int mask_main(int argc, char** argv);
 int merge_main(int argc, char** argv);
+int moncache_main(int argc, char** argv);
 int mondiff_main(int argc, char** argv);
 int mtz_main(int argc, char** argv);
 int mtz2cif_main(int argc, char** argv);
@@ -63,6 +64,7 @@ static SubCmd subcommands[] = {
   CMD(map2sf, "transform CCP4 map to map coefficients (in MTZ or mmCIF)"),
   CMD(mask, "make a bulk-solvent mask in the CCP4 format"),
   CMD(merge, "merge intensities from multi-record reflection file"),
+  CMD(moncache, "write binary cache of the monomer library"),
   CMD(mondiff, "compare two monomer CIF files"),
   CMD(mtz, "print info about MTZ reflection file"),
   CMD(mtz2cif, "convert MTZ to structure factor mmCIF"),
@@ -8,6 +8,9 @@
 #include "gemmi/util.hpp"  // for trim_str
 #include "gemmi/symmetry.hpp"
 #include "gemmi/floodfill.hpp"  // for mask_points_above_threshold
+#include "gemmi/fourier.hpp"   // for transform_map_to_f_phi
+#include "gemmi/mapcorr.hpp"   // for LocalCorrelation, calculate_fsc
+#include "gemmi/mmread_gz.hpp" // for read_structure_gz
 #include "histogram.h"     // for print_histogram
 #define GEMMI_PROG map
 #include "options.h"
@@ -15,7 +18,9 @@
 namespace {
 
 enum OptionIndex {
-  Dump=4, Deltas, CheckSym, Reorder, Full, Mask, Threshold, Fraction
+  Dump=4, Deltas, CheckSym, Reorder, Full, Mask, Threshold, Fraction,
+  Resample, GridSpac, GridDims, Order, Compare, Fsc, Bins, LocalCc, ResidueCc,
+  Radius, Threads
 };
 
 const option::Descriptor Usage[] = {
@@ -24,6 +29,8 @@ const option::Descriptor Usage[] = {
   CommonUsage[Help],
   CommonUsage[Version],
   CommonUsage[Verbose],
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1)." },
   { Dump, 0, "d", "dump", Arg::None,
     "  -d, --dump  \tPrint a map summary (default action)." },
   { Deltas, 0, "", "deltas", Arg::None,
@@ -41,6 +48,30 @@ const option::Descriptor Usage[] = {
     "  --threshold  \tExplicit threshold value for 0/1 mask." },
   { Fraction, 0, "", "fraction", Arg::Float,
     "  --fraction  \tThreshold is selected to have this fraction of 1's." },
+  { NoOp, 0, "", "", Arg::None, "\nOptions for resampling:" },
+  { Resample, 0, "", "resample", Arg::Required,
+    "  --resample=FILE  \tWrite map interpolated on a new grid." },
+  { GridSpac, 0, "s", "spacing", Arg::Float,
+    "  -s, --spacing=D  \tMax. sampling for the new grid." },
+  { GridDims, 0, "g", "grid", Arg::Int3,
+    "  -g, --grid=NX,NY,NZ  \tNew grid size." },
+  { Order, 0, "", "order", Arg::Int,
+    "  --order=N  \tInterpolation: 1=nearest, 2=linear (default), 3=cubic." },
+  { NoOp, 0, "", "", Arg::None, "\nOptions for comparing two maps:" },
+  { Compare, 0, "", "compare", Arg::Required,
+    "  --compare=MAP2  \tMap on the same grid, used by the options below." },
+  { Fsc, 0, "", "fsc", Arg::None,
+    "  --fsc  \tPrint FSC in resolution shells (and full-map FSC, if the maps"
+    " are half maps)." },
+  { Bins, 0, "", "bins", Arg::Int,
+    "  --bins=N  \tNumber of resolution shells for FSC (default: 20)." },
+  { LocalCc, 0, "", "local-cc", Arg::Required,
+    "  --local-cc=FILE  \tWrite map of CC in a box around each grid point." },
+  { ResidueCc, 0, "", "residue-cc", Arg::Required,
+    "  --residue-cc=MODEL  \tPrint CC in a box around each residue." },
+  { Radius, 0, "", "radius", Arg::Float,
+    "  --radius=R  \tBox half-width for --local-cc and margin for --residue-cc"
+    " (default: 3A)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -165,6 +196,37 @@ void print_deltas(const gemmi::Grid<T>& grid, double dmin, double dmax) {
   }
 }
 
+void print_fsc(const gemmi::Grid<float>& a, const gemmi::Grid<float>& b,
+               int nbins, int nthreads) {
+  gemmi::FPhiGrid<float> fa = gemmi::transform_map_to_f_phi(a, /*half_l=*/true);
+  gemmi::FPhiGrid<float> fb = gemmi::transform_map_to_f_phi(b, /*half_l=*/true);
+  gemmi::Binner binner;
+  gemmi::setup_binner_for_grid(binner, nbins, gemmi::Binner::Method::Dstar, fa);
+  std::vector<gemmi::FscBin> fsc = gemmi::calculate_fsc(fa, fb, binner, nthreads);
+  std::printf("\n  d_max   d_min  points    FSC   full-map FSC (for half maps)\n");
+  for (size_t i = 0; i < fsc.size(); ++i) {
+    double dmin = i + 1 < fsc.size() ? binner.dmin_of_bin((int)i)
+                                     : 1. / std::sqrt(binner.max_1_d2);
+    std::printf("%7.2f %7.2f %7d %7.4f %7.4f\n", binner.dmax_of_bin((int)i), dmin,
+                fsc[i].n, fsc[i].fsc(), fsc[i].full_map_fsc());
+  }
+}
+
+void print_residue_cc(const gemmi::LocalCorrelation& lc, const char* path,
+                      double margin, int nthreads) {
+  gemmi::Structure st = gemmi::read_structure_gz(path);
+  if (st.models.empty())
+    gemmi::fail("No atoms in the model: ", path);
+  const gemmi::Model& model = st.models[0];
+  std::vector<double> cc = lc.calculate_residue_cc(model, margin, nthreads);
+  std::printf("\nChain  SeqId Name     CC\n");
+  size_t n = 0;
+  for (const gemmi::Chain& chain : model.chains)
+    for (const gemmi::Residue& res : chain.residues)
+      std::printf("%-5s %6s %-4s %6.3f\n", chain.name.c_str(), res.seqid.str().c_str(),
+                  res.name.c_str(), cc[n++]);
+}
+
 } // anonymous namespace
 
 int GEMMI_MAIN(int argc, char **argv) {
@@ -172,9 +234,28 @@ int GEMMI_MAIN(int argc, char **argv) {
   p.simple_parse(argc, argv, Usage);
   p.require_input_files_as_args();
   p.check_exclusive_pair(Threshold, Fraction);
+  p.check_exclusive_pair(GridSpac, GridDims);
   //bool verbose = p.options[Verbose];
 
-  if (p.nonOptionsCount() > 1 && (p.options[Reorder] || p.options[Full])) {
+  if (p.options[Resample] && !p.options[GridSpac] && !p.options[GridDims]) {
+    std::fprintf(stderr, "Option --resample requires --spacing or --grid.\n");
+    return 1;
+  }
+  int order = p.options[Order] ? std::atoi(p.options[Order].arg) : 2;
+  if (order < 1 || order > 3) {
+    std::fprintf(stderr, "Option --order must be 1, 2 or 3.\n");
+    return 1;
+  }
+
+  if (!p.options[Compare] &&
+      (p.options[Fsc] || p.options[LocalCc] || p.options[ResidueCc])) {
+    std::fprintf(stderr, "Options --fsc, --local-cc and --residue-cc"
+                         " require --compare.\n");
+    return 1;
+  }
+
+  if (p.nonOptionsCount() > 1 && (p.options[Reorder] || p.options[Full] ||
+                                  p.options[Resample] || p.options[Compare])) {
     std::fprintf(stderr, "Option --write-... can be only used "
                          "with a single input file.\n");
     return 1;
@@ -182,7 +263,9 @@ int GEMMI_MAIN(int argc, char **argv) {
 
   bool dump = (p.options[Dump] ||
                !(p.options[Deltas] || p.options[CheckSym] ||
-                 p.options[Reorder] || p.options[Full] || p.options[Mask]));
+                 p.options[Reorder] || p.options[Full] || p.options[Mask] ||
+                 p.options[Resample] || p.options[Compare]));
+  int nthreads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
   try {
     for (int i = 0; i < p.nonOptionsCount(); ++i) {
       const char* input = p.nonOption(i);
@@ -217,7 +300,8 @@ int GEMMI_MAIN(int argc, char **argv) {
             return std::isnan(a) ? b : a;
         });
         map.grid.calculate_spacing();
-      } else if (p.options[Full] || p.options[Mask]) {
+      } else if (p.options[Full] || p.options[Mask] || p.options[Resample] ||
+                 p.options[Compare]) {
         map.setup(NAN, gemmi::MapSetup::Full);
       }
       if (p.options[Full]) {
@@ -255,6 +339,57 @@ int GEMMI_MAIN(int argc, char **argv) {
         mask.update_ccp4_header(0);
         mask.write_ccp4_map(p.options[Mask].arg);
       }
+      if (p.options[Resample]) {
+        gemmi::Ccp4<> out;
+        out.grid.unit_cell = map.grid.unit_cell;
+        out.grid.spacegroup = map.grid.spacegroup;
+        if (p.options[GridDims]) {
+          auto dims = parse_comma_separated_ints(p.options[GridDims].arg);
+          out.grid.set_size(dims[0], dims[1], dims[2]);
+        } else {
+          double spac = std::atof(p.options[GridSpac].arg);
+          out.grid.set_size_from_spacing(spac, gemmi::GridSizeRounding::Up);
+        }
+        map.grid.resample_to(out.grid, order, nthreads);
+        if (p.options[Verbose])
+          std::fprintf(stderr, "Resampled to grid %d x %d x %d\n",
+                       out.grid.nu, out.grid.nv, out.grid.nw);
+        out.update_ccp4_header(2);
+        out.write_ccp4_map(p.options[Resample].arg);
+      }
+      if (p.options[Compare]) {
+        gemmi::Ccp4<> map2;
+        map2.read_ccp4(gemmi::MaybeGzipped(p.options[Compare].arg));
+        map2.setup(NAN, gemmi::MapSetup::Full);
+        if (map2.grid.nu != map.grid.nu || map2.grid.nv != map.grid.nv ||
+            map2.grid.nw != map.grid.nw)
+          gemmi::fail("The maps have different grids.");
+        for (gemmi::Grid<float>* g : {&map.grid, &map2.grid}) {
+          size_t nn = std::count_if(g->data.begin(), g->data.end(),
+                                    [](float x) { return std::isnan(x); });
+          if (nn != 0) {
+            std::fprintf(stderr, "WARNING: %zu unknown values set to 0\n", nn);
+            g->change_values(NAN, 0.f);
+          }
+        }
+        if (p.options[Fsc]) {
+          int nbins = p.options[Bins] ? std::atoi(p.options[Bins].arg) : 20;
+          print_fsc(map.grid, map2.grid, nbins, nthreads);
+        }
+        double radius = p.options[Radius] ? std::atof(p.options[Radius].arg) : 3.0;
+        if (p.options[LocalCc]) {
+          gemmi::Ccp4<> out;
+          out.grid = gemmi::calculate_local_correlation_map(map.grid, map2.grid,
+                                                            radius, nthreads);
+          out.update_ccp4_header(2);
+          out.write_ccp4_map(p.options[LocalCc].arg);
+        }
+        if (p.options[ResidueCc]) {
+          gemmi::LocalCorrelation lc;
+          lc.prepare(map.grid, map2.grid, nthreads);
+          print_residue_cc(lc, p.options[ResidueCc].arg, radius, nthreads);
+        }
+      }
     }
   } catch (std::runtime_error& e) {
     std::fprintf(stderr, "ERROR: %s\n", e.what());
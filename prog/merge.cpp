@@ -19,7 +19,7 @@
 namespace {
 
 enum OptionIndex {
-  WriteAnom=4, NoSysAbs, NumObs, BlockName, Compare, PrintAll
+  WriteAnom=4, NoSysAbs, NumObs, BlockName, Compare, PrintAll, Stats, Threads
 };
 
 const option::Descriptor Usage[] = {
@@ -43,6 +43,10 @@ const option::Descriptor Usage[] = {
     "  --compare  \tcompare unmerged and merged data (no output file)." },
   { PrintAll, 0, "", "print-all", Arg::None,
     "  --print-all  \tprint all compared reflections." },
+  { Stats, 0, "", "stats", Arg::Optional,
+    "  --stats[=N]  \tprint data quality statistics in N shells (default: 10)." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads used for merging (default: 1)." },
   { NoOp, 0, "", "", Arg::None,
     "\nThe input file can be SF-mmCIF with _diffrn_refln, MTZ or XDS_ASCII.HKL."
     "\nThe output file can be either SF-mmCIF or MTZ."
@@ -66,6 +70,36 @@ void output_intensity_statistics(const Intensities& intensities) {
                intensities.data.size(), plus_count, minus_count);
 }
 
+void print_merging_statistics(const Intensities& intensities, int nbins, int nthreads) {
+  gemmi::Binner binner;
+  std::vector<double> inv_d2(intensities.data.size());
+  for (size_t i = 0; i != inv_d2.size(); ++i)
+    inv_d2[i] = intensities.unit_cell.calculate_1_d2(intensities.data[i].hkl);
+  binner.setup_from_1_d2(nbins, gemmi::Binner::Method::Dstar3, std::move(inv_d2),
+                         &intensities.unit_cell);
+  std::vector<gemmi::MergingStats> stats =
+    intensities.calculate_merging_stats(&binner, false, nthreads);
+  std::vector<int> possible = gemmi::count_reflections_in_bins(binner, intensities.spacegroup);
+  gemmi::MergingStats total;
+  int total_possible = 0;
+  printf(" d_max  d_min   #obs  #uniq  compl%%  <I/sig>  Rmerge   Rmeas    Rpim  CC1/2\n");
+  auto print_row = [](double dmax, double dmin, const gemmi::MergingStats& ms,
+                      int npossible) {
+    printf("%6.2f %6.2f %6d %6d %6.1f %8.2f %7.3f %7.3f %7.3f %6.3f\n",
+           dmax, dmin, ms.all_refl, ms.unique_refl, 100. * ms.unique_refl / npossible,
+           ms.mean_i_over_sigma(), ms.r_merge(), ms.r_meas(), ms.r_pim(), ms.cc_half());
+  };
+  // the upper limit of the last bin is +inf
+  double dmin = 1 / std::sqrt(binner.max_1_d2);
+  for (int i = 0; i != (int) stats.size(); ++i) {
+    print_row(binner.dmax_of_bin(i), i + 1 < nbins ? binner.dmin_of_bin(i) : dmin,
+              stats[i], possible[i]);
+    total.add(stats[i]);
+    total_possible += possible[i];
+  }
+  print_row(binner.dmax_of_bin(0), dmin, total, total_possible);
+}
+
 void read_intensities_from_rblocks(Intensities& intensities,
                                    DataType data_type,
                                    std::vector<gemmi::ReflnBlock>& rblocks,
@@ -92,29 +126,47 @@ void read_intensities_from_rblocks(Intensities& intensities,
   }
 }
 
+// Reads headers, then only the columns that are needed for data_type.
+template<typename Stream>
+void read_mtz_intensities(Stream&& stream, gemmi::Mtz& mtz, DataType& data_type) {
+  mtz.read_all_headers(stream);
+  if (data_type == DataType::Unknown)
+    data_type = mtz.batches.empty() ? DataType::Mean : DataType::Unmerged;
+  if (data_type == DataType::Mean && !mtz.imean_column()) {
+    std::fprintf(stderr, "No IMEAN, using I(+) and I(-) ...\n");
+    if (!mtz.iplus_column())
+      gemmi::fail("I(+) not found");
+    data_type = DataType::Anomalous;
+  }
+  mtz.read_raw_data_of_columns(stream, Intensities::mtz_column_labels(mtz, data_type));
+}
+
 Intensities read_intensities(DataType data_type, const char* input_path,
-                             const char* block_name, bool verbose) {
+                             const char* block_name, bool verbose, int nthreads) {
   try {
     Intensities intensities;
     if (gemmi::giends_with(input_path, ".mtz")) {
+      gemmi::MaybeGzipped input(input_path);
       gemmi::Mtz mtz;
       if (verbose)
         mtz.warnings = stderr;
-      mtz.read_input(gemmi::MaybeGzipped(input_path), /*with_data=*/true);
-      if (data_type == DataType::Unknown)
-        data_type = mtz.batches.empty() ? DataType::Mean : DataType::Unmerged;
-      if (data_type == DataType::Mean && !mtz.imean_column()) {
-        std::fprintf(stderr, "No IMEAN, using I(+) and I(-) ...\n");
-        if (!mtz.iplus_column())
-          gemmi::fail("I(+) not found");
-        data_type = DataType::Anomalous;
+      mtz.source_path = input.path();
+      // the file is opened once; gzipped file is read as a stream,
+      // not uncompressed into memory (as in Mtz::read_input_columns())
+      if (input.is_stdin()) {
+        read_mtz_intensities(gemmi::FileStream{stdin}, mtz, data_type);
+      } else if (input.is_compressed()) {
+        read_mtz_intensities(input.get_uncompressing_stream(), mtz, data_type);
+      } else {
+        gemmi::fileptr_t f = gemmi::file_open(input.path().c_str(), "rb");
+        read_mtz_intensities(gemmi::FileStream{f.get()}, mtz, data_type);
       }
       intensities.read_mtz(mtz, data_type);
       if (data_type != DataType::Unmerged)
         intensities.take_staraniso_b_from_mtz(mtz);
     } else if (gemmi::giends_with(input_path, ".hkl")) {
       gemmi::XdsAscii xds_ascii;
-      xds_ascii.read_input(gemmi::MaybeGzipped(input_path));
+      xds_ascii.read_input(gemmi::MaybeGzipped(input_path), nthreads);
       intensities.read_unmerged_intensities_from_xds(xds_ascii);
     } else {
       auto rblocks = gemmi::as_refln_blocks(gemmi::read_cif_gz(input_path).blocks);
@@ -302,6 +354,7 @@ int GEMMI_MAIN(int argc, char **argv) {
     p.print_try_help_and_exit("");
   }
   bool verbose = p.options[Verbose];
+  int nthreads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
   const char* input_path = p.nonOption(0);
   const char* output_path = nullptr;
   if (p.nonOptionsCount() == 2)
@@ -315,7 +368,7 @@ int GEMMI_MAIN(int argc, char **argv) {
   if (p.options[Compare] && output_path) {
     if (verbose)
       std::fprintf(stderr, "Reading merged reflections from %s ...\n", output_path);
-    ref = read_intensities(otype, output_path, nullptr, verbose);
+    ref = read_intensities(otype, output_path, nullptr, verbose, nthreads);
   }
 
   if (verbose)
@@ -327,7 +380,8 @@ int GEMMI_MAIN(int argc, char **argv) {
       if (p.options[Compare] && gemmi::giends_with(input_path, ".mtz"))
         // it's OK to compare also two merged files
         data_type = DataType::Unknown;
-      intensities = read_intensities(data_type, input_path, block_name, verbose);
+      intensities = read_intensities(data_type, input_path, block_name, verbose,
+                                     nthreads);
     } else { // special case of --compare with one mmCIF file
       if (gemmi::giends_with(input_path, ".mtz") ||
           gemmi::giends_with(input_path, ".hkl"))
@@ -341,12 +395,18 @@ int GEMMI_MAIN(int argc, char **argv) {
     }
     if (verbose)
       output_intensity_statistics(intensities);
+    if (p.options[Stats]) {
+      if (intensities.type != DataType::Unmerged)
+        gemmi::fail("--stats requires unmerged data");
+      int nbins = p.options[Stats].arg ? std::atoi(p.options[Stats].arg) : 10;
+      print_merging_statistics(intensities, nbins, nthreads);
+    }
     if (p.options[Compare]) {
       if (intensities.type != ref.type)
-        intensities.merge_in_place(ref.type);
+        intensities.merge_in_place(ref.type, nthreads);
       compare_intensities(intensities, ref, p.options[PrintAll]);
     } else {
-      intensities.merge_in_place(otype);
+      intensities.merge_in_place(otype, nthreads);
       if (p.options[NoSysAbs])
         intensities.remove_systematic_absences();
       if (verbose)
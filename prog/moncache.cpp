@@ -0,0 +1,63 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Write a binary cache of the monomer library (see monlib_cache.hpp).
+
+#include <stdio.h>
+#include <cstdlib>                // for getenv
+#include <gemmi/monlib_cache.hpp> // for write_monlib_cache
+#include <gemmi/read_cif.hpp>     // for read_cif_gz
+#define GEMMI_PROG moncache
+#include "options.h"
+
+namespace {
+
+enum OptionIndex { Monomers=4 };
+
+const option::Descriptor Usage[] = {
+  { NoOp, 0, "", "", Arg::None,
+    "Usage:"
+    "\n " EXE_NAME " [options] OUTPUT_FILE [CODE]..."
+    "\n\nWrites a binary cache of the monomer library, to be used with option"
+    "\n--moncache in programs that read the library (h, prep, rmsz)."
+    "\nIf CODEs are not given, all monomers from mon_lib_list.cif are cached."
+    "\nFiles that were modified after the cache was written are read"
+    "\nfrom the library.\n"
+    "\nOptions:" },
+  CommonUsage[Help],
+  CommonUsage[Version],
+  CommonUsage[Verbose],
+  { Monomers, 0, "", "monomers", Arg::Required,
+    "  --monomers=DIR  \tMonomer library dir (default: $CLIBD_MON)." },
+  { 0, 0, 0, 0, 0, 0 }
+};
+
+} // anonymous namespace
+
+int GEMMI_MAIN(int argc, char **argv) {
+  OptParser p(EXE_NAME);
+  p.simple_parse(argc, argv, Usage);
+  p.require_input_files_as_args();
+  const char* monomer_dir = p.options[Monomers] ? p.options[Monomers].arg
+                                                : std::getenv("CLIBD_MON");
+  if (monomer_dir == nullptr || *monomer_dir == '\0') {
+    fprintf(stderr, "Set $CLIBD_MON or use option --monomers.\n");
+    return 1;
+  }
+  const char* output = p.nonOption(0);
+  std::vector<std::string> codes;
+  for (int i = 1; i < p.nonOptionsCount(); ++i)
+    codes.emplace_back(p.nonOption(i));
+  try {
+    std::string error;
+    size_t n = gemmi::write_monlib_cache(output, monomer_dir, codes,
+                                         gemmi::read_cif_gz, &error);
+    if (!error.empty())
+      fprintf(stderr, "%s", error.c_str());
+    if (p.options[Verbose])
+      fprintf(stderr, "%zu files from %s cached in %s\n", n, monomer_dir, output);
+  } catch (std::runtime_error& e) {
+    fprintf(stderr, "ERROR: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
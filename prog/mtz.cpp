@@ -27,7 +27,7 @@ struct MtzArg: public Arg {
 
 enum OptionIndex {
   Headers=4, Dump, PrintBatch, PrintBatches, ExpandedBatches, PrintAppendix,
-  PrintTsv, PrintStats, PrintHistogram, PrintCells, CheckAsu,
+  PrintTsv, PrintStats, PrintHistogram, PrintCells, CheckAsu, Columns,
   Compare, ToggleEndian, NoIsym, UpdateReso
 };
 
@@ -60,6 +60,9 @@ const option::Descriptor Usage[] = {
     "  --cells  \tPrint cell parameters only." },
   { CheckAsu, 0, "", "check-asu", MtzArg::AsuChoice,
     "  --check-asu=ccp4|tnt  \tCheck if reflections are in ASU." },
+  { Columns, 0, "", "columns", Arg::Required,
+    "  --columns=LABEL1,...  \tRead data only from the listed columns"
+    " (and H, K, L)." },
   { Compare, 0, "", "compare", Arg::Required,
     "  --compare=FILE  \tCompare two MTZ files." },
   { ToggleEndian, 0, "", "toggle-endian", Arg::None,
@@ -528,8 +531,10 @@ void print_mtz_info(Stream&& stream, const char* path,
   mtz.read_main_headers(stream);
   mtz.read_history_and_batch_headers(stream);
   mtz.setup_spacegroup();
-  if (options[PrintTsv] || options[PrintStats] || options[PrintHistogram] ||
-      options[CheckAsu] || options[Compare] || options[UpdateReso])
+  if (options[Columns])
+    mtz.read_raw_data_of_columns(stream, gemmi::split_str(options[Columns].arg, ','));
+  else if (options[PrintTsv] || options[PrintStats] || options[PrintHistogram] ||
+           options[CheckAsu] || options[Compare] || options[UpdateReso])
     mtz.read_raw_data(stream);
   if (options[UpdateReso])
     mtz.update_reso();
@@ -9,6 +9,7 @@
 #include "gemmi/fstream.hpp"   // for Ofstream
 #include "gemmi/polyheur.hpp"  // for setup_entities
 #include "gemmi/monlib.hpp"    // for MonLib, read_monomer_lib
+#include "gemmi/monlib_cache.hpp" // for MonLibCache
 #include "gemmi/read_cif.hpp"  // for read_cif_gz
 #include "gemmi/mmread_gz.hpp" // for read_structure_gz
 #include "gemmi/contact.hpp"   // for ContactSearch
@@ -21,8 +22,8 @@ using namespace gemmi;
 namespace {
 
 enum OptionIndex {
-  Monomers=4, Libin, Libin2, AutoCis, AutoLink, AutoLigand,
-  NoAliases, NoZeroOccRestr, NoHydrogens, KeepHydrogens
+  Monomers=4, MonCache, Libin, Libin2, AutoCis, AutoLink, AutoLigand,
+  NoAliases, NoZeroOccRestr, NoHydrogens, KeepHydrogens, Threads
 };
 
 const option::Descriptor Usage[] = {
@@ -37,6 +38,8 @@ const option::Descriptor Usage[] = {
   CommonUsage[Verbose],
   { Monomers, 0, "", "monomers", Arg::Required,
     "  --monomers=DIR  \tMonomer library dir (default: $CLIBD_MON)." },
+  { MonCache, 0, "", "moncache", Arg::Required,
+    "  --moncache=FILE  \tCache of the monomer library (from gemmi moncache)." },
   { Libin, 0, "", "lib", Arg::Required,
     "  --lib=CIF  \tUser's library with priority over the monomer library. "
     "Can be given multiple times. If CIF is '+' reads INPUT_FILE (mmCIF only)." },
@@ -50,6 +53,9 @@ const option::Descriptor Usage[] = {
     "  --auto-ligand=Y|N  \tFind links not included in LINK/SSBOND (default: N)." },
   { NoAliases, 0, "", "no-aliases", Arg::None,
     "  --no-aliases  \tIgnore _chem_comp_alias." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads for preparing restraints"
+    " and hydrogens (default: 1)." },
   //{ NoZeroOccRestr, 0, "", "no-zero-occ", Arg::None,
   //  "  --no-zero-occ  \tNo restraints for zero-occupancy atoms." },
   { NoOp, 0, "", "", Arg::None,
@@ -92,6 +98,11 @@ int GEMMI_MAIN(int argc, char **argv) {
     Model& model0 = st.models[0];
 
     MonLib monlib;
+    MonLibCache moncache;
+    if (p.options[MonCache]) {
+      moncache.open(p.options[MonCache].arg);
+      monlib.cache = &moncache;
+    }
 
     auto read_user_file = [&](const char* path) {
       if (verbose)
@@ -161,8 +172,9 @@ int GEMMI_MAIN(int argc, char **argv) {
       h_change = HydrogenChange::NoChange;
     else
       h_change = HydrogenChange::ReAddButWater;
+    int nthreads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
     auto topo = prepare_topology(st, monlib, 0, h_change, reorder,
-                                 &std::cerr, ignore_unknown_links);
+                                 &std::cerr, ignore_unknown_links, nthreads);
     if (verbose)
       fprintf(stderr, "Preparing data for Refmac...\n");
     cif::Document crd = prepare_refmac_crd(st, *topo, monlib, h_change);
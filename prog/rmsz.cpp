@@ -1,17 +1,12 @@
 // Copyright 2018 Global Phasing Ltd.
 
 #include <stdio.h>
-#include <cstdlib>   // for getenv
-#include <iostream>  // for cerr
+#include <cmath>     // for isnan
+#include <cstdlib>   // for getenv, atoi
 #include <stdexcept>
-#include "gemmi/model.hpp"     // for Structure, Atom, etc
-#include "gemmi/chemcomp.hpp"  // for ChemComp
-#include "gemmi/monlib.hpp"    // for MonLib, read_monomer_lib
-#include "gemmi/topo.hpp"      // for Topo
-#include "gemmi/calculate.hpp" // for find_best_plane, get_distance_from_plane
-#include "gemmi/polyheur.hpp"  // for setup_entities
+#include "gemmi/monlib_cache.hpp" // for MonLibCache
+#include "gemmi/rmsz.hpp"      // for GeometryValidator
 #include <gemmi/read_cif.hpp>  // for read_cif_gz
-#include <gemmi/mmread_gz.hpp> // for read_structure_gz
 
 #define GEMMI_PROG rmsz
 #include "options.h"
@@ -20,13 +15,14 @@ using gemmi::Topo;
 
 namespace {
 
-enum OptionIndex { Quiet=4, Monomers, FormatIn, Cutoff };
+enum OptionIndex { Quiet=4, Monomers, MonCache, FormatIn, Cutoff, Outliers,
+                   Threads };
 
 const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
     "Usage:"
-    "\n " EXE_NAME " [options] INPUT_FILE"
-    "\n\nValidate geometry of a coordinate file with (Refmac) monomer library."
+    "\n " EXE_NAME " [options] INPUT_FILE..."
+    "\n\nValidate geometry of coordinate files with (Refmac) monomer library."
     "\n\nOptions:" },
   CommonUsage[Help],
   CommonUsage[Version],
@@ -35,129 +31,106 @@ const option::Descriptor Usage[] = {
     "  -q, --quiet  \tShow only summary." },
   { Monomers, 0, "", "monomers", Arg::Required,
     "  --monomers=DIR  \tMonomer library dir (default: $CLIBD_MON)." },
+  { MonCache, 0, "", "moncache", Arg::Required,
+    "  --moncache=FILE  \tCache of the monomer library (from gemmi moncache)." },
   { FormatIn, 0, "", "format", Arg::CoorFormat,
     "  --format=FORMAT  \tInput format (default: from the file extension)." },
   { Cutoff, 0, "", "cutoff", Arg::Float,
     "  --cutoff=ZC  \tList bonds and angles with Z score > ZC (default: 2)." },
+  { Outliers, 0, "", "outliers", Arg::Required,
+    "  --outliers=FILE  \tWrite outliers as a table (TSV) to FILE. With -j,"
+    " files are listed in the order of completion; the first column"
+    " is the position of the file in the arguments." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of files processed in parallel (default: 1)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
-struct RMS {
-  int n = 0;
-  double sum_sq = 0.;
-  void put(double x) { ++n; sum_sq += x * x; }
-  double get_value() const { return std::sqrt(sum_sq / n); }
-};
-
-struct RMSes {
-  RMS d_bond;
-  RMS d_angle;
-  RMS d_torsion;
-  RMS d_plane;
-  RMS z_bond;
-  RMS z_angle;
-  RMS z_torsion;
-  RMS z_plane;
-  int wrong_chirality = 0;
-  int all_chiralities = 0;
-  int wrong_bond = 0;
-  int wrong_angle = 0;
-  int wrong_torsion = 0;
-  int wrong_plane = 0;
-};
+const char* kind_name(Topo::RKind kind) {
+  switch (kind) {
+    case Topo::RKind::Bond: return "bond";
+    case Topo::RKind::Angle: return "angle";
+    case Topo::RKind::Torsion: return "torsion";
+    case Topo::RKind::Chirality: return "chirality";
+    case Topo::RKind::Plane: return "plane";
+  }
+  gemmi::unreachable();
+}
 
-double check_restraint(const Topo::Rule rule,
-                       const Topo& topo,
-                       double cutoff,
-                       const char* tag,
-                       RMSes* rmses,
-                       int verbosity) {
-  switch (rule.rkind) {
-    case Topo::RKind::Bond: {
-      const Topo::Bond& t = topo.bonds[rule.index];
-      double z = t.calculate_z();
-      if (z > cutoff) {
-        rmses->wrong_bond++;
-        if (verbosity >= 0) {
-          int n = printf("%s bond %s: |Z|=%.1f", tag, t.restr->str().c_str(), z);
-          if (verbosity > 0)
-            printf(verbosity < 2 ? " %*.3f -> %.3f" : " %*g -> %g",
-                   std::max(50 - n, 7), t.restr->value, t.calculate());
-          putchar('\n');
-        }
-      }
-      rmses->z_bond.put(z);
-      rmses->d_bond.put(z * t.restr->esd);
-      return z;
-    }
-    case Topo::RKind::Angle: {
-      const Topo::Angle& t = topo.angles[rule.index];
-      double z = t.calculate_z();
-      if (z > cutoff) {
-        rmses->wrong_angle++;
-        if (verbosity >= 0) {
-          int n = printf("%s angle %s: |Z|=%.1f", tag, t.restr->str().c_str(), z);
-          if (verbosity > 0)
-            printf(verbosity < 2 ? " %*.1f -> %.1f" : " %*g -> %g",
-                   std::max(50 - n, 7), t.restr->value, gemmi::deg(t.calculate()));
-          putchar('\n');
-        }
-      }
-      rmses->z_angle.put(z);
-      rmses->d_angle.put(z * t.restr->esd);
-      return z;
-    }
+void print_outlier(const gemmi::GeometryOutliers& out, size_t i, int verbosity) {
+  const char* tag = out.tag[i].c_str();
+  const char* restr = out.restraint[i].c_str();
+  switch (out.kind[i]) {
+    case Topo::RKind::Bond:
+    case Topo::RKind::Angle:
     case Topo::RKind::Torsion: {
-      const Topo::Torsion& t = topo.torsions[rule.index];
-      double z = t.calculate_z();  // takes into account t.restr->period
-      if (z > cutoff) {
-        rmses->wrong_torsion++;
-        if (verbosity >= 0) {
-          int n = printf("%s torsion %s: |Z|=%.1f",
-                         tag, t.restr->str().c_str(), z);
-          if (verbosity > 0)
-            printf(verbosity < 2 ? " %*.1f -> %.1f" : " %*g -> %g",
-                   std::max(50 - n, 7), t.restr->value, gemmi::deg(t.calculate()));
-          putchar('\n');
-        }
-      }
-      rmses->z_torsion.put(z);
-      rmses->d_torsion.put(z * t.restr->esd);
-      return z;
-    }
-    case Topo::RKind::Chirality: {
-      const Topo::Chirality& t = topo.chirs[rule.index];
-      rmses->all_chiralities++;
-      if (!t.check()) {
-        if (verbosity >= 0)
-          printf("%s wrong chirality of %s\n", tag, t.restr->str().c_str());
-        rmses->wrong_chirality++;
-        return 1.0;
-      }
-      return 0.0;
-    }
-    case Topo::RKind::Plane: {
-      const Topo::Plane& t = topo.planes[rule.index];
-      auto coeff = find_best_plane(t.atoms);
-      double max_z = 0;
-      for (const gemmi::Atom* atom : t.atoms) {
-        double dist = gemmi::get_distance_from_plane(atom->pos, coeff);
-        double z = dist / t.restr->esd;
-        if (verbosity >= 0)
-          if (z > cutoff)
-            printf("%s atom %s not in plane %s, |Z|=%.1f\n", tag,
-                   atom->name.c_str(), t.restr->str().c_str(), z);
-        if (z > max_z)
-            max_z = z;
-      }
-      rmses->z_plane.put(max_z);
-      rmses->d_plane.put(max_z * t.restr->esd);
-      if (max_z > cutoff)
-        rmses->wrong_plane++;
-      return max_z;
+      int n = printf("%s %s %s: |Z|=%.1f", tag, kind_name(out.kind[i]), restr, out.z[i]);
+      int width = std::max(50 - n, 7);
+      if (verbosity >= 2)
+        printf(" %*g -> %g", width, out.ideal[i], out.value[i]);
+      else if (verbosity == 1 && out.kind[i] == Topo::RKind::Bond)
+        printf(" %*.3f -> %.3f", width, out.ideal[i], out.value[i]);
+      else if (verbosity == 1)
+        printf(" %*.1f -> %.1f", width, out.ideal[i], out.value[i]);
+      putchar('\n');
+      break;
     }
+    case Topo::RKind::Chirality:
+      printf("%s wrong chirality of %s\n", tag, restr);
+      break;
+    case Topo::RKind::Plane:
+      printf("%s atom %s not in plane %s, |Z|=%.1f\n", tag,
+             out.atom[i].c_str(), restr, out.z[i]);
+      break;
+  }
+}
+
+void print_stats(const gemmi::GeometryStats& stats, double cutoff) {
+  printf("Model rmsZ: "
+         "bond: %.3f, angle: %.3f, torsion: %.3f, planarity %.3f\n"
+         "Model rmsD: "
+         "bond: %.3f, angle: %.3f, torsion: %.3f, planarity %.3f\n"
+         "wrong chirality: %d of %d\n",
+         stats.z_bond.get_value(),
+         stats.z_angle.get_value(),
+         stats.z_torsion.get_value(),
+         stats.z_plane.get_value(),
+         stats.d_bond.get_value(),
+         stats.d_angle.get_value(),
+         stats.d_torsion.get_value(),
+         stats.d_plane.get_value(),
+         stats.wrong_chirality, stats.all_chiralities);
+  printf("rmsZ > %g for:\n"
+         "  %d of %d bonds,\n"
+         "  %d of %d angles,\n"
+         "  %d of %d torsion angles,\n"
+         "  %d of %d planes.\n",
+         cutoff,
+         stats.wrong_bond, stats.z_bond.n,
+         stats.wrong_angle, stats.z_angle.n,
+         stats.wrong_torsion, stats.z_torsion.n,
+         stats.wrong_plane, stats.z_plane.n);
+}
+
+void print_tsv_number(std::FILE* f, double x) {
+  if (!std::isnan(x))
+    fprintf(f, "%g", x);
+}
+
+// one row per outlier, NaN values are left empty
+void write_outliers(std::FILE* f, const gemmi::GeometryValidator::Result& r) {
+  const gemmi::GeometryOutliers& out = r.outliers;
+  for (size_t i = 0; i != out.size(); ++i) {
+    fprintf(f, "%zu\t%s\t%s\t%s\t%s\t%s\t%s\t", r.entry + 1, r.path.c_str(),
+            r.model_names[out.model[i]].c_str(), kind_name(out.kind[i]),
+            out.tag[i].c_str(), out.restraint[i].c_str(), out.atom[i].c_str());
+    print_tsv_number(f, out.ideal[i]);
+    putc('\t', f);
+    print_tsv_number(f, out.value[i]);
+    putc('\t', f);
+    print_tsv_number(f, out.z[i]);
+    putc('\n', f);
   }
-  gemmi::unreachable();
 }
 
 } // anonymous namespace
@@ -165,83 +138,68 @@ double check_restraint(const Topo::Rule rule,
 int GEMMI_MAIN(int argc, char **argv) {
   OptParser p(EXE_NAME);
   p.simple_parse(argc, argv, Usage);
-  p.require_positional_args(1);
+  p.require_input_files_as_args();
   const char* monomer_dir = p.options[Monomers] ? p.options[Monomers].arg
                                                 : std::getenv("CLIBD_MON");
   if (monomer_dir == nullptr || *monomer_dir == '\0') {
     fprintf(stderr, "Set $CLIBD_MON or use option --monomers.\n");
     return 1;
   }
-  double cutoff = 2.0;
-  if (p.options[Cutoff])
-    cutoff = std::strtod(p.options[Cutoff].arg, nullptr);
   int verbosity = p.options[Verbose].count() - p.options[Quiet].count();
-  std::string input = p.coordinate_input_file(0);
+  int nthreads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
+  std::vector<std::string> paths;
+  for (int i = 0; i < p.nonOptionsCount(); ++i)
+    paths.push_back(p.coordinate_input_file(i));
+  bool multiple = paths.size() > 1;
+  int n_errors = 0;
   try {
-    gemmi::CoorFormat format = coor_format_as_enum(p.options[FormatIn]);
-    gemmi::Structure st = gemmi::read_structure_gz(input, format);
-    if (st.input_format == gemmi::CoorFormat::Pdb ||
-        st.input_format == gemmi::CoorFormat::ChemComp)
-      gemmi::setup_entities(st);
-    for (gemmi::Model& model : st.models) {
-      if (st.models.size() > 1)
-        printf("### Model %s ###\n", model.name.c_str());
-      gemmi::MonLib monlib = gemmi::read_monomer_lib(monomer_dir,
-                                                  model.get_all_residue_names(),
-                                                  gemmi::read_cif_gz);
-      Topo topo;
-      topo.warnings = &std::cerr;
-      topo.initialize_refmac_topology(st, model, monlib);
-      topo.finalize_refmac_topology(monlib);
-
-      RMSes rmses;
-      // We could iterate directly over Topo::bonds, Topo::angles, etc,
-      // but then we couldn't output the provenance (res or "link" below).
-      for (const Topo::ChainInfo& chain_info : topo.chain_infos)
-        for (const Topo::ResInfo& ri : chain_info.res_infos) {
-          for (const Topo::Link& prev : ri.prev) {
-            assert(ri.res == prev.res2);
-            std::string rtag = chain_info.chain_ref.name + " " +
-                               prev.res1->str() + "-" + ri.res->str();
-            for (const Topo::Rule& rule : prev.link_rules)
-              check_restraint(rule, topo, cutoff, rtag.c_str(), &rmses, verbosity);
-          }
-          std::string rtag = chain_info.chain_ref.name + " " + ri.res->str();
-          for (const Topo::Rule& rule : ri.monomer_rules)
-            check_restraint(rule, topo, cutoff, rtag.c_str(), &rmses, verbosity);
-        }
-      for (const Topo::Link& link : topo.extras)
-        for (const Topo::Rule& rule : link.link_rules)
-          check_restraint(rule, topo, cutoff, "link", &rmses, verbosity);
-
-      printf("Model rmsZ: "
-             "bond: %.3f, angle: %.3f, torsion: %.3f, planarity %.3f\n"
-             "Model rmsD: "
-             "bond: %.3f, angle: %.3f, torsion: %.3f, planarity %.3f\n"
-             "wrong chirality: %d of %d\n",
-             rmses.z_bond.get_value(),
-             rmses.z_angle.get_value(),
-             rmses.z_torsion.get_value(),
-             rmses.z_plane.get_value(),
-             rmses.d_bond.get_value(),
-             rmses.d_angle.get_value(),
-             rmses.d_torsion.get_value(),
-             rmses.d_plane.get_value(),
-             rmses.wrong_chirality, rmses.all_chiralities);
-      printf("rmsZ > %g for:\n"
-             "  %d of %d bonds,\n"
-             "  %d of %d angles,\n"
-             "  %d of %d torsion angles,\n"
-             "  %d of %d planes.\n",
-             cutoff,
-             rmses.wrong_bond, rmses.z_bond.n,
-             rmses.wrong_angle, rmses.z_angle.n,
-             rmses.wrong_torsion, rmses.z_torsion.n,
-             rmses.wrong_plane, rmses.z_plane.n);
+    gemmi::MonLibCache moncache;
+    if (p.options[MonCache])
+      moncache.open(p.options[MonCache].arg);
+    gemmi::GeometryValidator validator(monomer_dir, gemmi::read_cif_gz,
+                                       p.options[MonCache] ? &moncache : nullptr);
+    validator.format = coor_format_as_enum(p.options[FormatIn]);
+    if (p.options[Cutoff])
+      validator.cutoff = std::strtod(p.options[Cutoff].arg, nullptr);
+    std::FILE* tsv = nullptr;
+    if (p.options[Outliers]) {
+      tsv = std::fopen(p.options[Outliers].arg, "w");
+      if (!tsv)
+        gemmi::sys_fail(std::string("Failed to open ") + p.options[Outliers].arg);
+      fprintf(tsv, "entry\tfile\tmodel\tkind\ttag\trestraint\tatom\tideal\tvalue\tz\n");
     }
+    validator.run(paths, nthreads, [&](gemmi::GeometryValidator::Result& r) {
+      if (!r.warnings.empty()) {
+        std::fflush(stdout);
+        fputs(r.warnings.c_str(), stderr);
+      }
+      if (multiple)
+        printf("### File %s ###\n", r.path.c_str());
+      size_t row = 0;
+      for (size_t i = 0; i != r.stats.size(); ++i) {
+        if (r.model_names.size() > 1)
+          printf("### Model %s ###\n", r.model_names[i].c_str());
+        for (; row < r.outliers.size() && r.outliers.model[row] == (int) i; ++row)
+          if (verbosity >= 0)
+            print_outlier(r.outliers, row, verbosity);
+        print_stats(r.stats[i], validator.cutoff);
+      }
+      if (tsv)
+        write_outliers(tsv, r);
+      if (!r.error.empty()) {
+        ++n_errors;
+        std::fflush(stdout);
+        if (multiple)
+          fprintf(stderr, "ERROR: %s: %s\n", r.path.c_str(), r.error.c_str());
+        else
+          fprintf(stderr, "ERROR: %s\n", r.error.c_str());
+      }
+    });
+    if (tsv && std::fclose(tsv) != 0)
+      gemmi::sys_fail(std::string("Failed to write ") + p.options[Outliers].arg);
   } catch (std::exception& e) {
     fprintf(stderr, "ERROR: %s\n", e.what());
     return 1;
   }
-  return 0;
+  return n_errors == 0 ? 0 : 1;
 }
@@ -33,7 +33,7 @@ namespace {
 enum OptionIndex {
   Hkl=4, Dmin, For, NormalizeIt92, Rate, Blur, RCut, Test, ToMtz, Compare,
   CifFp, Wavelength, Unknown, NoAniso, Margin, ScaleTo, FLabel,
-  PhiLabel, Ksolv, Bsolv, Baniso, RadiiSet, Rprobe, Rshrink, WriteMap
+  PhiLabel, Ksolv, Bsolv, Baniso, RadiiSet, Rprobe, Rshrink, WriteMap, Threads
 };
 
 struct SfCalcArg: public Arg {
@@ -95,6 +95,8 @@ const option::Descriptor Usage[] = {
     "  --noaniso  \tIgnore anisotropic ADPs." },
   { Margin, 0, "", "margin", Arg::Float,
     "  --margin=NUM  \tFor non-crystal use bounding box w/ margin (default: 10)." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads for direct calculation and scaling (default: 1)." },
 
   { NoOp, 0, "", "", Arg::None,
     "\nOptions for density and FFT calculations (with --dmin):" },
@@ -226,7 +228,7 @@ void process_with_fft(const gemmi::Structure& st,
                       gemmi::Scaling<Real>& scaling,
                       bool verbose, const RefFile& file,
                       const gemmi::AsuData<gemmi::ValueSigma<Real>>& scale_to,
-                      const char* map_file) {
+                      const char* map_file, int nthreads) {
   // prepare electron density map
   if (verbose) {
     fprintf(stderr, "Preparing electron density on a grid...\n");
@@ -287,7 +289,7 @@ void process_with_fft(const gemmi::Structure& st,
            (unsigned long) scaling.points.size()); // %zu is absent in old MinGW
     scaling.fit_isotropic_b_approximately();
     //fprintf(stderr, "k_ov=%g B_ov=%g\n", scaling.k_overall, scaling.get_b_overall().u11);
-    scaling.fit_parameters();
+    scaling.fit_parameters(nthreads);
     gemmi::SMat33<double> b_aniso = scaling.get_b_overall();
     fprintf(stderr, "k_ov=%g B11=%g B22=%g B33=%g B12=%g B13=%g B23=%g\n",
             scaling.k_overall, b_aniso.u11, b_aniso.u22, b_aniso.u33,
@@ -301,6 +303,15 @@ void process_with_fft(const gemmi::Structure& st,
     for (gemmi::HklValue<std::complex<Real>>& hv : asu_data.v)
       print_sf(hv.value, hv.hkl);
   } else {
+    std::vector<std::complex<double>> exact_values;
+    if (!file.path) {  // --test without cache
+      std::vector<gemmi::Miller> hkls;
+      hkls.reserve(asu_data.v.size());
+      for (const gemmi::HklValue<std::complex<Real>>& hv : asu_data.v)
+        hkls.push_back(hv.hkl);
+      exact_values = calc.calculate_sf_batch(calc.prepare_atoms(st.models[0]),
+                                             hkls, nthreads);
+    }
     for (gemmi::HklValue<std::complex<Real>>& hv : asu_data.v) {
       std::complex<double> exact;
       if (file.path) {
@@ -322,9 +333,9 @@ void process_with_fft(const gemmi::Structure& st,
           exact = it->value;
         }
       } else {
-        exact = calc.calculate_sf_from_model(st.models[0], hv.hkl);
+        exact = exact_values[&hv - asu_data.v.data()];
         if (mott_bethe)
-          exact *= calc.mott_bethe_factor();
+          exact *= calc.mott_bethe_factor(hv.hkl);
       }
       comparator.add_complex(hv.value, exact);
       printf(" (%d %d %d)\t%7.2f\t%8.3f \t%6.2f\t%7.3f\td=%5.2f\n",
@@ -344,7 +355,7 @@ template<typename Table>
 void print_structure_factors_sm(const gemmi::SmallStructure& small,
                                 gemmi::StructureFactorCalculator<Table>& calc,
                                 bool mott_bethe, double d_min, bool verbose,
-                                const RefFile& file) {
+                                const RefFile& file, int nthreads) {
   Timer timer(verbose);
   timer.start();
   int counter = 0;
@@ -359,6 +370,7 @@ void print_structure_factors_sm(const gemmi::SmallStructure& small,
   gemmi::ReciprocalAsu asu(sg);
   gemmi::AsuData<std::complex<double>> asu_data;
   gemmi::GroupOps gops = sg->operations();
+  std::vector<gemmi::Miller> hkls;
   for (int h = -max_h; h <= max_h; ++h)
     for (int k = -max_k; k <= max_k; ++k)
       for (int l = 0; l <= max_l; ++l) {
@@ -368,17 +380,21 @@ void print_structure_factors_sm(const gemmi::SmallStructure& small,
         if (gops.is_systematically_absent(hkl))
           continue;
         double hkl_1_d2 = small.cell.calculate_1_d2(hkl);
-        if (hkl_1_d2 < max_1_d * max_1_d) {
-          auto value = calc.calculate_sf_from_small_structure(small, hkl);
-          if (mott_bethe)
-            value *= calc.mott_bethe_factor();
-          if (file.mode == RefFile::Mode::WriteMtz)
-            asu_data.v.push_back({hkl, value});
-          else
-            print_sf(value, hkl);
-          ++counter;
-        }
+        if (hkl_1_d2 < max_1_d * max_1_d)
+          hkls.push_back(hkl);
       }
+  std::vector<std::complex<double>> values =
+    calc.calculate_sf_batch(calc.prepare_atoms(small), hkls, nthreads);
+  for (size_t i = 0; i != hkls.size(); ++i) {
+    std::complex<double> value = values[i];
+    if (mott_bethe)
+      value *= calc.mott_bethe_factor(hkls[i]);
+    if (file.mode == RefFile::Mode::WriteMtz)
+      asu_data.v.push_back({hkls[i], value});
+    else
+      print_sf(value, hkls[i]);
+    ++counter;
+  }
   if (verbose) {
     fflush(stdout);
     fprintf(stderr, "Calculated %d SFs in %g s.\n", counter, timer.count());
@@ -397,7 +413,7 @@ void compare_with_hkl(const gemmi::SmallStructure& small,
                       const RefFile& file,
                       bool verbose,
                       Comparator& comparator,
-                      bool mott_bethe) {
+                      bool mott_bethe, int nthreads) {
   namespace cif = gemmi::cif;
   cif::Document hkl_doc = gemmi::read_cif_gz(file.path);
   cif::Block& block = hkl_doc.blocks.at(0);
@@ -430,6 +446,8 @@ void compare_with_hkl(const gemmi::SmallStructure& small,
     fprintf(stderr, "Checking %s_refln_%s from %s\n",
             use_sqrt ? "sqrt of " : "", tags[col].c_str()+1, file.path);
   gemmi::Miller hkl;
+  std::vector<gemmi::Miller> hkls;
+  std::vector<double> f_values;
   int missing = 0;
   int negative = 0;
   for (auto row : table) {
@@ -454,13 +472,20 @@ void compare_with_hkl(const gemmi::SmallStructure& small,
       fprintf(stderr, "Error in _refln_[] in %s: %s\n", file.path, e.what());
       continue;
     }
-    double f = std::abs(calc.calculate_sf_from_small_structure(small, hkl));
+    hkls.push_back(hkl);
+    f_values.push_back(f_from_file);
+  }
+  std::vector<std::complex<double>> calculated =
+    calc.calculate_sf_batch(calc.prepare_atoms(small), hkls, nthreads);
+  for (size_t i = 0; i != hkls.size(); ++i) {
+    hkl = hkls[i];
+    double f = std::abs(calculated[i]);
     if (mott_bethe)
-      f *= calc.mott_bethe_factor();
-    comparator.add(f_from_file, f);
+      f *= calc.mott_bethe_factor(hkl);
+    comparator.add(f_values[i], f);
     if (verbose)
       printf(" (%d %d %d)\t%7.2f\t%8.3f \td=%5.2f\n",
-             hkl[0], hkl[1], hkl[2], f_from_file, f,
+             hkl[0], hkl[1], hkl[2], f_values[i], f,
              small.cell.calculate_d(hkl));
   }
   if (missing)
@@ -473,19 +498,25 @@ template<typename Table>
 void compare_with_mtz(const gemmi::Model& model, const gemmi::UnitCell& cell,
                       gemmi::StructureFactorCalculator<Table>& calc,
                       const RefFile& file, bool verbose, Comparator& comparator,
-                      bool mott_bethe) {
+                      bool mott_bethe, int nthreads) {
   gemmi::Mtz mtz;
   mtz.read_input(gemmi::MaybeGzipped(file.path), true);
   gemmi::Mtz::Column* col = mtz.column_with_label(file.f_label);
   if (!col)
     gemmi::fail("MTZ file has no column with label: " + file.f_label);
   gemmi::MtzDataProxy data_proxy{mtz};
+  std::vector<gemmi::Miller> hkls;
+  hkls.reserve(mtz.nreflections);
+  for (size_t i = 0; i < data_proxy.size(); i += data_proxy.stride())
+    hkls.push_back(data_proxy.get_hkl(i));
+  std::vector<std::complex<double>> calculated =
+    calc.calculate_sf_batch(calc.prepare_atoms(model), hkls, nthreads);
   for (size_t i = 0; i < data_proxy.size(); i += data_proxy.stride()) {
-    gemmi::Miller hkl = data_proxy.get_hkl(i);
+    const gemmi::Miller& hkl = hkls[i / data_proxy.stride()];
     double f_from_file = data_proxy.get_num(i + col->idx);
-    double f = std::abs(calc.calculate_sf_from_model(model, hkl));
+    double f = std::abs(calculated[i / data_proxy.stride()]);
     if (mott_bethe)
-      f *= calc.mott_bethe_factor();
+      f *= calc.mott_bethe_factor(hkl);
     comparator.add(f_from_file, f);
     if (verbose)
       printf(" (%d %d %d)\t%7.2f\t%8.3f \td=%5.2f\n",
@@ -498,6 +529,7 @@ void process_with_table(bool use_st, gemmi::Structure& st, const gemmi::SmallStr
                         double wavelength, bool mott_bethe, const OptParser& p) {
   const gemmi::UnitCell& cell = use_st ? st.cell : small.cell;
   gemmi::StructureFactorCalculator<Table> calc(cell);
+  int nthreads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
 
   // assign f' given explicitely in a file
   if (p.options[CifFp]) {
@@ -658,13 +690,14 @@ void process_with_table(bool use_st, gemmi::Structure& st, const gemmi::SmallStr
       }
       const char* map_file = p.options[WriteMap] ? p.options[WriteMap].arg : nullptr;
       process_with_fft(st, dencalc, mott_bethe, masker, scaling,
-                       p.options[Verbose], file, scale_to, map_file);
+                       p.options[Verbose], file, scale_to, map_file, nthreads);
     } else {
       if (p.options[Rate] || p.options[RCut] || p.options[Blur] ||
           p.options[Test])
         gemmi::fail("Small molecule SFs are calculated directly. Do not use any\n"
                     "of the FFT-related options: --rate, --blur, --rcut, --test.");
-      print_structure_factors_sm(small, calc, mott_bethe, d_min, p.options[Verbose], file);
+      print_structure_factors_sm(small, calc, mott_bethe, d_min, p.options[Verbose],
+                                 file, nthreads);
     }
 
   // handle option --compare
@@ -672,9 +705,10 @@ void process_with_table(bool use_st, gemmi::Structure& st, const gemmi::SmallStr
     Comparator comparator;
     if (use_st)
       compare_with_mtz(st.models[0], st.cell, calc, file, p.options[Verbose],
-                       comparator, mott_bethe);
+                       comparator, mott_bethe, nthreads);
     else
-      compare_with_hkl(small, calc, file, p.options[Verbose], comparator, mott_bethe);
+      compare_with_hkl(small, calc, file, p.options[Verbose], comparator,
+                       mott_bethe, nthreads);
     print_to_stderr(comparator);
     fprintf(stderr, "  sum(F^2)_ratio=%g\n", comparator.scale());
   }
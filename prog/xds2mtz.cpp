@@ -3,6 +3,7 @@
 // Convert reflection data from XDS_ASCII to MTZ.
 
 #include <cstdio>             // for fprintf
+#include <algorithm>          // for stable_sort
 #include <set>
 #include <gemmi/gz.hpp>        // for MaybeGzipped
 #include <gemmi/xds_ascii.hpp> // for XdsAscii
@@ -15,7 +16,7 @@
 namespace {
 
 enum OptionIndex {
-  Title=4, History, Polarization, Normal
+  Title=4, History, Threads, Polarization, Normal
 };
 
 const option::Descriptor Usage[] = {
@@ -30,6 +31,8 @@ const option::Descriptor Usage[] = {
     "  --title  \tMTZ title." },
   { History, 0, "-H", "history", Arg::Required,
     "  -H LINE, --history=LINE  \tAdd a history line." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads used for parsing (default: 1)." },
   { NoOp, 0, "", "", Arg::None,
     "\nPolarization correction options for INTEGRATE.HKL files:" },
   { Polarization, 0, "", "polarization", Arg::Float,
@@ -60,7 +63,8 @@ int GEMMI_MAIN(int argc, char **argv) {
   if (verbose)
     std::fprintf(stderr, "Reading %s ...\n", input_path);
   try {
-    xds.read_input(gemmi::MaybeGzipped(input_path));
+    int nthreads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
+    xds.read_input(gemmi::MaybeGzipped(input_path), nthreads);
 
     // polarization correction
     if (p.options[Polarization]) {
@@ -116,30 +120,14 @@ int GEMMI_MAIN(int argc, char **argv) {
     }
     mtz.add_column("FLAG", 'I', 0, -1, false);
     mtz.nreflections = (int) xds.data.size();
-    mtz.data.resize(mtz.columns.size() * xds.data.size());
+    // Miller indices are moved to ASU in place, M/ISYM is stored separately.
     gemmi::UnmergedHklMover hkl_mover(mtz.spacegroup);
+    std::vector<int> isyms(xds.data.size());
     std::set<int> frames;
-    size_t k = 0;
-    for (const gemmi::XdsAscii::Refl& refl : xds.data) {
-      auto hkl = refl.hkl;
-      int isym = hkl_mover.move_to_asu(hkl);
-      for (size_t j = 0; j != 3; ++j)
-        mtz.data[k++] = (float) hkl[j];
-      mtz.data[k++] = (float) isym;
-      int frame = refl.frame();
-      frames.insert(frame);
-      mtz.data[k++] = (float) frame;
-      mtz.data[k++] = (float) refl.iobs;  // I
-      mtz.data[k++] = (float) std::fabs(refl.sigma);  // SIGI
-      mtz.data[k++] = (float) refl.xd;
-      mtz.data[k++] = (float) refl.yd;
-      mtz.data[k++] = (float) xds.rot_angle(refl);  // ROT
-      if (xds.has11) {
-        mtz.data[k++] = float(0.01 * refl.peak);  // FRACTIONCALC
-        mtz.data[k++] = (float) refl.rlp;
-        mtz.data[k++] = float(0.01 * refl.corr);
-      }
-      mtz.data[k++] = refl.sigma < 0 ? 64.f : 0.f;  // FLAG
+    for (size_t i = 0; i != xds.data.size(); ++i) {
+      gemmi::XdsAscii::Refl& refl = xds.data[i];
+      isyms[i] = hkl_mover.move_to_asu(refl.hkl);
+      frames.insert(refl.frame());
     }
     // Prepare a similar batch header as Pointless.
     gemmi::Mtz::Batch batch;
@@ -214,11 +202,52 @@ int GEMMI_MAIN(int argc, char **argv) {
       batch.floats[37] = float(phistt + xds.oscillation_range);  // phiend
       mtz.batches.push_back(batch);
     }
-    mtz.sort(5);
+    // The same order as from mtz.sort(5), but the data is written
+    // in chunks (without storing all MTZ rows in memory).
+    std::vector<int> order(xds.data.size());
+    for (size_t i = 0; i != order.size(); ++i)
+      order[i] = (int) i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+      const gemmi::XdsAscii::Refl& ra = xds.data[a];
+      const gemmi::XdsAscii::Refl& rb = xds.data[b];
+      if (ra.hkl != rb.hkl)
+        return ra.hkl < rb.hkl;
+      if (isyms[a] != isyms[b])
+        return isyms[a] < isyms[b];
+      return ra.frame() < rb.frame();
+    });
+    mtz.sort_order = {{1, 2, 3, 4, 5}};
     if (verbose)
       std::fprintf(stderr, "Writing %d reflections to %s ...\n",
                    mtz.nreflections, output_path);
-    mtz.write_to_file(output_path);
+    gemmi::MtzWriter writer(mtz, output_path);
+    const size_t chunk_size = 65536 * mtz.columns.size();
+    std::vector<float> buf;
+    buf.reserve(chunk_size);
+    for (int i : order) {
+      const gemmi::XdsAscii::Refl& refl = xds.data[i];
+      for (size_t j = 0; j != 3; ++j)
+        buf.push_back((float) refl.hkl[j]);
+      buf.push_back((float) isyms[i]);
+      buf.push_back((float) refl.frame());
+      buf.push_back((float) refl.iobs);  // I
+      buf.push_back((float) std::fabs(refl.sigma));  // SIGI
+      buf.push_back((float) refl.xd);
+      buf.push_back((float) refl.yd);
+      buf.push_back((float) xds.rot_angle(refl));  // ROT
+      if (xds.has11) {
+        buf.push_back(float(0.01 * refl.peak));  // FRACTIONCALC
+        buf.push_back((float) refl.rlp);
+        buf.push_back(float(0.01 * refl.corr));
+      }
+      buf.push_back(refl.sigma < 0 ? 64.f : 0.f);  // FLAG
+      if (buf.size() >= chunk_size) {
+        writer.add_rows(buf);
+        buf.clear();
+      }
+    }
+    writer.add_rows(buf);
+    writer.finish();
   } catch (std::exception& e) {
     std::fprintf(stderr, "ERROR: %s\n", e.what());
     return 1;
@@ -15,6 +15,7 @@ bool operator>(const std::complex<float>& a, const std::complex<float>& b) {
 #include "gemmi/solmask.hpp"  // for SolventMasker, mask_points_in_constant_radius
 #include "gemmi/blob.hpp"     // for Blob, find_blobs_by_flood_fill
 #include "gemmi/asumask.hpp"  // for MaskedGrid
+#include "gemmi/mapcorr.hpp"  // for LocalCorrelation, calculate_fsc
 #include "tostr.hpp"
 
 #include "common.h"
@@ -114,11 +115,12 @@ py::class_<Grid<T>, GridBase<T>> add_grid_common(py::module& m, const std::strin
     .def("set_unit_cell", (void (Gr::*)(const UnitCell&)) &Gr::set_unit_cell)
     .def("set_points_around", &Gr::set_points_around,
          py::arg("position"), py::arg("radius"), py::arg("value"), py::arg("use_pbc")=true)
-    .def("symmetrize_min", &Gr::symmetrize_min)
-    .def("symmetrize_max", &Gr::symmetrize_max)
-    .def("symmetrize_abs_max", &Gr::symmetrize_abs_max)
-    .def("symmetrize_sum", &Gr::symmetrize_sum)
-    .def("resample_to", &Gr::resample_to, py::arg("dest"), py::arg("order"))
+    .def("symmetrize_min", &Gr::symmetrize_min, py::arg("nthreads")=1)
+    .def("symmetrize_max", &Gr::symmetrize_max, py::arg("nthreads")=1)
+    .def("symmetrize_abs_max", &Gr::symmetrize_abs_max, py::arg("nthreads")=1)
+    .def("symmetrize_sum", &Gr::symmetrize_sum, py::arg("nthreads")=1)
+    .def("resample_to", &Gr::resample_to,
+         py::arg("dest"), py::arg("order"), py::arg("nthreads")=1)
     .def("masked_asu", &masked_asu<T>, py::keep_alive<0, 1>())
     .def("mask_points_in_constant_radius", &mask_points_in_constant_radius<T>,
          py::arg("model"), py::arg("radius"), py::arg("value"))
@@ -245,7 +247,8 @@ void add_grid(py::module& m) {
     .def("set_to_zero", &SolventMasker::set_to_zero)
     ;
   m.def("interpolate_grid", &interpolate_grid<float>,
-        py::arg("dest"), py::arg("src"), py::arg("tr"), py::arg("order")=2);
+        py::arg("dest"), py::arg("src"), py::arg("tr"), py::arg("order")=2,
+        py::arg("nthreads")=1);
   m.def("interpolate_grid_of_aligned_model2", &interpolate_grid_of_aligned_model2<float>,
         py::arg("dest"), py::arg("src"), py::arg("tr"),
         py::arg("dest_model"), py::arg("radius"), py::arg("order")=2);
@@ -283,4 +286,28 @@ void add_grid(py::module& m) {
     .def("str", &AsuBrick::str)
     ;
   m.def("find_asu_brick", &find_asu_brick);
+
+  // from mapcorr.hpp
+  py::class_<LocalCorrelation>(m, "LocalCorrelation")
+    .def(py::init<>())
+    .def("prepare", &LocalCorrelation::prepare<float>,
+         py::arg("x"), py::arg("y"), py::arg("nthreads")=1)
+    .def("box_cc", (double (LocalCorrelation::*)(int, int, int, int, int, int) const)
+                   &LocalCorrelation::box_cc,
+         py::arg("u"), py::arg("v"), py::arg("w"),
+         py::arg("su"), py::arg("sv"), py::arg("sw"))
+    .def("calculate_residue_cc", &LocalCorrelation::calculate_residue_cc,
+         py::arg("model"), py::arg("margin"), py::arg("nthreads")=1)
+    ;
+  m.def("calculate_local_correlation_map", &calculate_local_correlation_map<float>,
+        py::arg("x"), py::arg("y"), py::arg("radius"), py::arg("nthreads")=1);
+  py::class_<FscBin>(m, "FscBin")
+    .def_readonly("n", &FscBin::n)
+    .def("fsc", &FscBin::fsc)
+    .def("full_map_fsc", &FscBin::full_map_fsc)
+    ;
+  m.def("setup_binner_for_grid", &setup_binner_for_grid<std::complex<float>>,
+        py::arg("binner"), py::arg("nbins"), py::arg("method"), py::arg("grid"));
+  m.def("calculate_fsc", &calculate_fsc<float>,
+        py::arg("a"), py::arg("b"), py::arg("binner"), py::arg("nthreads")=1);
 }
@@ -161,6 +161,11 @@ void add_hkl(py::module& m) {
         std::ostringstream out;
         return new Mtz(self.convert_block_to_mtz(rb, out));
     })
+    .def("write_block_to_mtz_file", [](const CifToMtz& self, const ReflnBlock& rb,
+                                       const std::string& path) {
+        std::ostringstream out;
+        self.write_block_to_mtz_file(rb, path, out);
+    }, py::arg("rb"), py::arg("path"))
     ;
 
   py::enum_<DataType>(m, "DataType")
@@ -183,8 +188,11 @@ void add_hkl(py::module& m) {
     .def_readwrite("type", &Intensities::type)
     .def("resolution_range", &Intensities::resolution_range)
     .def("remove_systematic_absences", &Intensities::remove_systematic_absences)
-    .def("merge_in_place", &Intensities::merge_in_place, py::arg("itype"))
+    .def("merge_in_place", &Intensities::merge_in_place,
+         py::arg("itype"), py::arg("nthreads")=1)
     .def("read_mtz", &Intensities::read_mtz, py::arg("mtz"), py::arg("type"))
+    .def("calculate_merging_stats", &Intensities::calculate_merging_stats,
+         py::arg("binner"), py::arg("anomalous")=false, py::arg("nthreads")=1)
     .def_property_readonly("miller_array", [](const Intensities& self) {
       const Intensities::Refl* data = self.data.data();
       py::array::ShapeContainer shape({(py::ssize_t)self.data.size(), 3});
@@ -316,6 +324,43 @@ void add_hkl(py::module& m) {
 
   m.def("combine_correlations", &combine_correlations);
 
+  py::class_<BinStats>(m, "BinStats")
+    .def_readonly("nan_count", &BinStats::nan_count)
+    .def_property_readonly("count", &BinStats::count)
+    .def_property_readonly("mean", &BinStats::mean)
+    .def_property_readonly("mean_sq", &BinStats::mean_sq)
+    .def_property_readonly("mean_over_sigma", &BinStats::mean_over_sigma)
+    .def_property_readonly("variance", [](const BinStats& self) {
+        return self.value.for_sample();
+    })
+    .def_property_readonly("mean_1_d2", [](const BinStats& self) {
+        return self.inv_d2.mean_x;
+    })
+    ;
+  m.def("calculate_bin_stats", [](const Binner& binner, const Mtz& mtz,
+                                  const std::string& label, const std::string& sigma_label,
+                                  int nthreads) {
+      int sigma_idx = -1;
+      if (!sigma_label.empty())
+        sigma_idx = (int) mtz.get_column_with_label(sigma_label).idx;
+      size_t idx = mtz.get_column_with_label(label).idx;
+      return calculate_bin_stats(binner, MtzDataProxy{mtz}, idx, sigma_idx, nthreads);
+  }, py::arg("binner"), py::arg("mtz"), py::arg("label"), py::arg("sigma_label")="",
+     py::arg("nthreads")=1);
+  m.def("count_reflections_in_bins", &count_reflections_in_bins,
+        py::arg("binner"), py::arg("spacegroup"));
+
+  py::class_<MergingStats>(m, "MergingStats")
+    .def_readonly("all_refl", &MergingStats::all_refl)
+    .def_readonly("unique_refl", &MergingStats::unique_refl)
+    .def_readonly("stats_refl", &MergingStats::stats_refl)
+    .def("r_merge", &MergingStats::r_merge)
+    .def("r_meas", &MergingStats::r_meas)
+    .def("r_pim", &MergingStats::r_pim)
+    .def("cc_half", &MergingStats::cc_half)
+    .def("mean_i_over_sigma", &MergingStats::mean_i_over_sigma)
+    ;
+
   py::class_<HklMatch>(m, "HklMatch")
     .def(py::init([](py::array_t<int, py::array::c_style> hkl,
                      py::array_t<int, py::array::c_style> ref) {
@@ -11,10 +11,8 @@ namespace py = pybind11;
 using namespace gemmi;
 
 using monomers_type = std::map<std::string, ChemComp>;
-using links_type = std::map<std::string, ChemLink>;
 using modifications_type = std::map<std::string, ChemMod>;
 PYBIND11_MAKE_OPAQUE(monomers_type)
-PYBIND11_MAKE_OPAQUE(links_type)
 PYBIND11_MAKE_OPAQUE(modifications_type)
 
 void add_monlib(py::module& m) {
@@ -22,7 +20,51 @@ void add_monlib(py::module& m) {
   py::class_<ChemLink> chemlink(m, "ChemLink");
 
   py::bind_map<monomers_type>(m, "ChemCompMap");
-  py::bind_map<links_type>(m, "ChemLinkMap");
+  // Not bind_map: ChemLinkMap counts changes (for MonLib::link_index),
+  // so links returned here for possible in-place changes are counted too.
+  py::class_<ChemLinkMap>(m, "ChemLinkMap")
+    .def("__len__", &ChemLinkMap::size)
+    .def("__bool__", [](const ChemLinkMap& self) { return !self.empty(); })
+    .def("__contains__", [](const ChemLinkMap& self, const std::string& key) {
+        return self.count(key) != 0;
+    })
+    .def("__iter__", [](const ChemLinkMap& self) {
+        return py::make_key_iterator(self.begin(), self.end());
+    }, py::keep_alive<0, 1>())
+    .def("keys", [](const ChemLinkMap& self) {
+        std::vector<std::string> keys;
+        for (const auto& item : self)
+          keys.push_back(item.first);
+        return keys;
+    })
+    .def("values", [](ChemLinkMap& self) {
+        std::vector<ChemLink*> values;
+        for (const auto& item : self)
+          values.push_back(&self.modify(item.first));
+        return values;
+    }, py::return_value_policy::reference_internal)
+    .def("items", [](ChemLinkMap& self) {
+        std::vector<std::pair<std::string, ChemLink*>> items;
+        for (const auto& item : self)
+          items.emplace_back(item.first, &self.modify(item.first));
+        return items;
+    }, py::return_value_policy::reference_internal)
+    .def("__getitem__", [](ChemLinkMap& self, const std::string& key) -> ChemLink& {
+        if (self.count(key) == 0)
+          throw py::key_error(key);
+        return self.modify(key);
+    }, py::return_value_policy::reference_internal)
+    .def("__setitem__", [](ChemLinkMap& self, const std::string& key, const ChemLink& link) {
+        if (!self.emplace(key, link).second)
+          self.modify(key) = link;
+    })
+    .def("__delitem__", [](ChemLinkMap& self, const std::string& key) {
+        if (self.erase(key) == 0)
+          throw py::key_error(key);
+    })
+    .def("__repr__", [](const ChemLinkMap& self) {
+        return "<gemmi.ChemLinkMap with " + std::to_string(self.size()) + " links>";
+    });
   py::bind_map<modifications_type>(m, "ChemModMap");
 
   py::class_<ChemLink::Side>(chemlink, "Side")
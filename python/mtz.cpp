@@ -310,7 +310,10 @@ void add_mtz(py::module& m) {
     .def_readonly("axes", &Mtz::Batch::axes)
     ;
 
-  m.def("read_mtz_file", [](const std::string& path) {
+  m.def("read_mtz_file", [](const std::string& path, py::object columns) {
+      if (!columns.is_none())
+        return read_mtz_columns(MaybeGzipped(path),
+                                columns.cast<std::vector<std::string>>());
       return read_mtz(MaybeGzipped(path), true);
-  }, py::arg("path"), py::return_value_policy::move);
+  }, py::arg("path"), py::arg("columns")=py::none(), py::return_value_policy::move);
 }
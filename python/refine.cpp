@@ -2,6 +2,7 @@
 
 #include "gemmi/refine/geom.hpp"    // for Geometry
 #include "gemmi/refine/ll.hpp"    // for LL
+#include "gemmi/refine/sparse.hpp"  // for SparseMatrixCSR, solve_pcg
 #include "gemmi/it92.hpp"
 
 #include "common.h"
@@ -102,9 +103,10 @@ void add_ll(py::module& m, const char* name) {
          py::arg("cell"), py::arg("sg"), py::arg("atoms"), py::arg("mott_bethe"),
          py::arg("refine_xyz"), py::arg("adp_mode"), py::arg("refine_h"))
     .def("set_ncs", &T::set_ncs)
-    .def("calc_grad", &T::calc_grad)
-    .def("make_fisher_table_diag_fast", &T::make_fisher_table_diag_fast)
-    .def("fisher_diag_from_table", &T::fisher_diag_from_table)
+    .def("calc_grad", &T::calc_grad, py::arg("den"), py::arg("b_add"), py::arg("nthreads")=1)
+    .def("make_fisher_table_diag_fast", &T::make_fisher_table_diag_fast,
+         py::arg("b_min"), py::arg("b_max"), py::arg("d2dfw_table"), py::arg("nthreads")=1)
+    .def("fisher_diag_from_table", &T::fisher_diag_from_table, py::arg("nthreads")=1)
     .def("fisher_for_coo", [](T &self) {return for_coo_matrix(self);}, py::return_value_policy::reference_internal)
     .def_readonly("table_bs", &T::table_bs)
     .def_readonly("pp1", &T::pp1)
@@ -549,7 +551,8 @@ void add_refine(py::module& m) {
     .def("setup_nonbonded", &Geometry::setup_nonbonded)
     .def("calc", &Geometry::calc, py::arg("use_nucleus"), py::arg("check_only"),
          py::arg("wbond")=1, py::arg("wangle")=1, py::arg("wtors")=1,
-         py::arg("wchir")=1, py::arg("wplane")=1, py::arg("wstack")=1, py::arg("wvdw")=1)
+         py::arg("wchir")=1, py::arg("wplane")=1, py::arg("wstack")=1, py::arg("wvdw")=1,
+         py::arg("nthreads")=1)
     .def("calc_adp_restraint", &Geometry::calc_adp_restraint)
     // vdw parameters
     .def_readwrite("vdw_sdi_vdw", &Geometry::vdw_sdi_vdw)
@@ -564,6 +567,8 @@ void add_refine(py::module& m) {
     .def_readwrite("dinc_torsion_all", &Geometry::dinc_torsion_all)
     .def_readwrite("dinc_dummy", &Geometry::dinc_dummy)
     .def_readwrite("vdw_sdi_dummy", &Geometry::vdw_sdi_dummy)
+    .def_readwrite("nonbonded_skin", &Geometry::nonbonded_skin)
+    .def_readwrite("min_threads_for_packets", &Geometry::min_threads_for_packets)
     // ADP restraint parameters
     .def_readwrite("adpr_max_dist", &Geometry::adpr_max_dist)
     .def_readwrite("adpr_d_power", &Geometry::adpr_d_power)
@@ -583,4 +588,59 @@ void add_refine(py::module& m) {
     ;
   add_ll<gemmi::IT92<double>>(m, "LLX");
   m.def("precondition_eigen_coo", &precondition_eigen_coo);
+
+  using DoubleArray = py::array_t<double, py::array::c_style | py::array::forcecast>;
+  using IntArray = py::array_t<int, py::array::c_style | py::array::forcecast>;
+  py::class_<SparseMatrixCSR>(m, "SparseMatrixCSR")
+    .def_readonly("n", &SparseMatrixCSR::n)
+    .def_property_readonly("nnz", &SparseMatrixCSR::nnz)
+    // arrays for scipy.sparse.csr_matrix((data, indices, indptr)), not copied
+    .def_property_readonly("indptr", [](const SparseMatrixCSR& self) {
+        return py::array_t<int>(self.row_ptr.size(), self.row_ptr.data(), py::cast(self));
+    }, py::return_value_policy::reference_internal)
+    .def_property_readonly("indices", [](const SparseMatrixCSR& self) {
+        return py::array_t<int>(self.col_idx.size(), self.col_idx.data(), py::cast(self));
+    }, py::return_value_policy::reference_internal)
+    .def_property_readonly("data", [](const SparseMatrixCSR& self) {
+        return py::array_t<double>(self.values.size(), self.values.data(), py::cast(self));
+    }, py::return_value_policy::reference_internal)
+    .def("at", &SparseMatrixCSR::at)
+    .def("multiply", [](const SparseMatrixCSR& self, DoubleArray x, int nthreads) {
+        if (x.ndim() != 1 || x.shape(0) != self.n)
+          throw std::domain_error("multiply: wrong size of x");
+        py::array_t<double> y(self.n);
+        self.multiply(x.data(), y.mutable_data(), nthreads);
+        return y;
+    }, py::arg("x"), py::arg("nthreads")=1)
+    ;
+  py::class_<SymmetricMatrixBuilder>(m, "SymmetricMatrixBuilder")
+    .def(py::init<int>(), py::arg("n"))
+    .def("add", [](SymmetricMatrixBuilder& self, DoubleArray values,
+                   IntArray rows, IntArray cols, double weight) {
+        const size_t len = values.size();
+        if ((size_t) rows.size() != len || (size_t) cols.size() != len)
+          throw std::domain_error("add: arrays of different sizes");
+        self.add(values.data(), rows.data(), cols.data(), len, weight);
+    }, py::arg("values"), py::arg("rows"), py::arg("cols"), py::arg("weight")=1.)
+    .def("add_am", [](SymmetricMatrixBuilder& self, const GeomTarget& t, double weight) {
+        self.add_am(t, t.am, weight);
+    }, py::arg("target"), py::arg("weight")=1.)
+    .def("add_am", [](SymmetricMatrixBuilder& self, gemmi::LL<gemmi::IT92<double>>& ll,
+                      double weight, int nthreads) {
+        self.add_am(ll, ll.fisher_diag_from_table(nthreads), weight);
+    }, py::arg("ll"), py::arg("weight")=1., py::arg("nthreads")=1)
+    .def("to_csr", &SymmetricMatrixBuilder::to_csr, py::arg("nthreads")=1)
+    ;
+  py::class_<BlockJacobi>(m, "BlockJacobi")
+    .def(py::init<const SparseMatrixCSR&, int, double>(),
+         py::arg("a"), py::arg("n3"), py::arg("cutoff"))
+    ;
+  m.def("solve_pcg", [](const SparseMatrixCSR& a, const BlockJacobi& precond,
+                        const std::vector<double>& b, int max_iter, double tol,
+                        int nthreads) {
+      std::vector<double> x;
+      int iter = solve_pcg(a, precond, b, x, max_iter, tol, nthreads);
+      return py::make_tuple(py::array_t<double>(x.size(), x.data()), iter);
+  }, py::arg("a"), py::arg("precond"), py::arg("b"), py::arg("max_iter"),
+     py::arg("tol"), py::arg("nthreads")=1);
 }
@@ -21,10 +21,20 @@ void add_sfcalc(py::module& m, const char* name, bool with_mb) {
     .def(py::init<const gemmi::UnitCell&>())
     .def_readwrite("addends", &SFC::addends)
     .def("calculate_sf_from_model", &SFC::calculate_sf_from_model)
-    .def("calculate_sf_from_small_structure", &SFC::calculate_sf_from_small_structure);
+    .def("calculate_sf_from_small_structure", &SFC::calculate_sf_from_small_structure)
+    .def("calculate_sf_batch", [](const SFC& self, const gemmi::Model& model,
+                                  const std::vector<gemmi::Miller>& hkls, int nthreads) {
+        return self.calculate_sf_batch(self.prepare_atoms(model), hkls, nthreads);
+    }, py::arg("model"), py::arg("hkls"), py::arg("nthreads")=1)
+    .def("calculate_sf_batch", [](const SFC& self, const gemmi::SmallStructure& small,
+                                  const std::vector<gemmi::Miller>& hkls, int nthreads) {
+        return self.calculate_sf_batch(self.prepare_atoms(small), hkls, nthreads);
+    }, py::arg("small"), py::arg("hkls"), py::arg("nthreads")=1);
   if (with_mb)
     sfc
-      .def("mott_bethe_factor", &SFC::mott_bethe_factor)
+      .def("mott_bethe_factor", (double (SFC::*)() const) &SFC::mott_bethe_factor)
+      .def("mott_bethe_factor",
+           (double (SFC::*)(const gemmi::Miller&) const) &SFC::mott_bethe_factor)
       .def("calculate_mb_z", &SFC::calculate_mb_z,
            py::arg("model"), py::arg("hkl"), py::arg("only_h")=false);
 }
@@ -49,6 +59,10 @@ void add_dencalc(py::module& m, const char* name) {
     .def("set_grid_cell_and_spacegroup", &DenCalc::set_grid_cell_and_spacegroup)
     .def("reciprocal_space_multiplier", &DenCalc::reciprocal_space_multiplier)
     .def("mott_bethe_factor", &DenCalc::mott_bethe_factor)
+    .def("enable_profile_cache", [](DenCalc& self) {
+        if (!self.profile_cache)
+          self.profile_cache.reset(new gemmi::DensityProfileCache<Table, float>);
+    })
     .def("estimate_radius", [](const DenCalc &self, const gemmi::Atom &atom){
         double b;
         if (!atom.aniso.nonzero())
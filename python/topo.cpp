@@ -1,13 +1,14 @@
 // Copyright 2021 Global Phasing Ltd.
 
 #include "gemmi/topo.hpp"
-#include "gemmi/riding_h.hpp"  // for adjust_hydrogen_distances
+#include "gemmi/riding_h.hpp"  // for adjust_hydrogen_distances, HydrogenRecipe
 #include "gemmi/crd.hpp"       // for prepare_refmac_crd, ...
 
 #include "common.h"
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
 #include <pybind11/iostream.h>  // for detail::pythonbuf
+#include <pybind11/numpy.h>
 
 namespace py = pybind11;
 using namespace gemmi;
@@ -152,7 +153,7 @@ void add_topo(py::module& m) {
   m.def("prepare_topology",
     [](Structure& st, MonLib& monlib, size_t model_index,
        HydrogenChange h_change, bool reorder,
-       const py::object& pywarnings, bool ignore_unknown_links) {
+       const py::object& pywarnings, bool ignore_unknown_links, int nthreads) {
       std::ostream* warnings = nullptr;
       std::ostream os(nullptr);
       std::unique_ptr<py::detail::pythonbuf> buffer;
@@ -162,10 +163,54 @@ void add_topo(py::module& m) {
         warnings = &os;
       }
       return prepare_topology(st, monlib, model_index, h_change, reorder,
-                              warnings, ignore_unknown_links);
+                              warnings, ignore_unknown_links, nthreads);
     }, py::arg("st"), py::arg("monlib"), py::arg("model_index")=0,
        py::arg("h_change")=HydrogenChange::NoChange, py::arg("reorder")=false,
-       py::arg("warnings")=py::none(), py::arg("ignore_unknown_links")=false);
+       py::arg("warnings")=py::none(), py::arg("ignore_unknown_links")=false,
+       py::arg("nthreads")=1);
+
+  using DoubleArray = py::array_t<double, py::array::c_style>;
+  py::class_<HydrogenRecipe>(m, "HydrogenRecipe")
+    .def_readonly("atom_count", &HydrogenRecipe::atom_count)
+    .def_property_readonly("rule_count", [](const HydrogenRecipe& self) {
+        return self.rules.size();
+    })
+    .def("apply", (size_t (HydrogenRecipe::*)(Model&, int) const) &HydrogenRecipe::apply,
+         py::arg("model"), py::arg("nthreads")=1)
+    // x, y, z: arrays (modified in place) of size nsets * atom_count
+    .def("apply_to_arrays", [](const HydrogenRecipe& self, DoubleArray x,
+                               DoubleArray y, DoubleArray z, int nthreads) {
+        size_t size = x.size();
+        size_t nsets = self.atom_count != 0 ? size / self.atom_count : 0;
+        if ((size_t) y.size() != size || (size_t) z.size() != size ||
+            nsets * self.atom_count != size)
+          fail("apply_to_arrays: x, y, z must have the same size,"
+               " a multiple of atom_count");
+        return self.apply(x.mutable_data(), y.mutable_data(), z.mutable_data(),
+                          nsets, nthreads);
+    }, py::arg("x").noconvert(), py::arg("y").noconvert(), py::arg("z").noconvert(),
+       py::arg("nthreads")=1)
+    ;
+  m.def("compile_hydrogen_recipe",
+    [](Topo& topo, const Model& model, const py::object& pywarnings) {
+      std::ostream os(nullptr);
+      std::unique_ptr<py::detail::pythonbuf> buffer;
+      std::ostream* saved_warnings = topo.warnings;
+      topo.warnings = nullptr;
+      if (!pywarnings.is_none()) {
+        buffer.reset(new py::detail::pythonbuf(pywarnings));
+        os.rdbuf(buffer.get());
+        topo.warnings = &os;
+      }
+      try {
+        HydrogenRecipe recipe = compile_hydrogen_recipe(topo, model);
+        topo.warnings = saved_warnings;
+        return recipe;
+      } catch (...) {
+        topo.warnings = saved_warnings;
+        throw;
+      }
+    }, py::arg("topo"), py::arg("model"), py::arg("warnings")=py::none());
 
   // crd.hpp
   m.def("setup_for_crd", &setup_for_crd);
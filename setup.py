@@ -55,7 +55,7 @@ ext_modules = [
               + ['src/%s.cpp' % name for name in
                   ['sprintf', 'mtz', 'to_pdb', 'to_mmcif', 'mtz2cif',
                    'read_cif', 'mmcif', 'mmread_gz',
-                   'resinfo', 'polyheur', 'monlib', 'topo', 'riding_h', 'crd',
+                   'resinfo', 'polyheur', 'monlib', 'topo', 'riding_h', 'rmsz', 'crd',
                    'xds_ascii']],
               include_dirs=zlib_include_dirs + [
                   'include',
@@ -153,6 +153,9 @@ class BuildExt(build_ext):
                 opts.append('-fvisibility=hidden')
             if has_flag(self.compiler, '-g0'):
                 opts.append('-g0')
+            if has_flag(self.compiler, '-pthread'):
+                opts.append('-pthread')
+                link_opts.append('-pthread')
             if has_flag(self.compiler, '-Wl,-s'):
                 link_opts.append('-Wl,-s')
         elif ct.startswith('mingw'):
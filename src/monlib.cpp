@@ -2,6 +2,7 @@
 
 #include <gemmi/monlib.hpp>
 #include <gemmi/calculate.hpp>  // for calculate_chiral_volume
+#include <gemmi/monlib_cache.hpp>  // for MonLibCache
 
 namespace gemmi {
 
@@ -107,7 +108,7 @@ Restraints read_link_restraints(const cif::Block& block_) {
   return rt;
 }
 
-void insert_chemlinks_into(const cif::Document& doc, std::map<std::string,ChemLink>& links) {
+void insert_chemlinks_into(const cif::Document& doc, ChemLinkMap& links) {
   const cif::Block* list_block = doc.find_block("link_list");
   auto use_chem_link = [](const cif::Block& block, ChemLink& link) {
     for (auto row : const_cast<cif::Block&>(block).find("_chem_link.",
@@ -438,6 +439,14 @@ void ChemMod::apply_to(ChemComp& chemcomp, ChemComp::Group alias_group) const {
     }
 }
 
+cif::Document MonLib::read_library_file(const std::string& rel_path,
+                                        read_cif_func read_cif) const {
+  cif::Document doc;
+  if (cache && cache->read_document(monomer_dir, rel_path, doc))
+    return doc;
+  return (*read_cif)(monomer_dir + rel_path);
+}
+
 void MonLib::read_monomer_doc(const cif::Document& doc) {
   // ChemComp
   if (const cif::Block* block = doc.find_block("comp_list"))
@@ -447,6 +456,8 @@ void MonLib::read_monomer_doc(const cif::Document& doc) {
     add_monomer_if_present(block);
   // ChemLink
   insert_chemlinks_into(doc, links);
+  if (!link_index.is_current(links))
+    index_links();
   // ChemMod
   insert_chemmods_into(doc, modifications);
 }
@@ -13,16 +13,10 @@ namespace gemmi {
       sys_fail("Writing MTZ file failed"); \
   } while(0)
 
-template<typename Write>
-void Mtz::write_to_stream(Write write) const {
-  // uses: data, spacegroup, nreflections, batches, cell, sort_order,
-  //       valm, columns, datasets, history
-  if (!has_data())
-    fail("Cannot write Mtz which has no data");
-  if (!spacegroup)
-    fail("Cannot write Mtz which has no space group");
-  char buf[81] = {'M', 'T', 'Z', ' ', '\0'};
-  std::int64_t real_header_start = (int64_t) columns.size() * nreflections + 21;
+namespace {
+// the first 20 bytes of the file; header_start is in 4-byte words
+void prepare_first_record(char* buf, std::int64_t real_header_start) {
+  std::memcpy(buf, "MTZ ", 4);
   std::int32_t header_start = (int32_t) real_header_start;
   if (real_header_start > std::numeric_limits<int32_t>::max()) {
     header_start = -1;
@@ -33,12 +27,37 @@ void Mtz::write_to_stream(Write write) const {
   std::int32_t machst = is_little_endian() ? 0x00004144 : 0x11110000;
   std::memcpy(buf + 8, &machst, 4);
   std::memcpy(buf + 12, &real_header_start, 8);
+}
+} // anonymous namespace
+
+template<typename Write>
+void Mtz::write_to_stream(Write write) const {
+  // uses: data, spacegroup, nreflections, batches, cell, sort_order,
+  //       valm, columns, datasets, history
+  if (!has_data())
+    fail("Cannot write Mtz which has no data");
+  if (!spacegroup)
+    fail("Cannot write Mtz which has no space group");
+  char buf[80] = {0};
+  prepare_first_record(buf, (int64_t) columns.size() * nreflections + 21);
   if (write(buf, 80, 1) != 1 ||
       write(data.data(), 4, data.size()) != data.size())
     fail("Writing MTZ file failed");
+  std::vector<std::array<float,2>> col_minmax;
+  col_minmax.reserve(columns.size());
+  for (const Column& col : columns)
+    col_minmax.push_back(calculate_min_max_disregarding_nans(col.begin(), col.end()));
+  write_headers_to_stream(write, nreflections, col_minmax, calculate_min_max_1_d2());
+}
+
+template<typename Write>
+void Mtz::write_headers_to_stream(Write write, std::int64_t nrefl,
+                                  const std::vector<std::array<float,2>>& col_minmax,
+                                  const std::array<double,2>& reso) const {
+  char buf[81];
   WRITE("VERS MTZ:V1.1");
   WRITE("TITLE %s", title.c_str());
-  WRITE("NCOL %8zu %12d %8zu", columns.size(), nreflections, batches.size());
+  WRITE("NCOL %8zu %12d %8zu", columns.size(), (int) nrefl, batches.size());
   if (cell.is_crystal())
     WRITE("CELL  %9.4f %9.4f %9.4f %9.4f %9.4f %9.4f",
           cell.a, cell.b, cell.c, cell.alpha, cell.beta, cell.gamma);
@@ -63,7 +82,6 @@ void Mtz::write_to_stream(Write write) const {
   else
     for (Op op : ops)
       WRITE("SYMM %s", to_upper(op.triplet()).c_str());
-  auto reso = calculate_min_max_1_d2();
   WRITE("RESO %-20.12f %-20.12f", reso[0], reso[1]);
   if (std::isnan(valm))
     WRITE("VALM NAN");
@@ -74,8 +92,9 @@ void Mtz::write_to_stream(Write write) const {
     int len = gstb_snprintf(buffer, 18, "%.9f", f);
     return std::string(buffer, len > 0 ? std::min(len, 17) : 0);
   };
-  for (const Column& col : columns) {
-    auto minmax = calculate_min_max_disregarding_nans(col.begin(), col.end());
+  for (size_t i = 0; i != columns.size(); ++i) {
+    const Column& col = columns[i];
+    const std::array<float,2>& minmax = col_minmax.at(i);
     const char* label = !col.label.empty() ? col.label.c_str() : "_";
     WRITE("COLUMN %-30s %c %17s %17s %4d",
           label, col.type,
@@ -160,4 +179,36 @@ void Mtz::write_to_file(const std::string& path) const {
   }
 }
 
+void MtzWriter::finish() {
+  if (nreflections > std::numeric_limits<int>::max())
+    fail("Too many reflections for MTZ file: " + path);
+  std::FILE* f = file.get();
+  for (std::array<float,2>& minmax : column_minmax)
+    if (minmax[0] > minmax[1])  // only NaNs (or no data) in the column
+      minmax[0] = minmax[1] = NAN;
+  if (reso[0] == INFINITY)
+    reso[0] = 0;
+  try {
+    mtz.write_headers_to_stream([&](const void *ptr, size_t size, size_t nmemb) {
+        return std::fwrite(ptr, size, nmemb, f);
+    }, nreflections, column_minmax, reso);
+    char buf[80] = {0};
+    prepare_first_record(buf, (int64_t) column_minmax.size() * nreflections + 21);
+    if (std::fseek(f, 0, SEEK_SET) != 0 || std::fwrite(buf, 80, 1, f) != 1)
+      sys_fail("Writing MTZ file failed");
+  } catch (std::runtime_error& e) {
+    fail(std::string(e.what()) + ": " + path);
+  }
+  if (std::fclose(file.release()) != 0) {
+    remove_file(tmp_path);
+    sys_fail("Closing MTZ file failed: " + path);
+  }
+  try {
+    rename_file(tmp_path, path);
+  } catch (...) {
+    remove_file(tmp_path);
+    throw;
+  }
+}
+
 } // namespace gemmi
@@ -1,6 +1,8 @@
 // Copyright 2021 Global Phasing Ltd.
 
 #include <gemmi/read_cif.hpp>
+#include <cstdio>      // for fread, ferror
+#include <cstring>     // for memchr
 #include <gemmi/cif.hpp>    // for cif::read
 #include <gemmi/json.hpp>   // for cif::read_mmjson
 #include <gemmi/gz.hpp>     // for MaybeGzipped
@@ -30,4 +32,64 @@ cif::Document read_first_block_gz(const std::string& path, size_t limit) {
   return doc;
 }
 
+CharArray read_first_block_into_buffer_gz(const std::string& path) {
+  MaybeGzipped input(path);
+  fileptr_t f(nullptr, &std::fclose);
+  if (input.is_compressed())
+    input.get_uncompressing_stream();
+  else if (!input.is_stdin())
+    f = file_open(path.c_str(), "rb");
+  auto read_chunk = [&](char* buf, size_t len) -> size_t {
+    if (input.is_compressed())
+      return input.gzread_checked(buf, len);
+    FILE* file = f ? f.get() : stdin;
+    size_t n = std::fread(buf, 1, len, file);
+    if (n != len && std::ferror(file))
+      sys_fail("failed to read " + path);
+    return n;
+  };
+  auto starts_with_keyword = [](const char* p, const char* end, const char* kw) {
+    for (; *kw != '\0'; ++p, ++kw)
+      if (p == end || (*p | 0x20) != (*kw | 0x20))
+        return false;
+    return true;
+  };
+  CharArray mem(1024 * 1024);
+  size_t size = 0;
+  size_t line_start = 0;  // the first line that was not checked yet
+  bool in_textfield = false;
+  bool in_block = false;
+  for (;;) {
+    size_t n = read_chunk(mem.data() + size, mem.size() - size);
+    size += n;
+    bool eof = size != mem.size();
+    const char* end = mem.data() + size;
+    while (line_start != size) {
+      const char* line = mem.data() + line_start;
+      const char* nl = (const char*) std::memchr(line, '\n', end - line);
+      if (!nl && !eof)
+        break;
+      if (*line == ';')
+        in_textfield = !in_textfield;
+      const char* p = line;
+      while (p != end && (*p == ' ' || *p == '\t'))
+        ++p;
+      if (!in_textfield && *line != ';' &&
+          (starts_with_keyword(p, end, "data_") || starts_with_keyword(p, end, "global_"))) {
+        if (in_block) {
+          mem.set_size(line_start);
+          return mem;
+        }
+        in_block = true;
+      }
+      line_start = nl ? nl + 1 - mem.data() : size;
+    }
+    if (eof) {
+      mem.set_size(size);
+      return mem;
+    }
+    mem.resize(2 * mem.size());
+  }
+}
+
 } // namespace gemmi
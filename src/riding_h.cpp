@@ -1,7 +1,11 @@
 // Copyright 2018-2022 Global Phasing Ltd.
 
 #include <gemmi/riding_h.hpp>
+#include <numeric>             // for accumulate
+#include <sstream>             // for ostringstream
+#include <unordered_map>
 #include <gemmi/calculate.hpp> // for calculate_angle
+#include <gemmi/parallel.hpp>  // for parallel_for_chunks
 
 namespace gemmi {
 
@@ -142,20 +146,20 @@ static double calculate_tetrahedral_delta(double theta0, double theta1, double t
   return std::asin(z);
 }
 
-static void place_hydrogens(const Topo& topo, const Atom& atom) {
-  using Angle = Restraints::Angle;
-  struct BondedAtom {
-    Atom* ptr;
-    Position& pos; // == ptr->pos;
-    double dist;
-  };
+using Rule = HydrogenRecipe::Rule;
 
-  // put atoms bonded to atom into two lists
-  std::vector<BondedAtom> known; // heavy atoms with known positions
-  std::vector<BondedAtom> hs;    // H atoms (unknown)
+struct BondedAtom {
+  Atom* ptr;
+  double dist;
+};
+
+// Puts atoms bonded to atom into two lists: heavy atoms (with known
+// positions) and hydrogens (to be placed).
+static void find_bonded_atoms(const Topo& topo, const Atom& atom,
+                              std::vector<BondedAtom>& known,
+                              std::vector<BondedAtom>& hs) {
   known.reserve(3);
   hs.reserve(4);
-
   auto range = topo.bond_index.equal_range(&atom);
   char limit_altoc = '\0';
   for (auto i = range.first; i != range.second; ++i) {
@@ -181,80 +185,75 @@ static void place_hydrogens(const Topo& topo, const Atom& atom) {
       }
     }
     auto& atom_list = other->is_hydrogen() ? hs : known;
-    atom_list.push_back({other, other->pos, t->restr->value});
+    atom_list.push_back({other, t->restr->value});
   }
+}
 
-  if (hs.size() == 0)
-    return;
-
-  auto giveup = [&](const std::string& message) {
-    for (BondedAtom& bonded_h : hs) {
-      bonded_h.ptr->occ = 0;
-      bonded_h.ptr->calc_flag = CalcFlag::Dummy;
-    }
-    fail(message);
-  };
-
-  for (BondedAtom& bonded_h : hs)
-    bonded_h.ptr->calc_flag = CalcFlag::Calculated;
+// Looks up restraints that are needed to place hydrogens hs bonded to atom.
+// Atoms are stored in rule as numbers returned by index(const Atom*).
+// Throws if the hydrogens can't be placed; other problems are passed
+// to report(const std::string&).
+template<typename Index, typename Report>
+static void make_rule(const Topo& topo, const Atom& atom,
+                      const std::vector<BondedAtom>& known,
+                      const std::vector<BondedAtom>& hs,
+                      Index index, Report report, Rule& rule) {
+  using Angle = Restraints::Angle;
+  rule.parent = index(&atom);
+  rule.n_h = (unsigned char) std::min(hs.size(), (size_t) 4);
+  for (int i = 0; i < rule.n_h; ++i) {
+    rule.h[i] = index(hs[i].ptr);
+    rule.dist[i] = hs[i].dist;
+  }
+  for (size_t i = 0; i < known.size() && i < 3; ++i)
+    rule.heavy[i] = index(known[i].ptr);
+  const unsigned char all_h = (unsigned char) ((1 << rule.n_h) - 1);
 
   // ==== only hydrogens ====
   if (known.size() == 0) {
+    if (hs.size() > 4)
+      fail("Unusual: atom bonded to 5+ hydrogens.");
     // we can only arbitrarily pick directions of atoms
-    for (BondedAtom& bonded_h : hs)
-      bonded_h.ptr->occ = 0;
-    hs[0].pos = atom.pos + Position(hs[0].dist, 0, 0);
-    if (hs.size() > 1) {
-      double theta = pi();
+    rule.kind = Rule::Kind::NoHeavy;
+    rule.zero_occ = all_h;
+    rule.values[0] = pi();
+    if (hs.size() > 1)
       if (const Angle* ang = topo.take_angle(hs[1].ptr, &atom, hs[0].ptr))
-        theta = ang->radians();
-      hs[1].pos = atom.pos + Position(hs[1].dist * cos(theta),
-                                      hs[1].dist * sin(theta), 0);
-    }
-    if (hs.size() > 2) {
-      if (hs.size() == 3) {
-        // for now only NH3 (NH2.cif and NH3.cif) has such configuration,
-        // so we are cheating here a little.
-        double y = 2 * atom.pos.y - hs[1].pos.y;
-        hs[2].pos = Position(hs[1].pos.x, y, hs[1].pos.z);
-      } else if (hs.size() == 4) {
-        // similarly, only CH4 (CH2.cif) and NH4 (NH4.cif) are handled here
-        const Angle* ang1 = topo.take_angle(hs[2].ptr, &atom, hs[0].ptr);
-        const Angle* ang2 = topo.take_angle(hs[2].ptr, &atom, hs[1].ptr);
-        double theta1 = rad(ang1 ? ang1->value : 109.47122);
-        double theta2 = rad(ang2 ? ang2->value : 109.47122);
-        auto pos = position_from_two_angles(atom.pos, hs[0].pos, hs[1].pos,
-                                            hs[2].dist, theta1, theta2);
-        hs[2].pos = pos.first;
-        hs[3].pos = pos.second;
-      }
+        rule.values[0] = ang->radians();
+    if (hs.size() == 4) {
+      // only CH4 (CH2.cif) and NH4 (NH4.cif) are handled here
+      const Angle* ang1 = topo.take_angle(hs[2].ptr, &atom, hs[0].ptr);
+      const Angle* ang2 = topo.take_angle(hs[2].ptr, &atom, hs[1].ptr);
+      rule.values[1] = rad(ang1 ? ang1->value : 109.47122);
+      rule.values[2] = rad(ang2 ? ang2->value : 109.47122);
     }
 
   // ==== one heavy atom and hydrogens ====
   } else if (known.size() == 1) {
-    const BondedAtom& h = hs[0];
-    const BondedAtom& heavy = known[0];
-    const Restraints::Angle* angle = topo.take_angle(h.ptr, &atom, heavy.ptr);
+    const Atom* h = hs[0].ptr;
+    const Atom* heavy = known[0].ptr;
+    const Angle* angle = topo.take_angle(h, &atom, heavy);
     if (!angle)
-      giveup("No angle restraint for " + h.ptr->name + ".\n");
+      fail("No angle restraint for " + h->name + ".\n");
     if (std::abs(angle->value - 180.0) < 0.5) {
-      Vec3 u = atom.pos - h.pos;
-      h.pos = atom.pos + Position(u * (h.dist / u.length()));
       if (hs.size() > 1)
-        giveup("Unusual: one of two H atoms has angle restraint 180 deg.");
+        fail("Unusual: one of two H atoms has angle restraint 180 deg.");
+      rule.kind = Rule::Kind::Linear;
       return;
     }
-    double theta = angle->radians();
-    double tau = 0.0;
+    if (hs.size() >= 4)
+      fail("Unusual: atom bonded to one heavy atoms and 4+ hydrogens.");
+    rule.kind = Rule::Kind::OneHeavy;
+    rule.values[0] = angle->radians();
     int period = 0;
     const Atom* tau_end = nullptr;
     auto plane_range = topo.plane_index.equal_range(&atom);
     for (auto i = plane_range.first; i != plane_range.second; ++i) {
       const Topo::Plane& plane = *i->second;
       // only Topo::Plane with atoms.size() >= 4 is put into planes
-      if (plane.has(h.ptr) && plane.has(heavy.ptr)) {
+      if (plane.has(h) && plane.has(heavy)) {
         for (const Atom* a : plane.atoms) {
-          if (!a->is_hydrogen() && a != &atom && a != heavy.ptr) {
+          if (!a->is_hydrogen() && a != &atom && a != heavy) {
             tau_end = a;
             break;
           }
@@ -262,7 +261,7 @@ static void place_hydrogens(const Topo& topo, const Atom& atom) {
         break;
       }
     }
-    Atom* torsion_h = nullptr;
+    const Atom* torsion_h = nullptr;
     if (!tau_end) {
       // Using one dihedral angle.
       // We don't check here for which hydrogen the torsion angle is defined.
@@ -271,16 +270,16 @@ static void place_hydrogens(const Topo& topo, const Atom& atom) {
       auto tor_range = topo.torsion_index.equal_range(&atom);
       for (auto i = tor_range.first; i != tor_range.second; ++i) {
         const Topo::Torsion& tor = *i->second;
-        if (tor.atoms[1] == &atom && tor.atoms[2] == heavy.ptr &&
+        if (tor.atoms[1] == &atom && tor.atoms[2] == heavy &&
             tor.atoms[0]->is_hydrogen() && !tor.atoms[3]->is_hydrogen()) {
-          tau = rad(tor.restr->value);
+          rule.values[1] = rad(tor.restr->value);
           torsion_h = tor.atoms[0];
           tau_end = tor.atoms[3];
           period = tor.restr->period;
           break;
-        } else if (tor.atoms[2] == &atom && tor.atoms[1] == heavy.ptr &&
+        } else if (tor.atoms[2] == &atom && tor.atoms[1] == heavy &&
                    tor.atoms[3]->is_hydrogen() && !tor.atoms[0]->is_hydrogen()) {
-          tau = rad(tor.restr->value);
+          rule.values[1] = rad(tor.restr->value);
           torsion_h = tor.atoms[3];
           tau_end = tor.atoms[0];
           period = tor.restr->period;
@@ -288,48 +287,19 @@ static void place_hydrogens(const Topo& topo, const Atom& atom) {
         }
       }
     }
-
     if (tau_end)
-      h.pos = position_from_angle_and_torsion(tau_end->pos, heavy.pos, atom.pos,
-                                              h.dist, theta, tau);
-    else
-      h.pos = arbitrary_position_from_angle(heavy.pos, atom.pos, h.dist, theta);
-    if (std::isnan(h.pos.x)) {
-      h.pos = Position(0, 0, 0);
-      giveup("bonded atoms are exactly overlapping.");
-    }
-    if (hs.size() == 2) {
-      // I think we can assume the two hydrogens are symmetric.
-      Vec3 axis = (heavy.pos - atom.pos).normalized();
-      Vec3 perpendicular = get_vector_to_line(hs[0].pos, atom.pos, axis);
-      hs[1].pos = hs[0].pos + Position(2 * perpendicular);
-    } else if (hs.size() == 3) {
-      // Here we assume the three hydrogens are in the same distance from
-      // the parent atom and that they make an equilateral triangle.
-      // First check for which hydrogen was the torsion restraint (if any).
-      int idx = 0;
+      rule.tau_end = index(tau_end);
+    if (hs.size() == 3)
       for (int i : {1, 2})
-        if (torsion_h == hs[i].ptr) {
-          idx = i;
-          hs[i].pos = h.pos;
-        }
-      // Now get the other positions by rotation
-      Vec3 axis = (heavy.pos - atom.pos).normalized();
-      Vec3 v1 = h.pos - atom.pos;
-      Vec3 v2 = rotate_about_axis(v1, axis, rad(120));
-      Vec3 v3 = rotate_about_axis(v1, axis, rad(-120));
-      hs[(idx+1) % 3].pos = atom.pos + Position(v2);
-      hs[(idx+2) % 3].pos = atom.pos + Position(v3);
-    } else if (hs.size() >= 4) {
-      giveup("Unusual: atom bonded to one heavy atoms and 4+ hydrogens.");
-    }
+        if (torsion_h == hs[i].ptr)
+          rule.torsion_h = (unsigned char) i;
     if (!tau_end || period > (int)hs.size())
-      for (BondedAtom& bonded_h : hs)
-        bonded_h.ptr->occ = 0;
+      rule.zero_occ = all_h;
+
   // ==== two heavy atoms and hydrogens ====
   } else if (known.size() == 2) {
     if (hs.size() >= 3)
-      giveup("Unusual: atom bonded to 2+ heavy atoms and 3+ hydrogens.");
+      fail("Unusual: atom bonded to 2+ heavy atoms and 3+ hydrogens.");
     const Angle* ang1 = topo.take_angle(hs[0].ptr, &atom, known[0].ptr);
     const Angle* ang2 = topo.take_angle(hs[0].ptr, &atom, known[1].ptr);
     const Angle* ang3 = topo.take_angle(known[0].ptr, &atom, known[1].ptr);
@@ -337,8 +307,8 @@ static void place_hydrogens(const Topo& topo, const Atom& atom) {
     if (!ang1 || !ang2 || !ang3) {
       const Atom* ptr1 = (!ang1 || !ang2 ? hs[0].ptr : known[0].ptr);
       const Atom* ptr2 = (!ang1 ? known[0].ptr : known[1].ptr);
-      giveup(cat("Missing angle restraint ", ptr1->name, '-', atom.name,
-                 '-', ptr2->name, ".\n"));
+      fail(cat("Missing angle restraint ", ptr1->name, '-', atom.name,
+               '-', ptr2->name, ".\n"));
     }
     double theta1 = ang1->radians();
     double theta2 = ang2->radians();
@@ -347,108 +317,381 @@ static void place_hydrogens(const Topo& topo, const Atom& atom) {
     // Co-planar case. The sum of angles should be 360 degrees,
     // but in some cif files it differs slightly.
     if (theta1 + theta2 + theta3 > rad(360 - 3)) {
-      Vec3 v12 = known[0].pos - atom.pos;
-      Vec3 v13 = known[1].pos - atom.pos;
-      // theta3 is the ideal restraint value, cur_theta3 is the current value
-      double cur_theta3 = v12.angle(v13);
-      double ratio = (2 * pi() - cur_theta3) / (theta1 + theta2);
-      Vec3 axis = v13.cross(v12).normalized();
-      Vec3 v14 = rotate_about_axis(v12, axis, theta1 * ratio);
-      hs[0].pos = atom.pos + Position(hs[0].dist / v14.length() * v14);
+      rule.kind = Rule::Kind::Planar;
+      rule.values[0] = theta1;
+      rule.values[1] = theta2;
       if (hs.size() > 1) {
-        topo.err("Unhandled topology of " + std::to_string(hs.size()) +
-                 " hydrogens bonded to " + atom.name);
-        for (size_t i = 1; i < hs.size(); ++i) {
-          hs[i].ptr->occ = 0;
-          hs[i].ptr->calc_flag = CalcFlag::Dummy;
-        }
+        report("Unhandled topology of " + std::to_string(hs.size()) +
+               " hydrogens bonded to " + atom.name);
+        rule.dummy = (unsigned char) (all_h & ~1);
       }
       return;
     }
 
     // Tetrahedral or similar configuration.
+    rule.kind = Rule::Kind::TwoHeavy;
+    rule.values[0] = theta1;
+    rule.values[1] = theta2;
+    rule.values[2] = theta3;
     double hh_half = 0;
     if (hs.size() == 2)
       if (const Angle* hh = topo.take_angle(hs[0].ptr, &atom, hs[1].ptr))
         hh_half = 0.5 * hh->radians();
     if (hh_half == 0)
       hh_half = calculate_tetrahedral_delta(theta3, theta1, theta2);
-
-    // Based on Liebschner et al (2020) doi:10.1016/bs.mie.2020.01.007
-    // sec. 2.3. 2H-tetrahedral configuration
-    double c0 = std::cos(theta3);
-    double c1 = std::cos(theta1);
-    double c2 = std::cos(theta2);
-    double den = 1 / (1 - c0*c0);
-    double a = den * (c1 - c0 * c2);
-    double b = den * (c2 - c0 * c1);
-    // I think the paper defines u10 and u20 in the opposite direction,
-    // but I had to reverse it somewhere to make it work.
-    Vec3 u10 = (known[0].pos - atom.pos).normalized();
-    Vec3 u20 = (known[1].pos - atom.pos).normalized();
-    Vec3 v = u10.cross(u20);
-    if (std::isnan(v.x))
-      giveup("bonded atoms are exactly overlapping.");
-    Vec3 d = a * u10 + b * u20;
-    double dist_sin = hs[0].dist * std::sin(hh_half);
-    double dist_cos = hs[0].dist * std::cos(hh_half);
-    Vec3 v0s = v.changed_magnitude(dist_sin);
-    Vec3 d0c = d.changed_magnitude(dist_cos);
-    hs[0].pos = atom.pos + Position(d0c + v0s);
-    Position other_pos = atom.pos + Position(d0c - v0s);
-
+    rule.values[3] = hh_half;
     if (hs.size() == 1) {
       const Topo::Chirality* chir = topo.get_chirality(&atom);
       if (chir && chir->restr->sign != ChiralityType::Both) {
-        if (!chir->check())
-          hs[0].pos = other_pos;
+        rule.chir_sign = chir->restr->sign == ChiralityType::Positive ? 1 : -1;
+        for (int i = 0; i < 4; ++i)
+          rule.chir[i] = index(chir->atoms[i]);
       } else {
-        hs[0].ptr->occ = 0;
+        rule.zero_occ = 1;
       }
-    } else {  // hs.size() == 2
-      hs[1].pos = other_pos;
     }
 
   } else {  // known.size() >= 3
     if (hs.size() > 1)
-      giveup("Unusual: atom bonded to 3+ heavy atoms and 2+ hydrogens.");
-    // Based on Liebschner et al (2020) doi:10.1016/bs.mie.2020.01.007
-    // sec. 2.4. 1H-tetrahedral configuration
-    Vec3 u10 = (known[0].pos - atom.pos).normalized();
-    Vec3 u20 = (known[1].pos - atom.pos).normalized();
-    Vec3 u30 = (known[2].pos - atom.pos).normalized();
-    auto cos_tetrahedral = [&](size_t n) {
+      fail("Unusual: atom bonded to 3+ heavy atoms and 2+ hydrogens.");
+    rule.kind = Rule::Kind::ThreeHeavy;
+    for (int n = 0; n < 3; ++n) {
       const Angle* angle = topo.take_angle(known[n].ptr, &atom, hs[0].ptr);
-      return angle ? std::cos(angle->radians()) : -1./3.;
-    };
-    SMat33<double> m{1., 1., 1., u10.dot(u20), u10.dot(u30), u20.dot(u30)};
-    Vec3 rhs(cos_tetrahedral(0), cos_tetrahedral(1), cos_tetrahedral(2));
-    Vec3 abc = m.inverse().multiply(rhs);
-    Vec3 h_dir = abc.x * u10 + abc.y * u20 + abc.z * u30;
-    if (std::isnan(h_dir.x))
-      giveup("bonded atoms are exactly overlapping.");
-    hs[0].pos = atom.pos + Position(h_dir.changed_magnitude(hs[0].dist));
+      rule.values[n] = angle ? std::cos(angle->radians()) : -1./3.;
+    }
   }
 }
 
-void place_hydrogens_on_all_atoms(Topo& topo) {
-  for (Topo::ChainInfo& chain_info : topo.chain_infos)
-    for (Topo::ResInfo& ri : chain_info.res_infos) {
-      // If we don't have monomer description from a cif file,
-      // only ad-hoc restraints, don't try to place hydrogens.
-      if (ri.orig_chemcomp == nullptr)
-        continue;
-      for (Atom& atom : ri.res->atoms)
-        if (!atom.is_hydrogen()) {
-          try {
-            place_hydrogens(topo, atom);
-          } catch (const std::runtime_error& e) {
-            topo.err("Placing of hydrogen bonded to "
+// Access to positions of atoms in Model (through pointers).
+struct AtomCoor {
+  Atom* const* atoms;
+  Position get(int i) const { return atoms[i]->pos; }
+  void set(int i, const Position& p) const { atoms[i]->pos = p; }
+};
+
+// Access to positions in SoA layout.
+struct SoaCoor {
+  double* x;
+  double* y;
+  double* z;
+  Position get(int i) const { return Position(x[i], y[i], z[i]); }
+  void set(int i, const Position& p) const { x[i] = p.x; y[i] = p.y; z[i] = p.z; }
+};
+
+// Sets positions of hydrogens from the rule. Reads positions of the parent
+// atom, of atoms used in the rule and (only for Linear) of the hydrogen.
+// Returns false if the positions could not be calculated.
+template<typename Coor>
+static bool apply_rule(const Rule& rule, const Coor& c) {
+  const Position x = c.get(rule.parent);
+  switch (rule.kind) {
+    case Rule::Kind::Unplaced:
+      return false;
+
+    case Rule::Kind::NoHeavy: {
+      Position h0 = x + Position(rule.dist[0], 0, 0);
+      c.set(rule.h[0], h0);
+      if (rule.n_h > 1) {
+        double theta = rule.values[0];
+        Position h1 = x + Position(rule.dist[1] * cos(theta),
+                                   rule.dist[1] * sin(theta), 0);
+        c.set(rule.h[1], h1);
+        if (rule.n_h == 3) {
+          // for now only NH3 (NH2.cif and NH3.cif) has such configuration,
+          // so we are cheating here a little.
+          c.set(rule.h[2], Position(h1.x, 2 * x.y - h1.y, h1.z));
+        } else if (rule.n_h == 4) {
+          auto pos = position_from_two_angles(x, h0, h1, rule.dist[2],
+                                              rule.values[1], rule.values[2]);
+          c.set(rule.h[2], pos.first);
+          c.set(rule.h[3], pos.second);
+        }
+      }
+      return true;
+    }
+
+    case Rule::Kind::Linear: {
+      Vec3 u = x - c.get(rule.h[0]);
+      c.set(rule.h[0], x + Position(u * (rule.dist[0] / u.length())));
+      return true;
+    }
+
+    case Rule::Kind::OneHeavy: {
+      const Position heavy = c.get(rule.heavy[0]);
+      Position h;
+      if (rule.tau_end != -1)
+        h = position_from_angle_and_torsion(c.get(rule.tau_end), heavy, x,
+                                            rule.dist[0], rule.values[0], rule.values[1]);
+      else
+        h = arbitrary_position_from_angle(heavy, x, rule.dist[0], rule.values[0]);
+      if (std::isnan(h.x)) {
+        c.set(rule.h[0], Position(0, 0, 0));
+        return false;
+      }
+      c.set(rule.h[0], h);
+      if (rule.n_h == 2) {
+        // I think we can assume the two hydrogens are symmetric.
+        Vec3 axis = (heavy - x).normalized();
+        Vec3 perpendicular = get_vector_to_line(h, x, axis);
+        c.set(rule.h[1], h + Position(2 * perpendicular));
+      } else if (rule.n_h == 3) {
+        // Here we assume the three hydrogens are in the same distance from
+        // the parent atom and that they make an equilateral triangle.
+        // h is placed according to the torsion restraint (if any),
+        // other positions are obtained by rotation.
+        int idx = rule.torsion_h;
+        Vec3 axis = (heavy - x).normalized();
+        Vec3 v1 = h - x;
+        Vec3 v2 = rotate_about_axis(v1, axis, rad(120));
+        Vec3 v3 = rotate_about_axis(v1, axis, rad(-120));
+        c.set(rule.h[idx], h);
+        c.set(rule.h[(idx+1) % 3], x + Position(v2));
+        c.set(rule.h[(idx+2) % 3], x + Position(v3));
+      }
+      return true;
+    }
+
+    case Rule::Kind::Planar: {
+      Vec3 v12 = c.get(rule.heavy[0]) - x;
+      Vec3 v13 = c.get(rule.heavy[1]) - x;
+      // values[] are ideal restraint values, cur_theta3 is the current value
+      double cur_theta3 = v12.angle(v13);
+      double ratio = (2 * pi() - cur_theta3) / (rule.values[0] + rule.values[1]);
+      Vec3 axis = v13.cross(v12).normalized();
+      Vec3 v14 = rotate_about_axis(v12, axis, rule.values[0] * ratio);
+      c.set(rule.h[0], x + Position(rule.dist[0] / v14.length() * v14));
+      return true;
+    }
+
+    case Rule::Kind::TwoHeavy: {
+      // Based on Liebschner et al (2020) doi:10.1016/bs.mie.2020.01.007
+      // sec. 2.3. 2H-tetrahedral configuration
+      double c0 = std::cos(rule.values[2]);
+      double c1 = std::cos(rule.values[0]);
+      double c2 = std::cos(rule.values[1]);
+      double den = 1 / (1 - c0*c0);
+      double a = den * (c1 - c0 * c2);
+      double b = den * (c2 - c0 * c1);
+      // I think the paper defines u10 and u20 in the opposite direction,
+      // but I had to reverse it somewhere to make it work.
+      Vec3 u10 = (c.get(rule.heavy[0]) - x).normalized();
+      Vec3 u20 = (c.get(rule.heavy[1]) - x).normalized();
+      Vec3 v = u10.cross(u20);
+      if (std::isnan(v.x))
+        return false;
+      Vec3 d = a * u10 + b * u20;
+      double dist_sin = rule.dist[0] * std::sin(rule.values[3]);
+      double dist_cos = rule.dist[0] * std::cos(rule.values[3]);
+      Vec3 v0s = v.changed_magnitude(dist_sin);
+      Vec3 d0c = d.changed_magnitude(dist_cos);
+      Position other_pos = x + Position(d0c - v0s);
+      c.set(rule.h[0], x + Position(d0c + v0s));
+      if (rule.n_h == 1) {
+        if (rule.chir_sign != 0) {
+          double volume = calculate_chiral_volume(c.get(rule.chir[0]), c.get(rule.chir[1]),
+                                                  c.get(rule.chir[2]), c.get(rule.chir[3]));
+          if (rule.chir_sign * volume < 0)  // wrong chirality
+            c.set(rule.h[0], other_pos);
+        }
+      } else {  // n_h == 2
+        c.set(rule.h[1], other_pos);
+      }
+      return true;
+    }
+
+    case Rule::Kind::ThreeHeavy: {
+      // Based on Liebschner et al (2020) doi:10.1016/bs.mie.2020.01.007
+      // sec. 2.4. 1H-tetrahedral configuration
+      Vec3 u10 = (c.get(rule.heavy[0]) - x).normalized();
+      Vec3 u20 = (c.get(rule.heavy[1]) - x).normalized();
+      Vec3 u30 = (c.get(rule.heavy[2]) - x).normalized();
+      SMat33<double> m{1., 1., 1., u10.dot(u20), u10.dot(u30), u20.dot(u30)};
+      Vec3 rhs(rule.values[0], rule.values[1], rule.values[2]);
+      Vec3 abc = m.inverse().multiply(rhs);
+      Vec3 h_dir = abc.x * u10 + abc.y * u20 + abc.z * u30;
+      if (std::isnan(h_dir.x))
+        return false;
+      c.set(rule.h[0], x + Position(h_dir.changed_magnitude(rule.dist[0])));
+      return true;
+    }
+  }
+  unreachable();
+}
+
+// Sets calc_flag and occ of hydrogens placed (if ok) by apply_rule().
+template<typename AtomAt>
+static void set_h_flags(const Rule& rule, bool ok, AtomAt atom_at) {
+  for (int i = 0; i < rule.n_h; ++i) {
+    Atom& h = atom_at(rule.h[i]);
+    if (!ok || (rule.dummy & (1 << i)) != 0) {
+      h.occ = 0;
+      h.calc_flag = CalcFlag::Dummy;
+    } else {
+      h.calc_flag = CalcFlag::Calculated;
+      if ((rule.zero_occ & (1 << i)) != 0)
+        h.occ = 0;
+    }
+  }
+}
+
+template<typename Report>
+static void place_hydrogens(const Topo& topo, const Atom& atom, Report report) {
+  std::vector<BondedAtom> known; // heavy atoms with known positions
+  std::vector<BondedAtom> hs;    // H atoms (unknown)
+  find_bonded_atoms(topo, atom, known, hs);
+  if (hs.size() == 0)
+    return;
+
+  auto giveup = [&]() {
+    for (BondedAtom& bonded_h : hs) {
+      bonded_h.ptr->occ = 0;
+      bonded_h.ptr->calc_flag = CalcFlag::Dummy;
+    }
+  };
+  // atoms used in the rule are numbered locally
+  std::vector<Atom*> ptrs;
+  ptrs.reserve(12);
+  auto index = [&](const Atom* a) {
+    ptrs.push_back(const_cast<Atom*>(a));
+    return (int) ptrs.size() - 1;
+  };
+  Rule rule;
+  try {
+    make_rule(topo, atom, known, hs, index, report, rule);
+  } catch (...) {
+    giveup();
+    throw;
+  }
+  if (!apply_rule(rule, AtomCoor{ptrs.data()})) {
+    giveup();
+    fail("bonded atoms are exactly overlapping.");
+  }
+  set_h_flags(rule, true, [&](int i) -> Atom& { return *ptrs[i]; });
+}
+
+void place_hydrogens_on_all_atoms(Topo& topo, int nthreads) {
+  // place_hydrogens() reads positions of heavy atoms and changes only
+  // hydrogens bonded to the given atom, so chains can be done in parallel.
+  // Warnings are collected per chunk and written in the original order.
+  size_t nt = std::min((size_t) std::max(nthreads, 1), topo.chain_infos.size());
+  std::vector<std::ostringstream> messages(nt);
+  parallel_for_chunks(topo.chain_infos.size(), (int) nt, [&](size_t begin, size_t end, int k) {
+    auto report = [&](const std::string& msg) {
+      if (nt <= 1 || topo.warnings == nullptr)
+        topo.err(msg);
+      else
+        messages[k] << "Warning: " << msg << std::endl;
+    };
+    for (size_t i = begin; i != end; ++i) {
+      Topo::ChainInfo& chain_info = topo.chain_infos[i];
+      for (Topo::ResInfo& ri : chain_info.res_infos) {
+        // If we don't have monomer description from a cif file,
+        // only ad-hoc restraints, don't try to place hydrogens.
+        if (ri.orig_chemcomp == nullptr)
+          continue;
+        for (Atom& atom : ri.res->atoms)
+          if (!atom.is_hydrogen()) {
+            try {
+              place_hydrogens(topo, atom, report);
+            } catch (const std::runtime_error& e) {
+              report("Placing of hydrogen bonded to "
                      + atom_str(chain_info.chain_ref, *ri.res, atom)
                      + " failed:\n  " + e.what());
+            }
           }
+      }
+    }
+  });
+  if (nt > 1 && topo.warnings)
+    for (const std::ostringstream& m : messages)
+      *topo.warnings << m.str();
+}
+
+HydrogenRecipe compile_hydrogen_recipe(const Topo& topo, const Model& model) {
+  HydrogenRecipe recipe;
+  std::unordered_map<const Atom*, int> atom_index;
+  for (const Chain& chain : model.chains)
+    for (const Residue& res : chain.residues)
+      for (const Atom& atom : res.atoms)
+        atom_index.emplace(&atom, (int) atom_index.size());
+  recipe.atom_count = atom_index.size();
+  auto index = [&](const Atom* a) {
+    auto it = atom_index.find(a);
+    if (it == atom_index.end())
+      fail("compile_hydrogen_recipe: Topo was not prepared for this model");
+    return it->second;
+  };
+  auto report = [&](const std::string& msg) { topo.err(msg); };
+  std::vector<BondedAtom> known, hs;
+  for (const Topo::ChainInfo& chain_info : topo.chain_infos)
+    for (const Topo::ResInfo& ri : chain_info.res_infos) {
+      // the same residues as in place_hydrogens_on_all_atoms()
+      if (ri.orig_chemcomp == nullptr)
+        continue;
+      for (const Atom& atom : ri.res->atoms) {
+        if (atom.is_hydrogen())
+          continue;
+        index(&atom);  // check that atom is in the model
+        known.clear();
+        hs.clear();
+        find_bonded_atoms(topo, atom, known, hs);
+        if (hs.empty())
+          continue;
+        recipe.rules.emplace_back();
+        Rule& rule = recipe.rules.back();
+        try {
+          make_rule(topo, atom, known, hs, index, report, rule);
+        } catch (const std::runtime_error& e) {
+          rule.kind = Rule::Kind::Unplaced;
+          rule.dummy = (unsigned char) ((1 << rule.n_h) - 1);
+          topo.err("Placing of hydrogen bonded to "
+                   + atom_str(chain_info.chain_ref, *ri.res, atom)
+                   + " failed:\n  " + e.what());
         }
+      }
+    }
+  return recipe;
+}
+
+size_t HydrogenRecipe::apply(Model& model, int nthreads) const {
+  std::vector<Atom*> atoms;
+  atoms.reserve(atom_count);
+  for (Chain& chain : model.chains)
+    for (Residue& res : chain.residues)
+      for (Atom& atom : res.atoms)
+        atoms.push_back(&atom);
+  if (atoms.size() != atom_count)
+    fail("HydrogenRecipe: expected ", std::to_string(atom_count),
+         " atoms in the model, got ", std::to_string(atoms.size()));
+  // apply_rule() changes only hydrogens from the given rule,
+  // so rules can be applied in parallel.
+  std::vector<size_t> failed(std::max(nthreads, 1), 0);
+  parallel_for_chunks(rules.size(), nthreads, [&](size_t begin, size_t end, int k) {
+    AtomCoor coor{atoms.data()};
+    for (size_t i = begin; i != end; ++i) {
+      bool ok = apply_rule(rules[i], coor);
+      set_h_flags(rules[i], ok, [&](int n) -> Atom& { return *atoms[n]; });
+      if (!ok)
+        ++failed[k];
+    }
+  });
+  return std::accumulate(failed.begin(), failed.end(), (size_t) 0);
+}
+
+size_t HydrogenRecipe::apply(double* x, double* y, double* z, size_t nsets,
+                             int nthreads) const {
+  // all pairs (coordinate set, rule) are independent
+  const size_t n = nsets * rules.size();
+  std::vector<size_t> failed(std::max(nthreads, 1), 0);
+  parallel_for_chunks(n, nthreads, [&](size_t begin, size_t end, int k) {
+    for (size_t i = begin; i != end; ++i) {
+      size_t offset = i / rules.size() * atom_count;
+      SoaCoor coor{x + offset, y + offset, z + offset};
+      if (!apply_rule(rules[i % rules.size()], coor))
+        ++failed[k];
     }
+  });
+  return std::accumulate(failed.begin(), failed.end(), (size_t) 0);
 }
 
 }
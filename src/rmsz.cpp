@@ -0,0 +1,326 @@
+// Copyright 2023 Global Phasing Ltd.
+
+#include <gemmi/rmsz.hpp>
+#include <cassert>
+#include <cerrno>               // for ENOENT
+#include <exception>            // for current_exception
+#include <limits>               // for numeric_limits
+#include <sstream>              // for ostringstream
+#include <system_error>
+#include <gemmi/calculate.hpp>  // for find_best_plane, get_distance_from_plane
+#include <gemmi/mmread_gz.hpp>  // for read_structure_gz
+#include <gemmi/monlib_cache.hpp>  // for MonLibCache
+#include <gemmi/polyheur.hpp>   // for setup_entities
+
+namespace gemmi {
+
+namespace {
+
+void add_outlier(GeometryOutliers* out, int model_idx, Topo::RKind kind,
+                 const std::string& tag, std::string&& restraint,
+                 const std::string& atom, double ideal, double value, double z) {
+  out->model.push_back(model_idx);
+  out->kind.push_back(kind);
+  out->tag.push_back(tag);
+  out->restraint.push_back(std::move(restraint));
+  out->atom.push_back(atom);
+  out->ideal.push_back(ideal);
+  out->value.push_back(value);
+  out->z.push_back(z);
+}
+
+void check_restraint(const Topo::Rule rule, const Topo& topo, double cutoff,
+                     const std::string& tag, GeometryStats& stats,
+                     GeometryOutliers* out, int model_idx) {
+  static const std::string no_atom;
+  switch (rule.rkind) {
+    case Topo::RKind::Bond: {
+      const Topo::Bond& t = topo.bonds[rule.index];
+      double z = t.calculate_z();
+      if (z > cutoff) {
+        stats.wrong_bond++;
+        if (out)
+          add_outlier(out, model_idx, rule.rkind, tag, t.restr->str(), no_atom,
+                      t.restr->value, t.calculate(), z);
+      }
+      stats.z_bond.put(z);
+      stats.d_bond.put(z * t.restr->esd);
+      return;
+    }
+    case Topo::RKind::Angle: {
+      const Topo::Angle& t = topo.angles[rule.index];
+      double z = t.calculate_z();
+      if (z > cutoff) {
+        stats.wrong_angle++;
+        if (out)
+          add_outlier(out, model_idx, rule.rkind, tag, t.restr->str(), no_atom,
+                      t.restr->value, deg(t.calculate()), z);
+      }
+      stats.z_angle.put(z);
+      stats.d_angle.put(z * t.restr->esd);
+      return;
+    }
+    case Topo::RKind::Torsion: {
+      const Topo::Torsion& t = topo.torsions[rule.index];
+      double z = t.calculate_z();  // takes into account t.restr->period
+      if (z > cutoff) {
+        stats.wrong_torsion++;
+        if (out)
+          add_outlier(out, model_idx, rule.rkind, tag, t.restr->str(), no_atom,
+                      t.restr->value, deg(t.calculate()), z);
+      }
+      stats.z_torsion.put(z);
+      stats.d_torsion.put(z * t.restr->esd);
+      return;
+    }
+    case Topo::RKind::Chirality: {
+      const Topo::Chirality& t = topo.chirs[rule.index];
+      stats.all_chiralities++;
+      if (!t.check()) {
+        stats.wrong_chirality++;
+        if (out) {
+          const double nan = std::numeric_limits<double>::quiet_NaN();
+          add_outlier(out, model_idx, rule.rkind, tag, t.restr->str(), no_atom,
+                      nan, nan, nan);
+        }
+      }
+      return;
+    }
+    case Topo::RKind::Plane: {
+      const Topo::Plane& t = topo.planes[rule.index];
+      auto coeff = find_best_plane(t.atoms);
+      double max_z = 0;
+      for (const Atom* atom : t.atoms) {
+        double dist = get_distance_from_plane(atom->pos, coeff);
+        double z = dist / t.restr->esd;
+        if (out && z > cutoff)
+          add_outlier(out, model_idx, rule.rkind, tag, t.restr->str(), atom->name,
+                      0., dist, z);
+        if (z > max_z)
+          max_z = z;
+      }
+      stats.z_plane.put(max_z);
+      stats.d_plane.put(max_z * t.restr->esd);
+      if (max_z > cutoff)
+        stats.wrong_plane++;
+      return;
+    }
+  }
+  unreachable();
+}
+
+} // anonymous namespace
+
+GeometryStats check_geometry(const Topo& topo, double cutoff,
+                             GeometryOutliers* outliers, int model_idx) {
+  GeometryStats stats;
+  // We could iterate directly over Topo::bonds, Topo::angles, etc,
+  // but then we couldn't record the provenance (res or "link" below).
+  for (const Topo::ChainInfo& chain_info : topo.chain_infos)
+    for (const Topo::ResInfo& ri : chain_info.res_infos) {
+      for (const Topo::Link& prev : ri.prev) {
+        assert(ri.res == prev.res2);
+        std::string rtag = chain_info.chain_ref.name + " " +
+                           prev.res1->str() + "-" + ri.res->str();
+        for (const Topo::Rule& rule : prev.link_rules)
+          check_restraint(rule, topo, cutoff, rtag, stats, outliers, model_idx);
+      }
+      std::string rtag = chain_info.chain_ref.name + " " + ri.res->str();
+      for (const Topo::Rule& rule : ri.monomer_rules)
+        check_restraint(rule, topo, cutoff, rtag, stats, outliers, model_idx);
+    }
+  const std::string link_tag = "link";
+  for (const Topo::Link& link : topo.extras)
+    for (const Topo::Rule& rule : link.link_rules)
+      check_restraint(rule, topo, cutoff, link_tag, stats, outliers, model_idx);
+  return stats;
+}
+
+GeometryValidator::GeometryValidator(const std::string& monomer_dir,
+                                     read_cif_func read_cif,
+                                     MonLibCache* cache)
+    : read_cif_(read_cif) {
+  if (monomer_dir.empty())
+    fail("GeometryValidator: monomer_dir not specified.");
+  base_.set_monomer_dir(monomer_dir);
+  base_.cache = cache;
+  base_.read_monomer_doc_and_version(
+      base_.read_library_file("list/mon_lib_list.cif", read_cif));
+  base_.ener_lib.read(base_.read_library_file("ener_lib.cif", read_cif));
+}
+
+std::shared_ptr<const MonLib>
+GeometryValidator::read_monomer_file(const std::string& name) {
+  cif::Document doc;
+  try {
+    std::string rel_path = MonLib::relative_monomer_path(name);
+    bool cached = false;
+    if (base_.cache) {
+      std::lock_guard<std::mutex> lock(cache_mutex_);
+      cached = base_.cache->read_document(base_.monomer_dir, rel_path, doc);
+    }
+    if (!cached)
+      doc = (*read_cif_)(base_.monomer_dir + rel_path);
+  } catch (std::system_error& e) {
+    if (e.code().value() == ENOENT)
+      fail("Monomer not in the library: ", name, ".");
+    fail("Failed to read ", name, ": ", e.what(), ".");
+  } catch (std::runtime_error& e) {
+    fail("Failed to read ", name, ": ", e.what(), ".");
+  }
+  auto part = std::make_shared<MonLib>();
+  // as if the file was read after mon_lib_list.cif: groups from the list
+  // have priority over comp_list in the file
+  for (const cif::Block& block : doc.blocks)
+    if (starts_with(block.name, "comp_")) {
+      auto it = base_.cc_groups.find(block.name.substr(5));
+      if (it != base_.cc_groups.end())
+        part->cc_groups.insert(*it);
+    }
+  try {
+    part->read_monomer_doc(doc);
+  } catch (std::runtime_error& e) {
+    fail("Failed to read ", name, ": ", e.what(), ".");
+  }
+  return part;
+}
+
+std::shared_ptr<const MonLib>
+GeometryValidator::get_monomer_file(const std::string& name) {
+  std::shared_future<std::shared_ptr<const MonLib>> future;
+  std::promise<std::shared_ptr<const MonLib>> promise;
+  bool to_be_read = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = monomer_files_.find(name);
+    if (it != monomer_files_.end()) {
+      future = it->second;
+    } else {
+      if (monomer_files_.size() >= max_cached_monomers)
+        monomer_files_.clear();  // definitions in use are kept by shared_ptr
+      future = promise.get_future().share();
+      monomer_files_.emplace(name, future);
+      to_be_read = true;
+    }
+  }
+  // other threads that need this file wait in future.get()
+  if (to_be_read) {
+    try {
+      promise.set_value(read_monomer_file(name));
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+    }
+  }
+  return future.get();
+}
+
+// The same as MonLib::read_monomer_lib() without re-reading the list
+// and ener_lib, and with monomer files read only once. Names of monomers
+// from files that also have links or modifications are added to `extra`.
+bool GeometryValidator::add_monomers(MonLib& monlib,
+                                     const std::vector<std::string>& resnames,
+                                     std::string& error,
+                                     std::vector<std::string>& extra) {
+  bool ok = true;
+  for (const std::string& name : resnames) {
+    if (monlib.monomers.find(name) != monlib.monomers.end())
+      continue;
+    std::shared_ptr<const MonLib> part;
+    try {
+      part = get_monomer_file(name);
+    } catch (std::runtime_error& e) {
+      cat_to(error, e.what(), '\n');
+      ok = false;
+      continue;
+    }
+    for (const auto& item : part->monomers)
+      if (monlib.monomers.emplace(item.first, item.second).second &&
+          (!part->links.empty() || !part->modifications.empty()))
+        extra.push_back(item.first);
+    for (const auto& item : part->links)
+      monlib.add_link(item.second);
+    monlib.modifications.insert(part->modifications.begin(), part->modifications.end());
+  }
+  return ok;
+}
+
+// Removes links and modifications added to a copy of base_ (from monomer
+// files or by Topo), so that the next model starts afresh. Monomers that
+// came with links or modifications (extra) are removed too.
+void GeometryValidator::restore_base(MonLib& monlib,
+                                     const std::vector<std::string>& extra) const {
+  for (const std::string& name : extra)
+    monlib.monomers.erase(name);
+  if (monlib.links.size() != base_.links.size()) {
+    std::vector<std::string> added;
+    for (const auto& item : monlib.links)
+      if (base_.links.count(item.first) == 0)
+        added.push_back(item.first);
+    for (const std::string& id : added)
+      monlib.links.erase(id);
+  }
+  for (auto it = monlib.modifications.begin(); it != monlib.modifications.end(); )
+    if (base_.modifications.count(it->first) == 0)
+      it = monlib.modifications.erase(it);
+    else
+      ++it;
+}
+
+GeometryValidator::Result GeometryValidator::validate(const std::string& path,
+                                                      size_t entry) {
+  Result result;
+  result.entry = entry;
+  result.path = path;
+  std::ostringstream warnings;
+  // MonLib that is a copy of base_, taken from idle_monlibs_ if possible
+  std::unique_ptr<MonLib> monlib;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_monlibs_.empty()) {
+      monlib = std::move(idle_monlibs_.back());
+      idle_monlibs_.pop_back();
+    }
+  }
+  if (!monlib) {
+    monlib.reset(new MonLib(base_));
+    monlib->cache = nullptr;
+  } else if (monlib->monomers.size() > max_cached_monomers) {
+    monlib->monomers.clear();
+  }
+  try {
+    Structure st = read_structure_gz(path, format);
+    if (st.input_format == CoorFormat::Pdb ||
+        st.input_format == CoorFormat::ChemComp)
+      setup_entities(st);
+    for (size_t i = 0; i != st.models.size(); ++i) {
+      Model& model = st.models[i];
+      std::string error;
+      std::vector<std::string> extra;
+      bool ok = add_monomers(*monlib, model.get_all_residue_names(), error, extra);
+      try {
+        if (!ok)
+          fail(error + "Please create definitions for missing monomers.");
+        Topo topo;
+        topo.warnings = &warnings;
+        topo.initialize_refmac_topology(st, model, *monlib);
+        topo.finalize_refmac_topology(*monlib);
+        result.model_names.push_back(model.name);
+        result.stats.push_back(check_geometry(topo, cutoff, &result.outliers, (int) i));
+      } catch (...) {
+        restore_base(*monlib, extra);
+        throw;
+      }
+      restore_base(*monlib, extra);
+    }
+  } catch (std::exception& e) {
+    result.error = e.what();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_monlibs_.push_back(std::move(monlib));
+  }
+  result.warnings = warnings.str();
+  return result;
+}
+
+} // namespace gemmi
@@ -2,6 +2,8 @@
 
 #include <gemmi/topo.hpp>
 #include <cmath>               // for sqrt, round
+#include <sstream>             // for ostringstream
+#include <gemmi/parallel.hpp>  // for parallel_for_chunks
 #include <gemmi/polyheur.hpp>  // for get_or_check_polymer_type, ...
 #include <gemmi/riding_h.hpp>  // for place_hydrogens_on_all_atoms, ...
 #include <gemmi/modify.hpp>    // for remove_hydrogens
@@ -150,8 +152,7 @@ const std::string& add_auto_chemlink(MonLib& monlib,
   for (int n = 0; monlib.get_link(cl.id) != nullptr; ++n)
     cl.id.replace(orig_len, cl.id.size(), std::to_string(n));
 
-  auto it = monlib.links.emplace(cl.id, cl);
-  return it.first->first;
+  return monlib.add_link(cl).id;
 }
 
 void Topo::add_polymer_links(PolymerType polymer_type,
@@ -404,6 +405,8 @@ void Topo::apply_restraints_from_link(Link& link, const MonLib& monlib) {
 // see comments above the declaration
 void Topo::initialize_refmac_topology(Structure& st, Model& model0,
                                       MonLib& monlib, bool ignore_unknown_links) {
+  if (!monlib.link_index.is_current(monlib.links))
+    monlib.index_links();
   // initialize chains and residues
   for (Chain& chain : model0.chains)
     for (ResidueSpan& sub : chain.subchains()) {
@@ -526,22 +529,64 @@ void Topo::initialize_refmac_topology(Structure& st, Model& model0,
     }
 }
 
-void Topo::finalize_refmac_topology(const MonLib& monlib) {
+void Topo::finalize_refmac_topology(const MonLib& monlib, int nthreads) {
   // apply restraints
-  for (ChainInfo& chain_info : chain_infos)
-    for (ResInfo& ri : chain_info.res_infos) {
-      // link restraints
-      for (Link& link : ri.prev)
-        apply_restraints_from_link(link, monlib);
-      // monomer restraints
-      bool require_alt = false;
-      for (const auto& it : ri.chemcomps) {
-        auto rules = apply_restraints(it.cc->rt, *ri.res, nullptr,
-                                      it.altloc, '\0', require_alt);
-        vector_move_extend(ri.monomer_rules, std::move(rules));
-        require_alt = true;
+  auto apply_to_chains = [&](Topo& topo, size_t begin, size_t end) {
+    for (size_t i = begin; i != end; ++i)
+      for (ResInfo& ri : chain_infos[i].res_infos) {
+        // link restraints
+        for (Link& link : ri.prev)
+          topo.apply_restraints_from_link(link, monlib);
+        // monomer restraints
+        bool require_alt = false;
+        for (const auto& it : ri.chemcomps) {
+          auto rules = topo.apply_restraints(it.cc->rt, *ri.res, nullptr,
+                                             it.altloc, '\0', require_alt);
+          vector_move_extend(ri.monomer_rules, std::move(rules));
+          require_alt = true;
+        }
       }
+  };
+  size_t nt = std::min((size_t) std::max(nthreads, 1), chain_infos.size());
+  if (nt <= 1) {
+    apply_to_chains(*this, 0, chain_infos.size());
+  } else {
+    // Chains are processed in parallel, each chunk of chains into a separate
+    // Topo. Then restraints are moved here in the original order, so that
+    // the result doesn't depend on the number of threads.
+    std::vector<Topo> parts(nt);
+    std::vector<std::ostringstream> messages(nt);
+    std::vector<size_t> chunk_begin(nt + 1, chain_infos.size());
+    parallel_for_chunks(chain_infos.size(), (int) nt, [&](size_t begin, size_t end, int k) {
+      chunk_begin[k] = begin;
+      if (warnings)
+        parts[k].warnings = &messages[k];
+      apply_to_chains(parts[k], begin, end);
+    });
+    for (size_t k = 0; k != nt; ++k) {
+      Topo& part = parts[k];
+      const size_t offsets[5] = {bonds.size(), angles.size(), torsions.size(),
+                                 chirs.size(), planes.size()};
+      auto shift = [&](std::vector<Rule>& rules) {
+        for (Rule& rule : rules)
+          rule.index += offsets[static_cast<int>(rule.rkind)];
+      };
+      for (size_t i = chunk_begin[k]; i != chunk_begin[k+1]; ++i)
+        for (ResInfo& ri : chain_infos[i].res_infos) {
+          for (Link& link : ri.prev)
+            shift(link.link_rules);
+          shift(ri.monomer_rules);
+        }
+      vector_move_extend(bonds, std::move(part.bonds));
+      vector_move_extend(angles, std::move(part.angles));
+      vector_move_extend(torsions, std::move(part.torsions));
+      vector_move_extend(chirs, std::move(part.chirs));
+      vector_move_extend(planes, std::move(part.planes));
+      vector_move_extend(rt_storage, std::move(part.rt_storage));
+      if (warnings)
+        *warnings << messages[k].str();
     }
+  }
   for (Link& link : extras)
     apply_restraints_from_link(link, monlib);
 
@@ -670,7 +715,8 @@ static void remove_hydrogens_from_atom(Topo::ResInfo* ri,
 std::unique_ptr<Topo>
 prepare_topology(Structure& st, MonLib& monlib, size_t model_index,
                  HydrogenChange h_change, bool reorder,
-                 std::ostream* warnings, bool ignore_unknown_links) {
+                 std::ostream* warnings, bool ignore_unknown_links,
+                 int nthreads) {
   std::unique_ptr<Topo> topo(new Topo);
   topo->warnings = warnings;
   if (model_index >= st.models.size())
@@ -759,11 +805,11 @@ prepare_topology(Structure& st, MonLib& monlib, size_t model_index,
   }
 
   assign_serial_numbers(st.models[model_index]);
-  topo->finalize_refmac_topology(monlib);
+  topo->finalize_refmac_topology(monlib, nthreads);
 
   // the hydrogens added previously have positions not set
   if (h_change != HydrogenChange::NoChange)
-    place_hydrogens_on_all_atoms(*topo);
+    place_hydrogens_on_all_atoms(*topo, nthreads);
 
   return topo;
 }
@@ -2,8 +2,15 @@
 #include "doctest.h"
 
 #include <algorithm>
+#include <cstdio>    // for fopen, remove
+#include <cstring>   // for memcpy
+#include <sstream>   // for ostringstream
 #include <gemmi/cif.hpp>
+#include <gemmi/cif2mtz.hpp>  // for read_raw_refln_cif, CifToMtz
+#include <gemmi/gz.hpp>       // for MaybeGzipped
+#include <gemmi/read_cif.hpp> // for read_first_block_into_buffer_gz
 #include <gemmi/merge.hpp>    // for parse_voigt_notation, ...
+#include <gemmi/monlib_cache.hpp>  // for impl::CacheWriter, impl::CacheReader
 #include <gemmi/mtz2cif.hpp>  // write_staraniso_b_in_mmcif
 
 namespace cif = gemmi::cif;
@@ -110,3 +117,192 @@ TEST_CASE("aniso_b_tensor_eigen") {
   for (int i = 0; i < 6; ++i)
     CHECK(std::fabs(bval[i] - b2_elem[i]) < 1e-3);
 }
+
+TEST_CASE("monlib_cache_serialization") {
+  cif::Document doc = cif::read_string(
+      "data_a _a.x 1 _a.y 'two words'\n"
+      "loop_ _b.id _b.v\n1 ? 2 .\n"
+      "save_f _c.z 3\nsave_\n"
+      "data_b loop_ _d.i\n;\ntext field\n;\n");
+  doc.blocks[0].items[0].erase();
+  std::string data;
+  gemmi::impl::CacheWriter w{data};
+  for (const cif::Block& block : doc.blocks)
+    w.block(block);
+  gemmi::impl::CacheReader r{data.data(), data.data() + data.size()};
+  std::vector<cif::Block> blocks(2);
+  for (cif::Block& block : blocks)
+    r.block(block);
+  CHECK_EQ(r.ptr, r.end);
+  for (size_t i = 0; i < 2; ++i) {
+    const cif::Block& a = doc.blocks[i];
+    const cif::Block& b = blocks[i];
+    CHECK_EQ(a.name, b.name);
+    REQUIRE_EQ(a.items.size(), b.items.size());
+    for (size_t j = 0; j < a.items.size(); ++j) {
+      CHECK(a.items[j].type == b.items[j].type);
+      CHECK_EQ(a.items[j].line_number, b.items[j].line_number);
+    }
+  }
+  CHECK(blocks[0].items[0].type == cif::ItemType::Erased);
+  CHECK_EQ(*blocks[0].find_value("_a.y"), "'two words'");
+  CHECK_EQ(blocks[0].find_values("_b.v").at(1), ".");
+  CHECK_EQ(*blocks[0].find_frame("f")->find_value("_c.z"), "3");
+  CHECK_EQ(blocks[1].find_values("_d.i").at(0), ";\ntext field\n;");
+}
+
+static gemmi::CharArray string_to_buffer(const std::string& s) {
+  gemmi::CharArray mem(s.size());
+  std::memcpy(mem.data(), s.data(), s.size());
+  return mem;
+}
+
+static const char* sf_mmcif =
+  "data_a\n"
+  "_cell.length_a 10 _cell.length_b 11 _cell.length_c 12\n"
+  "_cell.angle_alpha 90 _cell.angle_beta 90 _cell.angle_gamma 90\n"
+  "_symmetry.space_group_name_H-M 'P 1'\n"
+  "loop_\n"
+  "_refln.index_h\n"
+  "_refln.index_k\n"
+  "_refln.index_l\n"
+  "_refln.F_meas_au\n"
+  "_refln.F_meas_sigma_au\n"
+  "1 2 3 10.5(2) 0.5\n"
+  "-1 0 4 ? .  # comment\n"
+  "  data_b\n"
+  "_cell.length_a 10 _cell.length_b 11 _cell.length_c 12\n"
+  "_cell.angle_alpha 90 _cell.angle_beta 90 _cell.angle_gamma 90\n"
+  " loop_\n"
+  "_refln.index_h\n"
+  "_refln.index_k\n"
+  "_refln.index_l\n"
+  "_refln.F_meas_au\n"
+  "_refln.F_meas_sigma_au\n"
+  "0 0 1 +3.5e1 2\n"
+  "2 2 2 7 1 3 3 3 8 1\n"
+  "data_c\n"
+  "loop_\n"
+  "_refln.index_h\n"
+  "_refln.index_k\n"
+  "_refln.index_l\n"
+  "_refln.F_meas_au\n"
+  "1 1 1 'quoted'\n";
+
+TEST_CASE("read_raw_refln_cif") {
+  gemmi::RawReflnCif raw = gemmi::read_raw_refln_cif(string_to_buffer(sf_mmcif), "test");
+  cif::Document doc = cif::read_string(sf_mmcif);
+  REQUIRE_EQ(raw.rblocks.size(), 3);
+  // the loop in data_c has a quoted value and is read by the CIF parser
+  CHECK_EQ(raw.raw_loops.size(), 2);
+  const size_t lengths[] = {2, 3, 1};
+  for (size_t i = 0; i != 3; ++i) {
+    const gemmi::ReflnBlock& rb = raw.rblocks[i];
+    CHECK_EQ(rb.block.name, doc.blocks[i].name);
+    const cif::Loop& expected = *doc.blocks[i].find_loop("_refln.index_h").get_loop();
+    REQUIRE(rb.default_loop);
+    CHECK_EQ(raw.loop_length(*rb.default_loop), lengths[i]);
+    CHECK_EQ(expected.length(), lengths[i]);
+    if (const std::vector<const char*>* values = raw.find_raw_values(rb.default_loop)) {
+      CHECK(rb.default_loop->values.empty());
+      REQUIRE_EQ(values->size(), expected.values.size());
+      for (size_t j = 0; j != values->size(); ++j) {
+        const char* p = (*values)[j];
+        CHECK_EQ(std::string(p, gemmi::skip_word(p)), expected.values[j]);
+      }
+    }
+  }
+  // conversion from tokens and from the usual Loop gives the same result
+  gemmi::ReflnBlock rb(std::move(doc.blocks[1]));
+  gemmi::CifToMtz cif2mtz;
+  std::ostringstream out;
+  gemmi::Mtz mtz1 = cif2mtz.convert_block_to_mtz(raw.rblocks[1], out, &raw);
+  gemmi::Mtz mtz2 = cif2mtz.convert_block_to_mtz(rb, out);
+  CHECK_EQ(mtz1.nreflections, 3);
+  CHECK(mtz1.data == mtz2.data);
+
+  // data_ after other tokens in the same line - blocks are not split here
+  // as by the CIF parser, so the file is parsed as usual
+  const char* tricky = "data_a\n_x.y 1 data_b\nloop_\n_refln.index_h\n1\n2\n";
+  gemmi::RawReflnCif raw2 = gemmi::read_raw_refln_cif(string_to_buffer(tricky), "test");
+  CHECK(raw2.raw_loops.empty());
+  REQUIRE_EQ(raw2.rblocks.size(), 2);
+  CHECK_EQ(raw2.rblocks[1].block.name, "b");
+  CHECK_EQ(raw2.loop_length(*raw2.rblocks[1].default_loop), 2);
+}
+
+TEST_CASE("MtzWriter") {
+  gemmi::RawReflnCif raw = gemmi::read_raw_refln_cif(string_to_buffer(sf_mmcif), "test");
+  gemmi::CifToMtz cif2mtz;
+  std::ostringstream out;
+  gemmi::Mtz mtz = cif2mtz.convert_block_to_mtz(raw.rblocks[1], out, &raw);
+  REQUIRE_EQ(mtz.nreflections, 3);
+  const char* path = "test_mtzwriter.mtz";
+  std::string tmp_path = std::string(path) + ".tmp";
+  auto file_exists = [](const std::string& p) {
+    std::FILE* f = std::fopen(p.c_str(), "rb");
+    if (f)
+      std::fclose(f);
+    return f != nullptr;
+  };
+  std::FILE* f = std::fopen(path, "wb");
+  REQUIRE(f);
+  std::fputs("old", f);
+  std::fclose(f);
+  {
+    // not finished (as if conversion failed): the old file is intact
+    gemmi::MtzWriter writer(mtz, path);
+    writer.add_rows(mtz.data);
+    CHECK(file_exists(tmp_path));
+  }
+  CHECK(!file_exists(tmp_path));
+  gemmi::CharArray old = gemmi::read_file_into_buffer(path);
+  CHECK_EQ(std::string(old.data(), old.size()), "old");
+
+  gemmi::MtzWriter writer(mtz, path);
+  writer.add_rows(mtz.data);
+  writer.finish();
+  CHECK(!file_exists(tmp_path));
+  gemmi::Mtz mtz2 = gemmi::read_mtz_file(path);
+  std::remove(path);
+  CHECK_EQ(mtz2.nreflections, 3);
+  CHECK(mtz2.data == mtz.data);
+}
+
+TEST_CASE("read_mtz_columns from gzipped file") {
+  const std::string path = TEST_DATA_DIR "5wkd_phases.mtz.gz";
+  gemmi::Mtz full = gemmi::read_mtz(gemmi::MaybeGzipped(path), true);
+  const std::vector<std::string> labels = {"PHWT", "FWT"};
+  auto check = [&](const gemmi::Mtz& mtz) {
+    REQUIRE(mtz.columns.size() == 5);
+    CHECK(mtz.nreflections == full.nreflections);
+    CHECK(mtz.appended_text == full.appended_text);
+    for (const gemmi::Mtz::Column& col : mtz.columns) {
+      const gemmi::Mtz::Column* full_col = full.column_with_label(col.label);
+      REQUIRE(full_col != nullptr);
+      CHECK(std::equal(col.begin(), col.end(), full_col->begin()));
+    }
+  };
+  // the file is read as a stream, not uncompressed into memory
+  check(gemmi::read_mtz_columns(gemmi::MaybeGzipped(path), labels));
+  // the same in small chunks
+  gemmi::MaybeGzipped input(path);
+  gemmi::MaybeGzipped::GzStream stream = input.get_uncompressing_stream();
+  gemmi::Mtz mtz;
+  mtz.read_all_headers(stream);
+  mtz.read_raw_data_of_columns(stream, labels, 1000);
+  check(mtz);
+}
+
+TEST_CASE("read_first_block_into_buffer_gz") {
+  const char* path = "test_first_block.cif";
+  std::FILE* f = std::fopen(path, "wb");
+  REQUIRE(f);
+  std::fputs(sf_mmcif, f);
+  std::fclose(f);
+  gemmi::CharArray mem = gemmi::read_first_block_into_buffer_gz(path);
+  std::remove(path);
+  std::string expected(sf_mmcif);
+  expected.resize(expected.find("  data_b"));
+  CHECK_EQ(std::string(mem.data(), mem.size()), expected);
+}
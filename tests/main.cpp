@@ -2,14 +2,31 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
+#include <algorithm>  // for any_of
+#include <cmath>  // for sin
 #include <cstdlib>  // for rand
 #include <climits>  // for INT_MIN, INT_MAX
+#include <complex>
+#include <functional>  // for function
 #include <vector>
 #include <gemmi/atox.hpp>
+#include <gemmi/numb.hpp>  // for as_number
 #include <gemmi/math.hpp>
 #include <gemmi/it92.hpp>
 #include <gemmi/util.hpp>  // for is_in_list
 #include <gemmi/asudata.hpp>  // for ComplexCorrelation
+#include <gemmi/brickgrid.hpp>  // for BrickedGrid
+#include <gemmi/dencalc.hpp>  // for DensityCalculator
+#include <gemmi/mapcorr.hpp>  // for LocalCorrelation
+#include <gemmi/merge.hpp>  // for Intensities
+#include <gemmi/millerkey.hpp>  // for pack_miller, MillerKeyMap
+#include <gemmi/mmread_gz.hpp>  // for read_structure_gz
+#include <gemmi/read_cif.hpp>  // for read_cif_gz
+#include <gemmi/sfcalc.hpp>  // for sincos_2pi, StructureFactorCalculator
+#include <gemmi/smcif.hpp>  // for make_small_structure_from_block
+#include <gemmi/levmar.hpp>  // for cholesky_solve, jordan_solve
+#include <gemmi/refine/ll.hpp>  // for LL, TableS3
+#include <gemmi/refine/sparse.hpp>  // for SymmetricMatrixBuilder, solve_pcg
 #include <linalg.h>
 
 static double draw() { return 10.0 * std::rand() / RAND_MAX - 5; }
@@ -130,6 +147,28 @@ TEST_CASE("Correlation") {
   CHECK_EQ(cor.intercept(), doctest::Approx(5.178423236514524));
 }
 
+TEST_CASE("Correlation::add") {
+  const double xs[] = {2.1, 2.5, 4.0, 3.6, 1.2, 0.3, 5.5};
+  const double ys[] = {8, 12, 14, 10, 3, 7, 11};
+  gemmi::Correlation all, a, b;
+  gemmi::Variance var_all, var_a, var_b;
+  for (int i = 0; i < 7; ++i) {
+    all.add_point(xs[i], ys[i]);
+    (i < 3 ? a : b).add_point(xs[i], ys[i]);
+    var_all.add_point(xs[i]);
+    (i < 3 ? var_a : var_b).add_point(xs[i]);
+  }
+  a.add(b);
+  CHECK_EQ(a.n, all.n);
+  CHECK_EQ(a.mean_y, doctest::Approx(all.mean_y));
+  CHECK_EQ(a.coefficient(), doctest::Approx(all.coefficient()));
+  CHECK_EQ(a.slope(), doctest::Approx(all.slope()));
+  var_a.add(var_b);
+  CHECK_EQ(var_a.n, 7);
+  CHECK_EQ(var_a.mean_x, doctest::Approx(var_all.mean_x));
+  CHECK_EQ(var_a.for_sample(), doctest::Approx(var_all.for_sample()));
+}
+
 TEST_CASE("ComplexCorrelation") {
   gemmi::ComplexCorrelation cor;
   cor.add_point(std::complex<double>{1., 2.},   std::complex<double>{2., 2.});
@@ -145,6 +184,26 @@ TEST_CASE("string_to_int") {
   CHECK_EQ(gemmi::string_to_int(std::to_string(INT_MAX), true), INT_MAX);
   CHECK_EQ(gemmi::string_to_int(std::to_string(INT_MIN), true), INT_MIN);
   CHECK_EQ(gemmi::string_to_int("", false), 0);
+  // with length, the number doesn't need to be followed by '\0'
+  CHECK_EQ(gemmi::string_to_int("-12 34", true, 3), -12);
+  CHECK_EQ(gemmi::string_to_int(" 7 x", true, 2), 7);
+  CHECK_THROWS(gemmi::string_to_int("12x", true, 3));
+}
+
+TEST_CASE("as_number") {
+  using gemmi::cif::as_number;
+  auto range = [](const char* s, size_t len) { return as_number(s, s + len); };
+  CHECK_EQ(range("1.5 2", 3), 1.5);
+  CHECK_EQ(range("+2e1)", 4), 20.);
+  CHECK_EQ(range("-0.25(3)x", 8), -0.25);
+  CHECK(std::isnan(range("12(3", 4)));  // no closing bracket within the range
+  CHECK(std::isnan(range("12(3)", 4)));
+  CHECK(std::isnan(range("-", 1)));
+  CHECK(std::isnan(range("+", 1)));
+  CHECK(std::isnan(range("1", 0)));
+  CHECK(std::isnan(range("-inf", 4)));
+  CHECK(std::isnan(range("?", 1)));
+  CHECK_EQ(as_number(std::string("3.25(1)")), 3.25);
 }
 
 TEST_CASE("is_in_list") {
@@ -191,3 +250,502 @@ TEST_CASE("vector_Vec3") {
   auto offset = x1 - x0;
   CHECK_EQ(offset, 3);
 }
+
+TEST_CASE("BrickedGrid") {
+  std::srand(12345);
+  gemmi::Grid<float> grid;
+  grid.set_unit_cell(50, 40, 60, 90, 100, 90);
+  grid.set_size(70, 40, 66);
+  for (float& x : grid.data)
+    x = (float) draw();
+  gemmi::BrickedGrid<float> bgrid;
+  bgrid.set_storage(8);  // 18 bricks in total, 10 go to the scratch file
+  bgrid.set_from_grid(grid);
+  CHECK_EQ(bgrid.brick_count(), 18);
+  CHECK_EQ(bgrid.cached_brick_count(), 8);
+  for (int i = 0; i < 200; ++i) {
+    double x = 100 * draw(), y = 100 * draw(), z = 100 * draw();
+    CHECK_EQ(bgrid.get_value((int)x, (int)y, (int)z),
+             grid.get_value((int)x, (int)y, (int)z));
+    CHECK_EQ(bgrid.interpolate_value(x, y, z),
+             doctest::Approx(grid.interpolate_value(x, y, z)));
+    CHECK_EQ(bgrid.tricubic_interpolation(x, y, z),
+             doctest::Approx(grid.tricubic_interpolation(x, y, z)));
+  }
+  gemmi::Grid<float> copy;
+  bgrid.copy_to_grid(copy);
+  CHECK(copy.data == grid.data);
+  gemmi::DataStats st1 = gemmi::calculate_data_statistics(grid.data);
+  gemmi::DataStats st2 = gemmi::calculate_data_statistics(bgrid);
+  CHECK_EQ(st1.dmean, doctest::Approx(st2.dmean));
+  CHECK_EQ(st1.rms, doctest::Approx(st2.rms));
+}
+
+TEST_CASE("Half") {
+  for (uint32_t i = 0; i < 0x10000; ++i) {
+    gemmi::Half h = gemmi::Half::from_bits((uint16_t) i);
+    float f = h;
+    if (std::isnan(f))
+      CHECK(gemmi::impl::is_nan(h));
+    else
+      CHECK_EQ(gemmi::Half(f).bits, h.bits);
+  }
+  CHECK_EQ(gemmi::Half(1.0f).bits, 0x3c00);
+  CHECK_EQ(gemmi::Half(-2.0f).bits, 0xc000);
+  CHECK_EQ(gemmi::Half(65504.f).bits, 0x7bff);
+  CHECK_EQ(gemmi::Half(65520.f).bits, 0x7c00);  // rounded to infinity
+  CHECK_EQ(gemmi::Half(1e-8f).bits, 0);
+  CHECK_EQ(gemmi::Half(1.0f + 1.f/2048).bits, 0x3c00);  // tie, to even
+  CHECK_EQ(gemmi::Half(1.0f + 3.f/2048).bits, 0x3c02);  // tie, to even
+  CHECK_EQ((float) gemmi::Half::from_bits(1), doctest::Approx(5.96046448e-8f));
+}
+
+TEST_CASE("QuantizedGrid") {
+  std::srand(12345);
+  gemmi::Grid<float> grid;
+  grid.set_unit_cell(50, 40, 60, 90, 100, 90);
+  grid.set_size(20, 16, 24);
+  for (float& x : grid.data)
+    x = (float) (3 * draw() - 1);
+  grid.data[7] = NAN;
+  gemmi::QuantizedGrid<int16_t> qgrid;
+  qgrid.set_from_grid(grid);
+  CHECK(std::isnan(qgrid.get_real_value(7, 0, 0)));
+  grid.data[7] = 0.f;
+  qgrid.set_real_value(7, 0, 0, 0.);
+  double eps = qgrid.scale;
+  for (int i = 0; i < 100; ++i) {
+    double x = 100 * draw(), y = 100 * draw(), z = 100 * draw();
+    CHECK_EQ(qgrid.get_real_value((int)x, (int)y, (int)z),
+             doctest::Approx(grid.get_value((int)x, (int)y, (int)z)).epsilon(eps));
+    CHECK_EQ(qgrid.interpolate_value(x, y, z),
+             doctest::Approx(grid.interpolate_value(x, y, z)).epsilon(eps));
+    CHECK_EQ(qgrid.tricubic_interpolation(x, y, z),
+             doctest::Approx(grid.tricubic_interpolation(x, y, z)).epsilon(eps));
+  }
+  std::vector<float> sub1(5 * 6 * 7), sub2(5 * 6 * 7);
+  grid.get_subarray(sub1.data(), {18, -2, 3}, {5, 6, 7});
+  qgrid.get_subarray(sub2.data(), {18, -2, 3}, {5, 6, 7});
+  for (size_t i = 0; i < sub1.size(); ++i)
+    CHECK_EQ(sub2[i], doctest::Approx(sub1[i]).epsilon(eps));
+  gemmi::DataStats st1 = gemmi::calculate_data_statistics(grid.data);
+  gemmi::DataStats st2 = gemmi::calculate_data_statistics(qgrid);
+  CHECK_EQ(st2.dmin, doctest::Approx(st1.dmin).epsilon(eps));
+  CHECK_EQ(st2.dmax, doctest::Approx(st1.dmax).epsilon(eps));
+  CHECK_EQ(st2.dmean, doctest::Approx(st1.dmean).epsilon(eps));
+  CHECK_EQ(st2.rms, doctest::Approx(st1.rms).epsilon(eps));
+
+  gemmi::Grid<gemmi::Half> hgrid;
+  hgrid.copy_metadata_from(grid);
+  hgrid.data.assign(grid.data.begin(), grid.data.end());
+  for (int i = 0; i < 100; ++i) {
+    double x = 100 * draw(), y = 100 * draw(), z = 100 * draw();
+    CHECK_EQ((float) hgrid.interpolate_value(x, y, z),
+             doctest::Approx(grid.interpolate_value(x, y, z)).epsilon(2e-3));
+  }
+  CHECK_EQ(hgrid.sum(), doctest::Approx(grid.sum()).epsilon(1e-3));
+}
+
+TEST_CASE("LocalCorrelation") {
+  std::srand(12345);
+  gemmi::Grid<float> a, b;
+  a.set_unit_cell(30, 25, 40, 90, 100, 90);
+  a.set_size(30, 24, 36);
+  b.copy_metadata_from(a);
+  b.data.resize(a.data.size());
+  for (size_t i = 0; i < a.data.size(); ++i) {
+    a.data[i] = (float) draw();
+    b.data[i] = (float) (a.data[i] + 2 * draw());
+  }
+  gemmi::LocalCorrelation lc;
+  lc.prepare(a, b, 2);
+  for (int i = 0; i < 50; ++i) {
+    // the box may wrap around the unit cell
+    int u = std::rand() % 100 - 50, v = std::rand() % 100 - 50, w = std::rand() % 100 - 50;
+    int su = std::rand() % 20 + 2, sv = std::rand() % 20 + 2, sw = std::rand() % 20 + 2;
+    gemmi::Correlation corr;
+    for (int dw = 0; dw < sw; ++dw)
+      for (int dv = 0; dv < sv; ++dv)
+        for (int du = 0; du < su; ++du)
+          corr.add_point(a.get_value(u+du, v+dv, w+dw), b.get_value(u+du, v+dv, w+dw));
+    CHECK_EQ(lc.box_cc(u, v, w, su, sv, sw), doctest::Approx(corr.coefficient()));
+  }
+}
+
+TEST_CASE("Intensities::merge_in_place") {
+  std::srand(12345);
+  gemmi::Intensities orig;
+  orig.spacegroup = gemmi::find_spacegroup_by_name("P 21 21 2");
+  orig.unit_cell.set(40, 50, 60, 90, 90, 90);
+  orig.data.resize(30000);
+  for (gemmi::Intensities::Refl& refl : orig.data) {
+    refl.hkl = {{std::rand() % 21 - 10, std::rand() % 21 - 10, std::rand() % 21 - 10}};
+    refl.isign = 0;
+    refl.value = 100 * draw();
+    refl.sigma = 6 + draw();
+  }
+  for (gemmi::DataType type : {gemmi::DataType::Mean, gemmi::DataType::Anomalous}) {
+    gemmi::Intensities serial = orig;
+    serial.switch_to_asu_indices();
+    serial.merge_in_place(type);
+    CHECK(std::is_sorted(serial.data.begin(), serial.data.end()));
+    for (int nthreads : {2, 3}) {
+      gemmi::Intensities parallel = orig;
+      parallel.switch_to_asu_indices(false, nthreads);
+      parallel.merge_in_place(type, nthreads);
+      REQUIRE_EQ(parallel.data.size(), serial.data.size());
+      for (size_t i = 0; i < serial.data.size(); ++i) {
+        CHECK_EQ(parallel.data[i].hkl, serial.data[i].hkl);
+        CHECK_EQ(parallel.data[i].isign, serial.data[i].isign);
+        CHECK_EQ(parallel.data[i].nobs, serial.data[i].nobs);
+        // summation order is the same, so the results are identical
+        CHECK_EQ(parallel.data[i].value, serial.data[i].value);
+        CHECK_EQ(parallel.data[i].sigma, serial.data[i].sigma);
+      }
+    }
+  }
+}
+
+TEST_CASE("Intensities::calculate_merging_stats") {
+  std::srand(4321);
+  gemmi::Intensities intensities;
+  intensities.spacegroup = gemmi::find_spacegroup_by_name("P 21 21 2");
+  intensities.unit_cell.set(40, 50, 60, 90, 90, 90);
+  intensities.type = gemmi::DataType::Unmerged;
+  intensities.data.resize(20000);
+  for (gemmi::Intensities::Refl& refl : intensities.data) {
+    refl.hkl = {{std::rand() % 15, std::rand() % 15, std::rand() % 15}};
+    refl.isign = 1;
+    refl.value = 100 * draw();
+    refl.sigma = 6 + draw();
+  }
+  intensities.switch_to_asu_indices();
+  std::vector<double> inv_d2;
+  for (const gemmi::Intensities::Refl& refl : intensities.data)
+    inv_d2.push_back(intensities.unit_cell.calculate_1_d2(refl.hkl));
+  gemmi::Binner binner;
+  binner.setup_from_1_d2(5, gemmi::Binner::Method::Dstar3, std::move(inv_d2),
+                         &intensities.unit_cell);
+  std::vector<gemmi::MergingStats> serial =
+    intensities.calculate_merging_stats(&binner);
+  REQUIRE_EQ(serial.size(), 5);
+  gemmi::Intensities merged = intensities;
+  merged.merge_in_place(gemmi::DataType::Mean);
+  gemmi::MergingStats total;
+  for (const gemmi::MergingStats& ms : serial)
+    total.add(ms);
+  CHECK_EQ(total.all_refl, (int) intensities.data.size());
+  CHECK_EQ(total.unique_refl, (int) merged.data.size());
+  CHECK(total.r_merge() > 0);
+  CHECK(total.r_meas() > total.r_merge());
+  CHECK(total.r_pim() < total.r_merge());
+  std::vector<gemmi::MergingStats> parallel =
+    intensities.calculate_merging_stats(&binner, false, 3);
+  for (size_t i = 0; i < serial.size(); ++i) {
+    CHECK_EQ(parallel[i].unique_refl, serial[i].unique_refl);
+    CHECK_EQ(parallel[i].r_merge(), doctest::Approx(serial[i].r_merge()));
+    CHECK_EQ(parallel[i].cc_half(), doctest::Approx(serial[i].cc_half()));
+    CHECK_EQ(parallel[i].mean_i_over_sigma(),
+             doctest::Approx(serial[i].mean_i_over_sigma()));
+  }
+}
+
+TEST_CASE("XdsAscii::read_buffer") {
+  std::string text =
+    "!FORMAT=XDS_ASCII    MERGE=FALSE    FRIEDEL'S_LAW=TRUE\n"
+    "!Generated by XSCALE   (VERSION Jan 10, 2022  BUILT=20220220)\n"
+    "!SPACE_GROUP_NUMBER=   19\n"
+    "!UNIT_CELL_CONSTANTS=    78.1    91.2   100.3  90.000  90.000  90.000\n"
+    "! ISET= 1 INPUT_FILE=a.HKL\n"
+    "! ISET= 2 INPUT_FILE=b.HKL\n"
+    "!NUMBER_OF_ITEMS_IN_EACH_DATA_RECORD=10\n";
+  for (const char* col : {"H=1", "K=2", "L=3", "IOBS=4", "SIGMA(IOBS)=5",
+                          "XD=6", "YD=7", "ZD=8", "ISET=9", "PSI=10"})
+    text += gemmi::cat("!ITEM_", col, '\n');
+  text += "!END_OF_HEADER\n";
+  for (int i = 0; i < 3000; ++i)
+    text += gemmi::cat(i % 7 - 3, ' ', i % 11, ' ', i % 13 + 1, "  1.5E+02  ", i % 9 + 1,
+                       "  1200.5  800.2  ", i / 10, ".3  ", i % 2 + 1, "  -4.5\n");
+  text += "!END_OF_DATA\n";
+  gemmi::XdsAscii serial;
+  serial.read_buffer(text.c_str(), text.size(), "serial");
+  REQUIRE_EQ(serial.data.size(), 3000);
+  CHECK_EQ(serial.isets.size(), 2);
+  CHECK(!serial.has11);
+  CHECK_EQ(serial.data[7].hkl, gemmi::Miller{{-3, 7, 8}});
+  CHECK_EQ(serial.data[7].sigma, 8);
+  CHECK_EQ(serial.data[7].iset, 2);
+  gemmi::XdsAscii parallel;
+  parallel.read_buffer(text.c_str(), text.size(), "parallel", 3);
+  REQUIRE_EQ(parallel.data.size(), serial.data.size());
+  for (size_t i = 0; i < serial.data.size(); ++i) {
+    CHECK_EQ(parallel.data[i].hkl, serial.data[i].hkl);
+    CHECK_EQ(parallel.data[i].zd, serial.data[i].zd);
+    CHECK_EQ(parallel.data[i].iset, serial.data[i].iset);
+  }
+}
+
+TEST_CASE("pack_miller") {
+  std::vector<gemmi::Miller> hkls;
+  for (int i = 0; i < 3000; ++i)
+    hkls.push_back({{rand() % 41 - 20, rand() % 2001 - 1000, rand() % 7 - 3}});
+  hkls.push_back({{-(1 << 19), 0, (1 << 19) - 1}});
+  std::vector<std::uint64_t> keys;
+  for (const gemmi::Miller& hkl : hkls) {
+    CHECK(gemmi::can_pack_miller(hkl));
+    keys.push_back(gemmi::pack_miller(hkl));
+    CHECK_EQ(gemmi::unpack_miller(keys.back()), hkl);
+  }
+  CHECK(!gemmi::can_pack_miller({{1 << 19, 0, 0}}));
+  std::vector<std::uint32_t> order = gemmi::radix_sort_indices(keys);
+  std::vector<gemmi::Miller> sorted = hkls;
+  std::stable_sort(sorted.begin(), sorted.end());
+  for (size_t i = 0; i < hkls.size(); ++i)
+    CHECK_EQ(hkls[order[i]], sorted[i]);
+  gemmi::MillerKeyMap<int> map;
+  for (int i = 0; i < (int) hkls.size(); ++i)
+    map.insert(keys[i], i);
+  for (int i = 0; i < (int) hkls.size(); ++i) {
+    const int* p = map.find(keys[i]);
+    REQUIRE(p != nullptr);
+    CHECK_EQ(hkls[*p], hkls[i]);
+    CHECK(*p <= i);  // the first occurrence is kept
+  }
+  CHECK(map.find(gemmi::pack_miller({{0, 5000, 0}})) == nullptr);
+}
+
+TEST_CASE("sincos_2pi") {
+  for (int i = -4000; i <= 4000; ++i) {
+    double t = i * 0.0123 + 1e-9 * rand() / RAND_MAX;
+    double s, c;
+    gemmi::sincos_2pi(t, &s, &c);
+    double arg = 2 * gemmi::pi() * t;
+    CHECK(std::fabs(s - std::sin(arg)) < 1e-13);
+    CHECK(std::fabs(c - std::cos(arg)) < 1e-13);
+  }
+  for (int q = -8; q <= 8; ++q) {  // exact quarters
+    double s, c;
+    gemmi::sincos_2pi(0.25 * q, &s, &c);
+    CHECK_EQ(s, (q % 2 == 0 ? 0. : (q == 1 || q == -3 || q == 5 || q == -7 ? 1. : -1.)));
+    CHECK(std::fabs(c - std::cos(0.5 * gemmi::pi() * q)) < 1e-15);
+  }
+}
+
+TEST_CASE("StructureFactorCalculator::calculate_sf_batch") {
+  using SFC = gemmi::StructureFactorCalculator<gemmi::IT92<double>>;
+  std::vector<gemmi::Miller> hkls;
+  for (int i = 0; i < 60; ++i)
+    hkls.push_back({{i % 7 - 3, i % 5 - 1, i % 11 - 5}});
+  // calculate_sf_batch() should give the same values as functions
+  // that calculate one reflection
+  auto compare = [&](SFC& calc, const gemmi::DirectSumAtoms& atoms,
+                     std::function<std::complex<double>(const gemmi::Miller&)> one) {
+    for (int nthreads : {1, 3}) {
+      std::vector<std::complex<double>> batch = calc.calculate_sf_batch(atoms, hkls, nthreads);
+      REQUIRE(batch.size() == hkls.size());
+      double max_f = 0, max_diff = 0;
+      std::vector<double> work;
+      for (size_t i = 0; i != hkls.size(); ++i) {
+        std::complex<double> f = one(hkls[i]);
+        max_f = std::max(max_f, std::abs(f));
+        max_diff = std::max(max_diff, std::abs(batch[i] - f));
+        CHECK(calc.calculate_sf_direct(atoms, hkls[i], work) == batch[i]);
+      }
+      CHECK(max_f > 1);
+      CHECK(max_diff < 1e-10 * max_f);
+    }
+  };
+
+  gemmi::Structure st = gemmi::read_structure_gz(TEST_DATA_DIR "1orc.pdb");
+  gemmi::Model& model = st.first_model();
+  // a few anisotropic atoms
+  model.chains.at(0).residues.at(0).atoms.at(0).aniso = {0.3f, 0.2f, 0.4f, 0.05f, -0.02f, 0.01f};
+  model.chains.at(0).residues.at(3).atoms.at(1).aniso = {0.5f, 0.6f, 0.3f, 0.f, 0.1f, 0.f};
+  SFC calc(st.cell);
+  calc.addends.set(gemmi::El::S, 0.3f);
+  gemmi::DirectSumAtoms atoms = calc.prepare_atoms(model);
+  CHECK(atoms.aniso.size() == 2);
+  compare(calc, atoms, [&](const gemmi::Miller& hkl) {
+      return calc.calculate_sf_from_model(model, hkl);
+  });
+
+  gemmi::cif::Document doc = gemmi::read_cif_gz(TEST_DATA_DIR "2013551.cif");
+  gemmi::SmallStructure small = gemmi::make_small_structure_from_block(doc.sole_block());
+  SFC small_calc(small.cell);
+  gemmi::DirectSumAtoms small_atoms = small_calc.prepare_atoms(small);
+  CHECK(!small_atoms.aniso.empty());
+  compare(small_calc, small_atoms, [&](const gemmi::Miller& hkl) {
+      return small_calc.calculate_sf_from_small_structure(small, hkl);
+  });
+}
+
+TEST_CASE("DensityProfileCache") {
+  using Table = gemmi::IT92<double>;
+  gemmi::DensityCalculator<Table, float> direct;
+  direct.grid.unit_cell.set(20, 22, 24, 90, 90, 90);
+  direct.grid.spacegroup = gemmi::find_spacegroup_by_name("P 1");
+  direct.d_min = 1.5;
+  direct.addends.set(gemmi::El::O, 0.05f);
+  direct.initialize_grid();
+  gemmi::DensityCalculator<Table, float> cached = direct;
+  cached.profile_cache.reset(new gemmi::DensityProfileCache<Table, float>);
+  gemmi::Atom atom;
+  atom.occ = 1.f;
+  for (int i = 0; i < 30; ++i) {
+    atom.element = i % 3 == 0 ? gemmi::El::O : gemmi::El::C;
+    atom.pos = gemmi::Position(0.7 * i, 0.5 * i, 0.3 * i);
+    atom.b_iso = i % 2 == 0 ? 20.f : 35.f;
+    direct.add_atom_density_to_grid(atom);
+    cached.add_atom_density_to_grid(atom);
+  }
+  CHECK_EQ(cached.profile_cache->size(), 4);
+  float max_diff = 0;
+  for (size_t i = 0; i < direct.grid.data.size(); ++i)
+    max_diff = std::max(max_diff, std::fabs(cached.grid.data[i] - direct.grid.data[i]));
+  CHECK(max_diff < 30 * 0.1 * direct.cutoff);
+
+  // B is rounded to 0.01
+  atom.element = gemmi::El::C;
+  atom.b_iso = 20.004f;
+  cached.add_atom_density_to_grid(atom);
+  atom.b_iso = 19.996f;
+  cached.add_atom_density_to_grid(atom);
+  CHECK_EQ(cached.profile_cache->size(), 4);
+  // the cache is cleared when full
+  cached.profile_cache->max_size = 5;
+  for (int i = 0; i < 3; ++i) {
+    atom.b_iso = 40.f + i;
+    cached.add_atom_density_to_grid(atom);
+  }
+  CHECK_EQ(cached.profile_cache->size(), 2);
+}
+
+TEST_CASE("LL::calc_grad and fisher_diag_from_table in threads") {
+  using Table = gemmi::IT92<double>;
+  gemmi::Structure st = gemmi::read_structure_gz(TEST_DATA_DIR "1orc.pdb");
+  std::vector<gemmi::Atom*> atoms;
+  for (gemmi::CRA cra : st.first_model().all())
+    atoms.push_back(cra.atom);
+  gemmi::SpaceGroup sg = *st.find_spacegroup();
+  gemmi::Grid<float> den;
+  den.unit_cell = st.cell;
+  den.spacegroup = &sg;
+  den.set_size_from_spacing(1.0, gemmi::GridSizeRounding::Up);
+  for (size_t i = 0; i != den.data.size(); ++i)
+    den.data[i] = (float) std::sin(0.37 * i);
+  gemmi::TableS3 d2dfw_table(2.0, 20.0);
+  std::vector<double> svals, yvals;
+  for (int i = 0; i <= 200; ++i) {
+    svals.push_back(0.05 + 0.00225 * i);
+    yvals.push_back(1.0 + 2.0 * svals.back());
+  }
+  d2dfw_table.make_table(svals, yvals);
+  double max_b = 0;
+  for (const gemmi::Atom* atom : atoms)
+    max_b = std::max(max_b, (double) atom->b_iso);
+  // atoms are processed in parallel, each writes only its own elements,
+  // so the results must be the same as with one thread
+  for (int adp_mode : {1, 2}) {
+    if (adp_mode == 2) {
+      atoms[0]->aniso = {0.3f, 0.2f, 0.4f, 0.05f, -0.02f, 0.01f};
+      atoms[5]->aniso = {0.5f, 0.6f, 0.3f, 0.f, 0.1f, 0.f};
+    }
+    auto make_ll = [&]() {
+      gemmi::LL<Table> ll(st.cell, &sg, atoms, false, true, adp_mode, false);
+      ll.set_ncs({gemmi::Transform{{}, {1.5, -2., 0.5}}});
+      return ll;
+    };
+    gemmi::LL<Table> ll1 = make_ll();
+    std::vector<double> vn1 = ll1.calc_grad(den, 0., 1);
+    ll1.make_fisher_table_diag_fast(0., 2 * max_b + 300., d2dfw_table, 1);
+    std::vector<double> am1 = ll1.fisher_diag_from_table(1);
+    CHECK(std::any_of(vn1.begin(), vn1.end(), [](double x) { return x != 0; }));
+    CHECK(std::all_of(am1.begin(), am1.end(), [](double x) { return x > 0; }));
+    for (int nthreads : {2, 3}) {
+      gemmi::LL<Table> ll = make_ll();
+      CHECK(ll.calc_grad(den, 0., nthreads) == vn1);
+      ll.make_fisher_table_diag_fast(0., 2 * max_b + 300., d2dfw_table, nthreads);
+      CHECK(ll.pp1 == ll1.pp1);
+      CHECK(ll.bb == ll1.bb);
+      CHECK(ll.aa == ll1.aa);
+      CHECK(ll.fisher_diag_from_table(nthreads) == am1);
+    }
+  }
+}
+
+TEST_CASE("cholesky_solve") {
+  // A = M^T M + I is positive definite
+  std::srand(12345);
+  const int n = 7;
+  std::vector<double> m(n * n), a(n * n, 0.), b(n);
+  for (double& x : m)
+    x = 0.1 * draw();
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j)
+      for (int k = 0; k < n; ++k)
+        a[n * i + j] += m[n * k + i] * m[n * k + j];
+    a[n * i + i] += 1.;
+    b[i] = i - 3;
+  }
+  std::vector<double> a2 = a, b2 = b;
+  CHECK(gemmi::cholesky_solve(a, b));
+  gemmi::jordan_solve(a2, b2);
+  // the same solution, within rounding errors
+  for (int i = 0; i < n; ++i)
+    CHECK(std::fabs(b[i] - b2[i]) < 1e-12);
+  // not positive definite - returns false and doesn't change arguments
+  std::vector<double> z(n * n, 0.), c(n, 1.);
+  CHECK(!gemmi::cholesky_solve(z, c));
+  CHECK_EQ(c[0], 1.);
+}
+
+TEST_CASE("solve_pcg") {
+  // A = M^T M + I, as above; 2 atoms (xyz) and 3 other parameters
+  std::srand(12345);
+  const int n = 9;
+  std::vector<double> m(n * n), a(n * n, 0.), b(n);
+  for (double& x : m)
+    x = 0.1 * draw();
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j)
+      for (int k = 0; k < n; ++k)
+        a[n * i + j] += m[n * k + i] * m[n * k + j];
+    a[n * i + i] += 1.;
+    b[i] = i - 3;
+  }
+  // one triangle, with the diagonal added in two halves
+  gemmi::SymmetricMatrixBuilder builder(n);
+  std::vector<double> values;
+  std::vector<int> rows, cols;
+  for (int i = 0; i < n; ++i)
+    for (int j = 0; j <= i; ++j) {
+      values.push_back(i == j ? 0.5 * a[n * i + j] : a[n * i + j]);
+      rows.push_back(i % 2 == 0 ? i : j);
+      cols.push_back(i % 2 == 0 ? j : i);
+    }
+  builder.add(values.data(), rows.data(), cols.data(), values.size());
+  for (int i = 0; i < n; ++i) {
+    double half = 0.5 * a[n * i + i];
+    builder.add(&half, &i, &i, 1);
+  }
+  gemmi::SparseMatrixCSR csr = builder.to_csr();
+  CHECK_EQ(csr.nnz(), size_t(n * n));
+  std::vector<double> y(n);
+  csr.multiply(b.data(), y.data());
+  for (int i = 0; i < n; ++i) {
+    double dense = 0.;
+    for (int j = 0; j < n; ++j) {
+      CHECK(std::fabs(csr.at(i, j) - a[n * i + j]) < 1e-12);
+      dense += a[n * i + j] * b[j];
+    }
+    CHECK(std::fabs(y[i] - dense) < 1e-12);
+  }
+  gemmi::BlockJacobi precond(csr, 6, 1e-9);
+  std::vector<double> x;
+  int iter = gemmi::solve_pcg(csr, precond, b, x, 100, 1e-12);
+  CHECK(iter > 0);
+  CHECK(iter <= 100);
+  gemmi::jordan_solve(a, b);
+  for (int i = 0; i < n; ++i)
+    CHECK(std::fabs(x[i] - b[i]) < 1e-9);
+}
@@ -81,6 +81,46 @@ class TestFloatGrid(unittest.TestCase):
         m.set_value(1, 2, 3, 0.0)
         m.symmetrize_min()
         self.assertEqual(m.sum(), 2 * N * N * N - 2 * 12)
+        m.fill(0.0)
+        m.set_value(1, 2, 3, 1.0)
+        m.symmetrize_sum(nthreads=2)
+        self.assertEqual(m.sum(), 12.0)
+
+    def test_resample(self):
+        m = gemmi.read_ccp4_map(full_path('5i55_tiny.ccp4'))
+        m.setup(0.)
+        for order in (1, 2, 3):
+            dest1 = gemmi.FloatGrid(90, 36, 90)
+            dest1.unit_cell = m.grid.unit_cell
+            m.grid.resample_to(dest1, order)
+            dest2 = gemmi.FloatGrid(90, 36, 90)
+            dest2.unit_cell = m.grid.unit_cell
+            m.grid.resample_to(dest2, order, nthreads=3)
+            for point in [(0, 0, 0), (5, 7, 11), (89, 35, 89), (44, 20, 61)]:
+                value = dest1.get_value(*point)
+                self.assertEqual(value, dest2.get_value(*point))
+                frac = dest1.get_fractional(*point)
+                if order == 2:
+                    expected = m.grid.interpolate_value(frac)
+                    self.assertAlmostEqual(value, expected, places=5)
+                elif order == 3:
+                    expected = m.grid.tricubic_interpolation(frac)
+                    self.assertAlmostEqual(value, expected, places=5)
+
+    def test_map_correlation(self):
+        m = gemmi.read_ccp4_map(full_path('5i55_tiny.ccp4'))
+        m.setup(0.)
+        peak = max(m.grid, key=lambda p: p.value)
+        cc_map = gemmi.calculate_local_correlation_map(m.grid, m.grid,
+                                                       radius=2.0, nthreads=2)
+        self.assertAlmostEqual(cc_map.get_value(peak.u, peak.v, peak.w), 1.0)
+        f = gemmi.transform_map_to_f_phi(m.grid, half_l=True)
+        binner = gemmi.Binner()
+        gemmi.setup_binner_for_grid(binner, 4, gemmi.Binner.Method.Dstar, f)
+        fsc = gemmi.calculate_fsc(f, f, binner, nthreads=2)
+        self.assertEqual(len(fsc), 4)
+        for shell in fsc:
+            self.assertAlmostEqual(shell.fsc(), 1.0)
 
 class TestCcp4Map(unittest.TestCase):
     @unittest.skipIf(numpy is None, "NumPy not installed.")
@@ -141,6 +181,19 @@ class TestCcp4Map(unittest.TestCase):
         self.assertEqual(mcut.grid.axis_order, gemmi.AxisOrder.XYZ)
         assert_numpy_equal(self, mcut.grid.array, expanded_data)
 
+    def test_half_precision(self):
+        m = gemmi.read_ccp4_map(full_path('5i55_tiny.ccp4'))
+        m.setup(0.)
+        m.update_ccp4_header(12)
+        tmp_path = get_path_for_tempfile(suffix='.mrc')
+        m.write_ccp4_map(tmp_path)
+        m2 = gemmi.read_ccp4_map(tmp_path)
+        self.assertEqual(m2.header_i32(4), 12)
+        for point in [(0, 0, 0), (5, 7, 11), (44, 20, 50)]:
+            value = m.grid.get_value(*point)
+            self.assertAlmostEqual(m2.grid.get_value(*point), value,
+                                   delta=1e-3 * abs(value) + 1e-6)
+
     def test_normalize(self):
         yzx_path = full_path('iota_yzx.ccp4.gz')
         m = gemmi.read_ccp4_map(full_path(yzx_path), setup=True)
@@ -87,6 +87,19 @@ class TestMtz(unittest.TestCase):
             assert_numpy_equal(self, numpy.array(mtz, copy=False), mtz.array)
             assert_numpy_equal(self, mtz.array, mtz2.array)
 
+    def test_read_selected_columns(self):
+        path = full_path('5e5z.mtz')
+        mtz = gemmi.read_mtz_file(path)
+        part = gemmi.read_mtz_file(path, columns=['FREE', 'SIGFP'])
+        self.assertEqual([col.label for col in part.columns],
+                         ['H', 'K', 'L', 'FREE', 'SIGFP'])
+        self.assertEqual(part.nreflections, mtz.nreflections)
+        for n, col in enumerate(part.columns):
+            self.assertEqual(col.idx, n)
+            self.assertEqual(list(col), list(mtz.column_with_label(col.label)))
+        with self.assertRaises(RuntimeError):
+            gemmi.read_mtz_file(path, columns=['NONEXISTENT'])
+
     def test_remove_and_add_column(self):
         path = full_path('5e5z.mtz')
         col_name = 'FREE'
@@ -182,6 +195,21 @@ class TestSfMmcif(unittest.TestCase):
         for order in (gemmi.AxisOrder.XYZ, gemmi.AxisOrder.ZYX):
             fft_test(self, rblock, 'pdbx_FWT', 'pdbx_PHWT', size)
 
+    def test_cif2mtz(self):
+        doc = gemmi.cif.read(full_path('r5wkdsf.ent'))
+        rblock = gemmi.as_refln_blocks(doc)[0]
+        cif2mtz = gemmi.CifToMtz()
+        mtz = cif2mtz.convert_block_to_mtz(rblock)
+        out_name = get_path_for_tempfile()
+        cif2mtz.write_block_to_mtz_file(rblock, out_name)
+        mtz2 = gemmi.read_mtz_file(out_name)
+        os.remove(out_name)
+        self.assertEqual(mtz2.nreflections, mtz.nreflections)
+        self.assertEqual([c.label for c in mtz2.columns],
+                         [c.label for c in mtz.columns])
+        if numpy is not None:
+            assert_numpy_equal(self, mtz2.array, mtz.array)
+
     def test_scaling(self):
         doc = gemmi.cif.read(full_path('r5wkdsf.ent'))
         rblock = gemmi.as_refln_blocks(doc)[0]
@@ -2,6 +2,7 @@
 
 import unittest
 import gemmi
+from common import full_path
 
 # from 5nl9
 FRAGMENT_WITH_UNK = """\
@@ -35,5 +36,27 @@ class TestDensityCalculator(unittest.TestCase):
             # we only check here that it doesn't crash
             dencalc.put_model_density_on_grid(st[0])
 
+class TestStructureFactorCalculator(unittest.TestCase):
+    def check_batch(self, calc, obj, calculate_one):
+        hkls = [[h, k, l] for h in (-2, 0, 3) for k in (-1, 1, 4)
+                for l in (-5, 0, 2)]
+        for nthreads in (1, 2):
+            batch = calc.calculate_sf_batch(obj, hkls, nthreads=nthreads)
+            self.assertEqual(len(batch), len(hkls))
+            for hkl, value in zip(hkls, batch):
+                expected = calculate_one(obj, hkl)
+                self.assertAlmostEqual(value, expected,
+                                       delta=1e-9 * (abs(expected) + 1))
+
+    def test_batch_model(self):
+        st = gemmi.read_structure(full_path('1orc.pdb'))
+        calc = gemmi.StructureFactorCalculatorX(st.cell)
+        self.check_batch(calc, st[0], calc.calculate_sf_from_model)
+
+    def test_batch_small_structure(self):
+        small = gemmi.read_small_structure(full_path('2013551.cif'))
+        calc = gemmi.StructureFactorCalculatorX(small.cell)
+        self.check_batch(calc, small, calc.calculate_sf_from_small_structure)
+
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,609 @@
+#include "doctest.h"
+
+#include <algorithm>  // for any_of
+#include <array>
+#include <cmath>      // for fabs
+#include <cstdio>     // for fopen, remove
+#include <memory>
+#include <random>
+#include <sstream>
+#include <tuple>
+#include <gemmi/monlib.hpp>
+#include <gemmi/mmread_gz.hpp>  // for read_structure_gz
+#include <gemmi/modify.hpp>     // for assign_serial_numbers
+#include <gemmi/monlib_cache.hpp>  // for write_monlib_cache, MonLibCache
+#include <gemmi/polyheur.hpp>   // for setup_entities
+#include <gemmi/read_cif.hpp>   // for read_cif_gz
+#include <gemmi/riding_h.hpp>   // for compile_hydrogen_recipe
+#include <gemmi/rmsz.hpp>       // for check_geometry, GeometryValidator
+#include <gemmi/topo.hpp>
+#include <gemmi/refine/geom.hpp>
+
+// Tests that use the mini monomer library from tests/ (list/mon_lib_list.cif,
+// ener_lib.cif and l/LIG.cif) and lig.pdb: two models, chains A and B
+// with two LIG residues each, and a LIG-LIG link between chains.
+
+namespace {
+
+std::string test_path(const std::string& name) {
+  return TEST_DATA_DIR + name;
+}
+
+gemmi::MonLib read_test_monlib() {
+  gemmi::MonLib monlib;
+  std::string error;
+  if (!monlib.read_monomer_lib(test_path(""), {"LIG"}, gemmi::read_cif_gz, &error))
+    gemmi::fail(error);
+  return monlib;
+}
+
+gemmi::Structure read_lig_pdb() {
+  gemmi::Structure st = gemmi::read_structure_gz(test_path("lig.pdb"));
+  gemmi::setup_entities(st);
+  return st;
+}
+
+// lig.pdb with hydrogens added (in all models) and Topo for the first model
+struct LigWithH {
+  gemmi::Structure st;
+  gemmi::MonLib monlib;
+  std::unique_ptr<gemmi::Topo> topo;
+
+  explicit LigWithH(int nthreads=1) : st(read_lig_pdb()), monlib(read_test_monlib()) {
+    std::ostringstream warnings;
+    for (size_t i = st.models.size(); i-- != 0; )
+      topo = gemmi::prepare_topology(st, monlib, i, gemmi::HydrogenChange::ReAdd,
+                                     false, &warnings, false, nthreads);
+    gemmi::assign_serial_numbers(st);
+  }
+};
+
+void prepare_geometry(gemmi::Geometry& geom, const gemmi::Topo& topo) {
+  geom.load_topo(topo);
+  geom.finalize_restraints();
+  // stacking of the planes in A1 and B1
+  REQUIRE(geom.planes.size() == 4);
+  geom.stackings.emplace_back(geom.planes[0].atoms, geom.planes[2].atoms);
+  gemmi::Geometry::Stacking& stacking = geom.stackings.back();
+  stacking.dist = 3.5;
+  stacking.sd_dist = 0.2;
+  stacking.angle = 0.;
+  stacking.sd_angle = 5.;
+  geom.setup_nonbonded();
+  geom.setup_target(true, 0);
+}
+
+void check_close(const std::vector<double>& a, const std::vector<double>& b) {
+  REQUIRE(a.size() == b.size());
+  size_t n_diff = 0;
+  for (size_t i = 0; i != a.size(); ++i)
+    if (std::fabs(a[i] - b[i]) > 1e-9 * (1 + std::fabs(a[i])))
+      ++n_diff;
+  CHECK(n_diff == 0);
+}
+
+// restraints from topo as text: restraint, atom serials and ideal values
+std::vector<std::string> topo_restraints_as_text(const gemmi::Topo& topo) {
+  std::vector<std::string> out;
+  auto serials = [](const gemmi::Atom* const* atoms, size_t n) {
+    std::string s;
+    for (size_t i = 0; i != n; ++i)
+      s += " " + std::to_string(atoms[i]->serial);
+    return s;
+  };
+  for (const gemmi::Topo::Bond& t : topo.bonds)
+    out.push_back("bond " + t.restr->str() + serials(t.atoms.data(), 2) + " " +
+                  std::to_string(t.restr->value) + " " + std::to_string(t.restr->esd));
+  for (const gemmi::Topo::Angle& t : topo.angles)
+    out.push_back("angle " + t.restr->str() + serials(t.atoms.data(), 3) + " " +
+                  std::to_string(t.restr->value));
+  for (const gemmi::Topo::Torsion& t : topo.torsions)
+    out.push_back("tors " + t.restr->str() + serials(t.atoms.data(), 4) + " " +
+                  std::to_string(t.restr->value));
+  for (const gemmi::Topo::Chirality& t : topo.chirs)
+    out.push_back("chir " + t.restr->str() + serials(t.atoms.data(), 4));
+  for (const gemmi::Topo::Plane& t : topo.planes)
+    out.push_back("plane " + t.restr->str() + serials(t.atoms.data(), t.atoms.size()));
+  for (const gemmi::Topo::Link& link : topo.extras)
+    out.push_back("link " + link.link_id + " " + link.res1->str() + " " +
+                  link.res2->str() + " " + std::to_string(link.link_rules.size()));
+  return out;
+}
+
+using AtomTuple = std::tuple<std::string, double, double, double, float>;
+
+std::vector<AtomTuple> all_atoms(const gemmi::Structure& st) {
+  std::vector<AtomTuple> out;
+  for (const gemmi::Model& model : st.models)
+    for (gemmi::const_CRA cra : model.all())
+      out.emplace_back(cra.atom->name, cra.atom->pos.x, cra.atom->pos.y,
+                       cra.atom->pos.z, cra.atom->occ);
+  return out;
+}
+
+} // anonymous namespace
+
+TEST_CASE("Geometry::calc in threads") {
+  LigWithH lig;
+  gemmi::Geometry geom(lig.st, &lig.monlib.ener_lib);
+  prepare_geometry(geom, *lig.topo);
+  CHECK(!geom.bonds.empty());
+  CHECK(!geom.angles.empty());
+  CHECK(!geom.torsions.empty());
+  CHECK(!geom.chirs.empty());
+  CHECK(!geom.vdws.empty());
+  // inter-chain link
+  CHECK(std::any_of(geom.bonds.begin(), geom.bonds.end(), [](const gemmi::Geometry::Bond& b) {
+    return b.atoms[0]->name == "O3" && b.atoms[1]->name == "O3";
+  }));
+
+  geom.clear_target();
+  double f1 = geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1, 1);
+  CHECK(f1 > 0);
+  CHECK(geom.target.target == f1);
+  std::vector<double> vn1 = geom.target.vn;
+  std::vector<double> am1 = geom.target.am;
+  // with fewer threads than min_threads_for_packets, the serial path is used
+  geom.clear_target();
+  CHECK(geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1, 2) == f1);
+  CHECK(geom.target.vn == vn1);
+  CHECK(geom.target.am == am1);
+  // always use colored packets, even on a single core
+  geom.min_threads_for_packets = 0;
+  for (int nthreads : {2, 3}) {
+    geom.clear_target();
+    double f = geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1, nthreads);
+    CHECK(f == f1);
+    CHECK(geom.target.target == f1);
+    check_close(geom.target.vn, vn1);
+    check_close(geom.target.am, am1);
+  }
+
+  // reporting
+  double f_rep = geom.calc(false, true, 1, 1, 1, 1, 1, 1, 1);
+  CHECK(f_rep == doctest::Approx(f1).epsilon(1e-12));
+  const gemmi::Geometry::Reporting& rep = geom.reporting;
+  CHECK(rep.bonds.size() == geom.bonds.size());
+  CHECK(rep.angles.size() == geom.angles.size());
+  CHECK(rep.torsions.size() == geom.torsions.size());
+  CHECK(rep.chirs.size() == geom.chirs.size());
+  CHECK(rep.planes.size() == geom.planes.size());
+  CHECK(rep.stackings.size() == geom.stackings.size());
+  size_t n_clashes = 0;  // only vdw pairs closer than the limit are reported
+  for (const gemmi::Geometry::Vdw& vdw : geom.vdws)
+    if (vdw.atoms[0]->pos.dist(vdw.atoms[1]->pos) <= vdw.value)
+      ++n_clashes;
+  CHECK(n_clashes != 0);
+  CHECK(rep.vdws.size() == n_clashes);
+}
+
+TEST_CASE("Geometry::calc with compiled restraints") {
+  LigWithH lig;
+  gemmi::Geometry geom(lig.st, &lig.monlib.ener_lib);
+  geom.load_topo(*lig.topo);
+  geom.finalize_restraints();
+  geom.setup_nonbonded();
+  // bond with two ideal values is calculated by Bond::calc()
+  REQUIRE(geom.bonds.size() > 1);
+  gemmi::Geometry::Bond::Value v = geom.bonds[1].values[0];
+  v.value += 0.1;
+  geom.bonds[1].values.push_back(v);
+  geom.setup_target(true, 0);
+
+  // the same as in Geometry::calc(), but with calc() of each restraint
+  geom.clear_target();
+  gemmi::GeomTarget* target = &geom.target;
+  double f_ref = 0.;
+  for (const auto& t : geom.bonds)
+    f_ref += t.calc(geom.st.cell, false, 1.1, target, nullptr);
+  for (const auto& t : geom.angles)
+    f_ref += t.calc(1.2, target, nullptr);
+  for (const auto& t : geom.torsions)
+    f_ref += t.calc(1, target, nullptr);
+  for (const auto& t : geom.chirs)
+    f_ref += t.calc(1, target, nullptr);
+  for (const auto& t : geom.planes)
+    f_ref += t.calc(1, target, nullptr);
+  for (const auto& t : geom.vdws)
+    f_ref += t.calc(geom.st.cell, 1, target, nullptr);
+  std::vector<double> vn_ref = geom.target.vn;
+  std::vector<double> am_ref = geom.target.am;
+
+  geom.clear_target();
+  double f = geom.calc(false, false, 1.1, 1.2, 1, 1, 1, 1, 1);
+  CHECK(f == doctest::Approx(f_ref).epsilon(1e-12));
+  check_close(geom.target.vn, vn_ref);
+  check_close(geom.target.am, am_ref);
+
+  // restraints added without setup_target()
+  geom.min_threads_for_packets = 0;
+  geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1, 2);  // prepares colorings
+  geom.angles.push_back(geom.angles[0]);
+  CHECK_THROWS(geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1));
+  geom.angles.pop_back();
+  geom.torsions.push_back(geom.torsions[0]);
+  CHECK_THROWS(geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1, 2));
+  geom.setup_target(true, 0);
+  geom.clear_target();
+  CHECK(geom.calc(false, false, 1, 1, 1, 1, 1, 1, 1, 2) > 0);
+}
+
+TEST_CASE("Geometry::setup_nonbonded with nonbonded_skin") {
+  LigWithH lig;
+  using Key = std::tuple<const gemmi::Atom*, const gemmi::Atom*, int,
+                         std::array<int, 3>, int, double, double>;
+  auto get_pairs = [](const gemmi::Geometry& geom) {
+    std::vector<Key> pairs;
+    for (const gemmi::Geometry::Vdw& v : geom.vdws)
+      pairs.emplace_back(v.atoms[0], v.atoms[1], v.sym_idx, v.pbc_shift,
+                         v.type, v.value, v.sigma);
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+  };
+  gemmi::Geometry geom0(lig.st, &lig.monlib.ener_lib);
+  gemmi::Geometry geom1(lig.st, &lig.monlib.ener_lib);
+  geom1.nonbonded_skin = 1.0;
+  for (gemmi::Geometry* geom : {&geom0, &geom1}) {
+    geom->load_topo(*lig.topo);
+    geom->finalize_restraints();
+  }
+  // atoms far apart, found only if the whole max_dist is searched
+  const float max_dist = 2 * 2.98f;
+  std::vector<gemmi::Atom*> atoms;
+  for (gemmi::CRA cra : lig.st.first_model().all())
+    atoms.push_back(cra.atom);
+  std::mt19937 rng(12345);
+  std::uniform_real_distribution<double> shift(-0.2, 0.2);
+  for (int n = 0; n != 4; ++n) {
+    // after the first call only cached pairs are checked, until
+    // an atom moves by more than skin/2
+    geom0.setup_nonbonded();
+    geom1.setup_nonbonded();
+    std::vector<Key> pairs = get_pairs(geom0);
+    CHECK(!pairs.empty());
+    CHECK(std::any_of(geom0.vdws.begin(), geom0.vdws.end(), [&](const gemmi::Geometry::Vdw& v) {
+      double d = v.atoms[0]->pos.dist(v.atoms[1]->pos);
+      return d > 4.5 && d < max_dist;
+    }));
+    CHECK(get_pairs(geom1) == pairs);
+    for (gemmi::Atom* atom : atoms)
+      atom->pos += gemmi::Position(shift(rng), shift(rng), shift(rng));
+  }
+}
+
+TEST_CASE("MonLib::match_link with and without index") {
+  using gemmi::ChemComp;
+  using gemmi::ChemLink;
+  gemmi::MonLib monlib = read_test_monlib();
+  // LIG as if it could also be a peptide: N1 -> N, C5 -> C
+  monlib.monomers.at("LIG").aliases.push_back({ChemComp::Group::Peptide,
+                                               {{"N1", "N"}, {"C5", "C"}}});
+  auto make_link = [](const char* id, const char* comp1, ChemComp::Group group2,
+                      const char* atom1, const char* atom2) {
+    ChemLink link;
+    link.id = id;
+    link.side1.comp = comp1;
+    link.side1.group = comp1[0] ? ChemComp::Group::Null : ChemComp::Group::Peptide;
+    link.side2.group = group2;
+    link.rt.bonds.push_back({{1, atom1}, {2, atom2}, gemmi::BondType::Single,
+                             false, 1.4, 0.02, 1.4, 0.02});
+    return link;
+  };
+  monlib.add_link(make_link("TRANS-test", "", ChemComp::Group::Peptide, "C", "N"));
+  monlib.add_link(make_link("LIG-pept", "LIG", ChemComp::Group::Peptide, "O3", "N"));
+  REQUIRE(monlib.links.size() == 3);
+  CHECK(monlib.link_index.is_current(monlib.links));
+
+  gemmi::Structure st = read_lig_pdb();
+  const gemmi::Residue& res1 = st.models[0].chains[0].residues[0];
+  const gemmi::Residue& res2 = st.models[0].chains[1].residues[0];
+  const ChemComp::Aliasing* peptide = &monlib.monomers.at("LIG").aliases.back();
+  struct Query {
+    const char* atom1;
+    const char* atom2;
+    const char* link_id;  // expected
+    bool inverted;
+    bool alias1, alias2;
+  };
+  const Query queries[] = {
+    {"O3", "O3", "LIG-LIG", false, false, false},
+    {"C5", "N1", "TRANS-test", false, true, true},
+    {"N1", "C5", "TRANS-test", true, true, true},
+    {"O3", "N1", "LIG-pept", false, false, true},
+    {"N1", "O3", "LIG-pept", true, true, false},
+    {"N1", "N1", nullptr, false, false, false},
+    {"C5", "O3", nullptr, false, false, false},
+  };
+  // the copy has no index, so it always does a linear scan
+  gemmi::MonLib linear = monlib;
+  CHECK(!linear.link_index.is_current(linear.links));
+  for (const Query& q : queries) {
+    auto m = monlib.match_link(res1, q.atom1, '\0', res2, q.atom2, '\0');
+    auto lin = linear.match_link(res1, q.atom1, '\0', res2, q.atom2, '\0');
+    if (q.link_id) {
+      REQUIRE(std::get<0>(m) != nullptr);
+      CHECK(std::get<0>(m)->id == q.link_id);
+      CHECK(std::get<1>(m) == q.inverted);
+      CHECK(std::get<2>(m) == (q.alias1 ? peptide : nullptr));
+      CHECK(std::get<3>(m) == (q.alias2 ? peptide : nullptr));
+    } else {
+      CHECK(std::get<0>(m) == nullptr);
+    }
+    REQUIRE((std::get<0>(lin) == nullptr) == (std::get<0>(m) == nullptr));
+    if (std::get<0>(lin)) {
+      CHECK(std::get<0>(lin)->id == std::get<0>(m)->id);
+      CHECK(std::get<1>(lin) == std::get<1>(m));
+      // aliasings point to ChemComps in the respective MonLib
+      const ChemComp::Aliasing* lin_peptide = &linear.monomers.at("LIG").aliases.back();
+      CHECK(std::get<2>(lin) == (std::get<2>(m) ? lin_peptide : nullptr));
+      CHECK(std::get<3>(lin) == (std::get<3>(m) ? lin_peptide : nullptr));
+    }
+  }
+
+  // changes in links make the index outdated
+  monlib.links.erase("LIG-pept");
+  CHECK(!monlib.link_index.is_current(monlib.links));
+  CHECK(std::get<0>(monlib.match_link(res1, "O3", '\0', res2, "N1", '\0')) == nullptr);
+  monlib.add_link(make_link("LIG-pept", "LIG", ChemComp::Group::Peptide, "O3", "C4"));
+  CHECK(monlib.link_index.is_current(monlib.links));
+  CHECK(std::get<0>(monlib.match_link(res1, "O3", '\0', res2, "N1", '\0')) == nullptr);
+  monlib.links.modify("LIG-pept").rt.bonds[0].id2.atom = "N";
+  CHECK(!monlib.link_index.is_current(monlib.links));
+  CHECK(std::get<0>(monlib.match_link(res1, "O3", '\0', res2, "N1", '\0'))->id == "LIG-pept");
+  monlib.index_links();
+  CHECK(std::get<0>(monlib.match_link(res1, "O3", '\0', res2, "N1", '\0'))->id == "LIG-pept");
+}
+
+TEST_CASE("check_geometry and GeometryValidator") {
+  using gemmi::GeometryStats;
+  using gemmi::GeometryOutliers;
+  using RKind = gemmi::Topo::RKind;
+  gemmi::Structure st = read_lig_pdb();
+  gemmi::MonLib monlib = read_test_monlib();
+  std::ostringstream warnings;
+  std::vector<GeometryStats> stats;
+  GeometryOutliers outliers;
+  for (size_t i = 0; i != st.models.size(); ++i) {
+    gemmi::Topo topo;
+    topo.warnings = &warnings;
+    topo.initialize_refmac_topology(st, st.models[i], monlib);
+    topo.finalize_refmac_topology(monlib);
+    stats.push_back(gemmi::check_geometry(topo, 2.0, &outliers, (int) i));
+  }
+  REQUIRE(stats.size() == 2);
+  for (const GeometryStats& s : stats) {
+    CHECK(s.z_bond.n == 49);  // including the link between chains
+    CHECK(s.z_angle.n == 66);
+    CHECK(s.all_chiralities == 4);
+    CHECK(s.z_plane.n == 0);  // without hydrogens, only 3 atoms are in plane
+  }
+  int n_bonds = 0, n_angles = 0;
+  for (size_t i = 0; i != outliers.size(); ++i) {
+    CHECK(outliers.z[i] > 2.0);
+    if (outliers.model[i] == 0) {
+      n_bonds += outliers.kind[i] == RKind::Bond;
+      n_angles += outliers.kind[i] == RKind::Angle;
+    }
+  }
+  CHECK(n_bonds == stats[0].wrong_bond);
+  CHECK(n_angles == stats[0].wrong_angle);
+  // the first row, as in the output of gemmi rmsz
+  REQUIRE(outliers.size() != 0);
+  CHECK(outliers.model[0] == 0);
+  CHECK(outliers.kind[0] == RKind::Bond);
+  CHECK(outliers.tag[0] == "A 1(LIG)");
+  CHECK(outliers.restraint[0] == "C1-C2");
+  CHECK(outliers.atom[0].empty());
+  CHECK(outliers.ideal[0] == 1.45);
+  CHECK(outliers.value[0] == doctest::Approx(1.51191).epsilon(1e-5));
+  CHECK(outliers.z[0] == doctest::Approx(3.09559).epsilon(1e-5));
+
+  // the same from GeometryValidator, for files processed in 2 threads
+  gemmi::GeometryValidator validator(test_path(""), gemmi::read_cif_gz);
+  std::vector<std::string> paths = {test_path("lig.pdb"), test_path("none.pdb"),
+                                    test_path("lig.pdb")};
+  std::vector<int> seen(paths.size(), 0);
+  validator.run(paths, 2, [&](gemmi::GeometryValidator::Result& r) {
+    REQUIRE(r.entry < paths.size());
+    seen[r.entry]++;
+    CHECK(r.path == paths[r.entry]);
+    if (r.entry == 1) {
+      CHECK(!r.error.empty());
+      return;
+    }
+    CHECK(r.error.empty());
+    CHECK(r.model_names == std::vector<std::string>{"1", "2"});
+    REQUIRE(r.stats.size() == 2);
+    for (size_t i = 0; i != 2; ++i) {
+      CHECK(r.stats[i].z_bond.n == stats[i].z_bond.n);
+      CHECK(r.stats[i].z_bond.sum_sq == stats[i].z_bond.sum_sq);
+      CHECK(r.stats[i].z_angle.sum_sq == stats[i].z_angle.sum_sq);
+      CHECK(r.stats[i].z_torsion.sum_sq == stats[i].z_torsion.sum_sq);
+      CHECK(r.stats[i].z_plane.sum_sq == stats[i].z_plane.sum_sq);
+      CHECK(r.stats[i].wrong_chirality == stats[i].wrong_chirality);
+      CHECK(r.stats[i].wrong_angle == stats[i].wrong_angle);
+    }
+    CHECK(r.outliers.model == outliers.model);
+    CHECK(r.outliers.kind == outliers.kind);
+    CHECK(r.outliers.tag == outliers.tag);
+    CHECK(r.outliers.restraint == outliers.restraint);
+    CHECK(r.outliers.atom == outliers.atom);
+    CHECK(r.outliers.value == outliers.value);
+    CHECK(r.outliers.z == outliers.z);
+  });
+  CHECK(seen == std::vector<int>{1, 1, 1});
+}
+
+TEST_CASE("write_monlib_cache and MonLibCache") {
+  const char* path = "test_moncache.bin";
+  std::string tmp_path = std::string(path) + ".tmp";
+  std::string error;
+  size_t n = gemmi::write_monlib_cache(path, test_path(""), {"LIG", "XYZ"},
+                                       gemmi::read_cif_gz, &error);
+  CHECK(n == 3);  // mon_lib_list.cif, ener_lib.cif and LIG.cif
+  CHECK(error.find("x/XYZ.cif") != std::string::npos);
+  std::FILE* f = std::fopen(tmp_path.c_str(), "rb");
+  CHECK(f == nullptr);  // renamed
+  if (f)
+    std::fclose(f);
+  gemmi::cif::Document doc;
+  {
+    gemmi::MonLibCache cache;
+    cache.open(path);
+    CHECK(cache.monomer_dir == test_path(""));
+    REQUIRE(cache.entries.size() == 3);
+    CHECK(cache.find("l/LIG.cif") != nullptr);
+    CHECK(!cache.read_document(test_path(""), "l/XYZ.cif", doc));
+    CHECK(cache.read_document(test_path(""), "l/LIG.cif", doc));
+  }
+  std::remove(path);
+  gemmi::cif::Document ref = gemmi::read_cif_gz(test_path("l/LIG.cif"));
+  REQUIRE(doc.blocks.size() == ref.blocks.size());
+  for (size_t i = 0; i != ref.blocks.size(); ++i) {
+    CHECK(doc.blocks[i].name == ref.blocks[i].name);
+    CHECK(doc.blocks[i].items.size() == ref.blocks[i].items.size());
+  }
+  CHECK(doc.find_block("comp_LIG")->find_values("_chem_comp_atom.atom_id").length() ==
+        ref.find_block("comp_LIG")->find_values("_chem_comp_atom.atom_id").length());
+}
+
+TEST_CASE("place_hydrogens_on_all_atoms") {
+  // positions of H in A/1 of the first model, written by gemmi h before
+  // HydrogenRecipe was introduced; all kinds of rules are used here
+  struct RefH {
+    const char* name;
+    gemmi::Position pos;
+    float occ;
+  };
+  const RefH ref[] = {
+    {"H1", {9.860, 9.655, 9.091}, 1.0},
+    {"H21", {11.929, 10.394, 9.460}, 1.0},
+    {"H22", {11.764, 10.177, 11.044}, 1.0},
+    {"H1N", {9.380, 11.999, 10.440}, 1.0},
+    {"H31", {10.497, 8.224, 10.837}, 1.0},
+    {"H32", {8.920, 8.598, 11.031}, 1.0},
+    {"H33", {10.054, 9.345, 11.938}, 1.0},
+    {"HN21", {5.878, 11.789, 10.710}, 1.0},
+    {"HN22", {7.233, 12.868, 10.749}, 1.0},
+    {"HO5", {6.956, 10.863, 12.369}, 0.0},
+    {"H4", {11.060, 12.000, 11.402}, 1.0},
+    {"HO1", {12.607, 13.479, 10.786}, 0.0},
+    {"H6", {9.842, 12.583, 9.192}, 1.0},
+    {"H81", {9.931, 14.921, 10.448}, 0.0},
+    {"H9", {12.268, 15.827, 10.031}, 1.0},
+    {"H91", {16.503, 12.319, 10.132}, 0.0},
+    {"H92", {15.169, 13.262, 10.132}, 0.0},
+    {"H93", {15.169, 11.376, 10.132}, 0.0},
+    {"H101", {15.377, 15.039, 10.714}, 0.0},
+    {"H102", {14.043, 15.982, 10.714}, 0.0},
+    {"H103", {14.043, 14.567, 11.530}, 0.0},
+    {"H104", {14.043, 14.567, 9.898}, 0.0},
+    {"HO91", {17.660, 9.630, 9.510}, 0.0},
+    {"HO92", {16.410, 10.598, 9.510}, 0.0},
+  };
+  LigWithH lig;
+  const gemmi::Residue& res = lig.st.models[0].chains[0].residues[0];
+  for (const RefH& r : ref) {
+    const gemmi::Atom* atom = res.find_atom(r.name, '*');
+    REQUIRE(atom != nullptr);
+    CHECK(atom->pos.dist(r.pos) < 0.001);
+    CHECK(atom->occ == r.occ);
+  }
+  size_t n_h = 0;
+  for (const gemmi::Atom& atom : res.atoms)
+    n_h += atom.is_hydrogen();
+  CHECK(n_h == sizeof(ref) / sizeof(ref[0]));
+}
+
+TEST_CASE("prepare_topology with nthreads") {
+  // finalize_refmac_topology() and place_hydrogens_on_all_atoms() process
+  // chains in parallel; restraints (including the inter-chain link)
+  // and hydrogens must not depend on the number of threads
+  LigWithH lig1(1);
+  std::vector<std::string> restraints1 = topo_restraints_as_text(*lig1.topo);
+  REQUIRE(lig1.topo->extras.size() == 1);
+  const gemmi::Topo::Link& link = lig1.topo->extras[0];
+  CHECK(link.res1->name == "LIG");
+  CHECK(link.res1 != link.res2);
+  CHECK(!link.link_rules.empty());
+  std::vector<AtomTuple> atoms1 = all_atoms(lig1.st);
+  for (int nthreads : {2, 4}) {
+    LigWithH lig(nthreads);
+    CHECK(topo_restraints_as_text(*lig.topo) == restraints1);
+    std::vector<AtomTuple> atoms = all_atoms(lig.st);
+    CHECK(atoms.size() == atoms1.size());
+    CHECK(atoms == atoms1);
+  }
+}
+
+TEST_CASE("HydrogenRecipe") {
+  using Kind = gemmi::HydrogenRecipe::Rule::Kind;
+  LigWithH lig;  // hydrogens placed in each model separately
+  gemmi::HydrogenRecipe recipe = gemmi::compile_hydrogen_recipe(*lig.topo,
+                                                                lig.st.models[0]);
+  // each kind of rule is tested
+  for (Kind kind : {Kind::NoHeavy, Kind::Linear, Kind::OneHeavy, Kind::Planar,
+                    Kind::TwoHeavy, Kind::ThreeHeavy})
+    CHECK(std::any_of(recipe.rules.begin(), recipe.rules.end(),
+                      [&](const gemmi::HydrogenRecipe::Rule& r) { return r.kind == kind; }));
+  CHECK(std::any_of(recipe.rules.begin(), recipe.rules.end(),
+                    [](const gemmi::HydrogenRecipe::Rule& r) {
+                      return r.kind == Kind::TwoHeavy && r.chir_sign != 0;
+                    }));
+
+  // positions from the recipe are the same as from place_hydrogens_on_all_atoms()
+  REQUIRE(lig.st.models.size() == 2);
+  gemmi::Structure st;
+  for (int nthreads : {1, 2}) {
+    // as after HydrogenChange::ReAdd; the position of H matters for Linear
+    st = lig.st;
+    for (gemmi::Model& model : st.models)
+      for (gemmi::CRA cra : model.all())
+        if (cra.atom->is_hydrogen()) {
+          cra.atom->pos = gemmi::Position(0, 0, 0);
+          cra.atom->occ = 1.f;
+        }
+    for (gemmi::Model& model : st.models)
+      CHECK(recipe.apply(model, nthreads) == 0);
+    for (size_t i = 0; i != st.models.size(); ++i) {
+      size_t n_diff = 0;
+      auto expected = lig.st.models[i].all();
+      auto it = expected.begin();
+      for (gemmi::CRA cra : st.models[i].all()) {
+        REQUIRE(it != expected.end());
+        const gemmi::Atom& a = *(*it++).atom;
+        REQUIRE(cra.atom->name == a.name);
+        if (cra.atom->pos.dist(a.pos) > 1e-9 || cra.atom->occ != a.occ)
+          ++n_diff;
+      }
+      CHECK(n_diff == 0);
+    }
+  }
+
+  // SoA layout gives the same positions (2 coordinate sets at once)
+  size_t n = recipe.atom_count;
+  std::vector<double> x(2 * n), y(2 * n), z(2 * n);
+  for (size_t k = 0; k != 2; ++k) {
+    size_t j = k * n;
+    for (gemmi::CRA cra : lig.st.models[k].all()) {
+      bool h = cra.atom->is_hydrogen();
+      x[j] = h ? 0. : cra.atom->pos.x;
+      y[j] = h ? 0. : cra.atom->pos.y;
+      z[j] = h ? 0. : cra.atom->pos.z;
+      ++j;
+    }
+    REQUIRE(j == (k + 1) * n);
+  }
+  CHECK(recipe.apply(x.data(), y.data(), z.data(), 2, 2) == 0);
+  size_t n_diff = 0;
+  for (size_t k = 0; k != 2; ++k) {
+    size_t j = k * n;
+    for (gemmi::CRA cra : st.models[k].all()) {
+      const gemmi::Position& p = cra.atom->pos;
+      if (x[j] != p.x || y[j] != p.y || z[j] != p.z)
+        ++n_diff;
+      ++j;
+    }
+  }
+  CHECK(n_diff == 0);
+}
@@ -8,7 +8,7 @@ BIN=.
 echo "\$ gemmi -h" > docs/gemmi-help.txt
 $BIN/gemmi -h >> docs/gemmi-help.txt
 for prog in align blobs cif2json cif2mtz contact contents convert \
-    fprime grep h json2cif map map2sf mask merge mondiff mtz mtz2cif \
+    fprime grep h json2cif map map2sf mask merge moncache mondiff mtz mtz2cif \
     prep reindex residues rmsz sf2map sfcalc sg tags validate wcn; do
   echo "\$ gemmi $prog -h" > docs/$prog-help.txt
   $BIN/gemmi $prog -h >> docs/$prog-help.txt